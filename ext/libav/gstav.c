@@ -162,6 +162,7 @@ plugin_init (GstPlugin * plugin)
   gst_ffmpegdemux_register (plugin);
   gst_ffmpegmux_register (plugin);
   gst_ffmpegdeinterlace_register (plugin);
+  gst_ffmpegsimulcastenc_register (plugin);
 
   /* Now we can return the pointer to the newly created Plugin object. */
   return TRUE;
@@ -59,6 +59,12 @@ static GstFlowReturn gst_ffmpegaudenc_handle_frame (GstAudioEncoder * encoder,
 static gboolean gst_ffmpegaudenc_start (GstAudioEncoder * encoder);
 static gboolean gst_ffmpegaudenc_stop (GstAudioEncoder * encoder);
 static void gst_ffmpegaudenc_flush (GstAudioEncoder * encoder);
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+static gboolean gst_ffmpegaudenc_decide_allocation (GstAudioEncoder * encoder,
+    GstQuery * query);
+static int gst_ffmpegaudenc_get_encode_buffer (AVCodecContext * context,
+    AVPacket * pkt, int flags);
+#endif
 
 static void gst_ffmpegaudenc_set_property (GObject * object,
     guint prop_id, const GValue * value, GParamSpec * pspec);
@@ -149,6 +155,10 @@ gst_ffmpegaudenc_class_init (GstFFMpegAudEncClass * klass)
       GST_DEBUG_FUNCPTR (gst_ffmpegaudenc_set_format);
   gstaudioencoder_class->handle_frame =
       GST_DEBUG_FUNCPTR (gst_ffmpegaudenc_handle_frame);
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  gstaudioencoder_class->decide_allocation =
+      GST_DEBUG_FUNCPTR (gst_ffmpegaudenc_decide_allocation);
+#endif
 }
 
 static void
@@ -164,6 +174,7 @@ gst_ffmpegaudenc_init (GstFFMpegAudEnc * ffmpegaudenc)
   ffmpegaudenc->refcontext = avcodec_alloc_context3 (klass->in_plugin);
   ffmpegaudenc->opened = FALSE;
   ffmpegaudenc->frame = av_frame_alloc ();
+  ffmpegaudenc->pkt = av_packet_alloc ();
 
   gst_audio_encoder_set_drainable (GST_AUDIO_ENCODER (ffmpegaudenc), TRUE);
 }
@@ -175,6 +186,7 @@ gst_ffmpegaudenc_finalize (GObject * object)
 
   /* clean up remaining allocated data */
   av_frame_free (&ffmpegaudenc->frame);
+  av_packet_free (&ffmpegaudenc->pkt);
   gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
   av_free (ffmpegaudenc->context);
   av_free (ffmpegaudenc->refcontext);
@@ -199,6 +211,22 @@ gst_ffmpegaudenc_start (GstAudioEncoder * encoder)
   return TRUE;
 }
 
+static void
+gst_ffmpegaudenc_release_packet_pool (GstFFMpegAudEnc * ffmpegaudenc)
+{
+  GstBufferPool *pool;
+
+  GST_OBJECT_LOCK (ffmpegaudenc);
+  pool = ffmpegaudenc->packet_pool;
+  ffmpegaudenc->packet_pool = NULL;
+  GST_OBJECT_UNLOCK (ffmpegaudenc);
+
+  if (pool) {
+    gst_buffer_pool_set_active (pool, FALSE);
+    gst_object_unref (pool);
+  }
+}
+
 static gboolean
 gst_ffmpegaudenc_stop (GstAudioEncoder * encoder)
 {
@@ -208,6 +236,8 @@ gst_ffmpegaudenc_stop (GstAudioEncoder * encoder)
   gst_ffmpeg_avcodec_close (ffmpegaudenc->context);
   ffmpegaudenc->opened = FALSE;
 
+  gst_ffmpegaudenc_release_packet_pool (ffmpegaudenc);
+
   return TRUE;
 }
 
@@ -245,6 +275,15 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
 
   gst_ffmpeg_cfg_fill_context (G_OBJECT (ffmpegaudenc), ffmpegaudenc->context);
 
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  /* let the encoder write its packets into our output buffers */
+  if (oclass->in_plugin->capabilities & AV_CODEC_CAP_DR1) {
+    ffmpegaudenc->context->opaque = ffmpegaudenc;
+    ffmpegaudenc->context->get_encode_buffer =
+        gst_ffmpegaudenc_get_encode_buffer;
+  }
+#endif
+
   /* fetch pix_fmt and so on */
   gst_ffmpeg_audioinfo_to_context (info, ffmpegaudenc->context);
   if (!ffmpegaudenc->context->time_base.den) {
@@ -371,6 +410,133 @@ gst_ffmpegaudenc_set_format (GstAudioEncoder * encoder, GstAudioInfo * info)
   return TRUE;
 }
 
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+static gboolean
+gst_ffmpegaudenc_decide_allocation (GstAudioEncoder * encoder, GstQuery * query)
+{
+  GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) encoder;
+  GstFFMpegAudEncClass *oclass =
+      (GstFFMpegAudEncClass *) G_OBJECT_GET_CLASS (ffmpegaudenc);
+  GstAudioInfo *info = gst_audio_encoder_get_audio_info (encoder);
+  GstBufferPool *pool = NULL, *old_pool;
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+  GstStructure *config;
+  GstCaps *caps;
+  guint size = 0, min = 0, max = 0, raw_size;
+  gint frame_size;
+
+  if (!GST_AUDIO_ENCODER_CLASS (parent_class)->decide_allocation (encoder,
+          query))
+    return FALSE;
+
+  if (!(oclass->in_plugin->capabilities & AV_CODEC_CAP_DR1)
+      || !ffmpegaudenc->opened)
+    return TRUE;
+
+  gst_query_parse_allocation (query, &caps, NULL);
+
+  gst_allocation_params_init (&params);
+  if (gst_query_get_n_allocation_params (query) > 0)
+    gst_query_parse_nth_allocation_param (query, 0, &allocator, &params);
+
+  if (gst_query_get_n_allocation_pools (query) > 0)
+    gst_query_parse_nth_allocation_pool (query, 0, &pool, &size, &min, &max);
+
+  /* the raw size of a frame bounds packets, but with a known bitrate aim at
+   * twice the average packet. The odd bigger one gets allocated outside of
+   * the pool */
+  frame_size = ffmpegaudenc->context->frame_size;
+  if (frame_size <= 0)
+    frame_size = 4096;
+  raw_size = frame_size * GST_AUDIO_INFO_BPF (info);
+  if (ffmpegaudenc->context->bit_rate > 0 && GST_AUDIO_INFO_RATE (info) > 0)
+    size = gst_util_uint64_scale (ffmpegaudenc->context->bit_rate / 8,
+        frame_size * 2, GST_AUDIO_INFO_RATE (info));
+  else
+    size = raw_size;
+  size = CLAMP (size, MIN (1024, raw_size), raw_size) +
+      AV_INPUT_BUFFER_PADDING_SIZE;
+
+  if (max == 0 || max > GST_FFMPEG_PACKET_POOL_MAX_BUFFERS)
+    max = GST_FFMPEG_PACKET_POOL_MAX_BUFFERS;
+  min = MIN (min, max);
+
+  if (pool && gst_buffer_pool_is_active (pool)) {
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
+  if (pool) {
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator (config, allocator, &params);
+    if (!gst_buffer_pool_set_config (pool, config)) {
+      GST_DEBUG_OBJECT (ffmpegaudenc, "downstream pool refused our config");
+      gst_object_unref (pool);
+      pool = NULL;
+    }
+  }
+
+  if (!pool) {
+    pool = gst_buffer_pool_new ();
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator (config, allocator, &params);
+    gst_buffer_pool_set_config (pool, config);
+  }
+
+  if (!gst_buffer_pool_set_active (pool, TRUE)) {
+    GST_WARNING_OBJECT (ffmpegaudenc, "failed to activate output packet pool");
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
+  GST_OBJECT_LOCK (ffmpegaudenc);
+  old_pool = ffmpegaudenc->packet_pool;
+  ffmpegaudenc->packet_pool = pool;
+  ffmpegaudenc->packet_pool_size = size;
+  ffmpegaudenc->packet_params = params;
+  GST_OBJECT_UNLOCK (ffmpegaudenc);
+
+  if (old_pool) {
+    gst_buffer_pool_set_active (old_pool, FALSE);
+    gst_object_unref (old_pool);
+  }
+
+  if (allocator)
+    gst_object_unref (allocator);
+
+  return TRUE;
+}
+
+/* May be called from libav's frame threads */
+static int
+gst_ffmpegaudenc_get_encode_buffer (AVCodecContext * context, AVPacket * pkt,
+    int flags)
+{
+  GstFFMpegAudEnc *ffmpegaudenc = (GstFFMpegAudEnc *) context->opaque;
+  GstAllocationParams params;
+  GstBufferPool *pool;
+  guint pool_size;
+  int res;
+
+  GST_OBJECT_LOCK (ffmpegaudenc);
+  pool = ffmpegaudenc->packet_pool ?
+      gst_object_ref (ffmpegaudenc->packet_pool) : NULL;
+  pool_size = ffmpegaudenc->packet_pool_size;
+  params = ffmpegaudenc->packet_params;
+  GST_OBJECT_UNLOCK (ffmpegaudenc);
+
+  res = gst_ffmpeg_avpacket_alloc_buffer (pkt, pool, pool_size, &params);
+
+  if (pool)
+    gst_object_unref (pool);
+
+  return res;
+}
+#endif
+
 static void
 gst_ffmpegaudenc_free_avpacket (gpointer pkt)
 {
@@ -554,32 +720,41 @@ gst_ffmpegaudenc_receive_packet (GstFFMpegAudEnc * ffmpegaudenc,
   AVCodecContext *ctx;
   gint res;
   GstFlowReturn ret;
-  AVPacket *pkt;
+  AVPacket *pkt = ffmpegaudenc->pkt;
 
   enc = GST_AUDIO_ENCODER (ffmpegaudenc);
 
   ctx = ffmpegaudenc->context;
 
-  pkt = g_slice_new0 (AVPacket);
-
   res = avcodec_receive_packet (ctx, pkt);
 
   if (res == 0) {
     GstBuffer *outbuf;
+    gint duration;
 
     GST_LOG_OBJECT (ffmpegaudenc, "pushing size %d", pkt->size);
 
-    outbuf =
-        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
-        pkt->size, 0, pkt->size, pkt, gst_ffmpegaudenc_free_avpacket);
+    duration = pkt->duration > 0 ? pkt->duration : -1;
+
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+    if (pkt->buf && ctx->get_encode_buffer ==
+        gst_ffmpegaudenc_get_encode_buffer) {
+      outbuf = gst_ffmpeg_avpacket_steal_buffer (pkt);
+    } else
+#endif
+    {
+      AVPacket *copy = g_slice_new (AVPacket);
+
+      av_packet_move_ref (copy, pkt);
+      outbuf =
+          gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, copy->data,
+          copy->size, 0, copy->size, copy, gst_ffmpegaudenc_free_avpacket);
+    }
 
-    ret =
-        gst_audio_encoder_finish_frame (enc, outbuf,
-        pkt->duration > 0 ? pkt->duration : -1);
+    ret = gst_audio_encoder_finish_frame (enc, outbuf, duration);
     *got_packet = TRUE;
   } else {
     GST_LOG_OBJECT (ffmpegaudenc, "no output produced");
-    g_slice_free (AVPacket, pkt);
     ret = GST_FLOW_OK;
     *got_packet = FALSE;
   }
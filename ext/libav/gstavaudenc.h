@@ -41,9 +41,15 @@ struct _GstFFMpegAudEnc
   gboolean opened;
 
   AVFrame *frame;
+  AVPacket *pkt;
 
   GstAudioChannelPosition ffmpeg_layout[64];
   gboolean needs_reorder;
+
+  /* output buffers for encoders writing packets directly (DR1) */
+  GstBufferPool *packet_pool;
+  guint packet_pool_size;
+  GstAllocationParams packet_params;
 };
 
 typedef struct _GstFFMpegAudEncClass GstFFMpegAudEncClass;
@@ -549,6 +549,21 @@ gst_ffmpeg_cfg_get_property (AVCodecContext * refcontext, GValue * value,
   return res >= 0;
 }
 
+/* Whether the codec accepts changes of this option on an opened context */
+gboolean
+gst_ffmpeg_cfg_is_runtime_param (GParamSpec * pspec)
+{
+#ifdef AV_OPT_FLAG_RUNTIME_PARAM
+  const AVOption *opt;
+
+  opt = g_param_spec_get_qdata (pspec, avoption_quark);
+
+  return opt && (opt->flags & AV_OPT_FLAG_RUNTIME_PARAM);
+#else
+  return FALSE;
+#endif
+}
+
 void
 gst_ffmpeg_cfg_fill_context (GObject * object, AVCodecContext * context)
 {
@@ -36,6 +36,8 @@ gboolean gst_ffmpeg_cfg_set_property (AVCodecContext *refcontext,
 gboolean gst_ffmpeg_cfg_get_property (AVCodecContext *refcontext,
     GValue * value, GParamSpec * pspec);
 
+gboolean gst_ffmpeg_cfg_is_runtime_param (GParamSpec * pspec);
+
 void gst_ffmpeg_cfg_fill_context (GObject *object, AVCodecContext * context);
 void gst_ffmpeg_cfg_finalize (void);
 
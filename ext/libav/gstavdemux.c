@@ -30,14 +30,43 @@
 /* #include <ffmpeg/avi.h> */
 #include <gst/gst.h>
 #include <gst/base/gstflowcombiner.h>
+#include <gst/video/video.h>
 
 #include "gstav.h"
 #include "gstavcodecmap.h"
 #include "gstavutils.h"
 #include "gstavprotocol.h"
+#include "gstavindex.h"
 
 #define MAX_STREAMS 20
 
+#define DEFAULT_AVIO_BUFFER_SIZE 32768
+#define DEFAULT_MAX_READ_AHEAD (1024 * 1024)
+#define DEFAULT_PREFETCH FALSE
+#define DEFAULT_CACHE_SIZE (4 * 1024 * 1024)
+#define DEFAULT_MMAP FALSE
+#define DEFAULT_PROBESIZE 0
+#define DEFAULT_ANALYZEDURATION 0
+#define DEFAULT_FPSPROBESIZE -1
+#define DEFAULT_FAST_OPEN FALSE
+#define DEFAULT_INDEX_FILE NULL
+
+enum
+{
+  PROP_0,
+  PROP_AVIO_BUFFER_SIZE,
+  PROP_MAX_READ_AHEAD,
+  PROP_PREFETCH,
+  PROP_CACHE_SIZE,
+  PROP_MMAP,
+  PROP_PROBESIZE,
+  PROP_ANALYZEDURATION,
+  PROP_FPSPROBESIZE,
+  PROP_FAST_OPEN,
+  PROP_INDEX_FILE,
+  PROP_INDEX,
+};
+
 typedef struct _GstFFMpegDemux GstFFMpegDemux;
 typedef struct _GstFFStream GstFFStream;
 
@@ -51,6 +80,16 @@ struct _GstFFStream
   GstClockTime last_ts;
   gboolean discont;
   gboolean eos;
+  /* libavformat didn't find an index for the stream, so collect one */
+  gboolean index_keyframes;
+
+  /* raw video: whether downstream takes the packet layout as a GstVideoMeta,
+   * else packets are repacked into the default layout of @info. Checked
+   * again when downstream asks for reconfiguration. */
+  gboolean check_video_meta;
+  gboolean video_meta;
+  GstVideoInfo info;
+  guint8 *palette;              /* last palette from the packet side data */
 
   GstTagList *tags;             /* stream tags */
 };
@@ -98,6 +137,25 @@ struct _GstFFMpegDemux
   GstFFMpegPipe ffpipe;
   GstTask *task;
   GRecMutex task_lock;
+
+  /* I/O settings, protected by the object lock */
+  gint avio_buffer_size;
+  guint max_read_ahead;
+  gboolean prefetch;
+  guint cache_size;
+  gboolean mmap;
+
+  /* probing settings, protected by the object lock */
+  gint64 probesize;
+  GstClockTime analyzeduration;
+  gint fpsprobesize;
+  gboolean fast_open;
+
+  /* keyframe index, protected by the object lock */
+  gchar *index_file;
+  GBytes *index_blob;
+  GstFFMpegIndex *index;
+  gboolean index_changed;
 };
 
 typedef struct _GstFFMpegDemuxClass GstFFMpegDemuxClass;
@@ -117,6 +175,10 @@ static void gst_ffmpegdemux_class_init (GstFFMpegDemuxClass * klass);
 static void gst_ffmpegdemux_base_init (GstFFMpegDemuxClass * klass);
 static void gst_ffmpegdemux_init (GstFFMpegDemux * demux);
 static void gst_ffmpegdemux_finalize (GObject * object);
+static void gst_ffmpegdemux_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec);
+static void gst_ffmpegdemux_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec);
 
 static gboolean gst_ffmpegdemux_sink_event (GstPad * sinkpad,
     GstObject * parent, GstEvent * event);
@@ -238,6 +300,79 @@ gst_ffmpegdemux_class_init (GstFFMpegDemuxClass * klass)
   parent_class = g_type_class_peek_parent (klass);
 
   gobject_class->finalize = GST_DEBUG_FUNCPTR (gst_ffmpegdemux_finalize);
+  gobject_class->set_property =
+      GST_DEBUG_FUNCPTR (gst_ffmpegdemux_set_property);
+  gobject_class->get_property =
+      GST_DEBUG_FUNCPTR (gst_ffmpegdemux_get_property);
+
+  g_object_class_install_property (gobject_class, PROP_AVIO_BUFFER_SIZE,
+      g_param_spec_int ("avio-buffer-size", "AVIO buffer size",
+          "Size of the buffer libavformat reads through, in bytes",
+          512, G_MAXINT, DEFAULT_AVIO_BUFFER_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_READ_AHEAD,
+      g_param_spec_uint ("max-read-ahead", "Maximum read-ahead",
+          "Maximum amount of data pulled at once in pull mode while reading "
+          "sequentially, in bytes (0 = avio-buffer-size)",
+          0, G_MAXINT, DEFAULT_MAX_READ_AHEAD,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREFETCH,
+      g_param_spec_boolean ("prefetch", "Prefetch",
+          "Pull the next range in a separate thread while the current one is "
+          "demuxed, in pull mode", DEFAULT_PREFETCH,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CACHE_SIZE,
+      g_param_spec_uint ("cache-size", "Cache size",
+          "Amount of data pulled earlier that is kept around for demuxers "
+          "seeking back and forth, in bytes", 0, G_MAXUINT,
+          DEFAULT_CACHE_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MMAP,
+      g_param_spec_boolean ("mmap", "Map local files",
+          "Read local files upstream from a memory mapping instead of pulling "
+          "them, in pull mode. Data is still copied into the AVIO buffer, and "
+          "truncating the file while it is read crashes", DEFAULT_MMAP,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PROBESIZE,
+      g_param_spec_int64 ("probesize", "Probe size",
+          "Maximum amount of data read to find the stream parameters, in "
+          "bytes (0 = libavformat default)", 0, G_MAXINT64, DEFAULT_PROBESIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ANALYZEDURATION,
+      g_param_spec_uint64 ("analyzeduration", "Analyze duration",
+          "Maximum duration of data read to find the stream parameters, in "
+          "nanoseconds (0 = libavformat default)", 0, G_MAXUINT64,
+          DEFAULT_ANALYZEDURATION, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_FPSPROBESIZE,
+      g_param_spec_int ("fpsprobesize", "FPS probe size",
+          "Number of frames read to find the frame rate "
+          "(-1 = libavformat default)", -1, G_MAXINT, DEFAULT_FPSPROBESIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_FAST_OPEN,
+      g_param_spec_boolean ("fast-open", "Fast open",
+          "Don't read any data to find the stream parameters when the "
+          "container headers already describe all streams", DEFAULT_FAST_OPEN,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INDEX_FILE,
+      g_param_spec_string ("index-file", "Index file",
+          "File the keyframe index is loaded from when opening and saved to "
+          "when closing, unless it was loaded from it", DEFAULT_INDEX_FILE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INDEX,
+      g_param_spec_boxed ("index", "Index",
+          "Keyframe index collected while demuxing in pull mode when this or "
+          "index-file is set, set to load one when opening, takes "
+          "precedence over index-file", G_TYPE_BYTES,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
   gstelement_class->change_state = gst_ffmpegdemux_change_state;
   gstelement_class->send_event = gst_ffmpegdemux_send_event;
@@ -287,9 +422,17 @@ gst_ffmpegdemux_init (GstFFMpegDemux * demux)
   demux->flowcombiner = gst_flow_combiner_new ();
 
   /* push based data */
-  g_mutex_init (&demux->ffpipe.tlock);
-  g_cond_init (&demux->ffpipe.cond);
-  demux->ffpipe.adapter = gst_adapter_new ();
+  gst_ffmpeg_pipe_init (&demux->ffpipe);
+
+  demux->avio_buffer_size = DEFAULT_AVIO_BUFFER_SIZE;
+  demux->max_read_ahead = DEFAULT_MAX_READ_AHEAD;
+  demux->prefetch = DEFAULT_PREFETCH;
+  demux->cache_size = DEFAULT_CACHE_SIZE;
+  demux->mmap = DEFAULT_MMAP;
+  demux->probesize = DEFAULT_PROBESIZE;
+  demux->analyzeduration = DEFAULT_ANALYZEDURATION;
+  demux->fpsprobesize = DEFAULT_FPSPROBESIZE;
+  demux->fast_open = DEFAULT_FAST_OPEN;
 
   /* blacklist unreliable push-based demuxers */
   if (strcmp (oclass->in_plugin->name, "ape"))
@@ -307,9 +450,12 @@ gst_ffmpegdemux_finalize (GObject * object)
 
   gst_flow_combiner_free (demux->flowcombiner);
 
-  g_mutex_clear (&demux->ffpipe.tlock);
-  g_cond_clear (&demux->ffpipe.cond);
-  gst_object_unref (demux->ffpipe.adapter);
+  gst_ffmpeg_pipe_clear (&demux->ffpipe);
+
+  g_free (demux->index_file);
+  if (demux->index_blob)
+    g_bytes_unref (demux->index_blob);
+  gst_ffmpeg_index_free (demux->index);
 
   gst_object_unref (demux->task);
   g_rec_mutex_clear (&demux->task_lock);
@@ -317,6 +463,142 @@ gst_ffmpegdemux_finalize (GObject * object)
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+static void
+gst_ffmpegdemux_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegDemux *demux = (GstFFMpegDemux *) object;
+
+  GST_OBJECT_LOCK (demux);
+  switch (prop_id) {
+    case PROP_AVIO_BUFFER_SIZE:
+      demux->avio_buffer_size = g_value_get_int (value);
+      break;
+    case PROP_MAX_READ_AHEAD:
+      demux->max_read_ahead = g_value_get_uint (value);
+      break;
+    case PROP_PREFETCH:
+      demux->prefetch = g_value_get_boolean (value);
+      break;
+    case PROP_CACHE_SIZE:
+      demux->cache_size = g_value_get_uint (value);
+      break;
+    case PROP_MMAP:
+      demux->mmap = g_value_get_boolean (value);
+      break;
+    case PROP_PROBESIZE:
+      demux->probesize = g_value_get_int64 (value);
+      break;
+    case PROP_ANALYZEDURATION:
+      demux->analyzeduration = g_value_get_uint64 (value);
+      break;
+    case PROP_FPSPROBESIZE:
+      demux->fpsprobesize = g_value_get_int (value);
+      break;
+    case PROP_FAST_OPEN:
+      demux->fast_open = g_value_get_boolean (value);
+      break;
+    case PROP_INDEX_FILE:
+      g_free (demux->index_file);
+      demux->index_file = g_value_dup_string (value);
+      break;
+    case PROP_INDEX:
+      if (demux->index_blob)
+        g_bytes_unref (demux->index_blob);
+      demux->index_blob = g_value_dup_boxed (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (demux);
+}
+
+static void
+gst_ffmpegdemux_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegDemux *demux = (GstFFMpegDemux *) object;
+
+  GST_OBJECT_LOCK (demux);
+  switch (prop_id) {
+    case PROP_AVIO_BUFFER_SIZE:
+      g_value_set_int (value, demux->avio_buffer_size);
+      break;
+    case PROP_MAX_READ_AHEAD:
+      g_value_set_uint (value, demux->max_read_ahead);
+      break;
+    case PROP_PREFETCH:
+      g_value_set_boolean (value, demux->prefetch);
+      break;
+    case PROP_CACHE_SIZE:
+      g_value_set_uint (value, demux->cache_size);
+      break;
+    case PROP_MMAP:
+      g_value_set_boolean (value, demux->mmap);
+      break;
+    case PROP_PROBESIZE:
+      g_value_set_int64 (value, demux->probesize);
+      break;
+    case PROP_ANALYZEDURATION:
+      g_value_set_uint64 (value, demux->analyzeduration);
+      break;
+    case PROP_FPSPROBESIZE:
+      g_value_set_int (value, demux->fpsprobesize);
+      break;
+    case PROP_FAST_OPEN:
+      g_value_set_boolean (value, demux->fast_open);
+      break;
+    case PROP_INDEX_FILE:
+      g_value_set_string (value, demux->index_file);
+      break;
+    case PROP_INDEX:
+      if (demux->index)
+        g_value_take_boxed (value, gst_ffmpeg_index_serialize (demux->index));
+      else
+        g_value_set_boxed (value, demux->index_blob);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+  GST_OBJECT_UNLOCK (demux);
+}
+
+/* writes the keyframe index to the index file if it differs from what the
+ * file holds */
+static void
+gst_ffmpegdemux_save_index (GstFFMpegDemux * demux)
+{
+  GBytes *bytes = NULL;
+  gchar *filename = NULL;
+  GError *err = NULL;
+  gconstpointer data;
+  gsize size;
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index && demux->index_changed && demux->index_file) {
+    bytes = gst_ffmpeg_index_serialize (demux->index);
+    filename = g_strdup (demux->index_file);
+    demux->index_changed = FALSE;
+  }
+  GST_OBJECT_UNLOCK (demux);
+
+  if (bytes == NULL)
+    return;
+
+  data = g_bytes_get_data (bytes, &size);
+  if (g_file_set_contents (filename, data, size, &err)) {
+    GST_INFO_OBJECT (demux, "saved index to %s", filename);
+  } else {
+    GST_WARNING_OBJECT (demux, "could not save index: %s", err->message);
+    g_clear_error (&err);
+  }
+
+  g_bytes_unref (bytes);
+  g_free (filename);
+}
+
 static void
 gst_ffmpegdemux_close (GstFFMpegDemux * demux)
 {
@@ -338,6 +620,7 @@ gst_ffmpegdemux_close (GstFFMpegDemux * demux)
       }
       if (stream->tags)
         gst_tag_list_unref (stream->tags);
+      g_free (stream->palette);
       g_free (stream);
     }
     demux->streams[n] = NULL;
@@ -345,6 +628,8 @@ gst_ffmpegdemux_close (GstFFMpegDemux * demux)
   demux->videopads = 0;
   demux->audiopads = 0;
 
+  gst_ffmpegdemux_save_index (demux);
+
   /* close demuxer context from ffmpeg */
   if (demux->seekable)
     gst_ffmpegdata_close (demux->context->pb);
@@ -945,6 +1230,7 @@ gst_ffmpegdemux_get_stream (GstFFMpegDemux * demux, AVStream * avstream)
   stream->discont = TRUE;
   stream->avstream = avstream;
   stream->last_ts = GST_CLOCK_TIME_NONE;
+  stream->check_video_meta = TRUE;
   stream->tags = NULL;
 
   switch (ctx->codec_type) {
@@ -1208,6 +1494,192 @@ gst_ffmpeg_metadata_to_tag_list (AVDictionary * metadata)
   return list;
 }
 
+/* whether @index was collected from the stream opened */
+static gboolean
+gst_ffmpegdemux_index_matches (GstFFMpegDemux * demux,
+    GstFFMpegIndex * index, gint64 file_size)
+{
+  guint i;
+  gint num, den;
+
+  if (gst_ffmpeg_index_get_file_size (index) != file_size ||
+      gst_ffmpeg_index_get_n_streams (index) != demux->context->nb_streams)
+    return FALSE;
+
+  for (i = 0; i < demux->context->nb_streams; i++) {
+    AVStream *avstream = demux->context->streams[i];
+
+    gst_ffmpeg_index_get_time_base (index, i, &num, &den);
+    if (num != avstream->time_base.num || den != avstream->time_base.den)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Loads the index set as blob or in the index file, and seeds libavformat
+ * with it. Collects keyframes for the streams libavformat didn't find an
+ * index for. The index file is (re)written unless the index came from it.
+ * Nothing is collected unless the index is kept somewhere, nor in push mode
+ * where there is no seeking to use it for. */
+static void
+gst_ffmpegdemux_load_index (GstFFMpegDemux * demux)
+{
+  GstFFMpegIndex *index = NULL;
+  GBytes *bytes;
+  gchar *filename, *contents;
+  GError *err = NULL;
+  gint64 file_size, timestamp, pos;
+  gsize length;
+  guint i, j, n_entries = 0;
+  gboolean from_file = FALSE;
+
+  GST_OBJECT_LOCK (demux);
+  bytes = demux->index_blob ? g_bytes_ref (demux->index_blob) : NULL;
+  filename = g_strdup (demux->index_file);
+  gst_ffmpeg_index_free (demux->index);
+  demux->index = NULL;
+  demux->index_changed = FALSE;
+  GST_OBJECT_UNLOCK (demux);
+
+  if ((bytes == NULL && filename == NULL) || !demux->seekable) {
+    GST_DEBUG_OBJECT (demux, "not collecting a keyframe index");
+    if (bytes)
+      g_bytes_unref (bytes);
+    g_free (filename);
+    return;
+  }
+
+  if (!gst_pad_peer_query_duration (demux->sinkpad, GST_FORMAT_BYTES,
+          &file_size))
+    file_size = -1;
+
+  if (bytes == NULL && filename != NULL) {
+    if (g_file_get_contents (filename, &contents, &length, &err)) {
+      bytes = g_bytes_new_take (contents, length);
+      from_file = TRUE;
+    } else {
+      GST_DEBUG_OBJECT (demux, "no index loaded: %s", err->message);
+      g_clear_error (&err);
+    }
+  }
+
+  if (bytes) {
+    index = gst_ffmpeg_index_deserialize (bytes);
+    if (index && !gst_ffmpegdemux_index_matches (demux, index, file_size)) {
+      GST_WARNING_OBJECT (demux, "index is for another stream, ignoring it");
+      gst_ffmpeg_index_free (index);
+      index = NULL;
+    }
+    g_bytes_unref (bytes);
+  }
+
+  if (index == NULL) {
+    from_file = FALSE;
+    index = gst_ffmpeg_index_new (demux->context->nb_streams, file_size);
+    for (i = 0; i < demux->context->nb_streams; i++) {
+      AVStream *avstream = demux->context->streams[i];
+
+      gst_ffmpeg_index_set_time_base (index, i, avstream->time_base.num,
+          avstream->time_base.den);
+    }
+  }
+
+  for (i = 0; i < demux->context->nb_streams; i++) {
+    AVStream *avstream = demux->context->streams[i];
+    GstFFStream *stream = gst_ffmpegdemux_get_stream (demux, avstream);
+
+    stream->index_keyframes = avstream->nb_index_entries == 0;
+    for (j = 0; j < gst_ffmpeg_index_get_n_entries (index, i); j++) {
+      gst_ffmpeg_index_get_entry (index, i, j, &timestamp, &pos);
+      av_add_index_entry (avstream, pos, timestamp, 0, 0, AVINDEX_KEYFRAME);
+      n_entries++;
+    }
+  }
+  GST_INFO_OBJECT (demux, "loaded %u index entries", n_entries);
+
+  GST_OBJECT_LOCK (demux);
+  demux->index = index;
+  demux->index_changed = !from_file;
+  GST_OBJECT_UNLOCK (demux);
+
+  g_free (filename);
+}
+
+/* adds a keyframe to the index, and to libavformat's if it's new */
+static void
+gst_ffmpegdemux_index_keyframe (GstFFMpegDemux * demux, AVStream * avstream,
+    gint64 timestamp, gint64 pos)
+{
+  gboolean added = FALSE;
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index &&
+      gst_ffmpeg_index_add (demux->index, avstream->index, timestamp, pos)) {
+    demux->index_changed = TRUE;
+    added = TRUE;
+  }
+  GST_OBJECT_UNLOCK (demux);
+
+  if (added)
+    av_add_index_entry (avstream, pos, timestamp, 0, 0, AVINDEX_KEYFRAME);
+}
+
+/* whether the headers read by avformat_open_input() are enough to create
+ * caps for all streams, without reading any packets */
+static gboolean
+gst_ffmpegdemux_params_known (AVFormatContext * context)
+{
+  guint i;
+
+  /* streams may still show up while reading */
+  if ((context->ctx_flags & AVFMTCTX_NOHEADER) || context->nb_streams == 0)
+    return FALSE;
+
+  for (i = 0; i < context->nb_streams; i++) {
+    AVCodecParameters *par = context->streams[i]->codecpar;
+
+    if (par->codec_id == AV_CODEC_ID_NONE)
+      return FALSE;
+
+    switch (par->codec_type) {
+      case AVMEDIA_TYPE_VIDEO:
+        if (par->width <= 0 || par->height <= 0)
+          return FALSE;
+        if (par->codec_id == AV_CODEC_ID_RAWVIDEO && par->format < 0)
+          return FALSE;
+        break;
+      case AVMEDIA_TYPE_AUDIO:
+        if (par->sample_rate <= 0 || par->channels <= 0)
+          return FALSE;
+        break;
+      default:
+        break;
+    }
+  }
+
+  return TRUE;
+}
+
+/* the earliest start time of the streams, for when it wasn't computed */
+static GstClockTime
+gst_ffmpegdemux_streams_start_time (AVFormatContext * context)
+{
+  GstClockTime start_time = GST_CLOCK_TIME_NONE, tmp;
+  guint i;
+
+  for (i = 0; i < context->nb_streams; i++) {
+    AVStream *avstream = context->streams[i];
+
+    tmp = gst_ffmpeg_time_ff_to_gst (avstream->start_time,
+        avstream->time_base);
+    if (GST_CLOCK_TIME_IS_VALID (tmp) && tmp < start_time)
+      start_time = tmp;
+  }
+
+  return GST_CLOCK_TIME_IS_VALID (start_time) ? start_time : 0;
+}
+
 static gboolean
 gst_ffmpegdemux_open (GstFFMpegDemux * demux)
 {
@@ -1218,31 +1690,75 @@ gst_ffmpegdemux_open (GstFFMpegDemux * demux)
   GstTagList *tags;
   GstEvent *event;
   GList *cached_events;
+  gint buffer_size;
+  guint max_read_ahead;
+  gboolean prefetch;
+  guint cache_size;
+  gboolean use_mmap;
+  gint64 probesize;
+  GstClockTime analyzeduration;
+  gint fpsprobesize;
+  gboolean fast_open;
+  GstClockTime open_start;
+
+  open_start = gst_util_get_timestamp ();
 
   /* to be sure... */
   gst_ffmpegdemux_close (demux);
 
+  GST_OBJECT_LOCK (demux);
+  buffer_size = demux->avio_buffer_size;
+  max_read_ahead = demux->max_read_ahead;
+  prefetch = demux->prefetch;
+  cache_size = demux->cache_size;
+  use_mmap = demux->mmap;
+  probesize = demux->probesize;
+  analyzeduration = demux->analyzeduration;
+  fpsprobesize = demux->fpsprobesize;
+  fast_open = demux->fast_open;
+  GST_OBJECT_UNLOCK (demux);
+
   /* open via our input protocol hack */
-  if (demux->seekable)
-    res = gst_ffmpegdata_open (demux->sinkpad, AVIO_FLAG_READ, &iocontext);
-  else
-    res = gst_ffmpeg_pipe_open (&demux->ffpipe, AVIO_FLAG_READ, &iocontext);
+  if (demux->seekable) {
+    res = gst_ffmpegdata_open (demux->sinkpad, AVIO_FLAG_READ, buffer_size,
+        &iocontext);
+    if (res >= 0) {
+      gst_ffmpegdata_set_read_ahead (iocontext, max_read_ahead, prefetch);
+      gst_ffmpegdata_set_cache_size (iocontext, cache_size);
+      if (use_mmap && gst_ffmpegdata_map_file (iocontext))
+        GST_INFO_OBJECT (demux, "reading mapped file");
+    }
+  } else {
+    res = gst_ffmpeg_pipe_open (&demux->ffpipe, AVIO_FLAG_READ, buffer_size,
+        &iocontext);
+  }
 
   if (res < 0)
     goto beach;
 
   demux->context = avformat_alloc_context ();
   demux->context->pb = iocontext;
+  if (probesize > 0)
+    demux->context->probesize = probesize;
+  if (analyzeduration > 0)
+    demux->context->max_analyze_duration =
+        gst_util_uint64_scale (analyzeduration, AV_TIME_BASE, GST_SECOND);
+  if (fpsprobesize >= 0)
+    demux->context->fps_probe_size = fpsprobesize;
   res = avformat_open_input (&demux->context, NULL, oclass->in_plugin, NULL);
 
   GST_DEBUG_OBJECT (demux, "av_open_input returned %d", res);
   if (res < 0)
     goto beach;
 
-  res = gst_ffmpeg_av_find_stream_info (demux->context);
-  GST_DEBUG_OBJECT (demux, "av_find_stream_info returned %d", res);
-  if (res < 0)
-    goto beach;
+  if (fast_open && gst_ffmpegdemux_params_known (demux->context)) {
+    GST_DEBUG_OBJECT (demux, "headers describe all streams, not probing");
+  } else {
+    res = gst_ffmpeg_av_find_stream_info (demux->context);
+    GST_DEBUG_OBJECT (demux, "av_find_stream_info returned %d", res);
+    if (res < 0)
+      goto beach;
+  }
 
   n_streams = demux->context->nb_streams;
   GST_DEBUG_OBJECT (demux, "we have %d streams", n_streams);
@@ -1255,9 +1771,17 @@ gst_ffmpegdemux_open (GstFFMpegDemux * demux)
 
   gst_element_no_more_pads (GST_ELEMENT (demux));
 
+  gst_ffmpegdemux_load_index (demux);
+
+  GST_INFO_OBJECT (demux, "opened in %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (gst_util_get_timestamp () - open_start));
+
   /* transform some useful info to GstClockTime and remember */
-  demux->start_time = gst_util_uint64_scale_int (demux->context->start_time,
-      GST_SECOND, AV_TIME_BASE);
+  if (demux->context->start_time != AV_NOPTS_VALUE)
+    demux->start_time = gst_util_uint64_scale_int (demux->context->start_time,
+        GST_SECOND, AV_TIME_BASE);
+  else
+    demux->start_time = gst_ffmpegdemux_streams_start_time (demux->context);
   GST_DEBUG_OBJECT (demux, "start time: %" GST_TIME_FORMAT,
       GST_TIME_ARGS (demux->start_time));
   if (demux->context->duration > 0)
@@ -1393,6 +1917,165 @@ gst_ffmpegdemux_type_find (GstTypeFind * tf, gpointer priv)
   }
 }
 
+static void
+gst_ffmpegdemux_free_avpacket (gpointer pkt)
+{
+  av_packet_unref ((AVPacket *) pkt);
+  g_slice_free (AVPacket, pkt);
+}
+
+/* Hands the refcounted data of @pkt over to a new buffer, leaving @pkt
+ * blank. libavformat zeroes the padding behind the payload, which is
+ * advertised when the packet's buffer has room for it. */
+static GstBuffer *
+gst_ffmpegdemux_wrap_avpacket (AVPacket * pkt)
+{
+  GstMemoryFlags flags = GST_MEMORY_FLAG_READONLY;
+  AVPacket *copy;
+  gsize maxsize;
+
+  copy = g_slice_new (AVPacket);
+  av_packet_move_ref (copy, pkt);
+
+  maxsize = copy->size;
+  if (copy->buf && copy->data + copy->size + AV_INPUT_BUFFER_PADDING_SIZE <=
+      copy->buf->data + copy->buf->size) {
+    flags |= GST_MEMORY_FLAG_ZERO_PADDED;
+    maxsize += AV_INPUT_BUFFER_PADDING_SIZE;
+  }
+
+  return gst_buffer_new_wrapped_full (flags, copy->data, maxsize, 0,
+      copy->size, copy, gst_ffmpegdemux_free_avpacket);
+}
+
+/* Asks downstream whether it handles GstVideoMeta, and takes the default
+ * layout for repacking from the caps */
+static void
+gst_ffmpegdemux_check_video_meta (GstFFMpegDemux * demux,
+    GstFFStream * stream)
+{
+  GstCaps *caps;
+  GstQuery *query;
+
+  stream->video_meta = FALSE;
+  gst_video_info_init (&stream->info);
+
+  caps = gst_pad_get_current_caps (stream->pad);
+  if (caps == NULL)
+    return;
+
+  if (!gst_video_info_from_caps (&stream->info, caps))
+    GST_WARNING_OBJECT (stream->pad, "can't handle caps %" GST_PTR_FORMAT,
+        caps);
+
+  query = gst_query_new_allocation (caps, FALSE);
+  if (gst_pad_peer_query (stream->pad, query))
+    stream->video_meta =
+        gst_query_find_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+  gst_query_unref (query);
+  gst_caps_unref (caps);
+
+  GST_DEBUG_OBJECT (stream->pad, "downstream %s video meta",
+      stream->video_meta ? "supports" : "doesn't support");
+}
+
+/* Fills in the planes of a raw video packet, libavformat stores them
+ * without padding. Palettes are not part of the packet but come as side
+ * data, the last one seen is used for them. */
+static gboolean
+gst_ffmpegdemux_get_raw_planes (GstFFMpegDemux * demux, GstFFStream * stream,
+    AVPacket * pkt, uint8_t * planes[4], int linesizes[4])
+{
+  AVCodecParameters *codecpar = stream->avstream->codecpar;
+  gint needed;
+
+  if (GST_VIDEO_INFO_HAS_PALETTE (&stream->info)) {
+    guint8 *palette;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+    size_t palette_size = 0;
+#else
+    gint palette_size = 0;
+#endif
+
+    palette = av_packet_get_side_data (pkt, AV_PKT_DATA_PALETTE,
+        &palette_size);
+    if (stream->palette == NULL)
+      stream->palette = g_malloc0 (AVPALETTE_SIZE);
+    if (palette)
+      memcpy (stream->palette, palette, MIN (palette_size, AVPALETTE_SIZE));
+
+    needed = av_image_fill_linesizes (linesizes, codecpar->format,
+        codecpar->width);
+    if (needed >= 0)
+      needed = linesizes[0] * codecpar->height;
+    planes[0] = pkt->data;
+    planes[1] = stream->palette;
+    planes[2] = planes[3] = NULL;
+  } else {
+    needed = av_image_fill_arrays (planes, linesizes, pkt->data,
+        codecpar->format, codecpar->width, codecpar->height, 1);
+  }
+
+  if (needed < 0 || needed > pkt->size) {
+    GST_WARNING_OBJECT (demux, "raw video packet of %d bytes is too small, "
+        "expected %d", pkt->size, needed);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Describes the layout libavformat left a raw video packet in, only
+ * possible for formats where all planes are part of the packet */
+static gboolean
+gst_ffmpegdemux_get_video_meta (GstFFStream * stream, AVPacket * pkt,
+    uint8_t * planes[4], int linesizes[4], gsize offset[GST_VIDEO_MAX_PLANES],
+    gint stride[GST_VIDEO_MAX_PLANES])
+{
+  guint i, n_planes;
+
+  n_planes = GST_VIDEO_INFO_N_PLANES (&stream->info);
+  if (GST_VIDEO_INFO_HAS_PALETTE (&stream->info) || n_planes > 4)
+    return FALSE;
+
+  for (i = 0; i < n_planes; i++) {
+    if (!planes[i] || planes[i] < pkt->data
+        || planes[i] >= pkt->data + pkt->size)
+      return FALSE;
+    offset[i] = planes[i] - pkt->data;
+    stride[i] = linesizes[i];
+  }
+
+  return TRUE;
+}
+
+/* Copies a raw video packet into the default layout of the caps, for
+ * downstream elements that don't handle GstVideoMeta */
+static GstBuffer *
+gst_ffmpegdemux_repack_raw_video (GstFFMpegDemux * demux,
+    GstFFStream * stream, uint8_t * planes[4], int linesizes[4])
+{
+  AVCodecParameters *codecpar = stream->avstream->codecpar;
+  GstVideoInfo *info = &stream->info;
+  uint8_t *dst[4] = { NULL, };
+  int dst_linesizes[4] = { 0, };
+  GstBuffer *outbuf;
+  GstMapInfo map;
+  guint i;
+
+  outbuf = gst_buffer_new_and_alloc (GST_VIDEO_INFO_SIZE (info));
+  gst_buffer_map (outbuf, &map, GST_MAP_WRITE);
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (info) && i < 4; i++) {
+    dst[i] = map.data + GST_VIDEO_INFO_PLANE_OFFSET (info, i);
+    dst_linesizes[i] = GST_VIDEO_INFO_PLANE_STRIDE (info, i);
+  }
+  av_image_copy (dst, dst_linesizes, (const uint8_t **) planes, linesizes,
+      codecpar->format, codecpar->width, codecpar->height);
+  gst_buffer_unmap (outbuf, &map);
+
+  return outbuf;
+}
+
 /* Task */
 static void
 gst_ffmpegdemux_loop (GstFFMpegDemux * demux)
@@ -1405,8 +2088,12 @@ gst_ffmpegdemux_loop (GstFFMpegDemux * demux)
   AVStream *avstream;
   GstBuffer *outbuf = NULL;
   GstClockTime timestamp, duration;
-  gint outsize;
   gboolean rawvideo;
+  gboolean key;
+  uint8_t *planes[4];
+  int linesizes[4];
+  gsize offset[GST_VIDEO_MAX_PLANES] = { 0, };
+  gint stride[GST_VIDEO_MAX_PLANES] = { 0, };
   GstFlowReturn stream_last_flow;
   gint64 pts;
 
@@ -1486,45 +2173,59 @@ gst_ffmpegdemux_loop (GstFFMpegDemux * demux)
   rawvideo = (avstream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
       avstream->codecpar->codec_id == AV_CODEC_ID_RAWVIDEO);
 
-  if (rawvideo)
-    outsize = gst_ffmpeg_avpicture_get_size (avstream->codecpar->format,
-        avstream->codecpar->width, avstream->codecpar->height);
-  else
-    outsize = pkt.size;
-
-  outbuf = gst_buffer_new_and_alloc (outsize);
-
-  /* copy the data from packet into the target buffer
-   * and do conversions for raw video packets */
-  if (rawvideo) {
-    AVFrame src, dst;
-    const gchar *plugin_name =
-        ((GstFFMpegDemuxClass *) (G_OBJECT_GET_CLASS (demux)))->in_plugin->name;
-    GstMapInfo map;
-
-    GST_WARNING ("Unknown demuxer %s, no idea what to do", plugin_name);
-    gst_ffmpeg_avpicture_fill (&src, pkt.data,
-        avstream->codecpar->format, avstream->codecpar->width,
-        avstream->codecpar->height);
-
-    gst_buffer_map (outbuf, &map, GST_MAP_WRITE);
-    gst_ffmpeg_avpicture_fill (&dst, map.data,
-        avstream->codecpar->format, avstream->codecpar->width,
-        avstream->codecpar->height);
-
-    av_image_copy (dst.data, dst.linesize, (const uint8_t **) src.data,
-        src.linesize, avstream->codecpar->format, avstream->codecpar->width,
-        avstream->codecpar->height);
-    gst_buffer_unmap (outbuf, &map);
-  } else {
-    gst_buffer_fill (outbuf, 0, pkt.data, outsize);
+  key = (pkt.flags & AV_PKT_FLAG_KEY) != 0;
+
+  if (key && stream->index_keyframes && pkt.pos >= 0) {
+    /* libavformat indexes by dts */
+    if (pkt.dts != AV_NOPTS_VALUE)
+      gst_ffmpegdemux_index_keyframe (demux, avstream, pkt.dts, pkt.pos);
+    else if (pkt.pts != AV_NOPTS_VALUE)
+      gst_ffmpegdemux_index_keyframe (demux, avstream, pkt.pts, pkt.pos);
+  }
+
+  if (rawvideo && (gst_pad_check_reconfigure (srcpad)
+          || stream->check_video_meta)) {
+    gst_ffmpegdemux_check_video_meta (demux, stream);
+    stream->check_video_meta = FALSE;
+  }
+
+  /* raw video goes out as is if downstream takes the layout libavformat
+   * left it in, else it is repacked */
+  if (rawvideo &&
+      GST_VIDEO_INFO_FORMAT (&stream->info) != GST_VIDEO_FORMAT_UNKNOWN &&
+      gst_ffmpegdemux_get_raw_planes (demux, stream, &pkt, planes,
+          linesizes)) {
+    if (stream->video_meta && pkt.buf &&
+        gst_ffmpegdemux_get_video_meta (stream, &pkt, planes, linesizes,
+            offset, stride)) {
+      outbuf = gst_ffmpegdemux_wrap_avpacket (&pkt);
+      gst_buffer_add_video_meta_full (outbuf, GST_VIDEO_FRAME_FLAG_NONE,
+          GST_VIDEO_INFO_FORMAT (&stream->info),
+          GST_VIDEO_INFO_WIDTH (&stream->info),
+          GST_VIDEO_INFO_HEIGHT (&stream->info),
+          GST_VIDEO_INFO_N_PLANES (&stream->info), offset, stride);
+    } else {
+      outbuf = gst_ffmpegdemux_repack_raw_video (demux, stream, planes,
+          linesizes);
+    }
+  }
+
+  /* the packet data is handed over to the buffer, libavformat only returns
+   * refcounted packets but copy if one slipped through */
+  if (outbuf == NULL) {
+    if (pkt.buf) {
+      outbuf = gst_ffmpegdemux_wrap_avpacket (&pkt);
+    } else {
+      outbuf = gst_buffer_new_and_alloc (pkt.size);
+      gst_buffer_fill (outbuf, 0, pkt.data, pkt.size);
+    }
   }
 
   GST_BUFFER_TIMESTAMP (outbuf) = timestamp;
   GST_BUFFER_DURATION (outbuf) = duration;
 
   /* mark keyframes */
-  if (!(pkt.flags & AV_PKT_FLAG_KEY)) {
+  if (!key) {
     GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
   }
 
@@ -1565,15 +2266,11 @@ pause:
     if (demux->seekable)
       gst_pad_pause_task (demux->sinkpad);
     else {
-      GstFFMpegPipe *ffpipe = &demux->ffpipe;
-
-      GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
       /* pause task and make sure loop stops */
       gst_task_pause (demux->task);
       g_rec_mutex_lock (&demux->task_lock);
       g_rec_mutex_unlock (&demux->task_lock);
-      demux->ffpipe.srcresult = ret;
-      GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
+      gst_ffmpeg_pipe_set_flow (&demux->ffpipe, ret);
     }
 
     if (ret == GST_FLOW_EOS) {
@@ -1659,10 +2356,7 @@ gst_ffmpegdemux_sink_event (GstPad * sinkpad, GstObject * parent,
       gst_pad_event_default (sinkpad, parent, event);
 
       /* now unblock the chain function */
-      GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-      ffpipe->srcresult = GST_FLOW_FLUSHING;
-      GST_FFMPEG_PIPE_SIGNAL (ffpipe);
-      GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
+      gst_ffmpeg_pipe_set_flow (ffpipe, GST_FLOW_FLUSHING);
 
       /* loop might run into WRONG_STATE and end itself,
        * but may also be waiting in a ffmpeg read
@@ -1677,22 +2371,18 @@ gst_ffmpegdemux_sink_event (GstPad * sinkpad, GstObject * parent,
       g_list_foreach (demux->cached_events, (GFunc) gst_mini_object_unref,
           NULL);
       g_list_free (demux->cached_events);
+      demux->cached_events = NULL;
       GST_OBJECT_UNLOCK (demux);
-      GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-      gst_adapter_clear (ffpipe->adapter);
-      ffpipe->srcresult = GST_FLOW_OK;
+      /* the loop drops what was queued before */
+      gst_ffmpeg_pipe_flush (ffpipe);
       /* loop may have decided to end itself as a result of flush WRONG_STATE */
       gst_task_start (demux->task);
       demux->flushing = FALSE;
       GST_LOG_OBJECT (demux, "loop started");
-      GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
       goto done;
     case GST_EVENT_EOS:
       /* inform the src task that it can stop now */
-      GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-      ffpipe->eos = TRUE;
-      GST_FFMPEG_PIPE_SIGNAL (ffpipe);
-      GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
+      gst_ffmpeg_pipe_set_eos (ffpipe);
 
       /* eat this event for now, task will send eos when finished */
       gst_event_unref (event);
@@ -1710,10 +2400,7 @@ gst_ffmpegdemux_sink_event (GstPad * sinkpad, GstObject * parent,
        * be waiting against a cond that will never be signalled. */
       if (GST_EVENT_IS_SERIALIZED (event)) {
         if (demux->opened) {
-          GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-          while (!ffpipe->needed)
-            GST_FFMPEG_PIPE_WAIT (ffpipe);
-          GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
+          gst_ffmpeg_pipe_wait_empty (ffpipe);
         } else {
           /* queue events and send them later (esp. tag events) */
           GST_OBJECT_LOCK (demux);
@@ -1736,56 +2423,13 @@ static GstFlowReturn
 gst_ffmpegdemux_chain (GstPad * sinkpad, GstObject * parent, GstBuffer * buffer)
 {
   GstFFMpegDemux *demux;
-  GstFFMpegPipe *ffpipe;
 
   demux = (GstFFMpegDemux *) parent;
-  ffpipe = &demux->ffpipe;
-
-  GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-
-  if (G_UNLIKELY (ffpipe->eos))
-    goto eos;
-
-  if (G_UNLIKELY (ffpipe->srcresult != GST_FLOW_OK))
-    goto ignore;
 
   GST_DEBUG ("Giving a buffer of %" G_GSIZE_FORMAT " bytes",
       gst_buffer_get_size (buffer));
-  gst_adapter_push (ffpipe->adapter, buffer);
-  buffer = NULL;
-  while (gst_adapter_available (ffpipe->adapter) >= ffpipe->needed) {
-    GST_DEBUG ("Adapter has more that requested (ffpipe->needed:%d)",
-        ffpipe->needed);
-    GST_FFMPEG_PIPE_SIGNAL (ffpipe);
-    GST_FFMPEG_PIPE_WAIT (ffpipe);
-    /* may have become flushing */
-    if (G_UNLIKELY (ffpipe->srcresult != GST_FLOW_OK))
-      goto ignore;
-  }
-
-  GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
-
-  return GST_FLOW_OK;
 
-/* special cases */
-eos:
-  {
-    GST_DEBUG_OBJECT (demux, "ignoring buffer at end-of-stream");
-    GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
-
-    gst_buffer_unref (buffer);
-    return GST_FLOW_EOS;
-  }
-ignore:
-  {
-    GST_DEBUG_OBJECT (demux, "ignoring buffer because src task encountered %s",
-        gst_flow_get_name (ffpipe->srcresult));
-    GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
-
-    if (buffer)
-      gst_buffer_unref (buffer);
-    return GST_FLOW_FLUSHING;
-  }
+  return gst_ffmpeg_pipe_push (&demux->ffpipe, buffer);
 }
 
 static gboolean
@@ -1843,21 +2487,14 @@ gst_ffmpegdemux_sink_activate_push (GstPad * sinkpad, GstObject * parent,
       GST_WARNING_OBJECT (demux, "Demuxer can't reliably operate in push-mode");
       goto beach;
     }
-    demux->ffpipe.eos = FALSE;
-    demux->ffpipe.srcresult = GST_FLOW_OK;
-    demux->ffpipe.needed = 0;
+    gst_ffmpeg_pipe_reset (&demux->ffpipe);
     demux->seekable = FALSE;
     res = gst_task_start (demux->task);
   } else {
-    GstFFMpegPipe *ffpipe = &demux->ffpipe;
-
     /* release chain and loop */
-    GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
-    demux->ffpipe.srcresult = GST_FLOW_FLUSHING;
+    gst_ffmpeg_pipe_set_flow (&demux->ffpipe, GST_FLOW_FLUSHING);
     /* end streaming by making ffmpeg believe eos */
-    demux->ffpipe.eos = TRUE;
-    GST_FFMPEG_PIPE_SIGNAL (ffpipe);
-    GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
+    gst_ffmpeg_pipe_set_eos (&demux->ffpipe);
 
     /* make sure streaming ends */
     gst_task_stop (demux->task);
@@ -1942,7 +2579,7 @@ gst_ffmpegdemux_change_state (GstElement * element, GstStateChange transition)
   switch (transition) {
     case GST_STATE_CHANGE_PAUSED_TO_READY:
       gst_ffmpegdemux_close (demux);
-      gst_adapter_clear (demux->ffpipe.adapter);
+      gst_ffmpeg_pipe_reset (&demux->ffpipe);
       g_list_foreach (demux->cached_events, (GFunc) gst_mini_object_unref,
           NULL);
       g_list_free (demux->cached_events);
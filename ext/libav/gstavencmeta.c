@@ -0,0 +1,111 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gstavencmeta.h"
+
+static gboolean
+gst_ffmpeg_enc_meta_init (GstMeta * meta, gpointer params, GstBuffer * buffer)
+{
+  GstFFMpegEncMeta *emeta = (GstFFMpegEncMeta *) meta;
+
+  emeta->pict_type = 0;
+  emeta->reference = TRUE;
+  emeta->temporal_id = 0;
+  emeta->qp = -1;
+  emeta->n_psnr = 0;
+
+  return TRUE;
+}
+
+static gboolean
+gst_ffmpeg_enc_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstFFMpegEncMeta *smeta = (GstFFMpegEncMeta *) meta;
+  GstFFMpegEncMeta *dmeta;
+
+  /* describes the whole picture, so only copies */
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  dmeta = gst_buffer_add_ffmpeg_enc_meta (dest, smeta->pict_type,
+      smeta->reference, smeta->temporal_id);
+  if (!dmeta)
+    return FALSE;
+
+  dmeta->qp = smeta->qp;
+  dmeta->n_psnr = smeta->n_psnr;
+  memcpy (dmeta->psnr, smeta->psnr, sizeof (smeta->psnr));
+
+  return TRUE;
+}
+
+GType
+gst_ffmpeg_enc_meta_api_get_type (void)
+{
+  static volatile GType type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstFFMpegEncMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return type;
+}
+
+const GstMetaInfo *
+gst_ffmpeg_enc_meta_get_info (void)
+{
+  static const GstMetaInfo *meta_info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) & meta_info)) {
+    const GstMetaInfo *mi = gst_meta_register (GST_FFMPEG_ENC_META_API_TYPE,
+        "GstFFMpegEncMeta", sizeof (GstFFMpegEncMeta),
+        gst_ffmpeg_enc_meta_init, (GstMetaFreeFunction) NULL,
+        gst_ffmpeg_enc_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) & meta_info, (GstMetaInfo *) mi);
+  }
+  return meta_info;
+}
+
+GstFFMpegEncMeta *
+gst_buffer_add_ffmpeg_enc_meta (GstBuffer * buffer, gint pict_type,
+    gboolean reference, guint temporal_id)
+{
+  GstFFMpegEncMeta *meta;
+
+  g_return_val_if_fail (GST_IS_BUFFER (buffer), NULL);
+
+  meta = (GstFFMpegEncMeta *) gst_buffer_add_meta (buffer,
+      GST_FFMPEG_ENC_META_INFO, NULL);
+  if (!meta)
+    return NULL;
+
+  meta->pict_type = pict_type;
+  meta->reference = reference;
+  meta->temporal_id = temporal_id;
+
+  return meta;
+}
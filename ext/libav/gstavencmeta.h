@@ -0,0 +1,72 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_FFMPEGENCMETA_H__
+#define __GST_FFMPEGENCMETA_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_FFMPEG_ENC_META_API_TYPE (gst_ffmpeg_enc_meta_api_get_type())
+#define GST_FFMPEG_ENC_META_INFO  (gst_ffmpeg_enc_meta_get_info())
+
+typedef struct _GstFFMpegEncMeta GstFFMpegEncMeta;
+
+/**
+ * GstFFMpegEncMeta:
+ * @meta: parent #GstMeta
+ * @pict_type: the AVPictureType of the encoded picture, 0 if unknown
+ * @reference: whether other pictures may be predicted from this one
+ * @temporal_id: temporal layer of the picture, 0 for the base layer and 1
+ *   for the pictures no other picture depends on
+ * @qp: quantizer the picture was encoded with, -1 if unknown
+ * @n_psnr: number of valid entries in @psnr
+ * @psnr: PSNR of each plane in dB, only computed by the encoders when the
+ *   "psnr" flag is set
+ *
+ * Describes an encoded picture, so that streams can be thinned and rate
+ * control can follow the encoder without parsing them. Applications can
+ * find the API type by the name "GstFFMpegEncMetaAPI".
+ */
+struct _GstFFMpegEncMeta
+{
+  GstMeta meta;
+
+  gint pict_type;
+  gboolean reference;
+  guint temporal_id;
+
+  gint qp;
+  guint n_psnr;
+  gdouble psnr[4];
+};
+
+GType gst_ffmpeg_enc_meta_api_get_type (void);
+const GstMetaInfo *gst_ffmpeg_enc_meta_get_info (void);
+
+#define gst_buffer_get_ffmpeg_enc_meta(b) \
+    ((GstFFMpegEncMeta *) gst_buffer_get_meta ((b), GST_FFMPEG_ENC_META_API_TYPE))
+
+GstFFMpegEncMeta *gst_buffer_add_ffmpeg_enc_meta (GstBuffer * buffer,
+    gint pict_type, gboolean reference, guint temporal_id);
+
+G_END_DECLS
+
+#endif /* __GST_FFMPEGENCMETA_H__ */
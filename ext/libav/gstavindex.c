@@ -0,0 +1,274 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/base/gstbytereader.h>
+#include <gst/base/gstbytewriter.h>
+
+#include "gstav.h"
+#include "gstavindex.h"
+
+#define INDEX_MAGIC GST_MAKE_FOURCC ('G', 'A', 'V', 'I')
+#define INDEX_VERSION 1
+
+typedef struct
+{
+  gint64 timestamp;
+  gint64 pos;
+} GstFFMpegIndexEntry;
+
+typedef struct
+{
+  gint num, den;
+  GArray *entries;
+} GstFFMpegIndexStream;
+
+struct _GstFFMpegIndex
+{
+  gint64 file_size;
+  guint n_streams;
+  GstFFMpegIndexStream *streams;
+};
+
+GstFFMpegIndex *
+gst_ffmpeg_index_new (guint n_streams, gint64 file_size)
+{
+  GstFFMpegIndex *index;
+  guint i;
+
+  index = g_new0 (GstFFMpegIndex, 1);
+  index->file_size = file_size;
+  index->n_streams = n_streams;
+  index->streams = g_new0 (GstFFMpegIndexStream, n_streams);
+  for (i = 0; i < n_streams; i++) {
+    index->streams[i].num = 0;
+    index->streams[i].den = 1;
+    index->streams[i].entries =
+        g_array_new (FALSE, FALSE, sizeof (GstFFMpegIndexEntry));
+  }
+
+  return index;
+}
+
+void
+gst_ffmpeg_index_free (GstFFMpegIndex * index)
+{
+  guint i;
+
+  if (index == NULL)
+    return;
+
+  for (i = 0; i < index->n_streams; i++)
+    g_array_free (index->streams[i].entries, TRUE);
+  g_free (index->streams);
+  g_free (index);
+}
+
+guint
+gst_ffmpeg_index_get_n_streams (GstFFMpegIndex * index)
+{
+  return index->n_streams;
+}
+
+gint64
+gst_ffmpeg_index_get_file_size (GstFFMpegIndex * index)
+{
+  return index->file_size;
+}
+
+void
+gst_ffmpeg_index_set_time_base (GstFFMpegIndex * index, guint stream,
+    gint num, gint den)
+{
+  g_return_if_fail (stream < index->n_streams);
+
+  index->streams[stream].num = num;
+  index->streams[stream].den = den;
+}
+
+void
+gst_ffmpeg_index_get_time_base (GstFFMpegIndex * index, guint stream,
+    gint * num, gint * den)
+{
+  g_return_if_fail (stream < index->n_streams);
+
+  *num = index->streams[stream].num;
+  *den = index->streams[stream].den;
+}
+
+/* Adds a keyframe, returns FALSE if there already is one at @timestamp */
+gboolean
+gst_ffmpeg_index_add (GstFFMpegIndex * index, guint stream,
+    gint64 timestamp, gint64 pos)
+{
+  GArray *entries;
+  GstFFMpegIndexEntry entry;
+  guint lo, hi, mid;
+
+  g_return_val_if_fail (stream < index->n_streams, FALSE);
+
+  entries = index->streams[stream].entries;
+
+  /* mostly appended while playing through */
+  lo = 0;
+  hi = entries->len;
+  if (hi > 0 &&
+      g_array_index (entries, GstFFMpegIndexEntry, hi - 1).timestamp <
+      timestamp) {
+    lo = hi;
+  } else {
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (g_array_index (entries, GstFFMpegIndexEntry, mid).timestamp <
+          timestamp)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < entries->len &&
+        g_array_index (entries, GstFFMpegIndexEntry, lo).timestamp ==
+        timestamp)
+      return FALSE;
+  }
+
+  entry.timestamp = timestamp;
+  entry.pos = pos;
+  g_array_insert_val (entries, lo, entry);
+
+  return TRUE;
+}
+
+guint
+gst_ffmpeg_index_get_n_entries (GstFFMpegIndex * index, guint stream)
+{
+  g_return_val_if_fail (stream < index->n_streams, 0);
+
+  return index->streams[stream].entries->len;
+}
+
+void
+gst_ffmpeg_index_get_entry (GstFFMpegIndex * index, guint stream,
+    guint idx, gint64 * timestamp, gint64 * pos)
+{
+  GstFFMpegIndexEntry *entry;
+
+  g_return_if_fail (stream < index->n_streams);
+  g_return_if_fail (idx < index->streams[stream].entries->len);
+
+  entry = &g_array_index (index->streams[stream].entries,
+      GstFFMpegIndexEntry, idx);
+  *timestamp = entry->timestamp;
+  *pos = entry->pos;
+}
+
+GBytes *
+gst_ffmpeg_index_serialize (GstFFMpegIndex * index)
+{
+  GstByteWriter writer;
+  guint size, i, j;
+
+  size = 20;
+  for (i = 0; i < index->n_streams; i++)
+    size += 12 + 16 * index->streams[i].entries->len;
+
+  gst_byte_writer_init_with_size (&writer, size, TRUE);
+
+  gst_byte_writer_put_uint32_le_unchecked (&writer, INDEX_MAGIC);
+  gst_byte_writer_put_uint32_le_unchecked (&writer, INDEX_VERSION);
+  gst_byte_writer_put_int64_le_unchecked (&writer, index->file_size);
+  gst_byte_writer_put_uint32_le_unchecked (&writer, index->n_streams);
+
+  for (i = 0; i < index->n_streams; i++) {
+    GstFFMpegIndexStream *stream = &index->streams[i];
+
+    gst_byte_writer_put_int32_le_unchecked (&writer, stream->num);
+    gst_byte_writer_put_int32_le_unchecked (&writer, stream->den);
+    gst_byte_writer_put_uint32_le_unchecked (&writer, stream->entries->len);
+    for (j = 0; j < stream->entries->len; j++) {
+      GstFFMpegIndexEntry *entry =
+          &g_array_index (stream->entries, GstFFMpegIndexEntry, j);
+
+      gst_byte_writer_put_int64_le_unchecked (&writer, entry->timestamp);
+      gst_byte_writer_put_int64_le_unchecked (&writer, entry->pos);
+    }
+  }
+
+  return g_bytes_new_take (gst_byte_writer_reset_and_get_data (&writer), size);
+}
+
+/* Returns NULL if @bytes doesn't hold an index in a known version */
+GstFFMpegIndex *
+gst_ffmpeg_index_deserialize (GBytes * bytes)
+{
+  GstFFMpegIndex *index = NULL;
+  GstByteReader reader;
+  guint32 magic, version, n_streams, n_entries;
+  gint32 num, den;
+  gint64 file_size, timestamp;
+  gconstpointer data;
+  gsize size;
+  guint i, j;
+
+  data = g_bytes_get_data (bytes, &size);
+  gst_byte_reader_init (&reader, data, size);
+
+  if (!gst_byte_reader_get_uint32_le (&reader, &magic) || magic != INDEX_MAGIC)
+    goto invalid;
+  if (!gst_byte_reader_get_uint32_le (&reader, &version) ||
+      version != INDEX_VERSION)
+    goto invalid;
+  if (!gst_byte_reader_get_int64_le (&reader, &file_size) ||
+      !gst_byte_reader_get_uint32_le (&reader, &n_streams))
+    goto invalid;
+  /* each stream takes at least 12 bytes */
+  if (n_streams > gst_byte_reader_get_remaining (&reader) / 12)
+    goto invalid;
+
+  index = gst_ffmpeg_index_new (n_streams, file_size);
+
+  for (i = 0; i < n_streams; i++) {
+    if (!gst_byte_reader_get_int32_le (&reader, &num) ||
+        !gst_byte_reader_get_int32_le (&reader, &den) ||
+        !gst_byte_reader_get_uint32_le (&reader, &n_entries))
+      goto invalid;
+    if (n_entries > gst_byte_reader_get_remaining (&reader) / 16)
+      goto invalid;
+
+    gst_ffmpeg_index_set_time_base (index, i, num, den);
+    for (j = 0; j < n_entries; j++) {
+      timestamp = gst_byte_reader_get_int64_le_unchecked (&reader);
+      gst_ffmpeg_index_add (index, i, timestamp,
+          gst_byte_reader_get_int64_le_unchecked (&reader));
+    }
+  }
+
+  return index;
+
+  /* ERRORS */
+invalid:
+  {
+    GST_WARNING ("invalid index at byte %u of %" G_GSIZE_FORMAT,
+        gst_byte_reader_get_pos (&reader), size);
+    gst_ffmpeg_index_free (index);
+    return NULL;
+  }
+}
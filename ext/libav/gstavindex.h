@@ -0,0 +1,59 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_FFMPEGINDEX_H__
+#define __GST_FFMPEGINDEX_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* Keyframe positions collected per stream while demuxing, in the stream
+ * time base, kept sorted by timestamp. The serialized form is, in little
+ * endian:
+ *
+ *   "GAVI" magic, guint32 version, gint64 size of the indexed file in bytes
+ *   (-1 if unknown), guint32 number of streams, and per stream gint32 time
+ *   base numerator and denominator, guint32 number of entries and the
+ *   entries as gint64 timestamp and byte position.
+ */
+typedef struct _GstFFMpegIndex GstFFMpegIndex;
+
+GstFFMpegIndex *gst_ffmpeg_index_new (guint n_streams, gint64 file_size);
+void gst_ffmpeg_index_free (GstFFMpegIndex * index);
+
+guint gst_ffmpeg_index_get_n_streams (GstFFMpegIndex * index);
+gint64 gst_ffmpeg_index_get_file_size (GstFFMpegIndex * index);
+void gst_ffmpeg_index_set_time_base (GstFFMpegIndex * index, guint stream,
+    gint num, gint den);
+void gst_ffmpeg_index_get_time_base (GstFFMpegIndex * index, guint stream,
+    gint * num, gint * den);
+
+gboolean gst_ffmpeg_index_add (GstFFMpegIndex * index, guint stream,
+    gint64 timestamp, gint64 pos);
+guint gst_ffmpeg_index_get_n_entries (GstFFMpegIndex * index, guint stream);
+void gst_ffmpeg_index_get_entry (GstFFMpegIndex * index, guint stream,
+    guint idx, gint64 * timestamp, gint64 * pos);
+
+GBytes *gst_ffmpeg_index_serialize (GstFFMpegIndex * index);
+GstFFMpegIndex *gst_ffmpeg_index_deserialize (GBytes * bytes);
+
+G_END_DECLS
+
+#endif /* __GST_FFMPEGINDEX_H__ */
@@ -667,7 +667,7 @@ gst_ffmpegmux_collected (GstCollectPads * pads, gpointer user_data)
       gst_pad_push_event (ffmpegmux->srcpad, gst_event_new_segment (&segment));
     }
 
-    if (gst_ffmpegdata_open (ffmpegmux->srcpad, open_flags,
+    if (gst_ffmpegdata_open (ffmpegmux->srcpad, open_flags, 0,
             &ffmpegmux->context->pb) < 0) {
       GST_ELEMENT_ERROR (ffmpegmux, LIBRARY, TOO_LAZY, (NULL),
           ("Failed to open stream context in avmux"));
@@ -23,6 +23,13 @@
 #endif
 #include <string.h>
 #include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#endif
 
 #include <libavformat/avformat.h>
 
@@ -31,7 +38,16 @@
 #include "gstav.h"
 #include "gstavprotocol.h"
 
+#define DEFAULT_BUFFER_SIZE 4096
+
 typedef struct _GstProtocolInfo GstProtocolInfo;
+typedef struct _GstProtocolBlock GstProtocolBlock;
+
+struct _GstProtocolBlock
+{
+  guint64 offset;
+  GstBuffer *buffer;
+};
 
 struct _GstProtocolInfo
 {
@@ -40,28 +56,292 @@ struct _GstProtocolInfo
   guint64 offset;
   gboolean eos;
   gint set_streamheader;
+
+  /* pull mode read-ahead: how much to pull next, doubling while avformat
+   * reads sequentially from where the last range ended */
+  guint buffer_size;
+  guint max_read_ahead;
+  guint read_ahead;
+  guint64 last_end;
+
+  /* the ranges pulled, most recently used first, holding at most cache_size
+   * bytes besides the most recent one */
+  GQueue blocks;
+  gsize cached;
+  guint cache_size;
+  guint cache_hits;
+  guint cache_misses;
+  /* size of the stream in bytes, -1 until upstream was asked */
+  gint64 size;
+
+  /* prefetching of the range following the cache, with LOCK */
+  gboolean prefetch;
+  GThread *prefetch_thread;
+  GMutex lock;
+  GCond cond;
+  gboolean prefetch_stop;
+  gboolean prefetch_busy;
+  guint64 prefetch_offset;
+  guint prefetch_size;
+  GstBuffer *prefetched;
+  guint64 prefetched_offset;
+  guint prefetched_size;
+
+  /* the local file upstream reads from, mapped into memory, or NULL */
+  const guint8 *map;
+  gsize map_size;
 };
 
+static gpointer
+gst_ffmpegdata_prefetch_loop (GstProtocolInfo * info)
+{
+  GstBuffer *inbuf;
+  GstFlowReturn ret;
+  guint64 offset;
+  guint size;
+
+  g_mutex_lock (&info->lock);
+  while (!info->prefetch_stop) {
+    if (!info->prefetch_size) {
+      g_cond_wait (&info->cond, &info->lock);
+      continue;
+    }
+
+    offset = info->prefetch_offset;
+    size = info->prefetch_size;
+    info->prefetch_size = 0;
+    info->prefetch_busy = TRUE;
+    g_mutex_unlock (&info->lock);
+
+    GST_LOG ("prefetching %u bytes at %" G_GUINT64_FORMAT, size, offset);
+    inbuf = NULL;
+    ret = gst_pad_pull_range (info->pad, offset, size, &inbuf);
+
+    g_mutex_lock (&info->lock);
+    info->prefetch_busy = FALSE;
+    /* failures are left to the reader to run into */
+    if (ret == GST_FLOW_OK) {
+      gst_buffer_replace (&info->prefetched, NULL);
+      info->prefetched = inbuf;
+      info->prefetched_offset = offset;
+      info->prefetched_size = size;
+    } else {
+      GST_DEBUG ("prefetching failed: %s", gst_flow_get_name (ret));
+      if (inbuf)
+        gst_buffer_unref (inbuf);
+    }
+    g_cond_broadcast (&info->cond);
+  }
+  g_mutex_unlock (&info->lock);
+
+  return NULL;
+}
+
+/* Takes the prefetched range starting at @offset and the size that was
+ * asked for. Cancels a request for another range that the prefetch thread
+ * didn't pick up yet and waits for a pull in progress, so that upstream
+ * never sees two pulls at once. */
+static GstBuffer *
+gst_ffmpegdata_take_prefetched (GstProtocolInfo * info, guint64 offset,
+    guint * size)
+{
+  GstBuffer *inbuf = NULL;
+
+  g_mutex_lock (&info->lock);
+  if (info->prefetch_size && info->prefetch_offset != offset) {
+    GST_DEBUG ("cancelling prefetch at %" G_GUINT64_FORMAT ", reading at %"
+        G_GUINT64_FORMAT, info->prefetch_offset, offset);
+    info->prefetch_size = 0;
+  }
+  while (info->prefetch_busy || info->prefetch_size)
+    g_cond_wait (&info->cond, &info->lock);
+  if (info->prefetched && info->prefetched_offset == offset) {
+    inbuf = info->prefetched;
+    info->prefetched = NULL;
+    *size = info->prefetched_size;
+  }
+  g_mutex_unlock (&info->lock);
+
+  return inbuf;
+}
+
+static void
+gst_ffmpegdata_schedule_prefetch (GstProtocolInfo * info, guint64 offset,
+    guint size)
+{
+  if (!info->prefetch_thread) {
+    info->prefetch_thread = g_thread_try_new ("avprotocol-prefetch",
+        (GThreadFunc) gst_ffmpegdata_prefetch_loop, info, NULL);
+    if (!info->prefetch_thread) {
+      GST_WARNING ("failed to start prefetch thread");
+      info->prefetch = FALSE;
+      return;
+    }
+  }
+
+  g_mutex_lock (&info->lock);
+  info->prefetch_offset = offset;
+  info->prefetch_size = size;
+  g_cond_broadcast (&info->cond);
+  g_mutex_unlock (&info->lock);
+}
+
+static void
+gst_ffmpegdata_stop_prefetch (GstProtocolInfo * info)
+{
+  if (info->prefetch_thread) {
+    g_mutex_lock (&info->lock);
+    info->prefetch_stop = TRUE;
+    g_cond_broadcast (&info->cond);
+    g_mutex_unlock (&info->lock);
+
+    g_thread_join (info->prefetch_thread);
+    info->prefetch_thread = NULL;
+  }
+  gst_buffer_replace (&info->prefetched, NULL);
+}
+
+static void
+gst_ffmpegdata_block_free (GstProtocolBlock * block)
+{
+  gst_buffer_unref (block->buffer);
+  g_slice_free (GstProtocolBlock, block);
+}
+
+/* Finds the cached block covering @offset */
+static GList *
+gst_ffmpegdata_find_block (GstProtocolInfo * info, guint64 offset)
+{
+  GList *l;
+
+  for (l = info->blocks.head; l; l = l->next) {
+    GstProtocolBlock *block = l->data;
+
+    if (offset >= block->offset &&
+        offset < block->offset + gst_buffer_get_size (block->buffer))
+      return l;
+  }
+
+  return NULL;
+}
+
+/* Adds a pulled range as the most recently used block, evicting the least
+ * recently used ones beyond the cache size */
+static void
+gst_ffmpegdata_add_block (GstProtocolInfo * info, guint64 offset,
+    GstBuffer * buffer)
+{
+  GstProtocolBlock *block;
+
+  block = g_slice_new (GstProtocolBlock);
+  block->offset = offset;
+  block->buffer = buffer;
+  g_queue_push_head (&info->blocks, block);
+  info->cached += gst_buffer_get_size (buffer);
+
+  while (info->blocks.length > 1 && info->cached - gst_buffer_get_size
+      (buffer) > info->cache_size) {
+    block = g_queue_pop_tail (&info->blocks);
+    info->cached -= gst_buffer_get_size (block->buffer);
+    gst_ffmpegdata_block_free (block);
+  }
+}
+
+static void
+gst_ffmpegdata_clear_blocks (GstProtocolInfo * info)
+{
+  g_queue_foreach (&info->blocks, (GFunc) gst_ffmpegdata_block_free, NULL);
+  g_queue_clear (&info->blocks);
+  info->cached = 0;
+}
+
+/* Copies what the cache holds at the current offset, returns -1 if no block
+ * covers it */
+static int
+gst_ffmpegdata_read_cache (GstProtocolInfo * info, unsigned char *buf,
+    int size)
+{
+  GstProtocolBlock *block;
+  GList *l;
+  guint64 skip;
+
+  l = gst_ffmpegdata_find_block (info, info->offset);
+  if (!l)
+    return -1;
+
+  /* most recently used first */
+  if (l != info->blocks.head) {
+    g_queue_unlink (&info->blocks, l);
+    g_queue_push_head_link (&info->blocks, l);
+  }
+
+  block = l->data;
+  skip = info->offset - block->offset;
+
+  return gst_buffer_extract (block->buffer, skip, buf, MIN (size,
+          gst_buffer_get_size (block->buffer) - skip));
+}
+
 static int
 gst_ffmpegdata_peek (void *priv_data, unsigned char *buf, int size)
 {
   GstProtocolInfo *info;
   GstBuffer *inbuf = NULL;
-  GstFlowReturn ret;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint pull_size;
   int total = 0;
 
   info = (GstProtocolInfo *) priv_data;
 
-  GST_DEBUG ("Pulling %d bytes at position %" G_GUINT64_FORMAT, size,
-      info->offset);
+  if (info->map) {
+    if (info->offset >= info->map_size)
+      return 0;
+    total = MIN ((guint64) size, info->map_size - info->offset);
+    memcpy (buf, info->map + info->offset, total);
+    return total;
+  }
 
-  ret = gst_pad_pull_range (info->pad, info->offset, (guint) size, &inbuf);
+  total = gst_ffmpegdata_read_cache (info, buf, size);
+  if (total >= 0) {
+    info->cache_hits++;
+    GST_LOG ("cache hit at %" G_GUINT64_FORMAT, info->offset);
+    return total;
+  }
+  info->cache_misses++;
+  GST_LOG ("cache miss at %" G_GUINT64_FORMAT, info->offset);
+
+  /* grow the read-ahead while avformat keeps reading where the last range
+   * ended, and start over after it jumped */
+  if (info->last_end && info->offset == info->last_end)
+    info->read_ahead = MIN (MAX (info->read_ahead, info->buffer_size) * 2,
+        MAX (info->max_read_ahead, info->buffer_size));
+  else
+    info->read_ahead = info->buffer_size;
+  pull_size = MAX ((guint) size, info->read_ahead);
+
+  if (info->prefetch)
+    inbuf = gst_ffmpegdata_take_prefetched (info, info->offset, &pull_size);
+
+  if (!inbuf) {
+    GST_DEBUG ("Pulling %u bytes at position %" G_GUINT64_FORMAT, pull_size,
+        info->offset);
+    ret = gst_pad_pull_range (info->pad, info->offset, pull_size, &inbuf);
+  }
 
   switch (ret) {
     case GST_FLOW_OK:
-      total = (gint) gst_buffer_get_size (inbuf);
-      gst_buffer_extract (inbuf, 0, buf, total);
-      gst_buffer_unref (inbuf);
+      info->last_end = info->offset + gst_buffer_get_size (inbuf);
+      if (gst_buffer_get_size (inbuf) == 0) {
+        gst_buffer_unref (inbuf);
+        total = 0;
+        break;
+      }
+      gst_ffmpegdata_add_block (info, info->offset, inbuf);
+      if (info->prefetch && gst_buffer_get_size (inbuf) >= pull_size &&
+          !gst_ffmpegdata_find_block (info, info->last_end))
+        gst_ffmpegdata_schedule_prefetch (info, info->last_end,
+            info->read_ahead);
+      total = gst_ffmpegdata_read_cache (info, buf, size);
       break;
     case GST_FLOW_EOS:
       total = 0;
@@ -152,10 +432,13 @@ gst_ffmpegdata_seek (void *priv_data, int64_t pos, int whence)
 
         GST_DEBUG ("Seek end");
 
-        if (gst_pad_is_linked (info->pad))
+        /* asked for over and over by some demuxers */
+        if (info->size < 0 && gst_pad_is_linked (info->pad))
           if (gst_pad_query_duration (GST_PAD_PEER (info->pad),
                   GST_FORMAT_BYTES, &duration))
-            newpos = ((guint64) duration) + pos;
+            info->size = duration;
+        if (info->size >= 0)
+          newpos = ((guint64) info->size) + pos;
       }
         break;
       default:
@@ -163,8 +446,11 @@ gst_ffmpegdata_seek (void *priv_data, int64_t pos, int whence)
         break;
     }
     /* FIXME : implement case for push-based behaviour */
-    if (whence != AVSEEK_SIZE)
+    if (whence != AVSEEK_SIZE) {
+      if (newpos != info->offset)
+        info->read_ahead = 0;
       info->offset = newpos;
+    }
   } else if (GST_PAD_IS_SRC (info->pad)) {
     GstSegment segment;
 
@@ -214,6 +500,19 @@ gst_ffmpegdata_close (AVIOContext * h)
 
   GST_LOG ("Closing file");
 
+  gst_ffmpegdata_stop_prefetch (info);
+  if (info->cache_hits || info->cache_misses)
+    GST_DEBUG ("block cache: %u hits, %u misses (%.1f%% hit rate)",
+        info->cache_hits, info->cache_misses,
+        100.0 * info->cache_hits / (info->cache_hits + info->cache_misses));
+  gst_ffmpegdata_clear_blocks (info);
+#ifdef HAVE_SYS_MMAN_H
+  if (info->map)
+    munmap ((void *) info->map, info->map_size);
+#endif
+  g_mutex_clear (&info->lock);
+  g_cond_clear (&info->cond);
+
   if (GST_PAD_IS_SRC (info->pad)) {
     /* send EOS - that closes down the stream */
     gst_pad_push_event (info->pad, gst_event_new_eos ());
@@ -230,12 +529,15 @@ gst_ffmpegdata_close (AVIOContext * h)
 }
 
 int
-gst_ffmpegdata_open (GstPad * pad, int flags, AVIOContext ** context)
+gst_ffmpegdata_open (GstPad * pad, int flags, int buffer_size,
+    AVIOContext ** context)
 {
   GstProtocolInfo *info;
-  static const int buffer_size = 4096;
   unsigned char *buffer = NULL;
 
+  if (buffer_size <= 0)
+    buffer_size = DEFAULT_BUFFER_SIZE;
+
   info = g_new0 (GstProtocolInfo, 1);
 
   info->set_streamheader = flags & GST_FFMPEG_URL_STREAMHEADER;
@@ -259,10 +561,17 @@ gst_ffmpegdata_open (GstPad * pad, int flags, AVIOContext ** context)
   info->eos = FALSE;
   info->pad = pad;
   info->offset = 0;
+  info->buffer_size = buffer_size;
+  info->size = -1;
+  g_queue_init (&info->blocks);
+  g_mutex_init (&info->lock);
+  g_cond_init (&info->cond);
 
   buffer = av_malloc (buffer_size);
   if (buffer == NULL) {
     GST_WARNING ("Failed to allocate buffer");
+    g_mutex_clear (&info->lock);
+    g_cond_clear (&info->cond);
     g_free (info);
     return -ENOMEM;
   }
@@ -272,6 +581,8 @@ gst_ffmpegdata_open (GstPad * pad, int flags, AVIOContext ** context)
       gst_ffmpegdata_read, gst_ffmpegdata_write, gst_ffmpegdata_seek);
   if (*context == NULL) {
     GST_WARNING ("Failed to allocate memory");
+    g_mutex_clear (&info->lock);
+    g_cond_clear (&info->cond);
     g_free (info);
     av_free (buffer);
     return -ENOMEM;
@@ -285,43 +596,414 @@ gst_ffmpegdata_open (GstPad * pad, int flags, AVIOContext ** context)
   return 0;
 }
 
+void
+gst_ffmpegdata_set_read_ahead (AVIOContext * h, guint max_read_ahead,
+    gboolean prefetch)
+{
+  GstProtocolInfo *info = (GstProtocolInfo *) h->opaque;
+
+  g_return_if_fail (info != NULL && GST_PAD_IS_SINK (info->pad));
+
+  info->max_read_ahead = max_read_ahead;
+  /* nothing to prefetch if reads aren't grouped into larger ranges */
+  info->prefetch = prefetch && max_read_ahead > info->buffer_size;
+}
+
+void
+gst_ffmpegdata_set_cache_size (AVIOContext * h, guint cache_size)
+{
+  GstProtocolInfo *info = (GstProtocolInfo *) h->opaque;
+
+  g_return_if_fail (info != NULL && GST_PAD_IS_SINK (info->pad));
+
+  info->cache_size = cache_size;
+}
+
+/* Reads the data from a mapping of the file from now on, if upstream hands
+ * out a local file as it is. Reads still copy from the mapping into the
+ * AVIO buffer, this only saves pulling buffers. Pulls the start of the file
+ * to verify it, as some sources answer the uri query but transform what
+ * they read; the rest isn't checked. Like any mapping, truncating the file
+ * while it's read raises SIGBUS instead of a flow error, which is why this
+ * is opt-in. Returns FALSE if the data keeps being pulled. */
+gboolean
+gst_ffmpegdata_map_file (AVIOContext * h)
+{
+#ifdef HAVE_SYS_MMAN_H
+  GstProtocolInfo *info = (GstProtocolInfo *) h->opaque;
+  GstQuery *query;
+  GstBuffer *head = NULL;
+  gchar *uri = NULL, *filename = NULL;
+  struct stat st;
+  gint64 duration;
+  gsize check;
+  void *map;
+  gint fd;
+
+  g_return_val_if_fail (info != NULL && GST_PAD_IS_SINK (info->pad), FALSE);
+
+  query = gst_query_new_uri ();
+  if (gst_pad_peer_query (info->pad, query))
+    gst_query_parse_uri (query, &uri);
+  gst_query_unref (query);
+
+  if (uri == NULL || !gst_uri_has_protocol (uri, "file"))
+    goto not_local;
+  filename = g_filename_from_uri (uri, NULL, NULL);
+  if (filename == NULL)
+    goto not_local;
+
+  fd = g_open (filename, O_RDONLY, 0);
+  if (fd < 0)
+    goto open_failed;
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size <= 0 ||
+      (guint64) st.st_size > G_MAXSIZE) {
+    close (fd);
+    goto not_regular;
+  }
+
+  /* a file still being written has grown past what upstream reports */
+  if (!gst_pad_peer_query_duration (info->pad, GST_FORMAT_BYTES, &duration) ||
+      duration != st.st_size) {
+    close (fd);
+    goto size_mismatch;
+  }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto map_failed;
+  close (fd);
+
+  check = MIN (st.st_size, DEFAULT_BUFFER_SIZE);
+  if (gst_pad_pull_range (info->pad, 0, check, &head) != GST_FLOW_OK ||
+      gst_buffer_get_size (head) != check ||
+      gst_buffer_memcmp (head, 0, map, check) != 0) {
+    munmap (map, st.st_size);
+    goto data_mismatch;
+  }
+  gst_buffer_unref (head);
+
+  /* demuxers mostly read front to back, let the kernel read ahead */
+  madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+  GST_INFO ("mapped %s, %" G_GINT64_FORMAT " bytes", filename,
+      (gint64) st.st_size);
+
+  /* nothing is pulled anymore */
+  gst_ffmpegdata_stop_prefetch (info);
+  gst_ffmpegdata_clear_blocks (info);
+  info->map = map;
+  info->map_size = st.st_size;
+  info->size = st.st_size;
+
+  g_free (filename);
+  g_free (uri);
+
+  return TRUE;
+
+  /* ERRORS */
+not_local:
+  {
+    GST_DEBUG ("no local file upstream (uri %s)", GST_STR_NULL (uri));
+    g_free (uri);
+    return FALSE;
+  }
+open_failed:
+  {
+    GST_DEBUG ("could not open %s: %s", filename, g_strerror (errno));
+    goto failed;
+  }
+not_regular:
+  {
+    GST_DEBUG ("%s is not a regular, non-empty file", filename);
+    goto failed;
+  }
+size_mismatch:
+  {
+    GST_DEBUG ("size of %s differs from upstream", filename);
+    goto failed;
+  }
+map_failed:
+  {
+    GST_DEBUG ("could not map %s: %s", filename, g_strerror (errno));
+    close (fd);
+    goto failed;
+  }
+data_mismatch:
+  {
+    GST_DEBUG ("upstream doesn't read %s as it is", filename);
+    if (head)
+      gst_buffer_unref (head);
+    goto failed;
+  }
+failed:
+  {
+    g_free (filename);
+    g_free (uri);
+    return FALSE;
+  }
+#else
+  return FALSE;
+#endif
+}
+
 /* specialized protocol for cross-thread pushing,
- * based on ffmpeg's pipe protocol */
+ * based on ffmpeg's pipe protocol.
+ *
+ * The streaming thread (producer) and the demuxer task (consumer) exchange
+ * buffers through a ring that each side only advances its own end of, so
+ * that neither waits unless the ring is actually full or empty. A flush
+ * bumps flush_pending, making the consumer drop everything up to the marker
+ * queued ahead of the next buffer. */
+
+/* queued to delimit the data discarded by a flush */
+static gint gst_ffmpeg_pipe_flush_marker;
+#define FLUSH_MARKER ((GstBuffer *) &gst_ffmpeg_pipe_flush_marker)
+
+void
+gst_ffmpeg_pipe_init (GstFFMpegPipe * ffpipe)
+{
+  memset (ffpipe, 0, sizeof (GstFFMpegPipe));
+  g_mutex_init (&ffpipe->lock);
+  g_cond_init (&ffpipe->cond);
+  ffpipe->srcresult = GST_FLOW_OK;
+}
+
+void
+gst_ffmpeg_pipe_clear (GstFFMpegPipe * ffpipe)
+{
+  gst_ffmpeg_pipe_reset (ffpipe);
+  g_mutex_clear (&ffpipe->lock);
+  g_cond_clear (&ffpipe->cond);
+}
+
+/* Drops all queued data and starts over, only call while neither side
+ * runs */
+void
+gst_ffmpeg_pipe_reset (GstFFMpegPipe * ffpipe)
+{
+  guint i;
+
+  for (i = 0; i < GST_FFMPEG_PIPE_RING_SIZE; i++) {
+    if (ffpipe->ring[i] && ffpipe->ring[i] != FLUSH_MARKER)
+      gst_buffer_unref (ffpipe->ring[i]);
+    ffpipe->ring[i] = NULL;
+  }
+  ffpipe->head = 0;
+  ffpipe->tail = 0;
+  ffpipe->queued_bytes = 0;
+  ffpipe->offset = 0;
+  ffpipe->flush_pending = 0;
+  ffpipe->markers_owed = 0;
+  ffpipe->eos = FALSE;
+  ffpipe->srcresult = GST_FLOW_OK;
+}
+
+/* wakes the other side if it waits for the ring to change */
+static void
+gst_ffmpeg_pipe_wake (GstFFMpegPipe * ffpipe, gint * waiting)
+{
+  if (g_atomic_int_get (waiting)) {
+    g_mutex_lock (&ffpipe->lock);
+    g_cond_broadcast (&ffpipe->cond);
+    g_mutex_unlock (&ffpipe->lock);
+  }
+}
+
+/* whether the producer has to wait before queueing into slot @head. The
+ * byte limit never blocks an empty ring, so that large buffers still pass. */
+static gboolean
+gst_ffmpeg_pipe_full (GstFFMpegPipe * ffpipe, gint head)
+{
+  gint tail = g_atomic_int_get (&ffpipe->tail);
+
+  if ((head + 1) % GST_FFMPEG_PIPE_RING_SIZE == tail)
+    return TRUE;
+
+  return tail != head &&
+      g_atomic_int_get (&ffpipe->queued_bytes) >= GST_FFMPEG_PIPE_MAX_BYTES;
+}
+
+/* Queues @item, waiting for room while the consumer is behind. Returns
+ * FALSE without taking @item if the consumer stopped meanwhile. */
+static gboolean
+gst_ffmpeg_pipe_enqueue (GstFFMpegPipe * ffpipe, GstBuffer * item)
+{
+  gint head = ffpipe->head;
+  gint next = (head + 1) % GST_FFMPEG_PIPE_RING_SIZE;
+
+  if (gst_ffmpeg_pipe_full (ffpipe, head)) {
+    GST_LOG ("ring full, waiting");
+    g_mutex_lock (&ffpipe->lock);
+    g_atomic_int_set (&ffpipe->producer_waiting, 1);
+    while (gst_ffmpeg_pipe_full (ffpipe, head) &&
+        g_atomic_int_get (&ffpipe->srcresult) == GST_FLOW_OK)
+      g_cond_wait (&ffpipe->cond, &ffpipe->lock);
+    g_atomic_int_set (&ffpipe->producer_waiting, 0);
+    g_mutex_unlock (&ffpipe->lock);
+
+    if (gst_ffmpeg_pipe_full (ffpipe, head))
+      return FALSE;
+  }
+
+  if (item != FLUSH_MARKER)
+    g_atomic_int_add (&ffpipe->queued_bytes, gst_buffer_get_size (item));
+  ffpipe->ring[head] = item;
+  g_atomic_int_set (&ffpipe->head, next);
+  gst_ffmpeg_pipe_wake (ffpipe, &ffpipe->consumer_waiting);
+
+  return TRUE;
+}
+
+GstFlowReturn
+gst_ffmpeg_pipe_push (GstFFMpegPipe * ffpipe, GstBuffer * buffer)
+{
+  if (G_UNLIKELY (g_atomic_int_get (&ffpipe->eos))) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_EOS;
+  }
+
+  if (G_UNLIKELY (g_atomic_int_get (&ffpipe->srcresult) != GST_FLOW_OK))
+    goto ignore;
+
+  /* delimit the data flushed before */
+  while (ffpipe->markers_owed > 0) {
+    if (!gst_ffmpeg_pipe_enqueue (ffpipe, FLUSH_MARKER))
+      goto ignore;
+    ffpipe->markers_owed--;
+  }
+
+  if (!gst_ffmpeg_pipe_enqueue (ffpipe, buffer))
+    goto ignore;
+
+  return GST_FLOW_OK;
+
+ignore:
+  {
+    GST_DEBUG ("ignoring buffer because src task encountered %s",
+        gst_flow_get_name (g_atomic_int_get (&ffpipe->srcresult)));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_FLUSHING;
+  }
+}
+
+void
+gst_ffmpeg_pipe_set_flow (GstFFMpegPipe * ffpipe, GstFlowReturn ret)
+{
+  g_mutex_lock (&ffpipe->lock);
+  g_atomic_int_set (&ffpipe->srcresult, ret);
+  g_cond_broadcast (&ffpipe->cond);
+  g_mutex_unlock (&ffpipe->lock);
+}
+
+void
+gst_ffmpeg_pipe_set_eos (GstFFMpegPipe * ffpipe)
+{
+  g_mutex_lock (&ffpipe->lock);
+  g_atomic_int_set (&ffpipe->eos, TRUE);
+  g_cond_broadcast (&ffpipe->cond);
+  g_mutex_unlock (&ffpipe->lock);
+}
+
+/* Discards the queued data and accepts new data again, from the producer
+ * side. Doesn't wait: the marker is only queued with the next buffer, by
+ * when the consumer made room for it dropping the flushed data. */
+void
+gst_ffmpeg_pipe_flush (GstFFMpegPipe * ffpipe)
+{
+  g_atomic_int_inc (&ffpipe->flush_pending);
+  ffpipe->markers_owed++;
+  gst_ffmpeg_pipe_set_flow (ffpipe, GST_FLOW_OK);
+}
+
+/* Waits until the consumer took all queued data, for serializing events
+ * with it */
+void
+gst_ffmpeg_pipe_wait_empty (GstFFMpegPipe * ffpipe)
+{
+  g_mutex_lock (&ffpipe->lock);
+  g_atomic_int_set (&ffpipe->producer_waiting, 1);
+  while (g_atomic_int_get (&ffpipe->tail) != ffpipe->head &&
+      g_atomic_int_get (&ffpipe->srcresult) == GST_FLOW_OK &&
+      !g_atomic_int_get (&ffpipe->eos))
+    g_cond_wait (&ffpipe->cond, &ffpipe->lock);
+  g_atomic_int_set (&ffpipe->producer_waiting, 0);
+  g_mutex_unlock (&ffpipe->lock);
+}
+
+/* releases the item at the tail, from the consumer side */
+static void
+gst_ffmpeg_pipe_dequeue (GstFFMpegPipe * ffpipe)
+{
+  gint tail = ffpipe->tail;
+
+  if (ffpipe->ring[tail] == FLUSH_MARKER) {
+    g_atomic_int_dec_and_test (&ffpipe->flush_pending);
+  } else {
+    g_atomic_int_add (&ffpipe->queued_bytes,
+        -(gint) gst_buffer_get_size (ffpipe->ring[tail]));
+    gst_buffer_unref (ffpipe->ring[tail]);
+  }
+  ffpipe->ring[tail] = NULL;
+  ffpipe->offset = 0;
+
+  g_atomic_int_set (&ffpipe->tail, (tail + 1) % GST_FFMPEG_PIPE_RING_SIZE);
+  gst_ffmpeg_pipe_wake (ffpipe, &ffpipe->producer_waiting);
+}
 
 static int
 gst_ffmpeg_pipe_read (void *priv_data, uint8_t * buf, int size)
 {
   GstFFMpegPipe *ffpipe;
-  guint available;
+  GstBuffer *buffer;
+  gboolean eos;
+  gint head;
+  gsize copied;
+  int total = 0;
 
   ffpipe = (GstFFMpegPipe *) priv_data;
 
   GST_LOG ("requested size %d", size);
 
-  GST_FFMPEG_PIPE_MUTEX_LOCK (ffpipe);
+  while (total < size) {
+    /* eos is set after the last buffer was queued */
+    eos = g_atomic_int_get (&ffpipe->eos);
+    head = g_atomic_int_get (&ffpipe->head);
 
-  GST_LOG ("requested size %d", size);
+    if (ffpipe->tail == head) {
+      /* short reads are fine, only wait if there's nothing at all */
+      if (total > 0 || eos)
+        break;
 
-  while ((available = gst_adapter_available (ffpipe->adapter)) < size
-      && !ffpipe->eos) {
-    GST_DEBUG ("Available:%d, requested:%d", available, size);
-    ffpipe->needed = size;
-    GST_FFMPEG_PIPE_SIGNAL (ffpipe);
-    GST_FFMPEG_PIPE_WAIT (ffpipe);
-  }
+      GST_DEBUG ("ring empty, waiting");
+      g_mutex_lock (&ffpipe->lock);
+      g_atomic_int_set (&ffpipe->consumer_waiting, 1);
+      while (ffpipe->tail == g_atomic_int_get (&ffpipe->head) &&
+          !g_atomic_int_get (&ffpipe->eos))
+        g_cond_wait (&ffpipe->cond, &ffpipe->lock);
+      g_atomic_int_set (&ffpipe->consumer_waiting, 0);
+      g_mutex_unlock (&ffpipe->lock);
+      continue;
+    }
 
-  size = MIN (available, size);
-  if (size) {
-    GST_LOG ("Getting %d bytes", size);
-    gst_adapter_copy (ffpipe->adapter, buf, 0, size);
-    gst_adapter_flush (ffpipe->adapter, size);
-    GST_LOG ("%" G_GSIZE_FORMAT " bytes left in adapter",
-        gst_adapter_available (ffpipe->adapter));
-    ffpipe->needed = 0;
+    buffer = ffpipe->ring[ffpipe->tail];
+    if (buffer == FLUSH_MARKER || g_atomic_int_get (&ffpipe->flush_pending)) {
+      GST_LOG ("dropping flushed data");
+      gst_ffmpeg_pipe_dequeue (ffpipe);
+      continue;
+    }
+
+    copied = gst_buffer_extract (buffer, ffpipe->offset, buf + total,
+        size - total);
+    total += copied;
+    ffpipe->offset += copied;
+    if (ffpipe->offset >= gst_buffer_get_size (buffer))
+      gst_ffmpeg_pipe_dequeue (ffpipe);
   }
-  GST_FFMPEG_PIPE_MUTEX_UNLOCK (ffpipe);
 
-  return size;
+  GST_LOG ("returning %d bytes", total);
+
+  return total;
 }
 
 int
@@ -340,13 +1022,13 @@ gst_ffmpeg_pipe_close (AVIOContext * h)
 }
 
 int
-gst_ffmpeg_pipe_open (GstFFMpegPipe * ffpipe, int flags, AVIOContext ** context)
+gst_ffmpeg_pipe_open (GstFFMpegPipe * ffpipe, int flags, int buffer_size,
+    AVIOContext ** context)
 {
-  static const int buffer_size = 4096;
   unsigned char *buffer = NULL;
 
-  /* sanity check */
-  g_return_val_if_fail (GST_IS_ADAPTER (ffpipe->adapter), -EINVAL);
+  if (buffer_size <= 0)
+    buffer_size = DEFAULT_BUFFER_SIZE;
 
   buffer = av_malloc (buffer_size);
   if (buffer == NULL) {
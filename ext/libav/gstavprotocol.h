@@ -21,57 +21,65 @@
 #ifndef __GST_FFMPEGPROTOCOL_H__
 #define __GST_FFMPEGPROTOCOL_H__
 
-#include <gst/base/gstadapter.h>
+#include <gst/gst.h>
 #include "gstav.h"
 
 G_BEGIN_DECLS
 
 /* pipe protocol helpers */
-#define GST_FFMPEG_PIPE_MUTEX_LOCK(m) G_STMT_START {                    \
-  GST_LOG ("locking tlock from thread %p", g_thread_self ()); \
-  g_mutex_lock (&m->tlock);                                              \
-  GST_LOG ("locked tlock from thread %p", g_thread_self ());  \
-} G_STMT_END
-
-#define GST_FFMPEG_PIPE_MUTEX_UNLOCK(m) G_STMT_START {                    \
-  GST_LOG ("unlocking tlock from thread %p", g_thread_self ()); \
-  g_mutex_unlock (&m->tlock);                                              \
-} G_STMT_END
-
-#define GST_FFMPEG_PIPE_WAIT(m) G_STMT_START {                          \
-  GST_LOG ("thread %p waiting", g_thread_self ());            \
-  g_cond_wait (&m->cond, &m->tlock);                                      \
-} G_STMT_END
-
-#define GST_FFMPEG_PIPE_SIGNAL(m) G_STMT_START {                        \
-  GST_LOG ("signalling from thread %p", g_thread_self ());    \
-  g_cond_signal (&m->cond);                                              \
-} G_STMT_END
+#define GST_FFMPEG_PIPE_RING_SIZE 256
+/* the producer also waits once this many bytes are queued */
+#define GST_FFMPEG_PIPE_MAX_BYTES (4 * 1024 * 1024)
 
 typedef struct _GstFFMpegPipe GstFFMpegPipe;
 
 struct _GstFFMpegPipe
 {
-  /* lock for syncing */
-  GMutex tlock;
-  /* with TLOCK */
-  /* signals counterpart thread to have a look */
-  GCond cond;
+  /* buffers queued by the streaming thread for the demuxer task. Only the
+   * producer advances head and only the consumer advances tail, one slot is
+   * kept free to tell a full ring from an empty one. */
+  GstBuffer *ring[GST_FFMPEG_PIPE_RING_SIZE];
+  gint head;
+  gint tail;
+  /* size of the queued buffers, added by the producer before queueing and
+   * subtracted by the consumer once released */
+  gint queued_bytes;
+  /* bytes the consumer already read from the buffer at tail */
+  gsize offset;
+  /* flushes whose marker the consumer didn't reach yet, and markers the
+   * producer didn't queue yet */
+  gint flush_pending;
+  gint markers_owed;
   /* seen eos */
-  gboolean eos;
+  gint eos;
   /* flowreturn obtained by src task */
-  GstFlowReturn srcresult;
-  /* adpater collecting data */
-  GstAdapter *adapter;
-  /* amount needed in adapter by src task */
-  guint needed;
+  gint srcresult;
+
+  /* only taken to wait for a full or empty ring, and to wake up */
+  GMutex lock;
+  GCond cond;
+  gint producer_waiting;
+  gint consumer_waiting;
 };
 
-int gst_ffmpeg_pipe_open (GstFFMpegPipe *ffpipe, int flags, AVIOContext ** context);
+void gst_ffmpeg_pipe_init (GstFFMpegPipe * ffpipe);
+void gst_ffmpeg_pipe_clear (GstFFMpegPipe * ffpipe);
+void gst_ffmpeg_pipe_reset (GstFFMpegPipe * ffpipe);
+GstFlowReturn gst_ffmpeg_pipe_push (GstFFMpegPipe * ffpipe, GstBuffer * buffer);
+void gst_ffmpeg_pipe_set_flow (GstFFMpegPipe * ffpipe, GstFlowReturn ret);
+void gst_ffmpeg_pipe_set_eos (GstFFMpegPipe * ffpipe);
+void gst_ffmpeg_pipe_flush (GstFFMpegPipe * ffpipe);
+void gst_ffmpeg_pipe_wait_empty (GstFFMpegPipe * ffpipe);
+
+/* a buffer_size of 0 selects the default of 4096 bytes */
+int gst_ffmpeg_pipe_open (GstFFMpegPipe *ffpipe, int flags, int buffer_size, AVIOContext ** context);
 int gst_ffmpeg_pipe_close (AVIOContext * h);
 
-int gst_ffmpegdata_open (GstPad * pad, int flags, AVIOContext ** context);
+int gst_ffmpegdata_open (GstPad * pad, int flags, int buffer_size, AVIOContext ** context);
 int gst_ffmpegdata_close (AVIOContext * h);
+void gst_ffmpegdata_set_read_ahead (AVIOContext * h, guint max_read_ahead, gboolean prefetch);
+void gst_ffmpegdata_set_cache_size (AVIOContext * h, guint cache_size);
+gboolean gst_ffmpegdata_map_file (AVIOContext * h);
 
 G_END_DECLS
 
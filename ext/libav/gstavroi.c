@@ -0,0 +1,102 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Conversion of GstVideoRegionOfInterestMeta to the regions passed to the
+ * encoders. Doesn't depend on libav, so the unit tests can build it. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstavroi.h"
+
+/* Quantizer offset for a region of interest: from the meta's "roi/avenc"
+ * parameters, else the offset configured for its type in @type_offsets,
+ * else @default_offset */
+gdouble
+gst_ffmpeg_roi_offset (GstVideoRegionOfInterestMeta * roi,
+    gdouble default_offset, const GstStructure * type_offsets)
+{
+  GstStructure *params;
+  gdouble offset;
+
+  params = gst_video_region_of_interest_meta_get_param (roi, "roi/avenc");
+  if (params && gst_structure_get_double (params, "quality-offset", &offset))
+    return offset;
+
+  if (type_offsets && roi->roi_type &&
+      gst_structure_get_double (type_offsets,
+          g_quark_to_string (roi->roi_type), &offset))
+    return offset;
+
+  return default_offset;
+}
+
+/* Collects the regions of interest of @buffer relative to the encoded region
+ * of @width x @height starting at @x,@y, clipped to it. Regions entirely
+ * outside of it are skipped. Returns the number of regions, stored in a new
+ * array in @regions to be freed with g_free(), or 0 and NULL */
+guint
+gst_ffmpeg_roi_from_buffer (GstBuffer * buffer, gint x, gint y,
+    gint width, gint height, gdouble default_offset,
+    const GstStructure * type_offsets, GstFFMpegRoi ** regions)
+{
+  GstVideoRegionOfInterestMeta *roi;
+  gpointer state = NULL;
+  guint n_rois = 0, i = 0;
+
+  *regions = NULL;
+
+  while (gst_buffer_iterate_meta_filtered (buffer, &state,
+          GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))
+    n_rois++;
+  if (n_rois == 0)
+    return 0;
+
+  *regions = g_new (GstFFMpegRoi, n_rois);
+
+  state = NULL;
+  while ((roi = (GstVideoRegionOfInterestMeta *)
+          gst_buffer_iterate_meta_filtered (buffer, &state,
+              GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))) {
+    gint left = MAX ((gint) roi->x - x, 0);
+    gint top = MAX ((gint) roi->y - y, 0);
+    gint right = MIN ((gint) (roi->x + roi->w) - x, width);
+    gint bottom = MIN ((gint) (roi->y + roi->h) - y, height);
+
+    /* outside of the encoded region */
+    if (left >= right || top >= bottom)
+      continue;
+
+    (*regions)[i].left = left;
+    (*regions)[i].top = top;
+    (*regions)[i].right = right;
+    (*regions)[i].bottom = bottom;
+    (*regions)[i].qoffset =
+        gst_ffmpeg_roi_offset (roi, default_offset, type_offsets);
+    i++;
+  }
+
+  if (i == 0) {
+    g_free (*regions);
+    *regions = NULL;
+  }
+
+  return i;
+}
@@ -0,0 +1,45 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __GST_FFMPEGROI_H__
+#define __GST_FFMPEGROI_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+/* A region of interest relative to the encoded picture, with the quantizer
+ * offset (-1 to 1 of the quantizer range) to encode it with */
+typedef struct
+{
+  gint left, top, right, bottom;
+  gdouble qoffset;
+} GstFFMpegRoi;
+
+gdouble gst_ffmpeg_roi_offset (GstVideoRegionOfInterestMeta * roi,
+    gdouble default_offset, const GstStructure * type_offsets);
+
+guint gst_ffmpeg_roi_from_buffer (GstBuffer * buffer, gint x, gint y,
+    gint width, gint height, gdouble default_offset,
+    const GstStructure * type_offsets, GstFFMpegRoi ** regions);
+
+G_END_DECLS
+
+#endif /* __GST_FFMPEGROI_H__ */
@@ -0,0 +1,1273 @@
+/* GStreamer
+ * Copyright (C) <1999> Erik Walthinsen <omega@cse.ogi.edu>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Encodes one raw video stream into several layers of decreasing resolution
+ * (simulcast). The input is mapped once, downscaled as a pyramid where each
+ * layer is scaled from the smallest larger one, and the layers are encoded
+ * in parallel on a shared thread pool. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+
+#include <gst/gst.h>
+#include <gst/base/gstflowcombiner.h>
+#include <gst/video/video.h>
+
+#include "gstav.h"
+#include "gstavcfg.h"
+#include "gstavcodecmap.h"
+#include "gstavutils.h"
+
+#define GST_FFSIMULCAST_PARAMS_QDATA \
+  g_quark_from_static_string("avsimulcastenc-params")
+
+#define DEFAULT_LAYERS NULL
+#define DEFAULT_SYNC_KEYFRAMES TRUE
+#define DEFAULT_QUANTIZER 0.0f
+
+enum
+{
+  PROP_0,
+  PROP_LAYERS,
+  PROP_SYNC_KEYFRAMES,
+  PROP_QUANTIZER,
+  PROP_CFG_BASE,
+};
+
+typedef struct _GstFFMpegSimulcastEnc GstFFMpegSimulcastEnc;
+typedef struct _GstFFMpegSimulcastEncClass GstFFMpegSimulcastEncClass;
+typedef struct _GstFFMpegSimulcastLayer GstFFMpegSimulcastLayer;
+
+/* Timestamps of an input frame, the codecs get the frame number as pts */
+typedef struct
+{
+  gint64 frame_number;
+  GstClockTime pts;
+  GstClockTime duration;
+} GstFFMpegSimulcastTimestamp;
+
+struct _GstFFMpegSimulcastLayer
+{
+  GstFFMpegSimulcastEnc *enc;
+  guint index;
+  GstPad *srcpad;
+
+  gint width;
+  gint height;
+  gint64 bitrate;
+
+  AVCodecContext *context;
+  AVFrame *picture;
+  AVPacket *pkt;
+
+  /* scaled input */
+  GstVideoInfo info;
+  GstVideoConverter *convert;
+  GstBuffer *scaled;
+  GstVideoFrame frame;
+  /* picture to encode, either frame, the input or that of a larger layer */
+  GstVideoFrame *vframe;
+  /* larger layer this one is downscaled from, NULL for the input */
+  GstFFMpegSimulcastLayer *source;
+
+  /* keyframe requests, protected by the object lock */
+  gboolean force_keyframe;
+  gboolean all_headers;
+
+  /* the current picture must be a keyframe, and downstream gets told about
+   * the next one */
+  gboolean keyframe;
+  gboolean announce_keyframe;
+  gboolean announce_all_headers;
+  GQueue output;
+};
+
+struct _GstFFMpegSimulcastEnc
+{
+  GstElement element;
+
+  GstPad *sinkpad;
+
+  /* properties, protected by the object lock. The codec options are kept
+   * in refcontext, like avenc does */
+  gchar *layers_desc;
+  gboolean sync_keyframes;
+  gfloat quantizer;
+  AVCodecContext *refcontext;
+
+  /* layers in property order, and largest first */
+  GPtrArray *layers;
+  GPtrArray *pyramid;
+  GstFlowCombiner *flow_combiner;
+
+  GstVideoInfo in_info;
+  gboolean negotiated;
+  gboolean opened;
+  GstSegment segment;
+
+  GstVideoFrame in_frame;
+  gint64 frame_number;
+  /* ring indexed by frame number, big enough for the frames the codecs hold
+   * back before their packets and decoding timestamps come out */
+  GstFFMpegSimulcastTimestamp *timestamps;
+  guint n_timestamps;
+
+  /* encodes the layers in parallel */
+  GThreadPool *pool;
+  GMutex pool_lock;
+  GCond pool_cond;
+  guint pending;
+};
+
+struct _GstFFMpegSimulcastEncClass
+{
+  GstElementClass parent_class;
+
+  AVCodec *in_plugin;
+};
+
+static GstElementClass *parent_class = NULL;
+
+static void gst_ffmpegsimulcastenc_base_init (GstFFMpegSimulcastEncClass *
+    klass);
+static void gst_ffmpegsimulcastenc_class_init (GstFFMpegSimulcastEncClass *
+    klass);
+static void gst_ffmpegsimulcastenc_init (GstFFMpegSimulcastEnc * enc);
+static void gst_ffmpegsimulcastenc_finalize (GObject * object);
+
+static void gst_ffmpegsimulcastenc_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_ffmpegsimulcastenc_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec);
+
+static GstStateChangeReturn gst_ffmpegsimulcastenc_change_state (GstElement *
+    element, GstStateChange transition);
+static gboolean gst_ffmpegsimulcastenc_sink_event (GstPad * pad,
+    GstObject * parent, GstEvent * event);
+static gboolean gst_ffmpegsimulcastenc_sink_query (GstPad * pad,
+    GstObject * parent, GstQuery * query);
+static gboolean gst_ffmpegsimulcastenc_src_event (GstPad * pad,
+    GstObject * parent, GstEvent * event);
+static GstFlowReturn gst_ffmpegsimulcastenc_chain (GstPad * pad,
+    GstObject * parent, GstBuffer * buffer);
+static void gst_ffmpegsimulcastenc_encode_layer (GstFFMpegSimulcastLayer *
+    layer, GstFFMpegSimulcastEnc * enc);
+
+static void
+gst_ffmpegsimulcastenc_base_init (GstFFMpegSimulcastEncClass * klass)
+{
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  AVCodec *in_plugin;
+  GstCaps *srccaps, *sinkcaps;
+  gchar *longname, *description;
+
+  in_plugin =
+      (AVCodec *) g_type_get_qdata (G_OBJECT_CLASS_TYPE (klass),
+      GST_FFSIMULCAST_PARAMS_QDATA);
+  g_assert (in_plugin != NULL);
+
+  longname = g_strdup_printf ("libav %s simulcast encoder",
+      in_plugin->long_name);
+  description = g_strdup_printf ("libav %s encoder producing several "
+      "resolutions of the same input", in_plugin->name);
+  gst_element_class_set_metadata (element_class, longname,
+      "Codec/Encoder/Video", description,
+      "Wim Taymans <wim.taymans@gmail.com>, "
+      "Ronald Bultje <rbultje@ronald.bitfreak.net>");
+  g_free (longname);
+  g_free (description);
+
+  if (!(srccaps = gst_ffmpeg_codecid_to_caps (in_plugin->id, NULL, TRUE))) {
+    GST_DEBUG ("Couldn't get source caps for encoder '%s'", in_plugin->name);
+    srccaps = gst_caps_new_empty_simple ("unknown/unknown");
+  }
+
+  sinkcaps = gst_ffmpeg_codectype_to_video_caps (NULL,
+      in_plugin->id, TRUE, in_plugin);
+  if (!sinkcaps) {
+    GST_DEBUG ("Couldn't get sink caps for encoder '%s'", in_plugin->name);
+    sinkcaps = gst_caps_new_empty_simple ("unknown/unknown");
+  }
+
+  gst_element_class_add_pad_template (element_class,
+      gst_pad_template_new ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, sinkcaps));
+  gst_element_class_add_pad_template (element_class,
+      gst_pad_template_new ("src_%u", GST_PAD_SRC, GST_PAD_SOMETIMES,
+          srccaps));
+
+  gst_caps_unref (sinkcaps);
+  gst_caps_unref (srccaps);
+
+  klass->in_plugin = in_plugin;
+}
+
+static void
+gst_ffmpegsimulcastenc_class_init (GstFFMpegSimulcastEncClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  parent_class = g_type_class_peek_parent (klass);
+
+  gobject_class->set_property = gst_ffmpegsimulcastenc_set_property;
+  gobject_class->get_property = gst_ffmpegsimulcastenc_get_property;
+  gobject_class->finalize = gst_ffmpegsimulcastenc_finalize;
+
+  g_object_class_install_property (gobject_class, PROP_LAYERS,
+      g_param_spec_string ("layers", "Layers",
+          "Comma separated list of WIDTHxHEIGHT[:BITRATE] layers, one source "
+          "pad is created for each (e.g. \"1280x720:1500000,640x360:500000\"). "
+          "Layers without a bitrate get the bitrate property scaled by their "
+          "share of the largest layer's area",
+          DEFAULT_LAYERS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SYNC_KEYFRAMES,
+      g_param_spec_boolean ("sync-keyframes", "Synchronize keyframes",
+          "Make a keyframe request on one layer apply to all of them",
+          DEFAULT_SYNC_KEYFRAMES, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_QUANTIZER,
+      g_param_spec_float ("quantizer", "Constant Quantizer",
+          "Constant quantizer for all layers, instead of the bitrate "
+          "(0 = use the bitrate)", 0, 30, DEFAULT_QUANTIZER,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  /* the same codec options as the avenc elements, applied to every layer */
+  gst_ffmpeg_cfg_install_properties (gobject_class, klass->in_plugin,
+      PROP_CFG_BASE, AV_OPT_FLAG_ENCODING_PARAM | AV_OPT_FLAG_VIDEO_PARAM);
+
+  element_class->change_state = gst_ffmpegsimulcastenc_change_state;
+}
+
+static void
+gst_ffmpegsimulcastenc_init (GstFFMpegSimulcastEnc * enc)
+{
+  GstElementClass *klass = GST_ELEMENT_GET_CLASS (enc);
+  GstFFMpegSimulcastEncClass *oclass = (GstFFMpegSimulcastEncClass *) klass;
+
+  enc->sinkpad =
+      gst_pad_new_from_template (gst_element_class_get_pad_template (klass,
+          "sink"), "sink");
+  gst_pad_set_event_function (enc->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_ffmpegsimulcastenc_sink_event));
+  gst_pad_set_query_function (enc->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_ffmpegsimulcastenc_sink_query));
+  gst_pad_set_chain_function (enc->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_ffmpegsimulcastenc_chain));
+  GST_PAD_SET_ACCEPT_TEMPLATE (enc->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (enc), enc->sinkpad);
+
+  enc->sync_keyframes = DEFAULT_SYNC_KEYFRAMES;
+  enc->quantizer = DEFAULT_QUANTIZER;
+  enc->refcontext = avcodec_alloc_context3 (oclass->in_plugin);
+  enc->layers = g_ptr_array_new ();
+  enc->pyramid = g_ptr_array_new ();
+  enc->flow_combiner = gst_flow_combiner_new ();
+  gst_segment_init (&enc->segment, GST_FORMAT_TIME);
+
+  g_mutex_init (&enc->pool_lock);
+  g_cond_init (&enc->pool_cond);
+  enc->pool =
+      g_thread_pool_new ((GFunc) gst_ffmpegsimulcastenc_encode_layer, enc,
+      g_get_num_processors (), FALSE, NULL);
+}
+
+static void
+gst_ffmpegsimulcastenc_close_layer (GstFFMpegSimulcastLayer * layer)
+{
+  GstBuffer *buf;
+
+  if (layer->context) {
+    gst_ffmpeg_avcodec_close (layer->context);
+    avcodec_free_context (&layer->context);
+  }
+  if (layer->convert) {
+    gst_video_converter_free (layer->convert);
+    layer->convert = NULL;
+  }
+  gst_buffer_replace (&layer->scaled, NULL);
+  layer->source = NULL;
+  layer->vframe = NULL;
+
+  while ((buf = g_queue_pop_head (&layer->output)))
+    gst_buffer_unref (buf);
+}
+
+static void
+gst_ffmpegsimulcastenc_free_layer (GstFFMpegSimulcastLayer * layer)
+{
+  gst_ffmpegsimulcastenc_close_layer (layer);
+  av_frame_free (&layer->picture);
+  av_packet_free (&layer->pkt);
+  g_slice_free (GstFFMpegSimulcastLayer, layer);
+}
+
+static void
+gst_ffmpegsimulcastenc_finalize (GObject * object)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) object;
+
+  g_thread_pool_free (enc->pool, FALSE, TRUE);
+  g_mutex_clear (&enc->pool_lock);
+  g_cond_clear (&enc->pool_cond);
+
+  g_ptr_array_foreach (enc->layers, (GFunc) gst_ffmpegsimulcastenc_free_layer,
+      NULL);
+  g_ptr_array_free (enc->layers, TRUE);
+  g_ptr_array_free (enc->pyramid, TRUE);
+  gst_flow_combiner_free (enc->flow_combiner);
+  g_free (enc->layers_desc);
+  g_free (enc->timestamps);
+  avcodec_free_context (&enc->refcontext);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+static gint
+gst_ffmpegsimulcastenc_compare_size (gconstpointer a, gconstpointer b)
+{
+  const GstFFMpegSimulcastLayer *la = *(GstFFMpegSimulcastLayer **) a;
+  const GstFFMpegSimulcastLayer *lb = *(GstFFMpegSimulcastLayer **) b;
+  gint64 area_a = (gint64) la->width * la->height;
+  gint64 area_b = (gint64) lb->width * lb->height;
+
+  return area_a > area_b ? -1 : area_a < area_b ? 1 : 0;
+}
+
+/* Parses "WxH[:BITRATE],..." into a new array of layers, NULL on errors */
+static GPtrArray *
+gst_ffmpegsimulcastenc_parse_layers (GstFFMpegSimulcastEnc * enc,
+    const gchar * desc)
+{
+  GPtrArray *layers = g_ptr_array_new ();
+  gchar **tokens;
+  guint i;
+
+  if (!desc)
+    return layers;
+
+  tokens = g_strsplit (desc, ",", -1);
+  for (i = 0; tokens[i]; i++) {
+    GstFFMpegSimulcastLayer *layer;
+    gchar *token = g_strstrip (tokens[i]);
+    gint width, height;
+    gint64 bitrate = 0;
+    gchar *bitrate_str;
+
+    if (*token == '\0')
+      continue;
+
+    if (sscanf (token, "%dx%d", &width, &height) != 2 || width <= 0
+        || height <= 0)
+      goto parse_error;
+
+    if ((bitrate_str = strchr (token, ':'))) {
+      gchar *end;
+
+      bitrate = g_ascii_strtoll (bitrate_str + 1, &end, 10);
+      if (*end != '\0' || bitrate < 0)
+        goto parse_error;
+    }
+
+    layer = g_slice_new0 (GstFFMpegSimulcastLayer);
+    layer->enc = enc;
+    layer->index = layers->len;
+    layer->width = width;
+    layer->height = height;
+    layer->bitrate = bitrate;
+    layer->picture = av_frame_alloc ();
+    layer->pkt = av_packet_alloc ();
+    g_queue_init (&layer->output);
+    g_ptr_array_add (layers, layer);
+    continue;
+
+  parse_error:
+    GST_WARNING_OBJECT (enc, "invalid layer \"%s\"", token);
+    g_ptr_array_foreach (layers, (GFunc) gst_ffmpegsimulcastenc_free_layer,
+        NULL);
+    g_ptr_array_free (layers, TRUE);
+    g_strfreev (tokens);
+    return NULL;
+  }
+  g_strfreev (tokens);
+
+  return layers;
+}
+
+/* Replaces the layers and their source pads, only in the NULL or READY
+ * state */
+static void
+gst_ffmpegsimulcastenc_set_layers (GstFFMpegSimulcastEnc * enc,
+    const gchar * desc)
+{
+  GstElement *element = GST_ELEMENT (enc);
+  GstPadTemplate *templ;
+  GPtrArray *layers, *old_layers;
+  guint i;
+
+  if (GST_STATE (enc) > GST_STATE_READY) {
+    GST_WARNING_OBJECT (enc, "layers can only be changed in the NULL or "
+        "READY state");
+    return;
+  }
+
+  if (!(layers = gst_ffmpegsimulcastenc_parse_layers (enc, desc)))
+    return;
+
+  GST_OBJECT_LOCK (enc);
+  g_free (enc->layers_desc);
+  enc->layers_desc = g_strdup (desc);
+  old_layers = enc->layers;
+  enc->layers = layers;
+  g_ptr_array_set_size (enc->pyramid, 0);
+  for (i = 0; i < layers->len; i++)
+    g_ptr_array_add (enc->pyramid, g_ptr_array_index (layers, i));
+  g_ptr_array_sort (enc->pyramid, gst_ffmpegsimulcastenc_compare_size);
+  GST_OBJECT_UNLOCK (enc);
+
+  for (i = 0; i < old_layers->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (old_layers, i);
+
+    gst_flow_combiner_remove_pad (enc->flow_combiner, layer->srcpad);
+    gst_element_remove_pad (element, layer->srcpad);
+    gst_ffmpegsimulcastenc_free_layer (layer);
+  }
+  g_ptr_array_free (old_layers, TRUE);
+
+  templ = gst_element_class_get_pad_template (GST_ELEMENT_GET_CLASS (enc),
+      "src_%u");
+  for (i = 0; i < layers->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (layers, i);
+    gchar *name = g_strdup_printf ("src_%u", i);
+
+    GST_DEBUG_OBJECT (enc, "layer %u: %dx%d at %" G_GINT64_FORMAT " bps", i,
+        layer->width, layer->height, layer->bitrate);
+
+    layer->srcpad = gst_pad_new_from_template (templ, name);
+    gst_pad_set_event_function (layer->srcpad,
+        GST_DEBUG_FUNCPTR (gst_ffmpegsimulcastenc_src_event));
+    gst_pad_use_fixed_caps (layer->srcpad);
+    gst_flow_combiner_add_pad (enc->flow_combiner, layer->srcpad);
+    gst_element_add_pad (element, layer->srcpad);
+    g_free (name);
+  }
+  gst_element_no_more_pads (element);
+}
+
+static void
+gst_ffmpegsimulcastenc_close (GstFFMpegSimulcastEnc * enc)
+{
+  guint i;
+
+  for (i = 0; i < enc->layers->len; i++)
+    gst_ffmpegsimulcastenc_close_layer (g_ptr_array_index (enc->layers, i));
+  enc->opened = FALSE;
+}
+
+static gboolean
+gst_ffmpegsimulcastenc_open_layer (GstFFMpegSimulcastEnc * enc,
+    GstFFMpegSimulcastLayer * layer)
+{
+  GstFFMpegSimulcastEncClass *oclass =
+      (GstFFMpegSimulcastEncClass *) G_OBJECT_GET_CLASS (enc);
+  GstVideoInfo *in_info = &enc->in_info;
+  GstFFMpegSimulcastLayer *largest;
+  GstCaps *allowed_caps, *other_caps, *caps;
+  enum AVPixelFormat pix_fmt;
+  guint index = layer->index;
+  gint par_n, par_d;
+  gfloat quantizer;
+  guint i;
+
+  /* keep the display aspect ratio of the input */
+  gst_video_info_set_format (&layer->info, GST_VIDEO_INFO_FORMAT (in_info),
+      layer->width, layer->height);
+  if (!gst_util_fraction_multiply (GST_VIDEO_INFO_PAR_N (in_info) *
+          GST_VIDEO_INFO_WIDTH (in_info), GST_VIDEO_INFO_PAR_D (in_info) *
+          layer->width, layer->height, GST_VIDEO_INFO_HEIGHT (in_info),
+          &par_n, &par_d)) {
+    par_n = par_d = 1;
+  }
+  GST_VIDEO_INFO_PAR_N (&layer->info) = par_n;
+  GST_VIDEO_INFO_PAR_D (&layer->info) = par_d;
+  GST_VIDEO_INFO_FPS_N (&layer->info) = GST_VIDEO_INFO_FPS_N (in_info);
+  GST_VIDEO_INFO_FPS_D (&layer->info) = GST_VIDEO_INFO_FPS_D (in_info);
+  GST_VIDEO_INFO_INTERLACE_MODE (&layer->info) =
+      GST_VIDEO_INFO_INTERLACE_MODE (in_info);
+  GST_VIDEO_INFO_COLORIMETRY (&layer->info) =
+      GST_VIDEO_INFO_COLORIMETRY (in_info);
+  GST_VIDEO_INFO_CHROMA_SITE (&layer->info) =
+      GST_VIDEO_INFO_CHROMA_SITE (in_info);
+
+  /* scale from the smallest larger layer */
+  layer->source = NULL;
+  for (i = 0; i < enc->pyramid->len; i++) {
+    GstFFMpegSimulcastLayer *other = g_ptr_array_index (enc->pyramid, i);
+
+    if (other == layer)
+      break;
+    if (other->width >= layer->width && other->height >= layer->height)
+      layer->source = other;
+  }
+
+  if (layer->width != GST_VIDEO_INFO_WIDTH (in_info)
+      || layer->height != GST_VIDEO_INFO_HEIGHT (in_info)) {
+    GstVideoInfo *src_info = layer->source ? &layer->source->info : in_info;
+
+    layer->convert = gst_video_converter_new (src_info, &layer->info,
+        gst_structure_new ("GstVideoConverter",
+            GST_VIDEO_CONVERTER_OPT_THREADS, G_TYPE_UINT,
+            g_get_num_processors (), NULL));
+    if (!layer->convert)
+      goto converter_failed;
+    layer->scaled = gst_buffer_new_allocate (NULL,
+        GST_VIDEO_INFO_SIZE (&layer->info), NULL);
+  }
+
+  layer->context = avcodec_alloc_context3 (oclass->in_plugin);
+  gst_ffmpeg_cfg_fill_context (G_OBJECT (enc), layer->context);
+  gst_ffmpeg_videoinfo_to_context (&layer->info, layer->context);
+
+  largest = g_ptr_array_index (enc->pyramid, 0);
+  if (layer->bitrate > 0)
+    layer->context->bit_rate = layer->bitrate;
+  else
+    layer->context->bit_rate =
+        gst_util_uint64_scale (layer->context->bit_rate,
+        (guint64) layer->width * layer->height,
+        (guint64) largest->width * largest->height);
+
+  GST_OBJECT_LOCK (enc);
+  quantizer = enc->quantizer;
+  GST_OBJECT_UNLOCK (enc);
+  if (quantizer > 0) {
+    layer->context->flags |= AV_CODEC_FLAG_QSCALE;
+    layer->context->global_quality = layer->picture->quality =
+        FF_QP2LAMBDA * quantizer;
+  } else {
+    layer->picture->quality = 0;
+  }
+
+  /* sanitize time base */
+  if (layer->context->time_base.num <= 0 || layer->context->time_base.den <= 0)
+    goto insane_timebase;
+
+  if ((oclass->in_plugin->id == AV_CODEC_ID_MPEG4)
+      && (layer->context->time_base.den > 65535)) {
+    /* MPEG4 Standards do not support time_base denominator greater than
+     * (1<<16) - 1, see avvidenc */
+    layer->context->time_base.num =
+        (gint) gst_util_uint64_scale_int (layer->context->time_base.num,
+        65535, layer->context->time_base.den);
+    layer->context->time_base.den = 65535;
+  }
+
+  pix_fmt = layer->context->pix_fmt;
+
+  allowed_caps = gst_pad_get_allowed_caps (layer->srcpad);
+  if (!allowed_caps)
+    allowed_caps = gst_pad_get_pad_template_caps (layer->srcpad);
+  gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
+      oclass->in_plugin->type, allowed_caps, layer->context);
+
+  if (gst_ffmpeg_avcodec_open (layer->context, oclass->in_plugin) < 0) {
+    gst_caps_unref (allowed_caps);
+    goto open_codec_fail;
+  }
+
+  if (pix_fmt != layer->context->pix_fmt || pix_fmt == AV_PIX_FMT_NONE) {
+    gst_caps_unref (allowed_caps);
+    goto pix_fmt_err;
+  }
+
+  other_caps = gst_ffmpeg_codecid_to_caps (oclass->in_plugin->id,
+      layer->context, TRUE);
+  if (!other_caps) {
+    gst_caps_unref (allowed_caps);
+    goto unsupported_codec;
+  }
+
+  caps = gst_caps_intersect (allowed_caps, other_caps);
+  gst_caps_unref (allowed_caps);
+  gst_caps_unref (other_caps);
+  if (gst_caps_is_empty (caps)) {
+    gst_caps_unref (caps);
+    goto unsupported_codec;
+  }
+  caps = gst_caps_fixate (caps);
+
+  GST_DEBUG_OBJECT (enc, "layer %u caps %" GST_PTR_FORMAT, index, caps);
+  gst_pad_push_event (layer->srcpad, gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+
+  return TRUE;
+
+  /* ERRORS */
+converter_failed:
+  {
+    GST_ERROR_OBJECT (enc, "layer %u: can't scale to %dx%d", index,
+        layer->width, layer->height);
+    return FALSE;
+  }
+insane_timebase:
+  {
+    GST_ERROR_OBJECT (enc, "layer %u: insane timebase %d/%d", index,
+        layer->context->time_base.num, layer->context->time_base.den);
+    return FALSE;
+  }
+open_codec_fail:
+  {
+    GST_DEBUG_OBJECT (enc, "layer %u: failed to open codec", index);
+    return FALSE;
+  }
+pix_fmt_err:
+  {
+    GST_DEBUG_OBJECT (enc, "layer %u: codec doesn't support the input format",
+        index);
+    return FALSE;
+  }
+unsupported_codec:
+  {
+    GST_DEBUG_OBJECT (enc, "layer %u: unsupported codec, downstream caps",
+        index);
+    return FALSE;
+  }
+}
+
+static gboolean
+gst_ffmpegsimulcastenc_open (GstFFMpegSimulcastEnc * enc)
+{
+  guint i, delay = 0;
+
+  gst_ffmpegsimulcastenc_close (enc);
+
+  if (enc->layers->len == 0)
+    goto no_layers;
+
+  /* in pyramid order, so that the sources are set up first */
+  for (i = 0; i < enc->pyramid->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->pyramid, i);
+
+    if (!gst_ffmpegsimulcastenc_open_layer (enc, layer)) {
+      gst_ffmpegsimulcastenc_close (enc);
+      return FALSE;
+    }
+    delay = MAX (delay, MAX (layer->context->delay,
+            layer->context->max_b_frames) + layer->context->thread_count);
+  }
+
+  /* a frame's timestamps are needed until the packet with its pts came out
+   * and, with reordering, until a later packet took its pts as dts */
+  g_free (enc->timestamps);
+  enc->n_timestamps = 2 * (delay + 1);
+  enc->timestamps = g_new (GstFFMpegSimulcastTimestamp, enc->n_timestamps);
+  for (i = 0; i < enc->n_timestamps; i++)
+    enc->timestamps[i].frame_number = -1;
+  GST_DEBUG_OBJECT (enc, "codec delay up to %u frames", delay);
+
+  enc->opened = TRUE;
+  enc->frame_number = 0;
+  gst_flow_combiner_reset (enc->flow_combiner);
+
+  return TRUE;
+
+no_layers:
+  {
+    GST_ELEMENT_ERROR (enc, CORE, NEGOTIATION, (NULL),
+        ("No layers configured"));
+    return FALSE;
+  }
+}
+
+static void
+gst_ffmpegsimulcastenc_free_avpacket (gpointer pkt)
+{
+  av_packet_unref ((AVPacket *) pkt);
+  g_slice_free (AVPacket, pkt);
+}
+
+static GstFFMpegSimulcastTimestamp *
+gst_ffmpegsimulcastenc_lookup_timestamp (GstFFMpegSimulcastEnc * enc,
+    gint64 frame_number)
+{
+  GstFFMpegSimulcastTimestamp *ts;
+
+  if (frame_number == AV_NOPTS_VALUE || frame_number < 0)
+    return NULL;
+
+  ts = &enc->timestamps[frame_number % enc->n_timestamps];
+
+  /* overwritten by a later frame */
+  return ts->frame_number == frame_number ? ts : NULL;
+}
+
+/* Collects the encoded packets of @layer into its output queue */
+static gint
+gst_ffmpegsimulcastenc_receive (GstFFMpegSimulcastEnc * enc,
+    GstFFMpegSimulcastLayer * layer)
+{
+  gint res;
+
+  while ((res = avcodec_receive_packet (layer->context, layer->pkt)) == 0) {
+    AVPacket *pkt = g_slice_new0 (AVPacket);
+    GstFFMpegSimulcastTimestamp *ts;
+    GstBuffer *outbuf;
+
+    av_packet_move_ref (pkt, layer->pkt);
+    outbuf =
+        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
+        pkt->size, 0, pkt->size, pkt, gst_ffmpegsimulcastenc_free_avpacket);
+
+    if ((ts = gst_ffmpegsimulcastenc_lookup_timestamp (enc, pkt->pts))) {
+      GST_BUFFER_PTS (outbuf) = ts->pts;
+      GST_BUFFER_DURATION (outbuf) = ts->duration;
+    } else {
+      GST_WARNING_OBJECT (enc, "layer %u: no timestamp for frame %"
+          G_GINT64_FORMAT, layer->index, (gint64) pkt->pts);
+    }
+
+    /* with reordering the codec shifts the decoding timestamps back by its
+     * delay, the first ones are extrapolated from the first frame */
+    if (pkt->dts == AV_NOPTS_VALUE || pkt->dts == pkt->pts) {
+      GST_BUFFER_DTS (outbuf) = GST_BUFFER_PTS (outbuf);
+    } else if ((ts = gst_ffmpegsimulcastenc_lookup_timestamp (enc, pkt->dts))) {
+      GST_BUFFER_DTS (outbuf) = ts->pts;
+    } else if (pkt->dts < 0 && (ts =
+            gst_ffmpegsimulcastenc_lookup_timestamp (enc, 0))
+        && GST_CLOCK_TIME_IS_VALID (ts->pts)
+        && GST_CLOCK_TIME_IS_VALID (ts->duration)
+        && ts->pts >= -pkt->dts * ts->duration) {
+      GST_BUFFER_DTS (outbuf) = ts->pts - (-pkt->dts) * ts->duration;
+    }
+    if (!(pkt->flags & AV_PKT_FLAG_KEY))
+      GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    g_queue_push_tail (&layer->output, outbuf);
+  }
+
+  return res == AVERROR (EAGAIN) || res == AVERROR_EOF ? 0 : res;
+}
+
+/* Runs on the thread pool, encodes the current picture of @layer */
+static void
+gst_ffmpegsimulcastenc_encode_layer (GstFFMpegSimulcastLayer * layer,
+    GstFFMpegSimulcastEnc * enc)
+{
+  AVFrame *picture = NULL;
+  gint res;
+  guint c;
+
+  if (layer->vframe) {
+    picture = layer->picture;
+    picture->format = layer->context->pix_fmt;
+    picture->width = GST_VIDEO_FRAME_WIDTH (layer->vframe);
+    picture->height = GST_VIDEO_FRAME_HEIGHT (layer->vframe);
+    for (c = 0; c < AV_NUM_DATA_POINTERS; ++c) {
+      if (c < GST_VIDEO_FRAME_N_PLANES (layer->vframe)) {
+        picture->data[c] = GST_VIDEO_FRAME_PLANE_DATA (layer->vframe, c);
+        picture->linesize[c] = GST_VIDEO_FRAME_PLANE_STRIDE (layer->vframe, c);
+      } else {
+        picture->data[c] = NULL;
+        picture->linesize[c] = 0;
+      }
+    }
+    picture->pts = enc->frame_number;
+    picture->pict_type =
+        layer->keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+  }
+
+  /* the picture isn't refcounted, so the codec copies what it keeps */
+  res = avcodec_send_frame (layer->context, picture);
+  layer->keyframe = FALSE;
+  if (res < 0 && res != AVERROR_EOF)
+    GST_WARNING_OBJECT (enc, "failed to encode %dx%d layer: %d",
+        layer->width, layer->height, res);
+  else if (gst_ffmpegsimulcastenc_receive (enc, layer) < 0)
+    GST_WARNING_OBJECT (enc, "failed to receive %dx%d layer packets",
+        layer->width, layer->height);
+
+  g_mutex_lock (&enc->pool_lock);
+  if (--enc->pending == 0)
+    g_cond_signal (&enc->pool_cond);
+  g_mutex_unlock (&enc->pool_lock);
+}
+
+/* Encodes the current pictures, or drains the codecs when there are none,
+ * of all layers in parallel */
+static void
+gst_ffmpegsimulcastenc_encode_layers (GstFFMpegSimulcastEnc * enc)
+{
+  guint i;
+
+  g_mutex_lock (&enc->pool_lock);
+  enc->pending = enc->layers->len;
+  g_mutex_unlock (&enc->pool_lock);
+
+  for (i = 0; i < enc->layers->len; i++)
+    g_thread_pool_push (enc->pool, g_ptr_array_index (enc->layers, i), NULL);
+
+  g_mutex_lock (&enc->pool_lock);
+  while (enc->pending > 0)
+    g_cond_wait (&enc->pool_cond, &enc->pool_lock);
+  g_mutex_unlock (&enc->pool_lock);
+}
+
+/* Pushes the encoded output of all layers and combines the flow returns */
+static GstFlowReturn
+gst_ffmpegsimulcastenc_push (GstFFMpegSimulcastEnc * enc)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint i;
+
+  for (i = 0; i < enc->layers->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+    GstBuffer *outbuf;
+
+    while ((outbuf = g_queue_pop_head (&layer->output))) {
+      GstFlowReturn res;
+
+      if (layer->announce_keyframe
+          && !GST_BUFFER_FLAG_IS_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        GstClockTime pts = GST_BUFFER_PTS (outbuf);
+
+        gst_pad_push_event (layer->srcpad,
+            gst_video_event_new_downstream_force_key_unit (pts,
+                gst_segment_to_stream_time (&enc->segment, GST_FORMAT_TIME,
+                    pts), gst_segment_to_running_time (&enc->segment,
+                    GST_FORMAT_TIME, pts), layer->announce_all_headers, 0));
+        layer->announce_keyframe = FALSE;
+      }
+
+      res = gst_pad_push (layer->srcpad, outbuf);
+      ret = gst_flow_combiner_update_pad_flow (enc->flow_combiner,
+          layer->srcpad, res);
+    }
+  }
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_ffmpegsimulcastenc_chain (GstPad * pad, GstObject * parent,
+    GstBuffer * buffer)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) parent;
+  GstFFMpegSimulcastTimestamp *ts;
+  GstFlowReturn ret;
+  guint i;
+
+  if (!enc->negotiated)
+    goto not_negotiated;
+
+  if (!enc->opened && !gst_ffmpegsimulcastenc_open (enc))
+    goto open_failed;
+
+  if (!gst_video_frame_map (&enc->in_frame, &enc->in_info, buffer,
+          GST_MAP_READ))
+    goto map_failed;
+
+  ts = &enc->timestamps[enc->frame_number % enc->n_timestamps];
+  ts->frame_number = enc->frame_number;
+  ts->pts = GST_BUFFER_PTS (buffer);
+  ts->duration = GST_BUFFER_DURATION (buffer);
+
+  GST_OBJECT_LOCK (enc);
+  for (i = 0; i < enc->layers->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+
+    if (layer->force_keyframe) {
+      layer->keyframe = TRUE;
+      layer->announce_keyframe = TRUE;
+      layer->announce_all_headers = layer->all_headers;
+    }
+    layer->force_keyframe = FALSE;
+    layer->all_headers = FALSE;
+  }
+  GST_OBJECT_UNLOCK (enc);
+
+  /* downscale, each layer from the smallest larger one */
+  for (i = 0; i < enc->pyramid->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->pyramid, i);
+    GstVideoFrame *src =
+        layer->source ? layer->source->vframe : &enc->in_frame;
+
+    if (!layer->convert) {
+      layer->vframe = &enc->in_frame;
+      continue;
+    }
+
+    if (!gst_video_frame_map (&layer->frame, &layer->info, layer->scaled,
+            GST_MAP_WRITE))
+      goto layer_map_failed;
+    gst_video_converter_frame (layer->convert, src, &layer->frame);
+    layer->vframe = &layer->frame;
+  }
+
+  gst_ffmpegsimulcastenc_encode_layers (enc);
+  enc->frame_number++;
+
+  for (i = 0; i < enc->layers->len; i++) {
+    GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+
+    if (layer->vframe == &layer->frame)
+      gst_video_frame_unmap (&layer->frame);
+    layer->vframe = NULL;
+  }
+  gst_video_frame_unmap (&enc->in_frame);
+  gst_buffer_unref (buffer);
+
+  ret = gst_ffmpegsimulcastenc_push (enc);
+
+  return ret;
+
+  /* ERRORS */
+not_negotiated:
+  {
+    GST_ELEMENT_ERROR (enc, CORE, NEGOTIATION, (NULL),
+        ("not configured to input format before data start"));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+open_failed:
+  {
+    GST_ELEMENT_ERROR (enc, CORE, NEGOTIATION, (NULL),
+        ("failed to set up the layer encoders"));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+map_failed:
+  {
+    GST_ELEMENT_ERROR (enc, STREAM, ENCODE, (NULL),
+        ("failed to map input buffer"));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+layer_map_failed:
+  {
+    for (i = 0; i < enc->layers->len; i++) {
+      GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+
+      if (layer->vframe == &layer->frame)
+        gst_video_frame_unmap (&layer->frame);
+      layer->vframe = NULL;
+    }
+    gst_video_frame_unmap (&enc->in_frame);
+    GST_ELEMENT_ERROR (enc, STREAM, ENCODE, (NULL),
+        ("failed to map scaled frame"));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+}
+
+static gboolean
+gst_ffmpegsimulcastenc_sink_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) parent;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:
+    {
+      GstCaps *caps;
+      GstVideoInfo info;
+
+      gst_event_parse_caps (event, &caps);
+      gst_event_unref (event);
+
+      if (!gst_video_info_from_caps (&info, caps))
+        return FALSE;
+
+      if (enc->opened && gst_video_info_is_equal (&info, &enc->in_info))
+        return TRUE;
+
+      /* finish what was encoded with the old format */
+      if (enc->opened) {
+        gst_ffmpegsimulcastenc_encode_layers (enc);
+        gst_ffmpegsimulcastenc_push (enc);
+      }
+
+      enc->in_info = info;
+      enc->negotiated = TRUE;
+
+      return gst_ffmpegsimulcastenc_open (enc);
+    }
+    case GST_EVENT_STREAM_START:
+    {
+      GstStreamFlags flags;
+      gboolean res = TRUE;
+      guint group_id, i;
+
+      /* every layer is a stream of its own, with an id derived from the
+       * upstream one, so store that first */
+      gst_pad_store_sticky_event (pad, event);
+      gst_event_parse_stream_flags (event, &flags);
+
+      for (i = 0; i < enc->layers->len; i++) {
+        GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+        GstEvent *start;
+        gchar *stream_id;
+
+        stream_id = gst_pad_create_stream_id_printf (layer->srcpad,
+            GST_ELEMENT_CAST (enc), "%u", i);
+        start = gst_event_new_stream_start (stream_id);
+        gst_event_set_stream_flags (start, flags);
+        if (gst_event_parse_group_id (event, &group_id))
+          gst_event_set_group_id (start, group_id);
+        res &= gst_pad_push_event (layer->srcpad, start);
+        g_free (stream_id);
+      }
+      gst_event_unref (event);
+
+      return res;
+    }
+    case GST_EVENT_SEGMENT:
+      gst_event_copy_segment (event, &enc->segment);
+      break;
+    case GST_EVENT_EOS:
+      if (enc->opened) {
+        gst_ffmpegsimulcastenc_encode_layers (enc);
+        gst_ffmpegsimulcastenc_push (enc);
+        /* drained codecs don't take more input, reopen on the next buffer */
+        gst_ffmpegsimulcastenc_close (enc);
+      }
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_ffmpegsimulcastenc_close (enc);
+      gst_segment_init (&enc->segment, GST_FORMAT_TIME);
+      gst_flow_combiner_reset (enc->flow_combiner);
+      break;
+    default:
+      break;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static gboolean
+gst_ffmpegsimulcastenc_sink_query (GstPad * pad, GstObject * parent,
+    GstQuery * query)
+{
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_ALLOCATION:
+      /* the input is only read, through video frame mapping */
+      gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+      return TRUE;
+    default:
+      return gst_pad_query_default (pad, parent, query);
+  }
+}
+
+static gboolean
+gst_ffmpegsimulcastenc_src_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) parent;
+
+  if (gst_video_event_is_force_key_unit (event)) {
+    gboolean all_headers = FALSE;
+    guint i;
+
+    gst_video_event_parse_upstream_force_key_unit (event, NULL, &all_headers,
+        NULL);
+
+    GST_OBJECT_LOCK (enc);
+    for (i = 0; i < enc->layers->len; i++) {
+      GstFFMpegSimulcastLayer *layer = g_ptr_array_index (enc->layers, i);
+
+      if (layer->srcpad == pad || enc->sync_keyframes) {
+        GST_DEBUG_OBJECT (enc, "keyframe requested on layer %u", i);
+        layer->force_keyframe = TRUE;
+        layer->all_headers |= all_headers;
+      }
+    }
+    GST_OBJECT_UNLOCK (enc);
+
+    gst_event_unref (event);
+    return TRUE;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static GstStateChangeReturn
+gst_ffmpegsimulcastenc_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) element;
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      enc->negotiated = FALSE;
+      gst_segment_init (&enc->segment, GST_FORMAT_TIME);
+      gst_flow_combiner_reset (enc->flow_combiner);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      gst_ffmpegsimulcastenc_close (enc);
+      enc->negotiated = FALSE;
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static void
+gst_ffmpegsimulcastenc_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) object;
+
+  switch (prop_id) {
+    case PROP_LAYERS:
+      gst_ffmpegsimulcastenc_set_layers (enc, g_value_get_string (value));
+      break;
+    case PROP_SYNC_KEYFRAMES:
+      GST_OBJECT_LOCK (enc);
+      enc->sync_keyframes = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+    case PROP_QUANTIZER:
+      GST_OBJECT_LOCK (enc);
+      enc->quantizer = g_value_get_float (value);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+    default:
+      /* applied when the layers are opened */
+      GST_OBJECT_LOCK (enc);
+      if (!gst_ffmpeg_cfg_set_property (enc->refcontext, value, pspec))
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+  }
+}
+
+static void
+gst_ffmpegsimulcastenc_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec)
+{
+  GstFFMpegSimulcastEnc *enc = (GstFFMpegSimulcastEnc *) object;
+
+  switch (prop_id) {
+    case PROP_LAYERS:
+      GST_OBJECT_LOCK (enc);
+      g_value_set_string (value, enc->layers_desc);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+    case PROP_SYNC_KEYFRAMES:
+      GST_OBJECT_LOCK (enc);
+      g_value_set_boolean (value, enc->sync_keyframes);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+    case PROP_QUANTIZER:
+      GST_OBJECT_LOCK (enc);
+      g_value_set_float (value, enc->quantizer);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+    default:
+      GST_OBJECT_LOCK (enc);
+      if (!gst_ffmpeg_cfg_get_property (enc->refcontext, value, pspec))
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      GST_OBJECT_UNLOCK (enc);
+      break;
+  }
+}
+
+gboolean
+gst_ffmpegsimulcastenc_register (GstPlugin * plugin)
+{
+  GTypeInfo typeinfo = {
+    sizeof (GstFFMpegSimulcastEncClass),
+    (GBaseInitFunc) gst_ffmpegsimulcastenc_base_init,
+    NULL,
+    (GClassInitFunc) gst_ffmpegsimulcastenc_class_init,
+    NULL,
+    NULL,
+    sizeof (GstFFMpegSimulcastEnc),
+    0,
+    (GInstanceInitFunc) gst_ffmpegsimulcastenc_init,
+  };
+  GType type;
+  AVCodec *in_plugin;
+  void *i = 0;
+
+  GST_LOG ("Registering simulcast encoders");
+
+  while ((in_plugin = (AVCodec *) av_codec_iterate (&i))) {
+    gchar *type_name;
+    GstCaps *caps;
+
+    if (in_plugin->type != AVMEDIA_TYPE_VIDEO
+        || !av_codec_is_encoder (in_plugin))
+      continue;
+
+    /* only codecs meant for video streams, where layers make sense */
+    if (gst_ffmpeg_codecid_is_image (in_plugin->id)
+        || in_plugin->id == AV_CODEC_ID_RAWVIDEO)
+      continue;
+
+    /* same restrictions as the avenc elements */
+    if (!strncmp (in_plugin->name, "lib", 3)
+        || strstr (in_plugin->name, "vaapi")
+        || strstr (in_plugin->name, "nvenc")
+        || g_str_has_suffix (in_plugin->name, "_qsv")
+        || g_str_has_suffix (in_plugin->name, "_v4l2m2m"))
+      continue;
+
+    /* only codecs we have caps for */
+    if (!(caps = gst_ffmpeg_codecid_to_caps (in_plugin->id, NULL, TRUE)))
+      continue;
+    gst_caps_unref (caps);
+
+    type_name = g_strdup_printf ("avsimulcastenc_%s", in_plugin->name);
+
+    type = g_type_from_name (type_name);
+
+    if (!type) {
+      type =
+          g_type_register_static (GST_TYPE_ELEMENT, type_name, &typeinfo, 0);
+      g_type_set_qdata (type, GST_FFSIMULCAST_PARAMS_QDATA,
+          (gpointer) in_plugin);
+    }
+
+    if (!gst_element_register (plugin, type_name, GST_RANK_NONE, type)) {
+      g_free (type_name);
+      return FALSE;
+    }
+
+    g_free (type_name);
+  }
+
+  GST_LOG ("Finished registering simulcast encoders");
+
+  return TRUE;
+}
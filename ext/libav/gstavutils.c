@@ -460,6 +460,109 @@ new_aligned_buffer (gint size)
   return buf;
 }
 
+typedef struct
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+} GstFFMpegPacketBuffer;
+
+static void
+gst_ffmpeg_packet_buffer_free (void *opaque, guint8 * data)
+{
+  GstFFMpegPacketBuffer *pbuf = opaque;
+
+  gst_buffer_unmap (pbuf->buffer, &pbuf->map);
+  gst_buffer_unref (pbuf->buffer);
+}
+
+static GQuark
+gst_ffmpeg_packet_buffer_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (!quark)
+    quark = g_quark_from_static_string ("GstFFMpegPacketBuffer");
+
+  return quark;
+}
+
+int
+gst_ffmpeg_avpacket_alloc_buffer (AVPacket * pkt, GstBufferPool * pool,
+    gsize pool_size, const GstAllocationParams * params)
+{
+  GstFFMpegPacketBuffer *pbuf;
+  GstBuffer *buffer = NULL;
+  gsize size = pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+  if (pool && size <= pool_size) {
+    GstBufferPoolAcquireParams aparams = { 0, };
+
+    /* never block the encoder, fall back to a plain allocation instead */
+    aparams.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+    if (gst_buffer_pool_acquire_buffer (pool, &buffer, &aparams) != GST_FLOW_OK)
+      buffer = NULL;
+  }
+
+  if (!buffer)
+    buffer =
+        gst_buffer_new_allocate (NULL, size, (GstAllocationParams *) params);
+  if (!buffer)
+    return AVERROR (ENOMEM);
+
+  /* pool buffers keep their wrapper across reuse */
+  pbuf = gst_mini_object_get_qdata (GST_MINI_OBJECT_CAST (buffer),
+      gst_ffmpeg_packet_buffer_quark ());
+  if (!pbuf) {
+    pbuf = g_new0 (GstFFMpegPacketBuffer, 1);
+    gst_mini_object_set_qdata (GST_MINI_OBJECT_CAST (buffer),
+        gst_ffmpeg_packet_buffer_quark (), pbuf, g_free);
+  }
+  pbuf->buffer = buffer;
+
+  if (!gst_buffer_map (buffer, &pbuf->map, GST_MAP_READWRITE)) {
+    gst_buffer_unref (buffer);
+    return AVERROR (ENOMEM);
+  }
+
+  pkt->buf = av_buffer_create (pbuf->map.data, pbuf->map.size,
+      gst_ffmpeg_packet_buffer_free, pbuf, 0);
+  if (!pkt->buf) {
+    gst_ffmpeg_packet_buffer_free (pbuf, NULL);
+    return AVERROR (ENOMEM);
+  }
+  pkt->data = pkt->buf->data;
+
+  return 0;
+}
+
+GstBuffer *
+gst_ffmpeg_avpacket_steal_buffer (AVPacket * pkt)
+{
+  GstFFMpegPacketBuffer *pbuf = av_buffer_get_opaque (pkt->buf);
+  GstBuffer *buffer;
+  gsize offset, size;
+
+  buffer = gst_buffer_ref (pbuf->buffer);
+  offset = pkt->data - pbuf->map.data;
+  size = pkt->size;
+
+  /* drops the mapping, and our extra ref unless libav kept the packet */
+  av_packet_unref (pkt);
+
+  if (gst_buffer_is_writable (buffer)) {
+    gst_buffer_resize (buffer, offset, size);
+  } else {
+    GstBuffer *sub;
+
+    /* the encoder still references the data, share the memory */
+    sub = gst_buffer_copy_region (buffer, GST_BUFFER_COPY_MEMORY, offset, size);
+    gst_buffer_unref (buffer);
+    buffer = sub;
+  }
+
+  return buffer;
+}
+
 int
 gst_ffmpeg_auto_max_threads (void)
 {
@@ -94,4 +94,23 @@ av_smp_format_depth(enum AVSampleFormat smp_fmt);
 GstBuffer *
 new_aligned_buffer (gint size);
 
+/* Upper bound for the number of buffers in an encoder's packet pool */
+#define GST_FFMPEG_PACKET_POOL_MAX_BUFFERS 16
+
+/*
+ * Let an encoder with AV_CODEC_CAP_DR1 write its packets straight into a
+ * GstBuffer, taken from @pool when it is big enough.
+ */
+int
+gst_ffmpeg_avpacket_alloc_buffer (AVPacket * pkt, GstBufferPool * pool,
+    gsize pool_size, const GstAllocationParams * params);
+
+/*
+ * Get the GstBuffer backing a packet allocated with
+ * gst_ffmpeg_avpacket_alloc_buffer(), trimmed to the packet payload.
+ * The data is never copied. The packet is unreffed.
+ */
+GstBuffer *
+gst_ffmpeg_avpacket_steal_buffer (AVPacket * pkt);
+
 #endif /* __GST_FFMPEG_UTILS_H__ */
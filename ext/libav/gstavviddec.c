@@ -43,6 +43,8 @@ GST_DEBUG_CATEGORY_STATIC (GST_CAT_PERFORMANCE);
 #define DEFAULT_MAX_THREADS		0
 #define DEFAULT_OUTPUT_CORRUPT		TRUE
 #define DEFAULT_REQUIRE_KEYFRAME	FALSE
+#define DEFAULT_ASYNC_DECODE		FALSE
+#define DEFAULT_ASYNC_QUEUE_SIZE	4
 #define REQUIRED_POOL_MAX_BUFFERS       32
 #define DEFAULT_STRIDE_ALIGN            31
 #define DEFAULT_ALLOC_PARAM             { 0, DEFAULT_STRIDE_ALIGN, 0, 0, }
@@ -57,6 +59,9 @@ enum
   PROP_MAX_THREADS,
   PROP_OUTPUT_CORRUPT,
   PROP_REQUIRE_KEYFRAME,
+  PROP_ASYNC_DECODE,
+  PROP_ASYNC_QUEUE_SIZE,
+  PROP_STATS,
   PROP_LAST
 };
 
@@ -96,6 +101,7 @@ static int gst_ffmpegviddec_get_buffer2 (AVCodecContext * context,
 
 static GstFlowReturn gst_ffmpegviddec_finish (GstVideoDecoder * decoder);
 static GstFlowReturn gst_ffmpegviddec_drain (GstVideoDecoder * decoder);
+static GstFlowReturn gst_ffmpegviddec_async_wait (GstFFMpegVidDec * ffmpegdec);
 
 static gboolean picture_changed (GstFFMpegVidDec * ffmpegdec,
     AVFrame * picture);
@@ -242,6 +248,19 @@ gst_ffmpegviddec_class_init (GstFFMpegVidDecClass * klass)
           "Whether the first frame is required to be a keyframe",
           DEFAULT_REQUIRE_KEYFRAME,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ASYNC_DECODE,
+      g_param_spec_boolean ("async-decode", "Asynchronous decoding",
+          "Decode and push in a separate thread, decoupling upstream from "
+          "the codec", DEFAULT_ASYNC_DECODE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ASYNC_QUEUE_SIZE,
+      g_param_spec_uint ("async-queue-size", "Asynchronous queue size",
+          "Maximum number of packets waiting for the decoding thread",
+          1, 64, DEFAULT_ASYNC_QUEUE_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics", "Decoder statistics",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
   caps = klass->in_plugin->capabilities;
   if (caps & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS)) {
@@ -282,6 +301,13 @@ gst_ffmpegviddec_init (GstFFMpegVidDec * ffmpegdec)
   ffmpegdec->max_threads = DEFAULT_MAX_THREADS;
   ffmpegdec->output_corrupt = DEFAULT_OUTPUT_CORRUPT;
   ffmpegdec->require_keyframe = DEFAULT_REQUIRE_KEYFRAME;
+  ffmpegdec->async_decode = DEFAULT_ASYNC_DECODE;
+  ffmpegdec->async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+  g_rec_mutex_init (&ffmpegdec->async_task_lock);
+  g_mutex_init (&ffmpegdec->codec_lock);
+  g_mutex_init (&ffmpegdec->async_lock);
+  g_cond_init (&ffmpegdec->async_cond);
+  g_queue_init (&ffmpegdec->async_queue);
 
   GST_PAD_SET_ACCEPT_TEMPLATE (GST_VIDEO_DECODER_SINK_PAD (ffmpegdec));
   gst_video_decoder_set_use_default_pad_acceptcaps (GST_VIDEO_DECODER_CAST
@@ -298,6 +324,11 @@ gst_ffmpegviddec_finalize (GObject * object)
 
   av_frame_free (&ffmpegdec->picture);
 
+  g_rec_mutex_clear (&ffmpegdec->async_task_lock);
+  g_mutex_clear (&ffmpegdec->codec_lock);
+  g_mutex_clear (&ffmpegdec->async_lock);
+  g_cond_clear (&ffmpegdec->async_cond);
+
   if (ffmpegdec->context != NULL) {
     gst_ffmpeg_avcodec_close (ffmpegdec->context);
     av_free (ffmpegdec->context);
@@ -1515,6 +1546,9 @@ gst_ffmpegviddec_video_frame (GstFFMpegVidDec * ffmpegdec,
 
   got_frame = TRUE;
 
+  /* decoding happens without the stream lock, outputting needs it */
+  GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+
   /* get the output picture timing info again */
   out_dframe = ffmpegdec->picture->opaque;
   out_frame = gst_video_codec_frame_ref (out_dframe->frame);
@@ -1684,6 +1718,8 @@ gst_ffmpegviddec_video_frame (GstFFMpegVidDec * ffmpegdec,
       gst_video_decoder_finish_frame (GST_VIDEO_DECODER (ffmpegdec), out_frame);
 
 beach:
+  if (got_frame)
+    GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
   GST_DEBUG_OBJECT (ffmpegdec, "return flow %s, got frame: %d",
       gst_flow_get_name (*ret), got_frame);
   return got_frame;
@@ -1742,6 +1778,9 @@ gst_ffmpegviddec_drain (GstVideoDecoder * decoder)
   GstFFMpegVidDec *ffmpegdec = (GstFFMpegVidDec *) decoder;
   GstFFMpegVidDecClass *oclass;
 
+  /* packets still queued for the decoding thread go before the drain */
+  gst_ffmpegviddec_async_wait (ffmpegdec);
+
   if (!ffmpegdec->opened)
     return GST_FLOW_OK;
 
@@ -1754,13 +1793,17 @@ gst_ffmpegviddec_drain (GstVideoDecoder * decoder)
     GST_LOG_OBJECT (ffmpegdec,
         "codec has delay capabilities, calling until ffmpeg has drained everything");
 
-    if (avcodec_send_packet (ffmpegdec->context, NULL))
+    g_mutex_lock (&ffmpegdec->codec_lock);
+    if (avcodec_send_packet (ffmpegdec->context, NULL)) {
+      g_mutex_unlock (&ffmpegdec->codec_lock);
       goto send_packet_failed;
+    }
 
     do {
       got_frame = gst_ffmpegviddec_frame (ffmpegdec, NULL, &ret);
     } while (got_frame && ret == GST_FLOW_OK);
     avcodec_flush_buffers (ffmpegdec->context);
+    g_mutex_unlock (&ffmpegdec->codec_lock);
   }
 
 done:
@@ -1771,11 +1814,13 @@ send_packet_failed:
   goto done;
 }
 
+/* Sends @frame to the codec and pushes the pictures it outputs, called with
+ * the codec lock but without the stream lock from either the streaming or
+ * the decoding thread */
 static GstFlowReturn
-gst_ffmpegviddec_handle_frame (GstVideoDecoder * decoder,
+gst_ffmpegviddec_decode_frame (GstFFMpegVidDec * ffmpegdec,
     GstVideoCodecFrame * frame)
 {
-  GstFFMpegVidDec *ffmpegdec = (GstFFMpegVidDec *) decoder;
   guint8 *data;
   gint size;
   gboolean got_frame;
@@ -1841,19 +1886,11 @@ gst_ffmpegviddec_handle_frame (GstVideoDecoder * decoder,
   GST_DEBUG_OBJECT (ffmpegdec, "stored opaque values idx %d",
       frame->system_frame_number);
 
-  /* This might call into get_buffer() from another thread,
-   * which would cause a deadlock. Release the lock here
-   * and taking it again later seems safe
-   * See https://bugzilla.gnome.org/show_bug.cgi?id=726020
-   */
-  GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
   if (avcodec_send_packet (ffmpegdec->context, &packet) < 0) {
     gst_video_decoder_request_sync_point (GST_VIDEO_DECODER_CAST (ffmpegdec),
         frame, GST_VIDEO_DECODER_REQUEST_SYNC_POINT_DISCARD_INPUT);
-    GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
     goto send_packet_failed;
   }
-  GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
 
   do {
     /* decode a frame of audio/video now */
@@ -1879,6 +1916,202 @@ send_packet_failed:
   }
 }
 
+static void
+gst_ffmpegviddec_async_loop (GstFFMpegVidDec * ffmpegdec)
+{
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&ffmpegdec->async_lock);
+  while (g_queue_is_empty (&ffmpegdec->async_queue)
+      && !ffmpegdec->async_flushing)
+    g_cond_wait (&ffmpegdec->async_cond, &ffmpegdec->async_lock);
+
+  if (ffmpegdec->async_flushing) {
+    g_mutex_unlock (&ffmpegdec->async_lock);
+    return;
+  }
+
+  frame = g_queue_pop_head (&ffmpegdec->async_queue);
+  g_atomic_int_set (&ffmpegdec->async_depth,
+      g_queue_get_length (&ffmpegdec->async_queue));
+  ffmpegdec->async_busy = TRUE;
+  g_cond_broadcast (&ffmpegdec->async_cond);
+  g_mutex_unlock (&ffmpegdec->async_lock);
+
+  /* drain and flush wait for the queue before touching the codec, the
+   * stream lock is only taken to output pictures */
+  g_mutex_lock (&ffmpegdec->codec_lock);
+  ret = gst_ffmpegviddec_decode_frame (ffmpegdec, frame);
+  g_mutex_unlock (&ffmpegdec->codec_lock);
+
+  g_mutex_lock (&ffmpegdec->async_lock);
+  ffmpegdec->async_busy = FALSE;
+  if (ret != GST_FLOW_OK) {
+    GST_DEBUG_OBJECT (ffmpegdec, "decoding thread got %s",
+        gst_flow_get_name (ret));
+    ffmpegdec->async_flow = ret;
+  }
+  g_cond_broadcast (&ffmpegdec->async_cond);
+  g_mutex_unlock (&ffmpegdec->async_lock);
+}
+
+static void
+gst_ffmpegviddec_async_start (GstFFMpegVidDec * ffmpegdec)
+{
+  GST_DEBUG_OBJECT (ffmpegdec, "starting decoding thread");
+
+  ffmpegdec->async_flushing = FALSE;
+  ffmpegdec->async_flow = GST_FLOW_OK;
+
+  ffmpegdec->async_task =
+      gst_task_new ((GstTaskFunction) gst_ffmpegviddec_async_loop, ffmpegdec,
+      NULL);
+  gst_task_set_lock (ffmpegdec->async_task, &ffmpegdec->async_task_lock);
+  gst_task_start (ffmpegdec->async_task);
+}
+
+/* Stops the decoding thread and discards the packets it didn't get to. Must
+ * not be called with the stream lock, which the thread may be waiting for. */
+static void
+gst_ffmpegviddec_async_stop (GstFFMpegVidDec * ffmpegdec)
+{
+  GstVideoCodecFrame *frame;
+
+  if (!ffmpegdec->async_task)
+    return;
+
+  GST_DEBUG_OBJECT (ffmpegdec, "stopping decoding thread");
+
+  gst_task_stop (ffmpegdec->async_task);
+  g_mutex_lock (&ffmpegdec->async_lock);
+  ffmpegdec->async_flushing = TRUE;
+  g_cond_broadcast (&ffmpegdec->async_cond);
+  g_mutex_unlock (&ffmpegdec->async_lock);
+
+  gst_task_join (ffmpegdec->async_task);
+  gst_object_unref (ffmpegdec->async_task);
+  ffmpegdec->async_task = NULL;
+
+  while ((frame = g_queue_pop_head (&ffmpegdec->async_queue)))
+    gst_video_codec_frame_unref (frame);
+  g_atomic_int_set (&ffmpegdec->async_depth, 0);
+}
+
+/* Waits until the decoding thread has sent all queued packets to the codec
+ * and pushed what came out, call with the stream lock */
+static GstFlowReturn
+gst_ffmpegviddec_async_wait (GstFFMpegVidDec * ffmpegdec)
+{
+  GstFlowReturn ret;
+
+  if (!ffmpegdec->async_task)
+    return GST_FLOW_OK;
+
+  GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
+  g_mutex_lock (&ffmpegdec->async_lock);
+  while ((!g_queue_is_empty (&ffmpegdec->async_queue) || ffmpegdec->async_busy)
+      && !ffmpegdec->async_flushing)
+    g_cond_wait (&ffmpegdec->async_cond, &ffmpegdec->async_lock);
+  ret = ffmpegdec->async_flow;
+  g_mutex_unlock (&ffmpegdec->async_lock);
+  GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_ffmpegviddec_async_push (GstFFMpegVidDec * ffmpegdec,
+    GstVideoCodecFrame * frame)
+{
+  GstFlowReturn ret;
+  guint queue_size, depth;
+
+  GST_OBJECT_LOCK (ffmpegdec);
+  queue_size = ffmpegdec->async_queue_size;
+  GST_OBJECT_UNLOCK (ffmpegdec);
+
+  if (!ffmpegdec->async_task)
+    gst_ffmpegviddec_async_start (ffmpegdec);
+
+  g_mutex_lock (&ffmpegdec->async_lock);
+  if (g_queue_get_length (&ffmpegdec->async_queue) >= queue_size) {
+    GST_LOG_OBJECT (ffmpegdec, "decoding queue full, waiting");
+
+    GST_OBJECT_LOCK (ffmpegdec);
+    ffmpegdec->async_full_waits++;
+    GST_OBJECT_UNLOCK (ffmpegdec);
+
+    /* the decoding thread needs the stream lock to push its output */
+    g_mutex_unlock (&ffmpegdec->async_lock);
+    GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
+    g_mutex_lock (&ffmpegdec->async_lock);
+    while (g_queue_get_length (&ffmpegdec->async_queue) >= queue_size
+        && ffmpegdec->async_flow == GST_FLOW_OK && !ffmpegdec->async_flushing)
+      g_cond_wait (&ffmpegdec->async_cond, &ffmpegdec->async_lock);
+    g_mutex_unlock (&ffmpegdec->async_lock);
+    GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+    g_mutex_lock (&ffmpegdec->async_lock);
+  }
+
+  ret = ffmpegdec->async_flow;
+  if (ret == GST_FLOW_OK) {
+    g_queue_push_tail (&ffmpegdec->async_queue, frame);
+    frame = NULL;
+    g_cond_broadcast (&ffmpegdec->async_cond);
+  }
+  depth = g_queue_get_length (&ffmpegdec->async_queue);
+  g_atomic_int_set (&ffmpegdec->async_depth, depth);
+  g_mutex_unlock (&ffmpegdec->async_lock);
+
+  GST_OBJECT_LOCK (ffmpegdec);
+  ffmpegdec->async_max_depth = MAX (ffmpegdec->async_max_depth, depth);
+  GST_OBJECT_UNLOCK (ffmpegdec);
+
+  if (frame) {
+    GST_DEBUG_OBJECT (ffmpegdec, "decoding thread returned %s",
+        gst_flow_get_name (ret));
+    gst_video_decoder_release_frame (GST_VIDEO_DECODER (ffmpegdec), frame);
+  }
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_ffmpegviddec_handle_frame (GstVideoDecoder * decoder,
+    GstVideoCodecFrame * frame)
+{
+  GstFFMpegVidDec *ffmpegdec = (GstFFMpegVidDec *) decoder;
+  GstFlowReturn ret;
+  gboolean async;
+
+  GST_OBJECT_LOCK (ffmpegdec);
+  async = ffmpegdec->async_decode;
+  GST_OBJECT_UNLOCK (ffmpegdec);
+
+  if (async)
+    return gst_ffmpegviddec_async_push (ffmpegdec, frame);
+
+  /* asynchronous decoding was just turned off */
+  if (ffmpegdec->async_task) {
+    gst_ffmpegviddec_async_wait (ffmpegdec);
+    GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
+    gst_ffmpegviddec_async_stop (ffmpegdec);
+    GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+  }
+
+  /* The codec might call into get_buffer() from another thread, which
+   * would deadlock on the stream lock.
+   * See https://bugzilla.gnome.org/show_bug.cgi?id=726020 */
+  GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
+  g_mutex_lock (&ffmpegdec->codec_lock);
+  ret = gst_ffmpegviddec_decode_frame (ffmpegdec, frame);
+  g_mutex_unlock (&ffmpegdec->codec_lock);
+  GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+
+  return ret;
+}
+
 static gboolean
 gst_ffmpegviddec_start (GstVideoDecoder * decoder)
 {
@@ -1899,6 +2132,11 @@ gst_ffmpegviddec_start (GstVideoDecoder * decoder)
 
   ffmpegdec->requiring_keyframe = ffmpegdec->require_keyframe;
 
+  GST_OBJECT_LOCK (ffmpegdec);
+  ffmpegdec->async_max_depth = 0;
+  ffmpegdec->async_full_waits = 0;
+  GST_OBJECT_UNLOCK (ffmpegdec);
+
   return TRUE;
 }
 
@@ -1907,6 +2145,8 @@ gst_ffmpegviddec_stop (GstVideoDecoder * decoder)
 {
   GstFFMpegVidDec *ffmpegdec = (GstFFMpegVidDec *) decoder;
 
+  gst_ffmpegviddec_async_stop (ffmpegdec);
+
   GST_OBJECT_LOCK (ffmpegdec);
   gst_ffmpegviddec_close (ffmpegdec, FALSE);
   GST_OBJECT_UNLOCK (ffmpegdec);
@@ -1959,10 +2199,19 @@ gst_ffmpegviddec_flush (GstVideoDecoder * decoder)
 {
   GstFFMpegVidDec *ffmpegdec = (GstFFMpegVidDec *) decoder;
 
+  /* queued packets belong to before the flush */
+  if (ffmpegdec->async_task) {
+    GST_VIDEO_DECODER_STREAM_UNLOCK (ffmpegdec);
+    gst_ffmpegviddec_async_stop (ffmpegdec);
+    GST_VIDEO_DECODER_STREAM_LOCK (ffmpegdec);
+  }
+
+  g_mutex_lock (&ffmpegdec->codec_lock);
   if (ffmpegdec->opened) {
     GST_LOG_OBJECT (decoder, "flushing buffers");
     avcodec_flush_buffers (ffmpegdec->context);
   }
+  g_mutex_unlock (&ffmpegdec->codec_lock);
 
   return TRUE;
 }
@@ -2162,12 +2411,37 @@ gst_ffmpegviddec_set_property (GObject * object,
     case PROP_REQUIRE_KEYFRAME:
       ffmpegdec->require_keyframe = g_value_get_boolean (value);
       break;
+    case PROP_ASYNC_DECODE:
+      GST_OBJECT_LOCK (ffmpegdec);
+      ffmpegdec->async_decode = g_value_get_boolean (value);
+      GST_OBJECT_UNLOCK (ffmpegdec);
+      break;
+    case PROP_ASYNC_QUEUE_SIZE:
+      GST_OBJECT_LOCK (ffmpegdec);
+      ffmpegdec->async_queue_size = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (ffmpegdec);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static GstStructure *
+gst_ffmpegviddec_get_stats (GstFFMpegVidDec * ffmpegdec)
+{
+  GstStructure *s;
+
+  GST_OBJECT_LOCK (ffmpegdec);
+  s = gst_structure_new ("avdec-stats",
+      "queue-depth", G_TYPE_UINT, g_atomic_int_get (&ffmpegdec->async_depth),
+      "queue-max-depth", G_TYPE_UINT, ffmpegdec->async_max_depth,
+      "queue-full-waits", G_TYPE_UINT64, ffmpegdec->async_full_waits, NULL);
+  GST_OBJECT_UNLOCK (ffmpegdec);
+
+  return s;
+}
+
 static void
 gst_ffmpegviddec_get_property (GObject * object,
     guint prop_id, GValue * value, GParamSpec * pspec)
@@ -2196,6 +2470,19 @@ gst_ffmpegviddec_get_property (GObject * object,
     case PROP_REQUIRE_KEYFRAME:
       g_value_set_boolean (value, ffmpegdec->require_keyframe);
       break;
+    case PROP_ASYNC_DECODE:
+      GST_OBJECT_LOCK (ffmpegdec);
+      g_value_set_boolean (value, ffmpegdec->async_decode);
+      GST_OBJECT_UNLOCK (ffmpegdec);
+      break;
+    case PROP_ASYNC_QUEUE_SIZE:
+      GST_OBJECT_LOCK (ffmpegdec);
+      g_value_set_uint (value, ffmpegdec->async_queue_size);
+      GST_OBJECT_UNLOCK (ffmpegdec);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_ffmpegviddec_get_stats (ffmpegdec));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -74,6 +74,27 @@ struct _GstFFMpegVidDec
   GstCaps *last_caps;
   gboolean requiring_keyframe;
 
+  /* asynchronous decoding */
+  gboolean async_decode;
+  guint async_queue_size;
+  GstTask *async_task;
+  GRecMutex async_task_lock;
+  /* serializes codec access between the streaming and the decoding thread,
+   * the stream lock is only taken to output pictures */
+  GMutex codec_lock;
+  /* protects the fields below */
+  GMutex async_lock;
+  GCond async_cond;
+  GQueue async_queue;
+  gboolean async_busy;
+  gboolean async_flushing;
+  GstFlowReturn async_flow;
+  gint async_depth;
+
+  /* statistics, protected by the object lock */
+  guint async_max_depth;
+  guint64 async_full_waits;
+
   /* Internally used for direct rendering */
   GstBufferPool *internal_pool;
   gint pool_width;
@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 /* for stats file handling */
 #include <stdio.h>
 #include <glib/gstdio.h>
@@ -31,13 +32,33 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/stereo3d.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 
 #include "gstav.h"
 #include "gstavcodecmap.h"
 #include "gstavutils.h"
 #include "gstavvidenc.h"
+#include "gstavencmeta.h"
 #include "gstavcfg.h"
-
+#include "gstavroi.h"
+
+GST_DEBUG_CATEGORY_STATIC (GST_CAT_PERFORMANCE);
+
+#define DEFAULT_STRIDE_ALIGN 31
+
+#define DEFAULT_MIN_FORCE_KEY_UNIT_INTERVAL 0
+#define DEFAULT_FORCE_KEY_UNIT_WINDOW 0
+#define DEFAULT_ASYNC_ENCODE FALSE
+#define DEFAULT_ASYNC_QUEUE_SIZE 4
+#define DEFAULT_ASYNC_DROP_POLICY GST_FFMPEG_DROP_NONE
+#define DEFAULT_OVERLOAD_ADAPTATION FALSE
+#define DEFAULT_SKIP_STATIC FALSE
+#define DEFAULT_ACTIVE TRUE
+#define DEFAULT_MAX_SKIP_INTERVAL GST_SECOND
+#define DEFAULT_PARALLEL_CHUNKS 0
+#define DEFAULT_TWO_PASS_LOOKAHEAD 60
+#define DEFAULT_MAX_THREADS 0
+#define DEFAULT_ROI_QUALITY_OFFSET -0.1
 
 enum
 {
@@ -45,6 +66,21 @@ enum
   PROP_QUANTIZER,
   PROP_PASS,
   PROP_FILENAME,
+  PROP_MIN_FORCE_KEY_UNIT_INTERVAL,
+  PROP_FORCE_KEY_UNIT_WINDOW,
+  PROP_STATS,
+  PROP_ASYNC_ENCODE,
+  PROP_ASYNC_QUEUE_SIZE,
+  PROP_ASYNC_DROP_POLICY,
+  PROP_OVERLOAD_ADAPTATION,
+  PROP_SKIP_STATIC,
+  PROP_MAX_SKIP_INTERVAL,
+  PROP_ACTIVE,
+  PROP_PARALLEL_CHUNKS,
+  PROP_TWO_PASS_LOOKAHEAD,
+  PROP_MAX_THREADS,
+  PROP_ROI_QUALITY_OFFSET,
+  PROP_ROI_TYPE_OFFSETS,
   PROP_CFG_BASE,
 };
 
@@ -60,7 +96,15 @@ static gboolean gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
     GstVideoCodecState * state);
 static gboolean gst_ffmpegvidenc_propose_allocation (GstVideoEncoder * encoder,
     GstQuery * query);
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+static gboolean gst_ffmpegvidenc_decide_allocation (GstVideoEncoder * encoder,
+    GstQuery * query);
+static int gst_ffmpegvidenc_get_encode_buffer (AVCodecContext * context,
+    AVPacket * pkt, int flags);
+#endif
 static gboolean gst_ffmpegvidenc_flush (GstVideoEncoder * encoder);
+static gboolean gst_ffmpegvidenc_src_event (GstVideoEncoder * encoder,
+    GstEvent * event);
 
 static GstFlowReturn gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
     GstVideoCodecFrame * frame);
@@ -72,8 +116,37 @@ static void gst_ffmpegvidenc_get_property (GObject * object,
 
 #define GST_FFENC_PARAMS_QDATA g_quark_from_static_string("avenc-params")
 
+/* Custom upstream event carrying new property values, see
+ * gst_ffmpegvidenc_src_event() */
+#define GST_FFENC_RECONFIGURE_EVENT "GstLibAVEncReconfigure"
+#define GST_FFENC_OVERLOAD_MESSAGE "GstLibAVEncOverload"
+#define GST_FFENC_PREPARE_EVENT "GstLibAVEncPrepare"
+
+/* Encoder options lowered, in this order, when the encoder can't keep up with
+ * the input frame rate. Options the codec doesn't have are skipped. */
+static const struct
+{
+  const gchar *name;
+  gint value;
+} overload_steps[] = {
+  {"mbd", 0},                   /* simple macroblock decision */
+  {"subq", 1},                  /* cheapest subpel refinement */
+  {"motion_est", 0},            /* cheapest motion estimation method */
+};
+
+/* level at which frames get dropped, after all options were lowered */
+#define OVERLOAD_DROP_LEVEL (G_N_ELEMENTS (overload_steps) + 1)
+/* frames to wait after a level change before the next one */
+#define OVERLOAD_HOLD_FRAMES 15
+/* fraction of the frame interval spent encoding to step up or down */
+#define OVERLOAD_HIGH_LOAD 0.9
+#define OVERLOAD_LOW_LOAD 0.6
+
 static GstElementClass *parent_class = NULL;
 
+/* both passes in one run, on a lookahead window */
+#define GST_FFMPEG_TWO_PASS (AV_CODEC_FLAG_PASS1 | AV_CODEC_FLAG_PASS2)
+
 #define GST_TYPE_FFMPEG_PASS (gst_ffmpeg_pass_get_type ())
 static GType
 gst_ffmpeg_pass_get_type (void)
@@ -86,6 +159,8 @@ gst_ffmpeg_pass_get_type (void)
       {AV_CODEC_FLAG_QSCALE, "Constant Quantizer", "quant"},
       {AV_CODEC_FLAG_PASS1, "VBR Encoding - Pass 1", "pass1"},
       {AV_CODEC_FLAG_PASS2, "VBR Encoding - Pass 2", "pass2"},
+      {GST_FFMPEG_TWO_PASS, "VBR Encoding - Two passes in memory",
+          "two-pass"},
       {0, NULL, NULL},
     };
 
@@ -96,6 +171,34 @@ gst_ffmpeg_pass_get_type (void)
   return ffmpeg_pass_type;
 }
 
+enum
+{
+  GST_FFMPEG_DROP_NONE,
+  GST_FFMPEG_DROP_OLDEST,
+  GST_FFMPEG_DROP_NEWEST,
+};
+
+#define GST_TYPE_FFMPEG_DROP_POLICY (gst_ffmpeg_drop_policy_get_type ())
+static GType
+gst_ffmpeg_drop_policy_get_type (void)
+{
+  static GType ffmpeg_drop_policy_type = 0;
+
+  if (!ffmpeg_drop_policy_type) {
+    static const GEnumValue ffmpeg_drop_policies[] = {
+      {GST_FFMPEG_DROP_NONE, "Wait until the queue has room", "none"},
+      {GST_FFMPEG_DROP_OLDEST, "Drop the oldest queued frame", "oldest"},
+      {GST_FFMPEG_DROP_NEWEST, "Drop the incoming frame", "newest"},
+      {0, NULL, NULL},
+    };
+
+    ffmpeg_drop_policy_type =
+        g_enum_register_static ("GstLibAVEncDropPolicy", ffmpeg_drop_policies);
+  }
+
+  return ffmpeg_drop_policy_type;
+}
+
 static void
 gst_ffmpegvidenc_base_init (GstFFMpegVidEncClass * klass)
 {
@@ -183,7 +286,106 @@ gst_ffmpegvidenc_class_init (GstFFMpegVidEncClass * klass)
           "Filename for multipass cache file", "stats.log",
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
 
-  /* register additional properties, possibly dependent on the exact CODEC */
+  g_object_class_install_property (gobject_class,
+      PROP_MIN_FORCE_KEY_UNIT_INTERVAL,
+      g_param_spec_uint64 ("min-force-key-unit-interval",
+          "Minimum Force Key Unit Interval",
+          "Minimum time between keyframes produced for force-key-unit "
+          "requests, later requests are deferred (0 = no limit)",
+          0, G_MAXUINT64, DEFAULT_MIN_FORCE_KEY_UNIT_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_FORCE_KEY_UNIT_WINDOW,
+      g_param_spec_uint64 ("force-key-unit-window", "Force Key Unit Window",
+          "Force-key-unit requests arriving this long after a keyframe are "
+          "merged into it", 0, G_MAXUINT64, DEFAULT_FORCE_KEY_UNIT_WINDOW,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics", "Encoder statistics",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ASYNC_ENCODE,
+      g_param_spec_boolean ("async-encode", "Asynchronous encoding",
+          "Encode in a separate thread, decoupling upstream from the codec",
+          DEFAULT_ASYNC_ENCODE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ASYNC_QUEUE_SIZE,
+      g_param_spec_uint ("async-queue-size", "Asynchronous queue size",
+          "Maximum number of frames waiting for the encoding thread",
+          1, 64, DEFAULT_ASYNC_QUEUE_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_OVERLOAD_ADAPTATION,
+      g_param_spec_boolean ("overload-adaptation", "Overload adaptation",
+          "Lower the encoder complexity, then drop frames, when encoding "
+          "takes longer than the frame interval",
+          DEFAULT_OVERLOAD_ADAPTATION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_SKIP_STATIC,
+      g_param_spec_boolean ("skip-static", "Skip static frames",
+          "Don't encode frames identical to the previous one, "
+          "e.g. for screen sharing", DEFAULT_SKIP_STATIC,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_SKIP_INTERVAL,
+      g_param_spec_uint64 ("max-skip-interval", "Maximum skip interval",
+          "Maximum time without encoding a frame when skipping static "
+          "frames (0 = unlimited)", 0, G_MAXUINT64, DEFAULT_MAX_SKIP_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ACTIVE,
+      g_param_spec_boolean ("active", "Active",
+          "Whether to encode. Inactive encoders drop their input until "
+          "reactivated or a keyframe is requested, then resume with a keyframe",
+          DEFAULT_ACTIVE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PARALLEL_CHUNKS,
+      g_param_spec_uint ("parallel-chunks", "Parallel chunks",
+          "Encode this many GOP sized chunks concurrently on separate "
+          "contexts, for offline encoding (0 = disabled)",
+          0, 64, DEFAULT_PARALLEL_CHUNKS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_TWO_PASS_LOOKAHEAD,
+      g_param_spec_uint ("two-pass-lookahead", "Two-pass lookahead",
+          "Number of frames buffered and analysed by the first pass "
+          "in two-pass mode", 1, 10000, DEFAULT_TWO_PASS_LOOKAHEAD,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ASYNC_DROP_POLICY,
+      g_param_spec_enum ("async-drop-policy", "Asynchronous drop policy",
+          "What to do with new frames when the encoding queue is full",
+          GST_TYPE_FFMPEG_DROP_POLICY, DEFAULT_ASYNC_DROP_POLICY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ROI_QUALITY_OFFSET,
+      g_param_spec_double ("roi-quality-offset", "ROI quality offset",
+          "Quantizer offset for regions of interest, negative values improve "
+          "their quality (-1 to 1 of the quantizer range)",
+          -1.0, 1.0, DEFAULT_ROI_QUALITY_OFFSET,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ROI_TYPE_OFFSETS,
+      g_param_spec_boxed ("roi-type-offsets", "ROI type offsets",
+          "Quantizer offsets overriding roi-quality-offset per region type, "
+          "e.g. \"offsets, face=(double)-0.3\"",
+          GST_TYPE_STRUCTURE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  if (klass->in_plugin->capabilities & (AV_CODEC_CAP_FRAME_THREADS |
+          AV_CODEC_CAP_SLICE_THREADS)) {
+    g_object_class_install_property (gobject_class, PROP_MAX_THREADS,
+        g_param_spec_int ("max-threads", "Maximum encode threads",
+            "Maximum number of worker threads to spawn. (0 = auto)",
+            0, G_MAXINT, DEFAULT_MAX_THREADS,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  }
+
+  /* register additional properties, possibly dependent on the exact CODEC.
+   * All of them can be changed while encoding: options the codec accepts at
+   * runtime are applied to the next frame, the others (bitrate among them)
+   * reopen the codec at the next keyframe. */
   gst_ffmpeg_cfg_install_properties (gobject_class, klass->in_plugin,
       PROP_CFG_BASE, AV_OPT_FLAG_ENCODING_PARAM | AV_OPT_FLAG_VIDEO_PARAM);
 
@@ -193,9 +395,15 @@ gst_ffmpegvidenc_class_init (GstFFMpegVidEncClass * klass)
   venc_class->handle_frame = gst_ffmpegvidenc_handle_frame;
   venc_class->set_format = gst_ffmpegvidenc_set_format;
   venc_class->propose_allocation = gst_ffmpegvidenc_propose_allocation;
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  venc_class->decide_allocation = gst_ffmpegvidenc_decide_allocation;
+#endif
   venc_class->flush = gst_ffmpegvidenc_flush;
+  venc_class->src_event = gst_ffmpegvidenc_src_event;
 
   gobject_class->finalize = gst_ffmpegvidenc_finalize;
+
+  GST_DEBUG_CATEGORY_GET (GST_CAT_PERFORMANCE, "GST_PERFORMANCE");
 }
 
 static void
@@ -209,8 +417,33 @@ gst_ffmpegvidenc_init (GstFFMpegVidEnc * ffmpegenc)
   ffmpegenc->context = avcodec_alloc_context3 (klass->in_plugin);
   ffmpegenc->refcontext = avcodec_alloc_context3 (klass->in_plugin);
   ffmpegenc->picture = av_frame_alloc ();
+  ffmpegenc->pkt = av_packet_alloc ();
   ffmpegenc->opened = FALSE;
   ffmpegenc->file = NULL;
+
+  ffmpegenc->min_force_key_unit_interval = DEFAULT_MIN_FORCE_KEY_UNIT_INTERVAL;
+  ffmpegenc->force_key_unit_window = DEFAULT_FORCE_KEY_UNIT_WINDOW;
+
+  ffmpegenc->async_encode = DEFAULT_ASYNC_ENCODE;
+  ffmpegenc->async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+  ffmpegenc->async_drop_policy = DEFAULT_ASYNC_DROP_POLICY;
+  ffmpegenc->overload_adaptation = DEFAULT_OVERLOAD_ADAPTATION;
+  ffmpegenc->skip_static = DEFAULT_SKIP_STATIC;
+  ffmpegenc->active = DEFAULT_ACTIVE;
+  ffmpegenc->max_skip_interval = DEFAULT_MAX_SKIP_INTERVAL;
+  ffmpegenc->parallel_chunks = DEFAULT_PARALLEL_CHUNKS;
+  ffmpegenc->two_pass_lookahead = DEFAULT_TWO_PASS_LOOKAHEAD;
+  ffmpegenc->max_threads = DEFAULT_MAX_THREADS;
+  ffmpegenc->roi_quality_offset = DEFAULT_ROI_QUALITY_OFFSET;
+  g_queue_init (&ffmpegenc->lookahead_queue);
+  g_rec_mutex_init (&ffmpegenc->async_task_lock);
+  g_mutex_init (&ffmpegenc->codec_lock);
+  g_mutex_init (&ffmpegenc->async_lock);
+  g_cond_init (&ffmpegenc->async_cond);
+  g_queue_init (&ffmpegenc->async_queue);
+  g_mutex_init (&ffmpegenc->chunk_lock);
+  g_cond_init (&ffmpegenc->chunk_cond);
+  g_queue_init (&ffmpegenc->chunks);
 }
 
 static void
@@ -220,7 +453,17 @@ gst_ffmpegvidenc_finalize (GObject * object)
 
   /* clean up remaining allocated data */
   g_free (ffmpegenc->filename);
+  g_list_free (ffmpegenc->pending_params);
+  if (ffmpegenc->roi_type_offsets)
+    gst_structure_free (ffmpegenc->roi_type_offsets);
+  g_rec_mutex_clear (&ffmpegenc->async_task_lock);
+  g_mutex_clear (&ffmpegenc->codec_lock);
+  g_mutex_clear (&ffmpegenc->async_lock);
+  g_cond_clear (&ffmpegenc->async_cond);
+  g_mutex_clear (&ffmpegenc->chunk_lock);
+  g_cond_clear (&ffmpegenc->chunk_cond);
   av_frame_free (&ffmpegenc->picture);
+  av_packet_free (&ffmpegenc->pkt);
   gst_ffmpeg_avcodec_close (ffmpegenc->context);
   av_free (ffmpegenc->context);
   avcodec_free_context (&ffmpegenc->refcontext);
@@ -228,19 +471,392 @@ gst_ffmpegvidenc_finalize (GObject * object)
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+/* Lowers the options of overload_steps below the current overload level on
+ * @context before it is opened, none of them can change at runtime */
+static void
+gst_ffmpegvidenc_overload_apply (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context)
+{
+  GObjectClass *klass = G_OBJECT_GET_CLASS (ffmpegenc);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (overload_steps); i++) {
+    GValue value = G_VALUE_INIT;
+    GParamSpec *pspec;
+    gboolean res;
+    gint current;
+
+    pspec = g_object_class_find_property (klass, overload_steps[i].name);
+    if (!pspec)
+      continue;
+
+    if (G_IS_PARAM_SPEC_ENUM (pspec)) {
+      g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+    } else if (G_IS_PARAM_SPEC_INT (pspec)) {
+      g_value_init (&value, G_TYPE_INT);
+    } else {
+      continue;
+    }
+
+    GST_OBJECT_LOCK (ffmpegenc);
+    res = gst_ffmpeg_cfg_get_property (ffmpegenc->refcontext, &value, pspec);
+    GST_OBJECT_UNLOCK (ffmpegenc);
+
+    if (res && i < ffmpegenc->overload_level) {
+      if (G_VALUE_HOLDS_ENUM (&value)) {
+        current = g_value_get_enum (&value);
+        g_value_set_enum (&value, MIN (current, overload_steps[i].value));
+      } else {
+        current = g_value_get_int (&value);
+        g_value_set_int (&value, MIN (current, overload_steps[i].value));
+      }
+    }
+
+    if (res && !gst_ffmpeg_cfg_set_property (context, &value, pspec))
+      GST_WARNING_OBJECT (ffmpegenc, "failed to set %s",
+          overload_steps[i].name);
+
+    g_value_unset (&value);
+  }
+}
+
+/* Picks the number of threads from the resolution, one per 320x240 pixels
+ * up to the number of CPUs, unless set by max-threads, or leaves it to codecs
+ * that pick their own. Frame threading adds latency, so like the decoders we
+ * only use it if upstream isn't live. Explicitly set threads and thread-type
+ * options are left alone. */
+static void
+gst_ffmpegvidenc_configure_threads (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context)
+{
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  gint capabilities = oclass->in_plugin->capabilities;
+  GstQuery *query;
+  gboolean is_live = FALSE;
+  gboolean threads_set, thread_type_set;
+  gint max_threads;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  max_threads = ffmpegenc->max_threads;
+  threads_set = ffmpegenc->threads_set;
+  thread_type_set = ffmpegenc->thread_type_set;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!threads_set) {
+    if (max_threads == 0) {
+      if (capabilities & AV_CODEC_CAP_AUTO_THREADS) {
+        context->thread_count = 0;
+      } else {
+        gint64 pixels = (gint64) context->width * context->height;
+
+        context->thread_count = CLAMP (pixels / (320 * 240), 1,
+            gst_ffmpeg_auto_max_threads ());
+      }
+    } else {
+      context->thread_count = max_threads;
+    }
+  }
+
+  if (!thread_type_set) {
+    if (capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+      query = gst_query_new_latency ();
+      if (gst_pad_peer_query (GST_VIDEO_ENCODER_SINK_PAD (ffmpegenc), query))
+        gst_query_parse_latency (query, &is_live, NULL, NULL);
+      gst_query_unref (query);
+    }
+
+    context->thread_type = 0;
+    if (capabilities & AV_CODEC_CAP_SLICE_THREADS)
+      context->thread_type |= FF_THREAD_SLICE;
+    if ((capabilities & AV_CODEC_CAP_FRAME_THREADS) && !is_live)
+      context->thread_type |= FF_THREAD_FRAME;
+  }
+
+  GST_DEBUG_OBJECT (ffmpegenc, "using %d threads of type 0x%x, %s upstream",
+      context->thread_count, context->thread_type,
+      is_live ? "live" : "non-live");
+}
+
+/* Copies the rate control targets, which may have been adjusted while
+ * encoding */
+static void
+gst_ffmpegvidenc_copy_rate_control (AVCodecContext * dest,
+    AVCodecContext * src)
+{
+  dest->global_quality = src->global_quality;
+  dest->bit_rate = src->bit_rate;
+  dest->rc_min_rate = src->rc_min_rate;
+  dest->rc_max_rate = src->rc_max_rate;
+  dest->rc_buffer_size = src->rc_buffer_size;
+}
+
+/* Sets the current values of the options the codec accepts at runtime on the
+ * open @context */
+static void
+gst_ffmpegvidenc_apply_runtime_params (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context)
+{
+  GParamSpec **pspecs;
+  guint n_pspecs, i;
+
+  pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS (ffmpegenc),
+      &n_pspecs);
+  for (i = 0; i < n_pspecs; i++) {
+    GValue value = G_VALUE_INIT;
+
+    if (!gst_ffmpeg_cfg_is_runtime_param (pspecs[i]))
+      continue;
+
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspecs[i]));
+    g_object_get_property (G_OBJECT (ffmpegenc), pspecs[i]->name, &value);
+    if (!gst_ffmpeg_cfg_set_property (context, &value, pspecs[i]))
+      GST_DEBUG_OBJECT (ffmpegenc, "failed to apply %s", pspecs[i]->name);
+    g_value_unset (&value);
+  }
+  g_free (pspecs);
+}
+
+/* Sets up an additional context for @info like the main one, plus the @pass
+ * flags for multipass encoding, without opening it. Reads the element's
+ * settings, so call from the streaming thread. Without @threaded, the
+ * context is single threaded. */
+static AVCodecContext *
+gst_ffmpegvidenc_setup_context (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoInfo * info, gint pass, gboolean threaded)
+{
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  AVCodecContext *main_context = ffmpegenc->context;
+  AVCodecContext *context;
+
+  context = avcodec_alloc_context3 (oclass->in_plugin);
+  gst_ffmpeg_cfg_fill_context (G_OBJECT (ffmpegenc), context);
+  if (ffmpegenc->overload_level > 0)
+    gst_ffmpegvidenc_overload_apply (ffmpegenc, context);
+  gst_ffmpeg_videoinfo_to_context (info, context);
+
+  if (ffmpegenc->input_state && info == &ffmpegenc->input_state->info) {
+    /* possibly cropped */
+    context->width = main_context->width;
+    context->height = main_context->height;
+  }
+
+  context->flags = main_context->flags | pass;
+  context->flags2 = main_context->flags2;
+  context->time_base = main_context->time_base;
+  context->pix_fmt = main_context->pix_fmt;
+  context->profile = main_context->profile;
+  context->level = main_context->level;
+  gst_ffmpegvidenc_copy_rate_control (context, main_context);
+
+  if (threaded && (oclass->in_plugin->capabilities &
+          (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS)))
+    gst_ffmpegvidenc_configure_threads (ffmpegenc, context);
+  else
+    context->thread_count = 1;
+
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  if (main_context->get_encode_buffer == gst_ffmpegvidenc_get_encode_buffer) {
+    context->opaque = ffmpegenc;
+    context->get_encode_buffer = gst_ffmpegvidenc_get_encode_buffer;
+  }
+#endif
+
+  return context;
+}
+
+/* Opens @context set up by gst_ffmpegvidenc_setup_context() with the
+ * multipass @stats_in, frees it on failure. Only touches @context, so it
+ * can run on any thread. */
 static gboolean
-gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
-    GstVideoCodecState * state)
+gst_ffmpegvidenc_open_setup_context (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext ** context, const gchar * stats_in)
 {
-  GstCaps *other_caps;
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+
+  /* only read while opening */
+  (*context)->stats_in = (gchar *) stats_in;
+  if (gst_ffmpeg_avcodec_open (*context, oclass->in_plugin) < 0)
+    goto open_failed;
+  (*context)->stats_in = NULL;
+
+  return TRUE;
+
+  /* ERRORS */
+open_failed:
+  {
+    GST_WARNING_OBJECT (ffmpegenc, "Failed to open an additional context");
+    (*context)->stats_in = NULL;
+    avcodec_free_context (context);
+    return FALSE;
+  }
+}
+
+/* Opens an additional context for @info set up like the main one, see
+ * gst_ffmpegvidenc_setup_context() */
+static AVCodecContext *
+gst_ffmpegvidenc_open_context (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoInfo * info, gint pass, const gchar * stats_in, gboolean threaded)
+{
+  AVCodecContext *context;
+
+  context = gst_ffmpegvidenc_setup_context (ffmpegenc, info, pass, threaded);
+  if (!gst_ffmpegvidenc_open_setup_context (ffmpegenc, &context, stats_in))
+    return NULL;
+
+  return context;
+}
+
+static GstCaps *
+gst_ffmpegvidenc_get_allowed_caps (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
   GstCaps *allowed_caps;
-  GstCaps *icaps;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "picking an output format ...");
+  allowed_caps = gst_pad_get_allowed_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
+  if (!allowed_caps) {
+    GST_DEBUG_OBJECT (ffmpegenc, "... but no peer, using template caps");
+    /* we need to copy because get_allowed_caps returns a ref, and
+     * get_pad_template_caps doesn't */
+    allowed_caps =
+        gst_pad_get_pad_template_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
+  }
+  GST_DEBUG_OBJECT (ffmpegenc, "chose caps %" GST_PTR_FORMAT, allowed_caps);
+
+  return allowed_caps;
+}
+
+/* Sets the output state for the open context, takes @allowed_caps */
+static gboolean
+gst_ffmpegvidenc_negotiate (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecState * state, GstCaps * allowed_caps)
+{
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
   GstVideoCodecState *output_format;
+  GstCaps *other_caps;
+  GstCaps *icaps;
+
+  /* try to set this caps on the other side */
+  other_caps = gst_ffmpeg_codecid_to_caps (oclass->in_plugin->id,
+      ffmpegenc->context, TRUE);
+
+  if (!other_caps) {
+    gst_caps_unref (allowed_caps);
+    return FALSE;
+  }
+
+  icaps = gst_caps_intersect (allowed_caps, other_caps);
+  gst_caps_unref (allowed_caps);
+  gst_caps_unref (other_caps);
+  if (gst_caps_is_empty (icaps)) {
+    gst_caps_unref (icaps);
+    return FALSE;
+  }
+  icaps = gst_caps_fixate (icaps);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "codec flags 0x%08x", ffmpegenc->context->flags);
+
+  /* Store input state and set output state */
+  if (ffmpegenc->input_state)
+    gst_video_codec_state_unref (ffmpegenc->input_state);
+  ffmpegenc->input_state = gst_video_codec_state_ref (state);
+
+  output_format = gst_video_encoder_set_output_state (encoder, icaps, state);
+  gst_video_codec_state_unref (output_format);
+
+  /* Store some tags */
+  {
+    GstTagList *tags = gst_tag_list_new_empty ();
+    const gchar *codec;
+
+    gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_NOMINAL_BITRATE,
+        (guint) ffmpegenc->context->bit_rate, NULL);
+
+    if ((codec =
+            gst_ffmpeg_get_codecid_longname (ffmpegenc->context->codec_id)))
+      gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_VIDEO_CODEC, codec,
+          NULL);
+
+    gst_video_encoder_merge_tags (encoder, tags, GST_TAG_MERGE_REPLACE);
+    gst_tag_list_unref (tags);
+  }
+
+  /* B-frames and frame threads delay the output */
+  if (GST_VIDEO_INFO_FPS_N (&state->info) > 0) {
+    GstClockTime latency;
+    gint delay = MAX (ffmpegenc->context->max_b_frames, 0);
+
+    if (ffmpegenc->context->active_thread_type & FF_THREAD_FRAME)
+      delay += ffmpegenc->context->thread_count - 1;
+
+    latency = gst_util_uint64_scale_ceil (delay * GST_SECOND,
+        GST_VIDEO_INFO_FPS_D (&state->info),
+        GST_VIDEO_INFO_FPS_N (&state->info));
+    GST_DEBUG_OBJECT (ffmpegenc, "latency of %d frames, %" GST_TIME_FORMAT,
+        delay, GST_TIME_ARGS (latency));
+    gst_video_encoder_set_latency (encoder, latency, latency);
+  }
+
+  /* success! */
+  ffmpegenc->opened = TRUE;
+  ffmpegenc->gop_position = 0;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->target_bitrate = MAX (ffmpegenc->context->bit_rate, 0);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  return TRUE;
+}
+
+/* Runs on the standby thread, which owns the standby context until joined */
+static gpointer
+gst_ffmpegvidenc_standby_open (gpointer data)
+{
+  GstFFMpegVidEnc *ffmpegenc = data;
+
+  gst_ffmpegvidenc_open_setup_context (ffmpegenc,
+      &ffmpegenc->standby_context, NULL);
+
+  return NULL;
+}
+
+static void
+gst_ffmpegvidenc_standby_discard (GstFFMpegVidEnc * ffmpegenc)
+{
+  if (ffmpegenc->standby_thread) {
+    g_thread_join (ffmpegenc->standby_thread);
+    ffmpegenc->standby_thread = NULL;
+  }
+
+  if (ffmpegenc->standby_context) {
+    gst_ffmpeg_avcodec_close (ffmpegenc->standby_context);
+    avcodec_free_context (&ffmpegenc->standby_context);
+  }
+}
+
+static gsize gst_ffmpegvidenc_input_alignment (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoInfo * info, GstVideoAlignment * align);
+
+/* (Re)opens the codec for @state with the current settings */
+static gboolean
+gst_ffmpegvidenc_configure (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecState * state)
+{
+  GstCaps *allowed_caps;
   enum AVPixelFormat pix_fmt;
-  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
   GstFFMpegVidEncClass *oclass =
       (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
 
+  ffmpegenc->last_input_valid = FALSE;
+
+  /* it may read the context we're about to reset */
+  gst_ffmpegvidenc_standby_discard (ffmpegenc);
+
   /* close old session */
   if (ffmpegenc->opened) {
     gst_ffmpeg_avcodec_close (ffmpegenc->context);
@@ -255,8 +871,22 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
   /* additional avcodec settings */
   gst_ffmpeg_cfg_fill_context (G_OBJECT (ffmpegenc), ffmpegenc->context);
 
-  /* and last but not least the pass; CBR, 2-pass, etc */
-  ffmpegenc->context->flags |= ffmpegenc->pass;
+  /* keep the reduced complexity if we are overloaded */
+  if (ffmpegenc->overload_level > 0)
+    gst_ffmpegvidenc_overload_apply (ffmpegenc, ffmpegenc->context);
+
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  /* let the encoder write its packets into our output buffers */
+  if (oclass->in_plugin->capabilities & AV_CODEC_CAP_DR1) {
+    ffmpegenc->context->opaque = ffmpegenc;
+    ffmpegenc->context->get_encode_buffer = gst_ffmpegvidenc_get_encode_buffer;
+  }
+#endif
+
+  /* and last but not least the pass; CBR, 2-pass, etc. In-memory two-pass
+   * encoding uses separate contexts per pass */
+  if (ffmpegenc->pass != GST_FFMPEG_TWO_PASS)
+    ffmpegenc->context->flags |= ffmpegenc->pass;
   switch (ffmpegenc->pass) {
       /* some additional action depends on type of pass */
     case AV_CODEC_FLAG_QSCALE:
@@ -288,6 +918,16 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
   /* fetch pix_fmt, fps, par, width, height... */
   gst_ffmpeg_videoinfo_to_context (&state->info, ffmpegenc->context);
 
+  /* only the cropped region of the input is encoded */
+  if (ffmpegenc->crop_width > 0) {
+    ffmpegenc->context->width = ffmpegenc->crop_width;
+    ffmpegenc->context->height = ffmpegenc->crop_height;
+  }
+
+  if (oclass->in_plugin->capabilities & (AV_CODEC_CAP_FRAME_THREADS |
+          AV_CODEC_CAP_SLICE_THREADS))
+    gst_ffmpegvidenc_configure_threads (ffmpegenc, ffmpegenc->context);
+
   /* sanitize time base */
   if (ffmpegenc->context->time_base.num <= 0
       || ffmpegenc->context->time_base.den <= 0)
@@ -310,16 +950,7 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
   pix_fmt = ffmpegenc->context->pix_fmt;
 
   /* some codecs support more than one format, first auto-choose one */
-  GST_DEBUG_OBJECT (ffmpegenc, "picking an output format ...");
-  allowed_caps = gst_pad_get_allowed_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
-  if (!allowed_caps) {
-    GST_DEBUG_OBJECT (ffmpegenc, "... but no peer, using template caps");
-    /* we need to copy because get_allowed_caps returns a ref, and
-     * get_pad_template_caps doesn't */
-    allowed_caps =
-        gst_pad_get_pad_template_caps (GST_VIDEO_ENCODER_SRC_PAD (encoder));
-  }
-  GST_DEBUG_OBJECT (ffmpegenc, "chose caps %" GST_PTR_FORMAT, allowed_caps);
+  allowed_caps = gst_ffmpegvidenc_get_allowed_caps (ffmpegenc);
   gst_ffmpeg_caps_with_codecid (oclass->in_plugin->id,
       oclass->in_plugin->type, allowed_caps, ffmpegenc->context);
 
@@ -345,59 +976,29 @@ gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
 
   /* second pass stats buffer no longer needed */
   g_free (ffmpegenc->context->stats_in);
+  ffmpegenc->context->stats_in = NULL;
 
-  /* try to set this caps on the other side */
-  other_caps = gst_ffmpeg_codecid_to_caps (oclass->in_plugin->id,
-      ffmpegenc->context, TRUE);
-
-  if (!other_caps) {
-    gst_caps_unref (allowed_caps);
+  if (!gst_ffmpegvidenc_negotiate (ffmpegenc, state, allowed_caps))
     goto unsupported_codec;
-  }
 
-  icaps = gst_caps_intersect (allowed_caps, other_caps);
-  gst_caps_unref (allowed_caps);
-  gst_caps_unref (other_caps);
-  if (gst_caps_is_empty (icaps)) {
-    gst_caps_unref (icaps);
-    goto unsupported_codec;
-  }
-  icaps = gst_caps_fixate (icaps);
+  {
+    GstVideoAlignment align;
 
-  GST_DEBUG_OBJECT (ffmpegenc, "codec flags 0x%08x", ffmpegenc->context->flags);
+    ffmpegenc->input_align =
+        gst_ffmpegvidenc_input_alignment (ffmpegenc, &state->info, &align);
+  }
 
-  /* Store input state and set output state */
-  if (ffmpegenc->input_state)
-    gst_video_codec_state_unref (ffmpegenc->input_state);
-  ffmpegenc->input_state = gst_video_codec_state_ref (state);
+  /* the new context was set up with the current settings */
+  GST_OBJECT_LOCK (ffmpegenc);
+  g_list_free (ffmpegenc->pending_params);
+  ffmpegenc->pending_params = NULL;
+  ffmpegenc->reopen_pending = FALSE;
+  GST_OBJECT_UNLOCK (ffmpegenc);
 
-  output_format = gst_video_encoder_set_output_state (encoder, icaps, state);
-  gst_video_codec_state_unref (output_format);
+  return TRUE;
 
-  /* Store some tags */
-  {
-    GstTagList *tags = gst_tag_list_new_empty ();
-    const gchar *codec;
-
-    gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_NOMINAL_BITRATE,
-        (guint) ffmpegenc->context->bit_rate, NULL);
-
-    if ((codec =
-            gst_ffmpeg_get_codecid_longname (ffmpegenc->context->codec_id)))
-      gst_tag_list_add (tags, GST_TAG_MERGE_REPLACE, GST_TAG_VIDEO_CODEC, codec,
-          NULL);
-
-    gst_video_encoder_merge_tags (encoder, tags, GST_TAG_MERGE_REPLACE);
-    gst_tag_list_unref (tags);
-  }
-
-  /* success! */
-  ffmpegenc->opened = TRUE;
-
-  return TRUE;
-
-  /* ERRORS */
-open_file_err:
+  /* ERRORS */
+open_file_err:
   {
     GST_ELEMENT_ERROR (ffmpegenc, RESOURCE, OPEN_WRITE,
         (("Could not open file \"%s\" for writing."), ffmpegenc->filename),
@@ -459,17 +1060,457 @@ cleanup_stats_in:
   }
 }
 
+static GstFlowReturn gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc *
+    ffmpegenc, gboolean send);
+
+/* Starts opening a standby context in the background for the resolution
+ * announced with a GstLibAVEncPrepare event. Called from the streaming thread
+ * as the other parameters are taken from the input state. */
+static void
+gst_ffmpegvidenc_standby_prepare (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstCaps *caps;
+  gboolean requested;
+  gboolean multipass;
+  gint width, height;
+  guint cookie;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  requested = ffmpegenc->standby_requested;
+  ffmpegenc->standby_requested = FALSE;
+  width = ffmpegenc->standby_width;
+  height = ffmpegenc->standby_height;
+  cookie = ffmpegenc->settings_cookie;
+  multipass = (ffmpegenc->pass & (AV_CODEC_FLAG_PASS1 |
+          AV_CODEC_FLAG_PASS2)) != 0;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!requested || !ffmpegenc->opened)
+    return;
+
+  if (multipass) {
+    GST_WARNING_OBJECT (ffmpegenc, "can't prepare a standby context for "
+        "multipass encoding");
+    return;
+  }
+
+  gst_ffmpegvidenc_standby_discard (ffmpegenc);
+
+  caps = gst_video_info_to_caps (&ffmpegenc->input_state->info);
+  gst_caps_set_simple (caps, "width", G_TYPE_INT, width, "height",
+      G_TYPE_INT, height, NULL);
+  if (!gst_video_info_from_caps (&ffmpegenc->standby_info, caps)) {
+    GST_WARNING_OBJECT (ffmpegenc, "invalid standby caps %" GST_PTR_FORMAT,
+        caps);
+    gst_caps_unref (caps);
+    return;
+  }
+  gst_caps_unref (caps);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "preparing standby context for %dx%d",
+      width, height);
+
+  /* everything depending on the settings and the live context is set up
+   * here, only the (slow) opening happens in the background */
+  ffmpegenc->standby_cookie = cookie;
+  ffmpegenc->standby_context = gst_ffmpegvidenc_setup_context (ffmpegenc,
+      &ffmpegenc->standby_info, 0, TRUE);
+  ffmpegenc->standby_thread = g_thread_new ("avenc-standby",
+      gst_ffmpegvidenc_standby_open, ffmpegenc);
+}
+
+/* Returns the standby context if it was opened for @state with the current
+ * settings, discards it otherwise */
+static AVCodecContext *
+gst_ffmpegvidenc_standby_take (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecState * state)
+{
+  GstVideoInfo *info = &state->info;
+  GstVideoInfo *standby = &ffmpegenc->standby_info;
+  AVCodecContext *context;
+  guint cookie;
+
+  if (!ffmpegenc->standby_thread)
+    return NULL;
+
+  g_thread_join (ffmpegenc->standby_thread);
+  ffmpegenc->standby_thread = NULL;
+
+  context = ffmpegenc->standby_context;
+  ffmpegenc->standby_context = NULL;
+  if (!context)
+    return NULL;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  cookie = ffmpegenc->settings_cookie;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (cookie != ffmpegenc->standby_cookie
+      || GST_VIDEO_INFO_FORMAT (info) != GST_VIDEO_INFO_FORMAT (standby)
+      || GST_VIDEO_INFO_WIDTH (info) != GST_VIDEO_INFO_WIDTH (standby)
+      || GST_VIDEO_INFO_HEIGHT (info) != GST_VIDEO_INFO_HEIGHT (standby)
+      || GST_VIDEO_INFO_FPS_N (info) != GST_VIDEO_INFO_FPS_N (standby)
+      || GST_VIDEO_INFO_FPS_D (info) != GST_VIDEO_INFO_FPS_D (standby)
+      || GST_VIDEO_INFO_PAR_N (info) != GST_VIDEO_INFO_PAR_N (standby)
+      || GST_VIDEO_INFO_PAR_D (info) != GST_VIDEO_INFO_PAR_D (standby)
+      || GST_VIDEO_INFO_INTERLACE_MODE (info) !=
+      GST_VIDEO_INFO_INTERLACE_MODE (standby)) {
+    GST_DEBUG_OBJECT (ffmpegenc, "discarding standby context, the format or "
+        "settings changed");
+    gst_ffmpeg_avcodec_close (context);
+    avcodec_free_context (&context);
+    return NULL;
+  }
+
+  return context;
+}
+
+/* Drains the current context and continues with the already open @context */
+static gboolean
+gst_ffmpegvidenc_switch_context (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context, GstVideoCodecState * state)
+{
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  GstVideoAlignment align;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "switching to the standby context");
+
+  gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+  ffmpegenc->last_input_valid = FALSE;
+
+  /* the targets may have changed since the standby context was set up */
+  gst_ffmpegvidenc_copy_rate_control (context, ffmpegenc->context);
+  gst_ffmpegvidenc_apply_runtime_params (ffmpegenc, context);
+
+  gst_ffmpeg_avcodec_close (ffmpegenc->context);
+  avcodec_free_context (&ffmpegenc->context);
+  ffmpegenc->context = context;
+  ffmpegenc->opened = FALSE;
+  /* opened uncropped, the next cropped frame reopens it */
+  ffmpegenc->crop_width = ffmpegenc->crop_height = 0;
+
+  if (!gst_ffmpegvidenc_negotiate (ffmpegenc, state,
+          gst_ffmpegvidenc_get_allowed_caps (ffmpegenc)))
+    goto negotiate_failed;
+
+  ffmpegenc->input_align =
+      gst_ffmpegvidenc_input_alignment (ffmpegenc, &state->info, &align);
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->standby_switches++;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  return TRUE;
+
+  /* ERRORS */
+negotiate_failed:
+  {
+    /* leave a closed context behind, the next configure opens it again */
+    GST_DEBUG_OBJECT (ffmpegenc, "failed to negotiate the standby context");
+    gst_ffmpeg_avcodec_close (ffmpegenc->context);
+    if (avcodec_get_context_defaults3 (ffmpegenc->context,
+            oclass->in_plugin) < 0)
+      GST_DEBUG_OBJECT (ffmpegenc, "Failed to set context defaults");
+    return FALSE;
+  }
+}
+
+static GstFlowReturn gst_ffmpegvidenc_async_wait (GstFFMpegVidEnc * ffmpegenc);
+static GstFlowReturn gst_ffmpegvidenc_chunks_finish (GstFFMpegVidEnc *
+    ffmpegenc);
+static GstFlowReturn gst_ffmpegvidenc_two_pass_window (GstFFMpegVidEnc *
+    ffmpegenc);
+
+static gboolean
+gst_ffmpegvidenc_set_format (GstVideoEncoder * encoder,
+    GstVideoCodecState * state)
+{
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  AVCodecContext *context;
+  gboolean res;
+
+  /* frames queued for the encoding thread belong to the old format */
+  gst_ffmpegvidenc_async_wait (ffmpegenc);
+  gst_ffmpegvidenc_chunks_finish (ffmpegenc);
+  gst_ffmpegvidenc_two_pass_window (ffmpegenc);
+
+  g_mutex_lock (&ffmpegenc->codec_lock);
+
+  /* keep encoding the cropped region if it still fits */
+  if (ffmpegenc->crop_width > GST_VIDEO_INFO_WIDTH (&state->info) ||
+      ffmpegenc->crop_height > GST_VIDEO_INFO_HEIGHT (&state->info))
+    ffmpegenc->crop_width = ffmpegenc->crop_height = 0;
+
+  /* a context prepared for this format saves reopening the codec */
+  context = gst_ffmpegvidenc_standby_take (ffmpegenc, state);
+  if (context && ffmpegenc->opened) {
+    res = gst_ffmpegvidenc_switch_context (ffmpegenc, context, state);
+  } else {
+    if (context) {
+      gst_ffmpeg_avcodec_close (context);
+      avcodec_free_context (&context);
+    }
+    res = gst_ffmpegvidenc_configure (ffmpegenc, state);
+  }
+  g_mutex_unlock (&ffmpegenc->codec_lock);
+
+  return res;
+}
+
+/* Gets the alignment, padding and stride alignment the codec wants for
+ * input frames of @info, returns the stride alignment mask */
+static gsize
+gst_ffmpegvidenc_input_alignment (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoInfo * info, GstVideoAlignment * align)
+{
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  AVCodecContext *context;
+  gint width, height;
+  gint linesize_align[AV_NUM_DATA_POINTERS];
+  gsize max_align = DEFAULT_STRIDE_ALIGN;
+  gint i;
+
+  /* a scratch context, the real one may be in use */
+  context = avcodec_alloc_context3 (oclass->in_plugin);
+  gst_ffmpeg_videoinfo_to_context (info, context);
+
+  width = GST_VIDEO_INFO_WIDTH (info);
+  height = GST_VIDEO_INFO_HEIGHT (info);
+  avcodec_align_dimensions2 (context, &width, &height, linesize_align);
+  avcodec_free_context (&context);
+
+  for (i = 0; i < 4; i++) {
+    if (linesize_align[i] > 0)
+      max_align |= linesize_align[i] - 1;
+  }
+
+  gst_video_alignment_reset (align);
+  align->padding_right = width - GST_VIDEO_INFO_WIDTH (info);
+  align->padding_bottom = height - GST_VIDEO_INFO_HEIGHT (info);
+  for (i = 0; i < GST_VIDEO_MAX_PLANES; i++)
+    align->stride_align[i] = max_align;
+
+  return max_align;
+}
+
+/* Offers upstream a pool of frames libav can encode in place */
+static GstBufferPool *
+gst_ffmpegvidenc_create_input_pool (GstFFMpegVidEnc * ffmpegenc,
+    GstCaps * caps, GstVideoInfo * info)
+{
+  GstAllocationParams params;
+  GstVideoAlignment align;
+  GstBufferPool *pool;
+  GstStructure *config;
+  gsize max_align;
+
+  max_align = gst_ffmpegvidenc_input_alignment (ffmpegenc, info, &align);
+  if (!gst_video_info_align (info, &align))
+    return NULL;
+
+  gst_allocation_params_init (&params);
+  params.align = max_align;
+
+  pool = gst_video_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, caps, GST_VIDEO_INFO_SIZE (info),
+      0, 0);
+  gst_buffer_pool_config_set_allocator (config, NULL, &params);
+  gst_buffer_pool_config_add_option (config,
+      GST_BUFFER_POOL_OPTION_VIDEO_META);
+  gst_buffer_pool_config_add_option (config,
+      GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT);
+  gst_buffer_pool_config_set_video_alignment (config, &align);
+
+  if (!gst_buffer_pool_set_config (pool, config)) {
+    GST_DEBUG_OBJECT (ffmpegenc, "failed to configure the input pool");
+    gst_object_unref (pool);
+    return NULL;
+  }
+
+  GST_DEBUG_OBJECT (ffmpegenc, "proposing pool with padding r:%u b:%u, "
+      "stride_align %" G_GSIZE_FORMAT, align.padding_right,
+      align.padding_bottom, max_align);
+
+  return pool;
+}
 
 static gboolean
 gst_ffmpegvidenc_propose_allocation (GstVideoEncoder * encoder,
     GstQuery * query)
 {
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstBufferPool *pool;
+  GstVideoInfo info;
+  gboolean need_pool;
+  GstCaps *caps;
+
   gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+  gst_query_add_allocation_meta (query, GST_VIDEO_CROP_META_API_TYPE, NULL);
+
+  gst_query_parse_allocation (query, &caps, &need_pool);
+  if (need_pool && caps && gst_video_info_from_caps (&info, caps)) {
+    pool = gst_ffmpegvidenc_create_input_pool (ffmpegenc, caps, &info);
+    if (pool) {
+      gst_query_add_allocation_pool (query, pool, GST_VIDEO_INFO_SIZE (&info),
+          0, 0);
+      GST_OBJECT_LOCK (ffmpegenc);
+      gst_object_replace ((GstObject **) & ffmpegenc->input_pool,
+          (GstObject *) pool);
+      GST_OBJECT_UNLOCK (ffmpegenc);
+      gst_object_unref (pool);
+    }
+  }
 
   return GST_VIDEO_ENCODER_CLASS (parent_class)->propose_allocation (encoder,
       query);
 }
 
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+static gboolean
+gst_ffmpegvidenc_decide_allocation (GstVideoEncoder * encoder, GstQuery * query)
+{
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstFFMpegVidEncClass *oclass =
+      (GstFFMpegVidEncClass *) G_OBJECT_GET_CLASS (ffmpegenc);
+  GstBufferPool *pool = NULL, *old_pool;
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+  GstStructure *config;
+  GstVideoInfo *info;
+  GstCaps *caps;
+  guint size = 0, min = 0, max = 0, raw_size;
+
+  if (!GST_VIDEO_ENCODER_CLASS (parent_class)->decide_allocation (encoder,
+          query))
+    return FALSE;
+
+  if (!(oclass->in_plugin->capabilities & AV_CODEC_CAP_DR1)
+      || !ffmpegenc->input_state)
+    return TRUE;
+
+  gst_query_parse_allocation (query, &caps, NULL);
+
+  gst_allocation_params_init (&params);
+  if (gst_query_get_n_allocation_params (query) > 0)
+    gst_query_parse_nth_allocation_param (query, 0, &allocator, &params);
+
+  if (gst_query_get_n_allocation_pools (query) > 0)
+    gst_query_parse_nth_allocation_pool (query, 0, &pool, &size, &min, &max);
+
+  /* the raw frame size bounds packets but would let every small packet pin a
+   * frame sized buffer, so aim at twice the average packet instead. The odd
+   * bigger one, like a keyframe, gets allocated outside of the pool */
+  info = &ffmpegenc->input_state->info;
+  raw_size = GST_VIDEO_INFO_SIZE (info);
+  if (ffmpegenc->context->bit_rate > 0 && GST_VIDEO_INFO_FPS_N (info) > 0)
+    size = gst_util_uint64_scale (ffmpegenc->context->bit_rate / 8,
+        GST_VIDEO_INFO_FPS_D (info) * 2, GST_VIDEO_INFO_FPS_N (info));
+  else
+    size = raw_size / 8;
+  size = CLAMP (size, MIN (4096, raw_size), raw_size) +
+      AV_INPUT_BUFFER_PADDING_SIZE;
+
+  if (max == 0 || max > GST_FFMPEG_PACKET_POOL_MAX_BUFFERS)
+    max = GST_FFMPEG_PACKET_POOL_MAX_BUFFERS;
+  min = MIN (min, max);
+
+  if (pool && gst_buffer_pool_is_active (pool)) {
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
+  if (pool) {
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator (config, allocator, &params);
+    if (!gst_buffer_pool_set_config (pool, config)) {
+      GST_DEBUG_OBJECT (ffmpegenc, "downstream pool refused our config");
+      gst_object_unref (pool);
+      pool = NULL;
+    }
+  }
+
+  if (!pool) {
+    pool = gst_buffer_pool_new ();
+    config = gst_buffer_pool_get_config (pool);
+    gst_buffer_pool_config_set_params (config, caps, size, min, max);
+    gst_buffer_pool_config_set_allocator (config, allocator, &params);
+    gst_buffer_pool_set_config (pool, config);
+  }
+
+  if (!gst_buffer_pool_set_active (pool, TRUE)) {
+    GST_WARNING_OBJECT (ffmpegenc, "failed to activate output packet pool");
+    gst_object_unref (pool);
+    pool = NULL;
+  }
+
+  GST_DEBUG_OBJECT (ffmpegenc, "using packet pool %" GST_PTR_FORMAT
+      " with up to %u buffers of %u bytes", pool, max, size);
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  old_pool = ffmpegenc->packet_pool;
+  ffmpegenc->packet_pool = pool;
+  ffmpegenc->packet_pool_size = size;
+  ffmpegenc->packet_params = params;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (old_pool) {
+    gst_buffer_pool_set_active (old_pool, FALSE);
+    gst_object_unref (old_pool);
+  }
+
+  if (allocator)
+    gst_object_unref (allocator);
+
+  return TRUE;
+}
+
+/* May be called from libav's frame threads */
+static int
+gst_ffmpegvidenc_get_encode_buffer (AVCodecContext * context, AVPacket * pkt,
+    int flags)
+{
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) context->opaque;
+  GstAllocationParams params;
+  GstBufferPool *pool;
+  guint pool_size;
+  int res;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  pool = ffmpegenc->packet_pool ? gst_object_ref (ffmpegenc->packet_pool) :
+      NULL;
+  pool_size = ffmpegenc->packet_pool_size;
+  params = ffmpegenc->packet_params;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  res = gst_ffmpeg_avpacket_alloc_buffer (pkt, pool, pool_size, &params);
+
+  if (pool)
+    gst_object_unref (pool);
+
+  return res;
+}
+#endif
+
+static void
+gst_ffmpegvidenc_release_packet_pool (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstBufferPool *pool;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  pool = ffmpegenc->packet_pool;
+  ffmpegenc->packet_pool = NULL;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (pool) {
+    gst_buffer_pool_set_active (pool, FALSE);
+    gst_object_unref (pool);
+  }
+}
+
 static void
 gst_ffmpegvidenc_free_avpacket (gpointer pkt)
 {
@@ -477,6 +1518,171 @@ gst_ffmpegvidenc_free_avpacket (gpointer pkt)
   g_slice_free (AVPacket, pkt);
 }
 
+static GstBuffer *
+gst_ffmpegvidenc_wrap_avpacket (AVPacket * pkt)
+{
+  AVPacket *copy;
+
+  copy = g_slice_new (AVPacket);
+  av_packet_move_ref (copy, pkt);
+
+  return gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, copy->data,
+      copy->size, 0, copy->size, copy, gst_ffmpegvidenc_free_avpacket);
+}
+
+/* Turns the packet into an output buffer, leaving @pkt blank */
+static GstBuffer *
+gst_ffmpegvidenc_packet_to_buffer (GstFFMpegVidEnc * ffmpegenc, AVPacket * pkt)
+{
+#ifdef AV_GET_ENCODE_BUFFER_FLAG_REF
+  if (pkt->buf && ffmpegenc->context->get_encode_buffer ==
+      gst_ffmpegvidenc_get_encode_buffer)
+    return gst_ffmpeg_avpacket_steal_buffer (pkt);
+#endif
+
+  return gst_ffmpegvidenc_wrap_avpacket (pkt);
+}
+
+typedef struct
+{
+  gint pict_type;
+  gboolean reference;
+  gint qp;
+  guint n_psnr;
+  gdouble psnr[4];
+} GstFFMpegVidEncPicture;
+
+/* PSNR of a plane of @pixels samples of @depth bits with the sum of squared
+ * errors @error */
+static gdouble
+gst_ffmpegvidenc_psnr (guint64 error, gint64 pixels, gint depth)
+{
+  gdouble peak = (1 << depth) - 1;
+
+  if (error == 0)
+    return 99.99;
+
+  return 10.0 * log10 (peak * peak * pixels / error);
+}
+
+/* Works out what kind of picture an encoded packet holds. The picture type,
+ * quantizer and plane errors come from the quality stats side data, which
+ * most encoders attach. Without AV_PKT_FLAG_DISPOSABLE, B-frames are only
+ * known to be unreferenced for codecs that can't predict from them. */
+static void
+gst_ffmpegvidenc_describe_packet (AVCodecContext * context, AVPacket * pkt,
+    GstFFMpegVidEncPicture * pic)
+{
+  guint8 *stats;
+#if LIBAVCODEC_VERSION_MAJOR >= 59
+  size_t size = 0;
+#else
+  gint size = 0;
+#endif
+
+  pic->pict_type = AV_PICTURE_TYPE_NONE;
+  pic->reference = TRUE;
+  pic->qp = -1;
+  pic->n_psnr = 0;
+
+  stats = av_packet_get_side_data (pkt, AV_PKT_DATA_QUALITY_STATS, &size);
+  if (stats && size >= 6) {
+    guint i, n_errors = MIN (stats[5], G_N_ELEMENTS (pic->psnr));
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get (context->pix_fmt);
+    gint h_shift = 0, v_shift = 0;
+    gint depth = desc ? desc->comp[0].depth : 8;
+
+    pic->qp = (gint) GST_READ_UINT32_LE (stats) / FF_QP2LAMBDA;
+    pic->pict_type = stats[4];
+
+    av_pix_fmt_get_chroma_sub_sample (context->pix_fmt, &h_shift, &v_shift);
+    for (i = 0; i < n_errors && size >= 8 + 8 * (i + 1); i++) {
+      gint64 pixels = (gint64) context->width * context->height;
+
+      if (i == 1 || i == 2)
+        pixels = (gint64) AV_CEIL_RSHIFT (context->width, h_shift) *
+            AV_CEIL_RSHIFT (context->height, v_shift);
+      pic->psnr[i] =
+          gst_ffmpegvidenc_psnr (GST_READ_UINT64_LE (stats + 8 + 8 * i),
+          pixels, depth);
+    }
+    /* the errors are only filled in when the encoder computes them */
+    if (context->flags & AV_CODEC_FLAG_PSNR)
+      pic->n_psnr = i;
+  } else if (pkt->flags & AV_PKT_FLAG_KEY) {
+    pic->pict_type = AV_PICTURE_TYPE_I;
+  }
+
+#ifdef AV_PKT_FLAG_DISPOSABLE
+  if (pkt->flags & AV_PKT_FLAG_DISPOSABLE)
+    pic->reference = FALSE;
+#endif
+
+  if (pic->pict_type == AV_PICTURE_TYPE_B) {
+    switch (context->codec_id) {
+      case AV_CODEC_ID_MPEG1VIDEO:
+      case AV_CODEC_ID_MPEG2VIDEO:
+      case AV_CODEC_ID_MPEG4:
+        pic->reference = FALSE;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+/* Unreferenced pictures can be dropped without breaking the stream and
+ * form the upper temporal layer */
+static void
+gst_ffmpegvidenc_tag_buffer (GstBuffer * outbuf, GstFFMpegVidEncPicture * pic)
+{
+  GstFFMpegEncMeta *meta;
+
+  if (!pic->reference)
+    GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DROPPABLE);
+
+  meta = gst_buffer_add_ffmpeg_enc_meta (outbuf, pic->pict_type,
+      pic->reference, pic->reference ? 0 : 1);
+  meta->qp = pic->qp;
+  meta->n_psnr = pic->n_psnr;
+  memcpy (meta->psnr, pic->psnr, sizeof (pic->psnr));
+}
+
+/* Adds an output picture to the window the rolling statistics are computed
+ * over */
+static void
+gst_ffmpegvidenc_quality_record (GstFFMpegVidEnc * ffmpegenc,
+    GstBuffer * outbuf, GstVideoCodecFrame * frame, gboolean key)
+{
+  GstFFMpegEncMeta *meta = gst_buffer_get_ffmpeg_enc_meta (outbuf);
+  GstFFMpegVidEncSample *sample;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  sample = &ffmpegenc->quality[ffmpegenc->quality_pos];
+  sample->size = gst_buffer_get_size (outbuf);
+  sample->qp = meta ? meta->qp : -1;
+  sample->key = key;
+  sample->duration = frame->duration;
+  ffmpegenc->quality_pos =
+      (ffmpegenc->quality_pos + 1) % GST_FFMPEGVIDENC_QUALITY_WINDOW;
+  if (ffmpegenc->quality_count < GST_FFMPEGVIDENC_QUALITY_WINDOW)
+    ffmpegenc->quality_count++;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
+/* Folds the time it took to encode a frame into the running average */
+static void
+gst_ffmpegvidenc_quality_encode_time (GstFFMpegVidEnc * ffmpegenc,
+    GstClockTime elapsed)
+{
+  GST_OBJECT_LOCK (ffmpegenc);
+  if (ffmpegenc->encode_time == 0)
+    ffmpegenc->encode_time = elapsed;
+  else
+    ffmpegenc->encode_time = (7 * ffmpegenc->encode_time + elapsed) / 8;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
 typedef struct
 {
   GstBuffer *buffer;
@@ -518,23 +1724,101 @@ stereo_gst_to_av (GstVideoMultiviewMode mview_mode)
   return AV_STEREO3D_2D;
 }
 
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT (56, 25, 100)
+/* Passes the regions of interest of @buffer on to encoders honouring
+ * AV_FRAME_DATA_REGIONS_OF_INTEREST, relative to the encoded region that
+ * starts at @x,@y */
+static void
+gst_ffmpegvidenc_add_roi (GstFFMpegVidEnc * ffmpegenc, AVFrame * picture,
+    GstBuffer * buffer, gint x, gint y, gint width, gint height)
+{
+  GstFFMpegRoi *rois;
+  AVFrameSideData *sd;
+  AVRegionOfInterest *regions;
+  guint n_rois, i;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  n_rois = gst_ffmpeg_roi_from_buffer (buffer, x, y, width, height,
+      ffmpegenc->roi_quality_offset, ffmpegenc->roi_type_offsets, &rois);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (n_rois == 0)
+    return;
+
+  /* libav takes the side data size as the number of regions */
+  sd = av_frame_new_side_data (picture, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+      n_rois * sizeof (AVRegionOfInterest));
+  if (!sd) {
+    g_free (rois);
+    return;
+  }
+  regions = (AVRegionOfInterest *) sd->data;
+
+  for (i = 0; i < n_rois; i++) {
+    regions[i].self_size = sizeof (AVRegionOfInterest);
+    regions[i].left = rois[i].left;
+    regions[i].top = rois[i].top;
+    regions[i].right = rois[i].right;
+    regions[i].bottom = rois[i].bottom;
+    regions[i].qoffset = av_d2q (rois[i].qoffset, 100);
+  }
+  g_free (rois);
+
+  GST_LOG_OBJECT (ffmpegenc, "passing %u regions of interest", n_rois);
+}
+#endif
+
+/* Gets the region of @info that @crop selects, with the origin rounded down
+ * to the chroma subsampling so that all planes start on the same sample.
+ * Returns FALSE if there is no crop or it doesn't fit in the frame. */
+static gboolean
+gst_ffmpegvidenc_crop_region (GstVideoInfo * info, GstVideoCropMeta * crop,
+    guint * x, guint * y)
+{
+  const GstVideoFormatInfo *finfo = info->finfo;
+  guint w_sub = 0, h_sub = 0;
+  guint c;
+
+  if (!crop || (crop->width == GST_VIDEO_INFO_WIDTH (info) &&
+          crop->height == GST_VIDEO_INFO_HEIGHT (info)))
+    return FALSE;
+
+  for (c = 0; c < GST_VIDEO_FORMAT_INFO_N_COMPONENTS (finfo); c++) {
+    w_sub = MAX (w_sub, GST_VIDEO_FORMAT_INFO_W_SUB (finfo, c));
+    h_sub = MAX (h_sub, GST_VIDEO_FORMAT_INFO_H_SUB (finfo, c));
+  }
+
+  *x = crop->x & ~((1 << w_sub) - 1);
+  *y = crop->y & ~((1 << h_sub) - 1);
+
+  return *x + crop->width <= GST_VIDEO_INFO_WIDTH (info) &&
+      *y + crop->height <= GST_VIDEO_INFO_HEIGHT (info);
+}
+
+/* Sends @frame to @context, adding the time spent in the codec to @elapsed
+ * if not NULL */
 static GstFlowReturn
-gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc,
-    GstVideoCodecFrame * frame)
+gst_ffmpegvidenc_send_picture (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context, AVFrame * picture, GstVideoCodecFrame * frame,
+    GstClockTime * elapsed)
 {
   GstVideoInfo *info = &ffmpegenc->input_state->info;
   BufferInfo *buffer_info;
+  GstVideoCropMeta *crop;
+  gboolean unaligned = FALSE;
+  gint width, height;
+  guint crop_x = 0, crop_y = 0;
   guint c;
   gint res;
   GstFlowReturn ret = GST_FLOW_ERROR;
-  AVFrame *picture = NULL;
+  gint64 start;
 
-  if (!frame)
+  if (!frame) {
+    picture = NULL;
     goto send_frame;
+  }
 
-  picture = ffmpegenc->picture;
-
-  if (ffmpegenc->context->flags & (AV_CODEC_FLAG_INTERLACED_DCT |
+  if (context->flags & (AV_CODEC_FLAG_INTERLACED_DCT |
           AV_CODEC_FLAG_INTERLACED_ME)) {
     picture->interlaced_frame = TRUE;
     /* if this is not the case, a filter element should be used to swap fields */
@@ -556,6 +1840,11 @@ gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc,
   if (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame))
     picture->pict_type = AV_PICTURE_TYPE_I;
 
+  /* the quantizer may change at any time */
+  if (context->flags & AV_CODEC_FLAG_QSCALE)
+    context->global_quality = picture->quality =
+        FF_QP2LAMBDA * ffmpegenc->quantizer;
+
   buffer_info = g_slice_new0 (BufferInfo);
   buffer_info->buffer = gst_buffer_ref (frame->input_buffer);
 
@@ -564,10 +1853,28 @@ gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc,
     GST_ERROR_OBJECT (ffmpegenc, "Failed to map input buffer");
     gst_buffer_unref (buffer_info->buffer);
     g_slice_free (BufferInfo, buffer_info);
-    gst_video_codec_frame_unref (frame);
     goto done;
   }
 
+  width = GST_VIDEO_FRAME_WIDTH (&buffer_info->vframe);
+  height = GST_VIDEO_FRAME_HEIGHT (&buffer_info->vframe);
+
+  /* encode the cropped region in place if the context was set up for it */
+  crop = gst_buffer_get_video_crop_meta (frame->input_buffer);
+  if (gst_ffmpegvidenc_crop_region (info, crop, &crop_x, &crop_y) &&
+      crop->width == context->width && crop->height == context->height) {
+    if (crop_x != crop->x || crop_y != crop->y)
+      GST_LOG_OBJECT (ffmpegenc, "crop origin %u,%u rounded to %u,%u",
+          crop->x, crop->y, crop_x, crop_y);
+    width = crop->width;
+    height = crop->height;
+  } else {
+    if (crop && (crop->width != width || crop->height != height))
+      GST_WARNING_OBJECT (ffmpegenc, "ignoring crop %ux%u+%u+%u",
+          crop->width, crop->height, crop->x, crop->y);
+    crop = NULL;
+  }
+
   /* Fill avpicture */
   picture->buf[0] =
       av_buffer_create (NULL, 0, buffer_info_free, buffer_info, 0);
@@ -576,22 +1883,54 @@ gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc,
       picture->data[c] = GST_VIDEO_FRAME_PLANE_DATA (&buffer_info->vframe, c);
       picture->linesize[c] =
           GST_VIDEO_FRAME_COMP_STRIDE (&buffer_info->vframe, c);
+      if (crop && c < GST_VIDEO_INFO_N_PLANES (info)) {
+        const GstVideoFormatInfo *finfo = info->finfo;
+
+        picture->data[c] +=
+            GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT (finfo, c, crop_y) *
+            picture->linesize[c] +
+            GST_VIDEO_FORMAT_INFO_SCALE_WIDTH (finfo, c, crop_x) *
+            GST_VIDEO_FRAME_COMP_PSTRIDE (&buffer_info->vframe, c);
+      }
+      if (((guintptr) picture->data[c] | picture->linesize[c]) &
+          ffmpegenc->input_align)
+        unaligned = TRUE;
     } else {
       picture->data[c] = NULL;
       picture->linesize[c] = 0;
     }
   }
 
-  picture->format = ffmpegenc->context->pix_fmt;
-  picture->width = GST_VIDEO_FRAME_WIDTH (&buffer_info->vframe);
-  picture->height = GST_VIDEO_FRAME_HEIGHT (&buffer_info->vframe);
+  if (unaligned)
+    GST_CAT_LOG_OBJECT (GST_CAT_PERFORMANCE, ffmpegenc,
+        "input frame not aligned, libav may have to copy it");
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  if (unaligned)
+    ffmpegenc->frames_unaligned++;
+  if (frame->input_buffer->pool &&
+      frame->input_buffer->pool == ffmpegenc->input_pool)
+    ffmpegenc->frames_pooled++;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  picture->format = context->pix_fmt;
+  picture->width = width;
+  picture->height = height;
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT (56, 25, 100)
+  gst_ffmpegvidenc_add_roi (ffmpegenc, picture, frame->input_buffer,
+      crop_x, crop_y, width, height);
+#endif
 
   picture->pts =
       gst_ffmpeg_time_gst_to_ff (frame->pts /
-      ffmpegenc->context->ticks_per_frame, ffmpegenc->context->time_base);
+      context->ticks_per_frame, context->time_base);
 
 send_frame:
-  res = avcodec_send_frame (ffmpegenc->context, picture);
+  start = g_get_monotonic_time ();
+  res = avcodec_send_frame (context, picture);
+  if (elapsed)
+    *elapsed += (g_get_monotonic_time () - start) * GST_USECOND;
 
   if (picture)
     av_frame_unref (picture);
@@ -605,31 +1944,55 @@ done:
   return ret;
 }
 
+static GstFlowReturn
+gst_ffmpegvidenc_send_frame (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, GstClockTime * elapsed)
+{
+  return gst_ffmpegvidenc_send_picture (ffmpegenc, ffmpegenc->context,
+      ffmpegenc->picture, frame, elapsed);
+}
+
+/* The encoding thread only takes the stream lock here, so that upstream
+ * keeps queueing frames while it encodes */
+static GstFlowReturn
+gst_ffmpegvidenc_finish_frame (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstFlowReturn ret;
+
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+  ret = gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+
+  return ret;
+}
+
+/* Receives a packet and finishes its frame, adding the time spent in the
+ * codec to @elapsed if not NULL */
 static GstFlowReturn
 gst_ffmpegvidenc_receive_packet (GstFFMpegVidEnc * ffmpegenc,
-    gboolean * got_packet, gboolean send)
+    gboolean * got_packet, gboolean send, GstClockTime * elapsed)
 {
-  AVPacket *pkt;
+  AVPacket *pkt = ffmpegenc->pkt;
   GstBuffer *outbuf;
   GstVideoCodecFrame *frame;
   gint res;
   GstFlowReturn ret = GST_FLOW_OK;
+  gint64 start;
 
   *got_packet = FALSE;
 
-  pkt = g_slice_new0 (AVPacket);
-
+  start = g_get_monotonic_time ();
   res = avcodec_receive_packet (ffmpegenc->context, pkt);
+  if (elapsed)
+    *elapsed += (g_get_monotonic_time () - start) * GST_USECOND;
 
   if (res == AVERROR (EAGAIN)) {
-    g_slice_free (AVPacket, pkt);
     goto done;
   } else if (res == AVERROR_EOF) {
-    g_slice_free (AVPacket, pkt);
     ret = GST_FLOW_EOS;
     goto done;
   } else if (res < 0) {
-    g_slice_free (AVPacket, pkt);
     res = GST_FLOW_ERROR;
     goto done;
   }
@@ -647,62 +2010,1338 @@ gst_ffmpegvidenc_receive_packet (GstFFMpegVidEnc * ffmpegenc,
   frame = gst_video_encoder_get_oldest_frame (GST_VIDEO_ENCODER (ffmpegenc));
 
   if (send) {
-    outbuf =
-        gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, pkt->data,
-        pkt->size, 0, pkt->size, pkt, gst_ffmpegvidenc_free_avpacket);
-    frame->output_buffer = outbuf;
+    GstFFMpegVidEncPicture pic;
+    gboolean key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
 
-    if (pkt->flags & AV_PKT_FLAG_KEY)
+    if (key)
       GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
     else
       GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
+
+    gst_ffmpegvidenc_describe_packet (ffmpegenc->context, pkt, &pic);
+    outbuf = gst_ffmpegvidenc_packet_to_buffer (ffmpegenc, pkt);
+    gst_ffmpegvidenc_tag_buffer (outbuf, &pic);
+    gst_ffmpegvidenc_quality_record (ffmpegenc, outbuf, frame, key);
+    frame->output_buffer = outbuf;
   } else {
-    gst_ffmpegvidenc_free_avpacket (pkt);
+    av_packet_unref (pkt);
   }
 
-  ret = gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+  ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
 
 done:
   return ret;
 }
 
-static GstFlowReturn
-gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
+/* Whether the encoder produces a keyframe for @frame on its own */
+static gboolean
+gst_ffmpegvidenc_keyframe_due (GstFFMpegVidEnc * ffmpegenc,
     GstVideoCodecFrame * frame)
 {
-  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
-  GstFlowReturn ret;
-  gboolean got_packet;
+  gint gop_size = ffmpegenc->context->gop_size;
 
-  ret = gst_ffmpegvidenc_send_frame (ffmpegenc, frame);
+  return GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame)
+      || ffmpegenc->gop_position == 0 || gop_size <= 1
+      || ffmpegenc->gop_position >= gop_size;
+}
 
-  if (ret != GST_FLOW_OK)
-    goto encode_fail;
+/* Keyframe storms (e.g. PLIs from many receivers) are coalesced: requests
+ * shortly after a keyframe are merged into it, and keyframes are forced at
+ * most once per min-force-key-unit-interval, requests in between being
+ * deferred to the end of the interval. */
+static void
+gst_ffmpegvidenc_filter_force_keyframe (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  gboolean requested = GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame);
+  GstClockTime elapsed;
 
-  gst_video_codec_frame_unref (frame);
+  GST_VIDEO_CODEC_FRAME_UNSET_FORCE_KEYFRAME (frame);
 
-  do {
-    ret = gst_ffmpegvidenc_receive_packet (ffmpegenc, &got_packet, TRUE);
-    if (ret != GST_FLOW_OK)
-      break;
-  } while (got_packet);
+  GST_OBJECT_LOCK (ffmpegenc);
 
-done:
-  return ret;
+  if (requested)
+    ffmpegenc->keyframe_requests++;
 
-  /* We choose to be error-resilient */
-encode_fail:
-  {
-#ifndef GST_DISABLE_GST_DEBUG
-    GstFFMpegVidEncClass *oclass =
-        (GstFFMpegVidEncClass *) (G_OBJECT_GET_CLASS (ffmpegenc));
-    GST_ERROR_OBJECT (ffmpegenc,
+  if (!GST_CLOCK_TIME_IS_VALID (frame->pts)
+      || !GST_CLOCK_TIME_IS_VALID (ffmpegenc->last_keyframe_ts)
+      || frame->pts < ffmpegenc->last_keyframe_ts)
+    elapsed = GST_CLOCK_TIME_NONE;
+  else
+    elapsed = frame->pts - ffmpegenc->last_keyframe_ts;
+
+  if (!requested && !ffmpegenc->keyframe_pending)
+    goto done;
+
+  if (gst_ffmpegvidenc_keyframe_due (ffmpegenc, frame)) {
+    /* the encoder makes one anyway */
+    if (requested)
+      ffmpegenc->keyframe_requests_merged++;
+    ffmpegenc->keyframe_pending = FALSE;
+  } else if (!GST_CLOCK_TIME_IS_VALID (elapsed)) {
+    GST_VIDEO_CODEC_FRAME_SET_FORCE_KEYFRAME (frame);
+    ffmpegenc->keyframe_pending = FALSE;
+  } else if (requested && elapsed < ffmpegenc->force_key_unit_window) {
+    GST_LOG_OBJECT (ffmpegenc, "merging keyframe request, last keyframe %"
+        GST_TIME_FORMAT " ago", GST_TIME_ARGS (elapsed));
+    ffmpegenc->keyframe_requests_merged++;
+  } else if (elapsed < ffmpegenc->min_force_key_unit_interval) {
+    if (requested) {
+      if (ffmpegenc->keyframe_pending) {
+        ffmpegenc->keyframe_requests_merged++;
+      } else {
+        GST_LOG_OBJECT (ffmpegenc, "deferring keyframe request, last keyframe "
+            "%" GST_TIME_FORMAT " ago", GST_TIME_ARGS (elapsed));
+        ffmpegenc->keyframe_requests_deferred++;
+      }
+    }
+    ffmpegenc->keyframe_pending = TRUE;
+  } else {
+    GST_VIDEO_CODEC_FRAME_SET_FORCE_KEYFRAME (frame);
+    ffmpegenc->keyframe_pending = FALSE;
+  }
+
+done:
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
+/* Applies the settings changed while encoding. Options the codec accepts at
+ * runtime go straight to the open context, anything else reopens the codec,
+ * but only once a keyframe is due so that the switch costs nothing extra.
+ * That includes the bitrate: the libavcodec encoders registered here copy
+ * bit_rate into their rate control when opened and never look at it again
+ * (the ones that do re-read it, x264 and nvenc, are not exposed). */
+static gboolean
+gst_ffmpegvidenc_reconfigure (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoCodecState *state;
+  GList *params, *l;
+  gboolean reopen, res;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  params = ffmpegenc->pending_params;
+  ffmpegenc->pending_params = NULL;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  for (l = params; l; l = l->next) {
+    GParamSpec *pspec = l->data;
+    GValue value = G_VALUE_INIT;
+
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+    g_object_get_property (G_OBJECT (ffmpegenc), pspec->name, &value);
+    if (gst_ffmpeg_cfg_set_property (ffmpegenc->context, &value, pspec)) {
+      GST_DEBUG_OBJECT (ffmpegenc, "applied %s at runtime", pspec->name);
+    } else {
+      GST_DEBUG_OBJECT (ffmpegenc, "failed to apply %s at runtime",
+          pspec->name);
+      GST_OBJECT_LOCK (ffmpegenc);
+      ffmpegenc->reopen_pending = TRUE;
+      GST_OBJECT_UNLOCK (ffmpegenc);
+    }
+    g_value_unset (&value);
+  }
+  g_list_free (params);
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  reopen = ffmpegenc->reopen_pending;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!reopen || !gst_ffmpegvidenc_keyframe_due (ffmpegenc, frame))
+    return TRUE;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "reopening codec with new settings");
+
+  gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+
+  /* negotiating the new output state needs the stream lock */
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+  state = gst_video_codec_state_ref (ffmpegenc->input_state);
+  res = gst_ffmpegvidenc_configure (ffmpegenc, state);
+  gst_video_codec_state_unref (state);
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+
+  return res;
+}
+
+static GstClockTime
+gst_ffmpegvidenc_frame_interval (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoInfo *info = &ffmpegenc->input_state->info;
+
+  if (GST_CLOCK_TIME_IS_VALID (frame->duration) && frame->duration > 0)
+    return frame->duration;
+
+  if (info->fps_n > 0 && info->fps_d > 0)
+    return gst_util_uint64_scale (GST_SECOND, info->fps_d, info->fps_n);
+
+  return GST_CLOCK_TIME_NONE;
+}
+
+/* Updates the encoding load with a frame that took @elapsed to encode and
+ * steps the overload level up or down when needed */
+static void
+gst_ffmpegvidenc_overload_update (GstFFMpegVidEnc * ffmpegenc,
+    GstClockTime interval, GstClockTime elapsed)
+{
+  guint old_level = ffmpegenc->overload_level;
+  guint level = old_level;
+  gdouble load;
+
+  load = (gdouble) elapsed / interval;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->overload_load = (7 * ffmpegenc->overload_load + load) / 8;
+  load = ffmpegenc->overload_load;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (++ffmpegenc->overload_hold < OVERLOAD_HOLD_FRAMES)
+    return;
+
+  if (load > OVERLOAD_HIGH_LOAD && level < OVERLOAD_DROP_LEVEL)
+    level++;
+  else if (load < OVERLOAD_LOW_LOAD && level > 0)
+    level--;
+  else
+    return;
+
+  GST_INFO_OBJECT (ffmpegenc, "encoding load %.2f, overload level %u -> %u",
+      load, old_level, level);
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->overload_level = level;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+  ffmpegenc->overload_hold = 0;
+  ffmpegenc->overload_credit = 0;
+
+  /* the options only take effect when the codec gets reopened, on the next
+   * keyframe like other settings that can't change at runtime */
+  if (MIN (old_level, level) < OVERLOAD_DROP_LEVEL - 1) {
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->reopen_pending = TRUE;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+  }
+
+  gst_element_post_message (GST_ELEMENT_CAST (ffmpegenc),
+      gst_message_new_element (GST_OBJECT_CAST (ffmpegenc),
+          gst_structure_new (GST_FFENC_OVERLOAD_MESSAGE,
+              "level", G_TYPE_UINT, level,
+              "load", G_TYPE_DOUBLE, load,
+              "dropping", G_TYPE_BOOLEAN, level == OVERLOAD_DROP_LEVEL,
+              NULL)));
+}
+
+/* At the drop level, only encode as many frames as the time spent on each
+ * allows, based on the average encoding load */
+static gboolean
+gst_ffmpegvidenc_overload_drop (GstFFMpegVidEnc * ffmpegenc,
+    GstClockTime interval)
+{
+  GstClockTime cost;
+
+  if (ffmpegenc->overload_level < OVERLOAD_DROP_LEVEL)
+    return FALSE;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  cost = ffmpegenc->overload_load * interval;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  ffmpegenc->overload_credit =
+      MIN (ffmpegenc->overload_credit + interval, 2 * MAX (cost, interval));
+  if (ffmpegenc->overload_credit < cost)
+    return TRUE;
+
+  ffmpegenc->overload_credit -= cost;
+  return FALSE;
+}
+
+/* Hashes the visible part of each plane of @frame into @hashes */
+static void
+gst_ffmpegvidenc_frame_hash (GstVideoFrame * frame,
+    guint64 hashes[GST_VIDEO_MAX_PLANES])
+{
+  guint done_planes = 0;
+  guint c, row;
+
+  memset (hashes, 0, GST_VIDEO_MAX_PLANES * sizeof (guint64));
+
+  for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (frame); c++) {
+    guint plane = GST_VIDEO_FRAME_COMP_PLANE (frame, c);
+    guint64 hash = G_GUINT64_CONSTANT (0xcbf29ce484222325);
+    gsize row_size, i;
+    guint8 *data;
+
+    /* components sharing a plane are hashed together */
+    if (done_planes & (1 << plane))
+      continue;
+    done_planes |= 1 << plane;
+
+    row_size = GST_VIDEO_FRAME_COMP_WIDTH (frame, c) *
+        GST_VIDEO_FRAME_COMP_PSTRIDE (frame, c);
+    if (row_size == 0)
+      row_size = GST_VIDEO_FRAME_PLANE_STRIDE (frame, plane);
+
+    data = GST_VIDEO_FRAME_PLANE_DATA (frame, plane);
+    for (row = 0; row < GST_VIDEO_FRAME_COMP_HEIGHT (frame, c); row++) {
+      for (i = 0; i + 8 <= row_size; i += 8) {
+        guint64 word;
+
+        memcpy (&word, data + i, 8);
+        hash = (hash ^ word) * G_GUINT64_CONSTANT (0x100000001b3);
+        hash ^= hash >> 29;
+      }
+      for (; i < row_size; i++)
+        hash = (hash ^ data[i]) * G_GUINT64_CONSTANT (0x100000001b3);
+      data += GST_VIDEO_FRAME_PLANE_STRIDE (frame, plane);
+    }
+    hashes[plane] = hash;
+  }
+}
+
+/* Hashes the input of @frame, returns FALSE if it can't be mapped */
+static gboolean
+gst_ffmpegvidenc_input_hash (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, guint64 hashes[GST_VIDEO_MAX_PLANES])
+{
+  GstVideoFrame vframe;
+
+  if (!gst_video_frame_map (&vframe, &ffmpegenc->input_state->info,
+          frame->input_buffer, GST_MAP_READ))
+    return FALSE;
+
+  gst_ffmpegvidenc_frame_hash (&vframe, hashes);
+  gst_video_frame_unmap (&vframe);
+
+  return TRUE;
+}
+
+/* Whether @frame is identical to the last encoded one and can be skipped.
+ * Sets @hashed and fills @hashes if the input was hashed on the way. */
+static gboolean
+gst_ffmpegvidenc_static_skip (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, guint64 hashes[GST_VIDEO_MAX_PLANES],
+    gboolean * hashed)
+{
+  GstClockTime max_skip_interval;
+  gboolean skip_static;
+  gboolean equal;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  skip_static = ffmpegenc->skip_static;
+  max_skip_interval = ffmpegenc->max_skip_interval;
+  if (skip_static)
+    ffmpegenc->frames_static_checked++;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!skip_static || !ffmpegenc->last_input_valid)
+    return FALSE;
+
+  /* encode once in a while anyway, to keep receivers alive */
+  if (max_skip_interval > 0 && GST_CLOCK_TIME_IS_VALID (frame->pts)
+      && GST_CLOCK_TIME_IS_VALID (ffmpegenc->last_input_ts)
+      && frame->pts >= ffmpegenc->last_input_ts + max_skip_interval)
+    return FALSE;
+
+  *hashed = gst_ffmpegvidenc_input_hash (ffmpegenc, frame, hashes);
+  if (!*hashed)
+    return FALSE;
+
+  equal = memcmp (hashes, ffmpegenc->last_input_hash,
+      sizeof (ffmpegenc->last_input_hash)) == 0;
+
+  if (equal) {
+    GST_LOG_OBJECT (ffmpegenc, "skipping static frame %u",
+        frame->system_frame_number);
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->frames_static_skipped++;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+  }
+
+  return equal;
+}
+
+/* Returns whether to encode @frame, resuming on a keyframe request when
+ * inactive. Sets @resume when the frame must be an immediate keyframe. */
+static gboolean
+gst_ffmpegvidenc_check_active (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame, gboolean * resume)
+{
+  gboolean active, notify = FALSE;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  if (!ffmpegenc->active && GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame)) {
+    GST_INFO_OBJECT (ffmpegenc, "keyframe requested, resuming");
+    ffmpegenc->active = TRUE;
+    ffmpegenc->resume_pending = TRUE;
+    notify = TRUE;
+  }
+  active = ffmpegenc->active;
+  *resume = active && ffmpegenc->resume_pending;
+  if (active) {
+    ffmpegenc->resume_pending = FALSE;
+    if (*resume)
+      ffmpegenc->keyframe_requests++;
+  }
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (notify)
+    g_object_notify (G_OBJECT (ffmpegenc), "active");
+
+  return active;
+}
+
+/* Reopens the codec at the size of the input crop when it changes */
+static gboolean
+gst_ffmpegvidenc_check_crop (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoInfo *info = &ffmpegenc->input_state->info;
+  GstVideoCodecState *state;
+  GstVideoCropMeta *crop;
+  gint width = 0, height = 0;
+  guint x, y;
+  gboolean res;
+
+  /* crops that don't fit once aligned are ignored when encoding */
+  crop = gst_buffer_get_video_crop_meta (frame->input_buffer);
+  if (gst_ffmpegvidenc_crop_region (info, crop, &x, &y)) {
+    width = crop->width;
+    height = crop->height;
+  }
+
+  if (width == ffmpegenc->crop_width && height == ffmpegenc->crop_height)
+    return TRUE;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "input crop changed to %dx%d, reopening codec",
+      width, height);
+
+  gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+
+  ffmpegenc->crop_width = width;
+  ffmpegenc->crop_height = height;
+
+  /* negotiating the new output state needs the stream lock */
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+  state = gst_video_codec_state_ref (ffmpegenc->input_state);
+  res = gst_ffmpegvidenc_configure (ffmpegenc, state);
+  gst_video_codec_state_unref (state);
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+
+  return res;
+}
+
+/* Encodes @frame and finishes the frames the codec has output meanwhile,
+ * runs in the encoding thread in asynchronous mode. Called with the codec
+ * lock. */
+static GstFlowReturn
+gst_ffmpegvidenc_encode_frame (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstClockTime interval = GST_CLOCK_TIME_NONE;
+  GstClockTime elapsed = 0;
+  GstFlowReturn ret;
+  guint64 hashes[GST_VIDEO_MAX_PLANES];
+  gboolean hashed = FALSE;
+  gboolean skip_static;
+  gboolean got_packet;
+  gboolean keyframe;
+  gboolean resume;
+
+  if (!gst_ffmpegvidenc_check_active (ffmpegenc, frame, &resume))
+    goto inactive;
+
+  if (resume) {
+    /* immediately, regardless of the keyframe rate limiting */
+    GST_DEBUG_OBJECT (ffmpegenc, "resuming with a keyframe");
+    GST_VIDEO_CODEC_FRAME_SET_FORCE_KEYFRAME (frame);
+    ffmpegenc->keyframe_pending = FALSE;
+    ffmpegenc->inactive_drained = FALSE;
+  } else {
+    gst_ffmpegvidenc_filter_force_keyframe (ffmpegenc, frame);
+  }
+
+  if (!gst_ffmpegvidenc_check_crop (ffmpegenc, frame))
+    goto reconfigure_fail;
+
+  if (!gst_ffmpegvidenc_reconfigure (ffmpegenc, frame))
+    goto reconfigure_fail;
+
+  keyframe = gst_ffmpegvidenc_keyframe_due (ffmpegenc, frame);
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  if (ffmpegenc->overload_adaptation)
+    interval = gst_ffmpegvidenc_frame_interval (ffmpegenc, frame);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!keyframe && gst_ffmpegvidenc_static_skip (ffmpegenc, frame, hashes,
+          &hashed))
+    goto static_skip;
+
+  if (GST_CLOCK_TIME_IS_VALID (interval)) {
+    /* keyframes are never dropped, they may have been requested */
+    if (!keyframe && gst_ffmpegvidenc_overload_drop (ffmpegenc, interval))
+      goto overload_drop;
+  }
+  if (keyframe)
+    ffmpegenc->last_keyframe_ts = frame->pts;
+
+  /* only the time spent in the codec counts, not pushing the output */
+  ret = gst_ffmpegvidenc_send_frame (ffmpegenc, frame, &elapsed);
+
+  if (ret != GST_FLOW_OK)
+    goto encode_fail;
+
+  ffmpegenc->gop_position = keyframe ? 1 : ffmpegenc->gop_position + 1;
+
+  /* reference for detecting static frames */
+  GST_OBJECT_LOCK (ffmpegenc);
+  skip_static = ffmpegenc->skip_static;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+  if (skip_static && !hashed)
+    hashed = gst_ffmpegvidenc_input_hash (ffmpegenc, frame, hashes);
+  if (skip_static && hashed) {
+    memcpy (ffmpegenc->last_input_hash, hashes,
+        sizeof (ffmpegenc->last_input_hash));
+    ffmpegenc->last_input_valid = TRUE;
+    ffmpegenc->last_input_ts = frame->pts;
+  } else {
+    ffmpegenc->last_input_valid = FALSE;
+  }
+
+  gst_video_codec_frame_unref (frame);
+
+  do {
+    ret = gst_ffmpegvidenc_receive_packet (ffmpegenc, &got_packet, TRUE,
+        &elapsed);
+    if (ret != GST_FLOW_OK)
+      break;
+  } while (got_packet);
+
+  gst_ffmpegvidenc_quality_encode_time (ffmpegenc, elapsed);
+  if (GST_CLOCK_TIME_IS_VALID (interval))
+    gst_ffmpegvidenc_overload_update (ffmpegenc, interval, elapsed);
+
+done:
+  return ret;
+
+inactive:
+  {
+    if (!ffmpegenc->inactive_drained) {
+      /* push out what the codec still holds, it gets reopened on resume as
+       * it doesn't take input after draining */
+      GST_DEBUG_OBJECT (ffmpegenc, "inactive, draining encoder");
+      gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+      if (ffmpegenc->opened) {
+        GST_OBJECT_LOCK (ffmpegenc);
+        ffmpegenc->reopen_pending = TRUE;
+        GST_OBJECT_UNLOCK (ffmpegenc);
+      }
+      ffmpegenc->inactive_drained = TRUE;
+    }
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->frames_inactive_dropped++;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+    ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
+    goto done;
+  }
+static_skip:
+  {
+    ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
+    goto done;
+  }
+overload_drop:
+  {
+    GST_DEBUG_OBJECT (ffmpegenc, "overloaded, dropping frame %u",
+        frame->system_frame_number);
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->frames_dropped++;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+    ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
+    goto done;
+  }
+
+  /* We choose to be error-resilient */
+encode_fail:
+  {
+#ifndef GST_DISABLE_GST_DEBUG
+    GstFFMpegVidEncClass *oclass =
+        (GstFFMpegVidEncClass *) (G_OBJECT_GET_CLASS (ffmpegenc));
+    GST_ERROR_OBJECT (ffmpegenc,
         "avenc_%s: failed to encode buffer", oclass->in_plugin->name);
 #endif /* GST_DISABLE_GST_DEBUG */
     /* avoid frame (and ts etc) piling up */
-    ret = gst_video_encoder_finish_frame (encoder, frame);
+    ret = gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
     goto done;
   }
+reconfigure_fail:
+  {
+    GST_ELEMENT_ERROR (ffmpegenc, LIBRARY, SETTINGS, (NULL),
+        ("Failed to reopen the codec with the new settings"));
+    gst_ffmpegvidenc_finish_frame (ffmpegenc, frame);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+}
+
+static void
+gst_ffmpegvidenc_async_loop (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while (g_queue_is_empty (&ffmpegenc->async_queue)
+      && !ffmpegenc->async_flushing)
+    g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+
+  if (ffmpegenc->async_flushing) {
+    g_mutex_unlock (&ffmpegenc->async_lock);
+    return;
+  }
+
+  frame = g_queue_pop_head (&ffmpegenc->async_queue);
+  g_atomic_int_set (&ffmpegenc->async_depth,
+      g_queue_get_length (&ffmpegenc->async_queue));
+  ffmpegenc->async_busy = TRUE;
+  g_cond_broadcast (&ffmpegenc->async_cond);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  /* set_format and flush drain the queue before touching the codec, the
+   * stream lock is only taken to finish frames */
+  g_mutex_lock (&ffmpegenc->codec_lock);
+  ret = gst_ffmpegvidenc_encode_frame (ffmpegenc, frame);
+  g_mutex_unlock (&ffmpegenc->codec_lock);
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  ffmpegenc->async_busy = FALSE;
+  if (ret != GST_FLOW_OK) {
+    GST_DEBUG_OBJECT (ffmpegenc, "encoding thread got %s",
+        gst_flow_get_name (ret));
+    ffmpegenc->async_flow = ret;
+  }
+  g_cond_broadcast (&ffmpegenc->async_cond);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+}
+
+static void
+gst_ffmpegvidenc_async_start (GstFFMpegVidEnc * ffmpegenc)
+{
+  GST_DEBUG_OBJECT (ffmpegenc, "starting encoding thread");
+
+  ffmpegenc->async_flushing = FALSE;
+  ffmpegenc->async_flow = GST_FLOW_OK;
+
+  ffmpegenc->async_task =
+      gst_task_new ((GstTaskFunction) gst_ffmpegvidenc_async_loop, ffmpegenc,
+      NULL);
+  gst_task_set_lock (ffmpegenc->async_task, &ffmpegenc->async_task_lock);
+  gst_task_start (ffmpegenc->async_task);
+}
+
+/* Stops the encoding thread, discarding the frames it didn't get to. Must not
+ * be called with the stream lock, which the thread may be waiting for. */
+static void
+gst_ffmpegvidenc_async_stop (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstVideoCodecFrame *frame;
+
+  if (!ffmpegenc->async_task)
+    return;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "stopping encoding thread");
+
+  gst_task_stop (ffmpegenc->async_task);
+  g_mutex_lock (&ffmpegenc->async_lock);
+  ffmpegenc->async_flushing = TRUE;
+  g_cond_broadcast (&ffmpegenc->async_cond);
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  gst_task_join (ffmpegenc->async_task);
+  gst_object_unref (ffmpegenc->async_task);
+  ffmpegenc->async_task = NULL;
+
+  while ((frame = g_queue_pop_head (&ffmpegenc->async_queue)))
+    gst_video_codec_frame_unref (frame);
+  g_atomic_int_set (&ffmpegenc->async_depth, 0);
+}
+
+/* Waits for the encoding thread to process all queued frames, call with the
+ * stream lock */
+static GstFlowReturn
+gst_ffmpegvidenc_async_wait (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFlowReturn ret;
+
+  if (!ffmpegenc->async_task)
+    return GST_FLOW_OK;
+
+  GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+  g_mutex_lock (&ffmpegenc->async_lock);
+  while ((!g_queue_is_empty (&ffmpegenc->async_queue) || ffmpegenc->async_busy)
+      && !ffmpegenc->async_flushing)
+    g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+  ret = ffmpegenc->async_flow;
+  g_mutex_unlock (&ffmpegenc->async_lock);
+  GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_async_push (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoCodecFrame *dropped = NULL;
+  GstFlowReturn ret;
+  guint queue_size;
+  gint drop_policy;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  queue_size = ffmpegenc->async_queue_size;
+  drop_policy = ffmpegenc->async_drop_policy;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (!ffmpegenc->async_task)
+    gst_ffmpegvidenc_async_start (ffmpegenc);
+
+  g_mutex_lock (&ffmpegenc->async_lock);
+  if (g_queue_get_length (&ffmpegenc->async_queue) >= queue_size) {
+    switch (drop_policy) {
+      case GST_FFMPEG_DROP_OLDEST:
+        dropped = g_queue_pop_head (&ffmpegenc->async_queue);
+        break;
+      case GST_FFMPEG_DROP_NEWEST:
+        dropped = frame;
+        frame = NULL;
+        break;
+      default:
+        /* the encoding thread needs the stream lock to finish frames */
+        g_mutex_unlock (&ffmpegenc->async_lock);
+        GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+        g_mutex_lock (&ffmpegenc->async_lock);
+        while (g_queue_get_length (&ffmpegenc->async_queue) >= queue_size
+            && ffmpegenc->async_flow == GST_FLOW_OK
+            && !ffmpegenc->async_flushing)
+          g_cond_wait (&ffmpegenc->async_cond, &ffmpegenc->async_lock);
+        g_mutex_unlock (&ffmpegenc->async_lock);
+        GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+        g_mutex_lock (&ffmpegenc->async_lock);
+        break;
+    }
+  }
+
+  ret = ffmpegenc->async_flow;
+  if (frame) {
+    g_queue_push_tail (&ffmpegenc->async_queue, frame);
+    g_atomic_int_set (&ffmpegenc->async_depth,
+        g_queue_get_length (&ffmpegenc->async_queue));
+    g_cond_broadcast (&ffmpegenc->async_cond);
+  }
+  g_mutex_unlock (&ffmpegenc->async_lock);
+
+  if (dropped) {
+    GST_DEBUG_OBJECT (ffmpegenc, "encoding queue full, dropping frame %u",
+        dropped->system_frame_number);
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->frames_dropped++;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+    gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), dropped);
+  }
+
+  return ret;
+}
+
+/* Chunked encoding: the input is split into GOP sized chunks starting with a
+ * keyframe, each encoded from start to end by a fresh context in a thread
+ * pool. Chunks are emitted in input order once done, so at most
+ * parallel-chunks chunks are encoding besides the one being collected. */
+typedef struct
+{
+  AVCodecContext *context;
+  GQueue frames;
+  /* one buffer per packet, in output order */
+  GQueue buffers;
+  gboolean done;
+  GstFlowReturn ret;
+  GstClockTime encode_time;
+  /* first pass statistics, if collected */
+  GString *stats;
+} GstFFMpegVidEncChunk;
+
+#define CHUNK_DEFAULT_LENGTH 30
+
+static void
+gst_ffmpegvidenc_chunk_free (GstFFMpegVidEncChunk * chunk)
+{
+  g_queue_foreach (&chunk->frames, (GFunc) gst_video_codec_frame_unref, NULL);
+  g_queue_clear (&chunk->frames);
+  g_queue_foreach (&chunk->buffers, (GFunc) gst_buffer_unref, NULL);
+  g_queue_clear (&chunk->buffers);
+  gst_ffmpeg_avcodec_close (chunk->context);
+  avcodec_free_context (&chunk->context);
+  if (chunk->stats)
+    g_string_free (chunk->stats, TRUE);
+  g_slice_free (GstFFMpegVidEncChunk, chunk);
+}
+
+/* Opens a chunk context set up like the main one, plus the @pass flags and
+ * @stats_in for multipass encoding */
+static GstFFMpegVidEncChunk *
+gst_ffmpegvidenc_chunk_new (GstFFMpegVidEnc * ffmpegenc, gint pass,
+    const gchar * stats_in)
+{
+  GstFFMpegVidEncChunk *chunk;
+  AVCodecContext *context;
+
+  /* single threaded, the chunks are the unit of parallelism */
+  context = gst_ffmpegvidenc_open_context (ffmpegenc,
+      &ffmpegenc->input_state->info, pass, stats_in, FALSE);
+  if (!context)
+    return NULL;
+
+  chunk = g_slice_new0 (GstFFMpegVidEncChunk);
+  chunk->context = context;
+  g_queue_init (&chunk->frames);
+  g_queue_init (&chunk->buffers);
+  chunk->ret = GST_FLOW_OK;
+
+  return chunk;
+}
+
+/* Whether the streams of @a and @b could be concatenated */
+static gboolean
+gst_ffmpegvidenc_same_headers (AVCodecContext * a, AVCodecContext * b)
+{
+  return a->extradata_size == b->extradata_size &&
+      (a->extradata_size == 0 ||
+      memcmp (a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_chunk_receive (GstFFMpegVidEncChunk * chunk, AVPacket * pkt)
+{
+  GstBuffer *outbuf;
+  gint res;
+
+  while ((res = avcodec_receive_packet (chunk->context, pkt)) == 0) {
+    gboolean key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    GstFFMpegVidEncPicture pic;
+
+    if (chunk->stats && chunk->context->stats_out)
+      g_string_append (chunk->stats, chunk->context->stats_out);
+
+    gst_ffmpegvidenc_describe_packet (chunk->context, pkt, &pic);
+    outbuf = gst_ffmpegvidenc_wrap_avpacket (pkt);
+    gst_ffmpegvidenc_tag_buffer (outbuf, &pic);
+    if (!key)
+      GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+    g_queue_push_tail (&chunk->buffers, outbuf);
+  }
+
+  if (res == AVERROR (EAGAIN) || res == AVERROR_EOF)
+    return GST_FLOW_OK;
+
+  return GST_FLOW_ERROR;
+}
+
+/* Encodes all frames of @chunk and drains its context */
+static void
+gst_ffmpegvidenc_chunk_run (GstFFMpegVidEnc * ffmpegenc,
+    GstFFMpegVidEncChunk * chunk)
+{
+  AVFrame *picture = av_frame_alloc ();
+  AVPacket *pkt = av_packet_alloc ();
+  GstFlowReturn ret = GST_FLOW_OK;
+  gint64 start = g_get_monotonic_time ();
+  GList *l;
+
+  for (l = chunk->frames.head; l && ret == GST_FLOW_OK; l = l->next) {
+    if (g_atomic_int_get (&ffmpegenc->chunks_flushing)) {
+      ret = GST_FLOW_FLUSHING;
+      break;
+    }
+
+    ret = gst_ffmpegvidenc_send_picture (ffmpegenc, chunk->context, picture,
+        l->data, NULL);
+    if (ret == GST_FLOW_OK)
+      ret = gst_ffmpegvidenc_chunk_receive (chunk, pkt);
+  }
+
+  /* drain */
+  if (ret == GST_FLOW_OK)
+    ret = gst_ffmpegvidenc_send_picture (ffmpegenc, chunk->context, NULL,
+        NULL, NULL);
+  if (ret == GST_FLOW_OK)
+    ret = gst_ffmpegvidenc_chunk_receive (chunk, pkt);
+
+  av_packet_free (&pkt);
+  av_frame_free (&picture);
+
+  chunk->ret = ret;
+  chunk->encode_time = (g_get_monotonic_time () - start) * GST_USECOND;
+}
+
+/* GThreadPool function */
+static void
+gst_ffmpegvidenc_chunk_encode (gpointer data, gpointer user_data)
+{
+  GstFFMpegVidEncChunk *chunk = data;
+  GstFFMpegVidEnc *ffmpegenc = user_data;
+
+  gst_ffmpegvidenc_chunk_run (ffmpegenc, chunk);
+
+  g_mutex_lock (&ffmpegenc->chunk_lock);
+  chunk->done = TRUE;
+  g_cond_broadcast (&ffmpegenc->chunk_cond);
+  g_mutex_unlock (&ffmpegenc->chunk_lock);
+}
+
+/* Finishes the frames of a done chunk, with one packet per frame in order */
+static GstFlowReturn
+gst_ffmpegvidenc_chunk_emit (GstFFMpegVidEnc * ffmpegenc,
+    GstFFMpegVidEncChunk * chunk)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
+  GstVideoCodecFrame *frame;
+  GstBuffer *outbuf;
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstFlowReturn res;
+
+  /* like the single context path, we choose to be error-resilient and
+   * finish the frames without output */
+  if (chunk->ret != GST_FLOW_OK)
+    GST_ERROR_OBJECT (ffmpegenc, "failed to encode chunk: %s",
+        gst_flow_get_name (chunk->ret));
+
+  if (!g_queue_is_empty (&chunk->frames))
+    gst_ffmpegvidenc_quality_encode_time (ffmpegenc,
+        chunk->encode_time / g_queue_get_length (&chunk->frames));
+
+  while ((frame = g_queue_pop_head (&chunk->frames))) {
+    outbuf = g_queue_pop_head (&chunk->buffers);
+    if (outbuf) {
+      gboolean key =
+          !GST_BUFFER_FLAG_IS_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+      if (key)
+        GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (frame);
+      else
+        GST_VIDEO_CODEC_FRAME_UNSET_SYNC_POINT (frame);
+      gst_ffmpegvidenc_quality_record (ffmpegenc, outbuf, frame, key);
+      frame->output_buffer = outbuf;
+    }
+
+    res = gst_video_encoder_finish_frame (encoder, frame);
+    if (ret == GST_FLOW_OK)
+      ret = res;
+  }
+
+  if (!g_queue_is_empty (&chunk->buffers))
+    GST_WARNING_OBJECT (ffmpegenc, "dropping %u packets without frame",
+        g_queue_get_length (&chunk->buffers));
+
+  gst_ffmpegvidenc_chunk_free (chunk);
+
+  return ret;
+}
+
+/* Emits the finished chunks at the head of the queue, waiting for chunks
+ * until no more than @max_pending are left */
+static GstFlowReturn
+gst_ffmpegvidenc_chunks_emit (GstFFMpegVidEnc * ffmpegenc, guint max_pending)
+{
+  GstFFMpegVidEncChunk *chunk;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (&ffmpegenc->chunk_lock);
+  while ((chunk = g_queue_peek_head (&ffmpegenc->chunks))) {
+    if (!chunk->done) {
+      if (g_queue_get_length (&ffmpegenc->chunks) <= max_pending)
+        break;
+      g_cond_wait (&ffmpegenc->chunk_cond, &ffmpegenc->chunk_lock);
+      continue;
+    }
+
+    g_queue_pop_head (&ffmpegenc->chunks);
+    g_mutex_unlock (&ffmpegenc->chunk_lock);
+
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->chunks_encoded++;
+    ffmpegenc->chunks_encode_time += chunk->encode_time;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+
+    if (ret == GST_FLOW_OK)
+      ret = gst_ffmpegvidenc_chunk_emit (ffmpegenc, chunk);
+    else
+      gst_ffmpegvidenc_chunk_emit (ffmpegenc, chunk);
+
+    g_mutex_lock (&ffmpegenc->chunk_lock);
+  }
+
+  if (g_queue_is_empty (&ffmpegenc->chunks) && ffmpegenc->chunks_busy_since) {
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->chunks_wall_time +=
+        (g_get_monotonic_time () - ffmpegenc->chunks_busy_since) * GST_USECOND;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+    ffmpegenc->chunks_busy_since = 0;
+  }
+  g_mutex_unlock (&ffmpegenc->chunk_lock);
+
+  return ret;
+}
+
+static void
+gst_ffmpegvidenc_chunk_submit (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncChunk *chunk = ffmpegenc->chunk_current;
+
+  if (!chunk)
+    return;
+  ffmpegenc->chunk_current = NULL;
+
+  if (!ffmpegenc->chunk_pool)
+    ffmpegenc->chunk_pool = g_thread_pool_new (gst_ffmpegvidenc_chunk_encode,
+        ffmpegenc, g_get_num_processors (), FALSE, NULL);
+
+  GST_DEBUG_OBJECT (ffmpegenc, "submitting chunk of %u frames",
+      g_queue_get_length (&chunk->frames));
+
+  g_mutex_lock (&ffmpegenc->chunk_lock);
+  if (!ffmpegenc->chunks_busy_since)
+    ffmpegenc->chunks_busy_since = g_get_monotonic_time ();
+  g_queue_push_tail (&ffmpegenc->chunks, chunk);
+  g_mutex_unlock (&ffmpegenc->chunk_lock);
+
+  g_thread_pool_push (ffmpegenc->chunk_pool, chunk, NULL);
+}
+
+/* Waits for all chunks and discards them, the one being collected too */
+static void
+gst_ffmpegvidenc_chunks_discard (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncChunk *chunk;
+
+  if (ffmpegenc->chunk_current) {
+    gst_ffmpegvidenc_chunk_free (ffmpegenc->chunk_current);
+    ffmpegenc->chunk_current = NULL;
+  }
+
+  g_atomic_int_set (&ffmpegenc->chunks_flushing, TRUE);
+  g_mutex_lock (&ffmpegenc->chunk_lock);
+  while ((chunk = g_queue_peek_head (&ffmpegenc->chunks))) {
+    if (!chunk->done) {
+      g_cond_wait (&ffmpegenc->chunk_cond, &ffmpegenc->chunk_lock);
+      continue;
+    }
+    g_queue_pop_head (&ffmpegenc->chunks);
+    gst_ffmpegvidenc_chunk_free (chunk);
+  }
+  ffmpegenc->chunks_busy_since = 0;
+  g_mutex_unlock (&ffmpegenc->chunk_lock);
+  g_atomic_int_set (&ffmpegenc->chunks_flushing, FALSE);
+}
+
+/* Encodes all pending chunks, for draining */
+static GstFlowReturn
+gst_ffmpegvidenc_chunks_finish (GstFFMpegVidEnc * ffmpegenc)
+{
+  gst_ffmpegvidenc_chunk_submit (ffmpegenc);
+
+  return gst_ffmpegvidenc_chunks_emit (ffmpegenc, 0);
+}
+
+/* Whether to use chunked encoding, which doesn't work with multipass
+ * encoding as the passes need the whole stream on one context */
+static gboolean
+gst_ffmpegvidenc_use_chunks (GstFFMpegVidEnc * ffmpegenc)
+{
+  gboolean use_chunks;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  use_chunks = ffmpegenc->parallel_chunks > 0 && !ffmpegenc->chunks_refused;
+  if (use_chunks && (ffmpegenc->pass & (AV_CODEC_FLAG_PASS1 |
+              AV_CODEC_FLAG_PASS2))) {
+    GST_WARNING_OBJECT (ffmpegenc, "parallel chunks can't be used for "
+        "multipass encoding");
+    ffmpegenc->chunks_refused = TRUE;
+    use_chunks = FALSE;
+  }
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  return use_chunks;
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_chunk_push (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  GstFFMpegVidEncChunk *chunk = ffmpegenc->chunk_current;
+  GstFlowReturn ret;
+  guint max_chunks;
+  guint length;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  max_chunks = ffmpegenc->parallel_chunks;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  gst_ffmpegvidenc_filter_force_keyframe (ffmpegenc, frame);
+
+  length = ffmpegenc->context->gop_size > 1 ?
+      ffmpegenc->context->gop_size : CHUNK_DEFAULT_LENGTH;
+
+  /* a scene cut or keyframe request starts a new chunk */
+  if (chunk && (GST_VIDEO_CODEC_FRAME_IS_FORCE_KEYFRAME (frame)
+          || g_queue_get_length (&chunk->frames) >= length)) {
+    gst_ffmpegvidenc_chunk_submit (ffmpegenc);
+    chunk = NULL;
+  }
+
+  if (!chunk) {
+    /* bound the memory held by frames and packets of chunks in flight */
+    ret = gst_ffmpegvidenc_chunks_emit (ffmpegenc, max_chunks - 1);
+    if (ret != GST_FLOW_OK) {
+      gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+      return ret;
+    }
+
+    chunk = gst_ffmpegvidenc_chunk_new (ffmpegenc, 0, NULL);
+    if (!chunk)
+      goto no_chunk;
+    if (!gst_ffmpegvidenc_same_headers (chunk->context, ffmpegenc->context)) {
+      GST_WARNING_OBJECT (ffmpegenc, "Chunk context has different stream "
+          "headers than the main one");
+      gst_ffmpegvidenc_chunk_free (chunk);
+      goto no_chunk;
+    }
+    ffmpegenc->chunk_current = chunk;
+    ffmpegenc->last_keyframe_ts = frame->pts;
+  }
+
+  g_queue_push_tail (&chunk->frames, frame);
+
+  return gst_ffmpegvidenc_chunks_emit (ffmpegenc, G_MAXUINT);
+
+no_chunk:
+  {
+    GST_WARNING_OBJECT (ffmpegenc, "falling back to a single context");
+    GST_OBJECT_LOCK (ffmpegenc);
+    ffmpegenc->chunks_refused = TRUE;
+    GST_OBJECT_UNLOCK (ffmpegenc);
+    return gst_ffmpegvidenc_encode_frame (ffmpegenc, frame);
+  }
+}
+
+/* Replaces the codec_data of the output caps when a second pass context came
+ * up with different stream headers than the main context */
+static void
+gst_ffmpegvidenc_update_headers (GstFFMpegVidEnc * ffmpegenc,
+    AVCodecContext * context)
+{
+  GstVideoEncoder *encoder = GST_VIDEO_ENCODER (ffmpegenc);
+  AVCodecContext *main_context = ffmpegenc->context;
+  GstVideoCodecState *output_state;
+  GstCaps *caps;
+
+  if (gst_ffmpegvidenc_same_headers (context, main_context))
+    return;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "stream headers changed, updating caps");
+
+  av_freep (&main_context->extradata);
+  main_context->extradata_size = 0;
+  if (context->extradata_size > 0) {
+    main_context->extradata = av_mallocz (context->extradata_size +
+        AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy (main_context->extradata, context->extradata,
+        context->extradata_size);
+    main_context->extradata_size = context->extradata_size;
+  }
+
+  output_state = gst_video_encoder_get_output_state (encoder);
+  if (!output_state)
+    return;
+
+  caps = gst_caps_copy (output_state->caps);
+  gst_video_codec_state_unref (output_state);
+
+  if (main_context->extradata_size > 0) {
+    GstBuffer *codec_data =
+        gst_buffer_new_allocate (NULL, main_context->extradata_size, NULL);
+
+    gst_buffer_fill (codec_data, 0, main_context->extradata,
+        main_context->extradata_size);
+    gst_caps_set_simple (caps, "codec_data", GST_TYPE_BUFFER, codec_data,
+        NULL);
+    gst_buffer_unref (codec_data);
+  } else {
+    gst_structure_remove_field (gst_caps_get_structure (caps, 0),
+        "codec_data");
+  }
+
+  output_state = gst_video_encoder_set_output_state (encoder, caps,
+      ffmpegenc->input_state);
+  gst_video_codec_state_unref (output_state);
+}
+
+/* In-memory two-pass encoding: the frames of a lookahead window are encoded
+ * by a first pass context collecting the rate control statistics, then by a
+ * second pass context reading them. Each window starts with a keyframe. This
+ * works with the encoders using libavcodec's rate control, which report their
+ * statistics in stats_out. */
+static GstFlowReturn
+gst_ffmpegvidenc_two_pass_window (GstFFMpegVidEnc * ffmpegenc)
+{
+  GstFFMpegVidEncChunk *chunk;
+  GstVideoCodecFrame *frame;
+  GString *stats;
+  GList *l;
+
+  if (g_queue_is_empty (&ffmpegenc->lookahead_queue))
+    return GST_FLOW_OK;
+
+  GST_DEBUG_OBJECT (ffmpegenc, "encoding window of %u frames",
+      g_queue_get_length (&ffmpegenc->lookahead_queue));
+
+  chunk = gst_ffmpegvidenc_chunk_new (ffmpegenc, AV_CODEC_FLAG_PASS1, NULL);
+  if (!chunk)
+    goto open_failed;
+
+  for (l = ffmpegenc->lookahead_queue.head; l; l = l->next)
+    g_queue_push_tail (&chunk->frames, gst_video_codec_frame_ref (l->data));
+  chunk->stats = g_string_new (NULL);
+
+  gst_ffmpegvidenc_chunk_run (ffmpegenc, chunk);
+  if (chunk->ret != GST_FLOW_OK) {
+    gst_ffmpegvidenc_chunk_free (chunk);
+    goto first_pass_failed;
+  }
+
+  stats = chunk->stats;
+  chunk->stats = NULL;
+  gst_ffmpegvidenc_chunk_free (chunk);
+
+  chunk = gst_ffmpegvidenc_chunk_new (ffmpegenc, AV_CODEC_FLAG_PASS2,
+      stats->str);
+  g_string_free (stats, TRUE);
+  if (!chunk)
+    goto open_failed;
+
+  gst_ffmpegvidenc_update_headers (ffmpegenc, chunk->context);
+
+  /* the second pass encodes and finishes the buffered frames */
+  chunk->frames = ffmpegenc->lookahead_queue;
+  g_queue_init (&ffmpegenc->lookahead_queue);
+
+  gst_ffmpegvidenc_chunk_run (ffmpegenc, chunk);
+
+  return gst_ffmpegvidenc_chunk_emit (ffmpegenc, chunk);
+
+  /* ERRORS */
+open_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegenc, LIBRARY, SETTINGS, (NULL),
+        ("Failed to open the codec for two-pass encoding"));
+    goto drop_window;
+  }
+first_pass_failed:
+  {
+    GST_ELEMENT_ERROR (ffmpegenc, LIBRARY, ENCODE, (NULL),
+        ("First pass encoding failed"));
+    goto drop_window;
+  }
+drop_window:
+  {
+    while ((frame = g_queue_pop_head (&ffmpegenc->lookahead_queue)))
+      gst_video_encoder_finish_frame (GST_VIDEO_ENCODER (ffmpegenc), frame);
+    return GST_FLOW_ERROR;
+  }
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_two_pass_push (GstFFMpegVidEnc * ffmpegenc,
+    GstVideoCodecFrame * frame)
+{
+  guint lookahead;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  lookahead = ffmpegenc->two_pass_lookahead;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  gst_ffmpegvidenc_filter_force_keyframe (ffmpegenc, frame);
+
+  g_queue_push_tail (&ffmpegenc->lookahead_queue, frame);
+
+  if (g_queue_get_length (&ffmpegenc->lookahead_queue) < lookahead)
+    return GST_FLOW_OK;
+
+  return gst_ffmpegvidenc_two_pass_window (ffmpegenc);
+}
+
+static void
+gst_ffmpegvidenc_two_pass_discard (GstFFMpegVidEnc * ffmpegenc)
+{
+  g_queue_foreach (&ffmpegenc->lookahead_queue,
+      (GFunc) gst_video_codec_frame_unref, NULL);
+  g_queue_clear (&ffmpegenc->lookahead_queue);
+}
+
+static GstFlowReturn
+gst_ffmpegvidenc_handle_frame (GstVideoEncoder * encoder,
+    GstVideoCodecFrame * frame)
+{
+  GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstFlowReturn ret;
+  gboolean async;
+  gboolean two_pass;
+
+  gst_ffmpegvidenc_standby_prepare (ffmpegenc);
+
+  /* chunked encoding takes precedence, it's parallel and asynchronous */
+  if (gst_ffmpegvidenc_use_chunks (ffmpegenc))
+    return gst_ffmpegvidenc_chunk_push (ffmpegenc, frame);
+
+  /* chunked encoding was just turned off */
+  if (ffmpegenc->chunk_current || !g_queue_is_empty (&ffmpegenc->chunks)) {
+    ret = gst_ffmpegvidenc_chunks_finish (ffmpegenc);
+    if (ret != GST_FLOW_OK) {
+      gst_video_encoder_finish_frame (encoder, frame);
+      return ret;
+    }
+  }
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  async = ffmpegenc->async_encode;
+  two_pass = ffmpegenc->pass == GST_FFMPEG_TWO_PASS;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
+  if (two_pass)
+    return gst_ffmpegvidenc_two_pass_push (ffmpegenc, frame);
+
+  /* two-pass encoding was just turned off */
+  if (!g_queue_is_empty (&ffmpegenc->lookahead_queue)) {
+    ret = gst_ffmpegvidenc_two_pass_window (ffmpegenc);
+    if (ret != GST_FLOW_OK) {
+      gst_video_encoder_finish_frame (encoder, frame);
+      return ret;
+    }
+  }
+
+  if (async)
+    return gst_ffmpegvidenc_async_push (ffmpegenc, frame);
+
+  /* asynchronous encoding was just turned off */
+  if (ffmpegenc->async_task) {
+    gst_ffmpegvidenc_async_wait (ffmpegenc);
+    GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+    gst_ffmpegvidenc_async_stop (ffmpegenc);
+    GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+  }
+
+  g_mutex_lock (&ffmpegenc->codec_lock);
+  ret = gst_ffmpegvidenc_encode_frame (ffmpegenc, frame);
+  g_mutex_unlock (&ffmpegenc->codec_lock);
+
+  return ret;
 }
 
 static GstFlowReturn
@@ -717,13 +3356,14 @@ gst_ffmpegvidenc_flush_buffers (GstFFMpegVidEnc * ffmpegenc, gboolean send)
   if (!ffmpegenc->opened)
     goto done;
 
-  ret = gst_ffmpegvidenc_send_frame (ffmpegenc, NULL);
+  ret = gst_ffmpegvidenc_send_frame (ffmpegenc, NULL, NULL);
 
   if (ret != GST_FLOW_OK)
     goto done;
 
   do {
-    ret = gst_ffmpegvidenc_receive_packet (ffmpegenc, &got_packet, send);
+    ret = gst_ffmpegvidenc_receive_packet (ffmpegenc, &got_packet, send,
+        NULL);
     if (ret != GST_FLOW_OK)
       break;
   } while (got_packet);
@@ -740,28 +3380,153 @@ gst_ffmpegvidenc_set_property (GObject * object,
 
   ffmpegenc = (GstFFMpegVidEnc *) (object);
 
-  if (ffmpegenc->opened) {
-    GST_WARNING_OBJECT (ffmpegenc,
-        "Can't change properties once decoder is setup !");
-    return;
-  }
-
+  GST_OBJECT_LOCK (ffmpegenc);
   switch (prop_id) {
     case PROP_QUANTIZER:
+      /* picked up by the next frame */
       ffmpegenc->quantizer = g_value_get_float (value);
       break;
     case PROP_PASS:
       ffmpegenc->pass = g_value_get_enum (value);
+      ffmpegenc->reopen_pending = ffmpegenc->opened;
+      ffmpegenc->settings_cookie++;
       break;
     case PROP_FILENAME:
       g_free (ffmpegenc->filename);
       ffmpegenc->filename = g_value_dup_string (value);
       break;
+    case PROP_MIN_FORCE_KEY_UNIT_INTERVAL:
+      ffmpegenc->min_force_key_unit_interval = g_value_get_uint64 (value);
+      break;
+    case PROP_FORCE_KEY_UNIT_WINDOW:
+      ffmpegenc->force_key_unit_window = g_value_get_uint64 (value);
+      break;
+    case PROP_ASYNC_ENCODE:
+      ffmpegenc->async_encode = g_value_get_boolean (value);
+      break;
+    case PROP_ASYNC_QUEUE_SIZE:
+      ffmpegenc->async_queue_size = g_value_get_uint (value);
+      break;
+    case PROP_ASYNC_DROP_POLICY:
+      ffmpegenc->async_drop_policy = g_value_get_enum (value);
+      break;
+    case PROP_OVERLOAD_ADAPTATION:
+      ffmpegenc->overload_adaptation = g_value_get_boolean (value);
+      break;
+    case PROP_SKIP_STATIC:
+      ffmpegenc->skip_static = g_value_get_boolean (value);
+      break;
+    case PROP_ACTIVE:
+    {
+      gboolean active = g_value_get_boolean (value);
+
+      if (active && !ffmpegenc->active)
+        ffmpegenc->resume_pending = TRUE;
+      ffmpegenc->active = active;
+      break;
+    }
+    case PROP_MAX_SKIP_INTERVAL:
+      ffmpegenc->max_skip_interval = g_value_get_uint64 (value);
+      break;
+    case PROP_PARALLEL_CHUNKS:
+      ffmpegenc->parallel_chunks = g_value_get_uint (value);
+      ffmpegenc->chunks_refused = FALSE;
+      break;
+    case PROP_TWO_PASS_LOOKAHEAD:
+      ffmpegenc->two_pass_lookahead = g_value_get_uint (value);
+      break;
+    case PROP_MAX_THREADS:
+      ffmpegenc->max_threads = g_value_get_int (value);
+      ffmpegenc->reopen_pending = ffmpegenc->opened;
+      ffmpegenc->settings_cookie++;
+      break;
+    case PROP_ROI_QUALITY_OFFSET:
+      ffmpegenc->roi_quality_offset = g_value_get_double (value);
+      break;
+    case PROP_ROI_TYPE_OFFSETS:
+      if (ffmpegenc->roi_type_offsets)
+        gst_structure_free (ffmpegenc->roi_type_offsets);
+      ffmpegenc->roi_type_offsets = g_value_dup_boxed (value);
+      break;
     default:
-      if (!gst_ffmpeg_cfg_set_property (ffmpegenc->refcontext, value, pspec))
+      if (!gst_ffmpeg_cfg_set_property (ffmpegenc->refcontext, value, pspec)) {
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+      }
+      if (!strcmp (pspec->name, "threads"))
+        ffmpegenc->threads_set = TRUE;
+      else if (!strcmp (pspec->name, "thread-type"))
+        ffmpegenc->thread_type_set = TRUE;
+      if (gst_ffmpeg_cfg_is_runtime_param (pspec)) {
+        /* also applied to a standby context once switched to */
+        if (ffmpegenc->opened
+            && !g_list_find (ffmpegenc->pending_params, pspec))
+          ffmpegenc->pending_params =
+              g_list_append (ffmpegenc->pending_params, pspec);
+      } else {
+        if (ffmpegenc->opened)
+          ffmpegenc->reopen_pending = TRUE;
+        ffmpegenc->settings_cookie++;
+      }
       break;
   }
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
+/* call with the object lock */
+static GstStructure *
+gst_ffmpegvidenc_get_stats (GstFFMpegVidEnc * ffmpegenc)
+{
+  guint64 size = 0, bitrate = 0, qp_sum = 0;
+  GstClockTime duration = 0;
+  guint i, keyframes = 0, n_qp = 0;
+
+  /* rolling values over the last pictures */
+  for (i = 0; i < ffmpegenc->quality_count; i++) {
+    GstFFMpegVidEncSample *sample = &ffmpegenc->quality[i];
+
+    size += sample->size;
+    if (GST_CLOCK_TIME_IS_VALID (sample->duration))
+      duration += sample->duration;
+    if (sample->qp >= 0) {
+      qp_sum += sample->qp;
+      n_qp++;
+    }
+    if (sample->key)
+      keyframes++;
+  }
+  if (duration > 0)
+    bitrate = gst_util_uint64_scale (size * 8, GST_SECOND, duration);
+
+  return gst_structure_new ("avenc-stats",
+      "keyframe-requests", G_TYPE_UINT64, ffmpegenc->keyframe_requests,
+      "keyframe-requests-merged", G_TYPE_UINT64,
+      ffmpegenc->keyframe_requests_merged,
+      "keyframe-requests-deferred", G_TYPE_UINT64,
+      ffmpegenc->keyframe_requests_deferred,
+      "queue-depth", G_TYPE_UINT, g_atomic_int_get (&ffmpegenc->async_depth),
+      "frames-dropped", G_TYPE_UINT64, ffmpegenc->frames_dropped,
+      "overload-level", G_TYPE_UINT, ffmpegenc->overload_level,
+      "encode-load", G_TYPE_DOUBLE, ffmpegenc->overload_load,
+      "frames-inactive-dropped", G_TYPE_UINT64,
+      ffmpegenc->frames_inactive_dropped,
+      "frames-static-skipped", G_TYPE_UINT64, ffmpegenc->frames_static_skipped,
+      "static-skip-ratio", G_TYPE_DOUBLE, ffmpegenc->frames_static_checked ?
+      (gdouble) ffmpegenc->frames_static_skipped /
+      ffmpegenc->frames_static_checked : 0.0,
+      "chunks-encoded", G_TYPE_UINT64, ffmpegenc->chunks_encoded,
+      "chunk-scaling", G_TYPE_DOUBLE, ffmpegenc->chunks_wall_time ?
+      (gdouble) ffmpegenc->chunks_encode_time /
+      ffmpegenc->chunks_wall_time : 0.0,
+      "standby-switches", G_TYPE_UINT64, ffmpegenc->standby_switches,
+      "input-frames-pooled", G_TYPE_UINT64, ffmpegenc->frames_pooled,
+      "input-frames-unaligned", G_TYPE_UINT64, ffmpegenc->frames_unaligned,
+      "bitrate", G_TYPE_UINT64, bitrate,
+      "target-bitrate", G_TYPE_UINT64, ffmpegenc->target_bitrate,
+      "average-qp", G_TYPE_DOUBLE, n_qp ? (gdouble) qp_sum / n_qp : -1.0,
+      "keyframe-ratio", G_TYPE_DOUBLE, ffmpegenc->quality_count ?
+      (gdouble) keyframes / ffmpegenc->quality_count : 0.0,
+      "encode-time", G_TYPE_UINT64, ffmpegenc->encode_time, NULL);
 }
 
 static void
@@ -772,6 +3537,7 @@ gst_ffmpegvidenc_get_property (GObject * object,
 
   ffmpegenc = (GstFFMpegVidEnc *) (object);
 
+  GST_OBJECT_LOCK (ffmpegenc);
   switch (prop_id) {
     case PROP_QUANTIZER:
       g_value_set_float (value, ffmpegenc->quantizer);
@@ -782,11 +3548,122 @@ gst_ffmpegvidenc_get_property (GObject * object,
     case PROP_FILENAME:
       g_value_take_string (value, g_strdup (ffmpegenc->filename));
       break;
+    case PROP_MIN_FORCE_KEY_UNIT_INTERVAL:
+      g_value_set_uint64 (value, ffmpegenc->min_force_key_unit_interval);
+      break;
+    case PROP_FORCE_KEY_UNIT_WINDOW:
+      g_value_set_uint64 (value, ffmpegenc->force_key_unit_window);
+      break;
+    case PROP_ASYNC_ENCODE:
+      g_value_set_boolean (value, ffmpegenc->async_encode);
+      break;
+    case PROP_ASYNC_QUEUE_SIZE:
+      g_value_set_uint (value, ffmpegenc->async_queue_size);
+      break;
+    case PROP_ASYNC_DROP_POLICY:
+      g_value_set_enum (value, ffmpegenc->async_drop_policy);
+      break;
+    case PROP_OVERLOAD_ADAPTATION:
+      g_value_set_boolean (value, ffmpegenc->overload_adaptation);
+      break;
+    case PROP_SKIP_STATIC:
+      g_value_set_boolean (value, ffmpegenc->skip_static);
+      break;
+    case PROP_ACTIVE:
+      g_value_set_boolean (value, ffmpegenc->active);
+      break;
+    case PROP_MAX_SKIP_INTERVAL:
+      g_value_set_uint64 (value, ffmpegenc->max_skip_interval);
+      break;
+    case PROP_PARALLEL_CHUNKS:
+      g_value_set_uint (value, ffmpegenc->parallel_chunks);
+      break;
+    case PROP_TWO_PASS_LOOKAHEAD:
+      g_value_set_uint (value, ffmpegenc->two_pass_lookahead);
+      break;
+    case PROP_MAX_THREADS:
+      g_value_set_int (value, ffmpegenc->max_threads);
+      break;
+    case PROP_ROI_QUALITY_OFFSET:
+      g_value_set_double (value, ffmpegenc->roi_quality_offset);
+      break;
+    case PROP_ROI_TYPE_OFFSETS:
+      g_value_set_boxed (value, ffmpegenc->roi_type_offsets);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, gst_ffmpegvidenc_get_stats (ffmpegenc));
+      break;
     default:
       if (!gst_ffmpeg_cfg_get_property (ffmpegenc->refcontext, value, pspec))
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
+  GST_OBJECT_UNLOCK (ffmpegenc);
+}
+
+static gboolean
+gst_ffmpegvidenc_reconfigure_field (GQuark field_id, const GValue * value,
+    gpointer user_data)
+{
+  GObject *object = G_OBJECT (user_data);
+  const gchar *name = g_quark_to_string (field_id);
+  GParamSpec *pspec;
+
+  pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (object), name);
+
+  if (!pspec || !(pspec->flags & G_PARAM_WRITABLE)
+      || !g_value_type_transformable (G_VALUE_TYPE (value),
+          G_PARAM_SPEC_VALUE_TYPE (pspec))) {
+    GST_WARNING_OBJECT (object, "Can't reconfigure property %s", name);
+    return TRUE;
+  }
+
+  GST_DEBUG_OBJECT (object, "reconfiguring %s", name);
+  g_object_set_property (object, name, value);
+
+  return TRUE;
+}
+
+/* Besides setting properties, applications (or a congestion controller
+ * downstream) can send a custom upstream GstLibAVEncReconfigure event whose
+ * fields are property names and values, e.g.
+ * "GstLibAVEncReconfigure, bitrate=(int)500000, gop-size=(int)60".
+ * A GstLibAVEncPrepare event with the width and height of an upcoming input
+ * format opens a codec for it in the background, which is switched to if the
+ * caps and settings match when the format changes. */
+static gboolean
+gst_ffmpegvidenc_src_event (GstVideoEncoder * encoder, GstEvent * event)
+{
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_UPSTREAM &&
+      gst_event_has_name (event, GST_FFENC_RECONFIGURE_EVENT)) {
+    gst_structure_foreach (gst_event_get_structure (event),
+        gst_ffmpegvidenc_reconfigure_field, encoder);
+    gst_event_unref (event);
+    return TRUE;
+  }
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_CUSTOM_UPSTREAM &&
+      gst_event_has_name (event, GST_FFENC_PREPARE_EVENT)) {
+    GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+    const GstStructure *s = gst_event_get_structure (event);
+    gint width, height;
+
+    if (gst_structure_get_int (s, "width", &width) && width > 0 &&
+        gst_structure_get_int (s, "height", &height) && height > 0) {
+      GST_OBJECT_LOCK (ffmpegenc);
+      ffmpegenc->standby_width = width;
+      ffmpegenc->standby_height = height;
+      ffmpegenc->standby_requested = TRUE;
+      GST_OBJECT_UNLOCK (ffmpegenc);
+    } else {
+      GST_WARNING_OBJECT (ffmpegenc, "invalid prepare event %" GST_PTR_FORMAT,
+          s);
+    }
+    gst_event_unref (event);
+    return TRUE;
+  }
+
+  return GST_VIDEO_ENCODER_CLASS (parent_class)->src_event (encoder, event);
 }
 
 static gboolean
@@ -794,8 +3671,21 @@ gst_ffmpegvidenc_flush (GstVideoEncoder * encoder)
 {
   GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
 
+  if (ffmpegenc->async_task) {
+    GST_VIDEO_ENCODER_STREAM_UNLOCK (ffmpegenc);
+    gst_ffmpegvidenc_async_stop (ffmpegenc);
+    GST_VIDEO_ENCODER_STREAM_LOCK (ffmpegenc);
+  }
+
+  gst_ffmpegvidenc_chunks_discard (ffmpegenc);
+  gst_ffmpegvidenc_two_pass_discard (ffmpegenc);
+
+  g_mutex_lock (&ffmpegenc->codec_lock);
   if (ffmpegenc->opened)
     avcodec_flush_buffers (ffmpegenc->context);
+  g_mutex_unlock (&ffmpegenc->codec_lock);
+
+  ffmpegenc->last_input_valid = FALSE;
 
   return TRUE;
 }
@@ -814,6 +3704,36 @@ gst_ffmpegvidenc_start (GstVideoEncoder * encoder)
     return FALSE;
   }
 
+  ffmpegenc->last_keyframe_ts = GST_CLOCK_TIME_NONE;
+  ffmpegenc->keyframe_pending = FALSE;
+  ffmpegenc->overload_hold = 0;
+  ffmpegenc->overload_credit = 0;
+  ffmpegenc->last_input_ts = GST_CLOCK_TIME_NONE;
+  ffmpegenc->inactive_drained = FALSE;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  ffmpegenc->overload_level = 0;
+  ffmpegenc->overload_load = 0;
+  ffmpegenc->frames_inactive_dropped = 0;
+  ffmpegenc->frames_static_checked = 0;
+  ffmpegenc->frames_static_skipped = 0;
+  ffmpegenc->keyframe_requests = 0;
+  ffmpegenc->keyframe_requests_merged = 0;
+  ffmpegenc->keyframe_requests_deferred = 0;
+  ffmpegenc->frames_dropped = 0;
+  ffmpegenc->chunks_encoded = 0;
+  ffmpegenc->chunks_encode_time = 0;
+  ffmpegenc->chunks_wall_time = 0;
+  ffmpegenc->standby_switches = 0;
+  ffmpegenc->frames_pooled = 0;
+  ffmpegenc->frames_unaligned = 0;
+  ffmpegenc->quality_pos = 0;
+  ffmpegenc->quality_count = 0;
+  ffmpegenc->encode_time = 0;
+  ffmpegenc->target_bitrate = 0;
+  ffmpegenc->standby_requested = FALSE;
+  GST_OBJECT_UNLOCK (ffmpegenc);
+
   return TRUE;
 }
 
@@ -822,10 +3742,26 @@ gst_ffmpegvidenc_stop (GstVideoEncoder * encoder)
 {
   GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
 
+  gst_ffmpegvidenc_async_stop (ffmpegenc);
+  gst_ffmpegvidenc_chunks_discard (ffmpegenc);
+  gst_ffmpegvidenc_two_pass_discard (ffmpegenc);
+  gst_ffmpegvidenc_standby_discard (ffmpegenc);
+  if (ffmpegenc->chunk_pool) {
+    g_thread_pool_free (ffmpegenc->chunk_pool, FALSE, TRUE);
+    ffmpegenc->chunk_pool = NULL;
+  }
   gst_ffmpegvidenc_flush_buffers (ffmpegenc, FALSE);
   gst_ffmpeg_avcodec_close (ffmpegenc->context);
   ffmpegenc->opened = FALSE;
 
+  gst_ffmpegvidenc_release_packet_pool (ffmpegenc);
+  ffmpegenc->last_input_valid = FALSE;
+
+  GST_OBJECT_LOCK (ffmpegenc);
+  gst_object_replace ((GstObject **) & ffmpegenc->input_pool, NULL);
+  GST_OBJECT_UNLOCK (ffmpegenc);
+  ffmpegenc->crop_width = ffmpegenc->crop_height = 0;
+
   if (ffmpegenc->input_state) {
     gst_video_codec_state_unref (ffmpegenc->input_state);
     ffmpegenc->input_state = NULL;
@@ -838,8 +3774,21 @@ static GstFlowReturn
 gst_ffmpegvidenc_finish (GstVideoEncoder * encoder)
 {
   GstFFMpegVidEnc *ffmpegenc = (GstFFMpegVidEnc *) encoder;
+  GstFlowReturn ret;
 
-  return gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+  gst_ffmpegvidenc_async_wait (ffmpegenc);
+
+  ret = gst_ffmpegvidenc_chunks_finish (ffmpegenc);
+  if (ret == GST_FLOW_OK)
+    ret = gst_ffmpegvidenc_two_pass_window (ffmpegenc);
+  if (ret != GST_FLOW_OK)
+    return ret;
+
+  g_mutex_lock (&ffmpegenc->codec_lock);
+  ret = gst_ffmpegvidenc_flush_buffers (ffmpegenc, TRUE);
+  g_mutex_unlock (&ffmpegenc->codec_lock);
+
+  return ret;
 }
 
 gboolean
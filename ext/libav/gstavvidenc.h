@@ -30,8 +30,19 @@
 
 G_BEGIN_DECLS
 
+/* number of pictures the rolling statistics are computed over */
+#define GST_FFMPEGVIDENC_QUALITY_WINDOW 64
+
 typedef struct _GstFFMpegVidEnc GstFFMpegVidEnc;
 
+typedef struct
+{
+  gsize size;
+  gint qp;
+  gboolean key;
+  GstClockTime duration;
+} GstFFMpegVidEncSample;
+
 struct _GstFFMpegVidEnc
 {
   GstVideoEncoder parent;
@@ -40,10 +51,15 @@ struct _GstFFMpegVidEnc
 
   AVCodecContext *context;
   AVFrame *picture;
+  AVPacket *pkt;
   gboolean opened;
   gboolean discont;
   guint pass;
   gfloat quantizer;
+  gint max_threads;
+  /* the threads and thread-type codec options were set explicitly */
+  gboolean threads_set;
+  gboolean thread_type_set;
 
   /* statistics file */
   gchar *filename;
@@ -54,6 +70,123 @@ struct _GstFFMpegVidEnc
   gsize working_buf_size;
 
   AVCodecContext *refcontext;
+
+  /* settings changed while encoding, protected by the object lock */
+  GList *pending_params;
+  gboolean reopen_pending;
+  /* frames sent since the last keyframe */
+  gint gop_position;
+
+  /* force-key-unit rate limiting */
+  GstClockTime min_force_key_unit_interval;
+  GstClockTime force_key_unit_window;
+  GstClockTime last_keyframe_ts;
+  gboolean keyframe_pending;
+
+  /* asynchronous encoding */
+  gboolean async_encode;
+  guint async_queue_size;
+  gint async_drop_policy;
+  GstTask *async_task;
+  GRecMutex async_task_lock;
+  /* serializes codec access between the streaming and the encoding thread,
+   * the latter takes the stream lock only to finish frames */
+  GMutex codec_lock;
+  /* protects the fields below */
+  GMutex async_lock;
+  GCond async_cond;
+  GQueue async_queue;
+  gboolean async_busy;
+  gboolean async_flushing;
+  GstFlowReturn async_flow;
+  gint async_depth;
+
+  /* adaptation to encoding taking longer than the frame interval */
+  gboolean overload_adaptation;
+  guint overload_hold;
+  GstClockTime overload_credit;
+
+  /* static frame detection */
+  gboolean skip_static;
+  GstClockTime max_skip_interval;
+  /* hashes of the planes of the last encoded frame, so that upstream gets
+   * its buffer back right away */
+  guint64 last_input_hash[GST_VIDEO_MAX_PLANES];
+  gboolean last_input_valid;
+  GstClockTime last_input_ts;
+
+  /* demand driven encoding, active and resume_pending are protected by the
+   * object lock */
+  gboolean active;
+  gboolean resume_pending;
+  gboolean inactive_drained;
+
+  /* parallel encoding of GOP sized chunks on separate contexts */
+  guint parallel_chunks;
+  gboolean chunks_refused;
+  GThreadPool *chunk_pool;
+  gpointer chunk_current;
+  gint64 chunks_busy_since;
+  gint chunks_flushing;
+  /* protects the fields below and the chunks' state */
+  GMutex chunk_lock;
+  GCond chunk_cond;
+  GQueue chunks;
+
+  /* in-memory two-pass encoding */
+  guint two_pass_lookahead;
+  GQueue lookahead_queue;
+
+  /* context opened in the background for an announced resolution, the
+   * request and settings_cookie are protected by the object lock */
+  gboolean standby_requested;
+  gint standby_width;
+  gint standby_height;
+  guint settings_cookie;
+  GThread *standby_thread;
+  AVCodecContext *standby_context;
+  GstVideoInfo standby_info;
+  guint standby_cookie;
+
+  /* statistics, protected by the object lock */
+  guint64 keyframe_requests;
+  guint64 keyframe_requests_merged;
+  guint64 keyframe_requests_deferred;
+  guint64 frames_dropped;
+  guint overload_level;
+  gdouble overload_load;
+  guint64 frames_inactive_dropped;
+  guint64 frames_static_checked;
+  guint64 frames_static_skipped;
+  guint64 chunks_encoded;
+  GstClockTime chunks_encode_time;
+  GstClockTime chunks_wall_time;
+  guint64 standby_switches;
+  guint64 frames_pooled;
+  guint64 frames_unaligned;
+  GstFFMpegVidEncSample quality[GST_FFMPEGVIDENC_QUALITY_WINDOW];
+  guint quality_pos;
+  guint quality_count;
+  GstClockTime encode_time;
+  guint64 target_bitrate;
+
+  /* region of interest quantizer offsets, protected by the object lock */
+  gdouble roi_quality_offset;
+  GstStructure *roi_type_offsets;
+
+  /* size of the encoded region of cropped input, 0 if not cropped */
+  gint crop_width;
+  gint crop_height;
+
+  /* input pool proposed upstream, protected by the object lock, and the
+   * stride alignment mask the codec wants */
+  GstBufferPool *input_pool;
+  gsize input_align;
+
+  /* output buffers for encoders writing packets directly (DR1) */
+  GstBufferPool *packet_pool;
+  guint packet_pool_size;
+  GstAllocationParams packet_params;
 };
 
 typedef struct _GstFFMpegVidEncClass GstFFMpegVidEncClass;
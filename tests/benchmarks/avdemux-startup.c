@@ -0,0 +1,171 @@
+/* GStreamer
+ * Copyright (C) 2026 gst-libav contributors
+ *
+ * avdemux-startup.c: time it takes avdemux to open a file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Measures the time from starting a filesrc ! avdemux_<format> pipeline
+ * until the demuxer added all its pads, with the default probing, bounded
+ * probing and fast-open.
+ *
+ * Usage: avdemux-startup FILE FORMAT [ITERATIONS]
+ * e.g. avdemux-startup movie.mp4 mov_mp4_m4a_3gp_3g2_mj2 */
+
+#include <stdlib.h>
+
+#include <gst/gst.h>
+
+#define DEFAULT_ITERATIONS 20
+
+static const gchar *configs[] = {
+  "",
+  "probesize=65536 analyzeduration=100000000 fpsprobesize=1",
+  "fast-open=true",
+  "probesize=65536 analyzeduration=100000000 fpsprobesize=1 fast-open=true",
+};
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+} StartupData;
+
+static void
+pad_added_cb (GstElement * demux, GstPad * pad, GstBin * pipeline)
+{
+  GstElement *sink;
+  GstPad *sinkpad;
+
+  sink = gst_element_factory_make ("fakesink", NULL);
+  g_object_set (sink, "async", FALSE, "sync", FALSE, NULL);
+  gst_bin_add (pipeline, sink);
+  gst_element_sync_state_with_parent (sink);
+
+  sinkpad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+static void
+no_more_pads_cb (GstElement * demux, StartupData * data)
+{
+  g_mutex_lock (&data->lock);
+  data->done = TRUE;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+}
+
+/* returns the time until no-more-pads, or GST_CLOCK_TIME_NONE on errors */
+static GstClockTime
+run_once (const gchar * location, const gchar * format, const gchar * config)
+{
+  GstElement *pipeline, *demux;
+  StartupData data;
+  GstClockTime start, elapsed = GST_CLOCK_TIME_NONE;
+  GError *err = NULL;
+  gchar *desc;
+  gint64 end_time;
+
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! avdemux_%s name=demux %s",
+      location, format, config);
+  pipeline = gst_parse_launch (desc, &err);
+  g_free (desc);
+  if (pipeline == NULL) {
+    g_printerr ("could not create pipeline: %s\n", err->message);
+    g_clear_error (&err);
+    return GST_CLOCK_TIME_NONE;
+  }
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.done = FALSE;
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  g_signal_connect (demux, "pad-added", G_CALLBACK (pad_added_cb), pipeline);
+  g_signal_connect (demux, "no-more-pads", G_CALLBACK (no_more_pads_cb),
+      &data);
+
+  start = gst_util_get_timestamp ();
+  if (gst_element_set_state (pipeline, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_FAILURE)
+    goto done;
+
+  end_time = g_get_monotonic_time () + 10 * G_TIME_SPAN_SECOND;
+  g_mutex_lock (&data.lock);
+  while (!data.done)
+    if (!g_cond_wait_until (&data.cond, &data.lock, end_time))
+      break;
+  if (data.done)
+    elapsed = gst_util_get_timestamp () - start;
+  g_mutex_unlock (&data.lock);
+
+done:
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (demux);
+  gst_object_unref (pipeline);
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  return elapsed;
+}
+
+gint
+main (gint argc, gchar * argv[])
+{
+  guint iterations = DEFAULT_ITERATIONS;
+  guint i, j;
+
+  gst_init (&argc, &argv);
+
+  if (argc < 3) {
+    g_print ("usage: %s FILE FORMAT [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 3)
+    iterations = MAX (atoi (argv[3]), 1);
+
+  for (i = 0; i < G_N_ELEMENTS (configs); i++) {
+    GstClockTime elapsed, total = 0, min = GST_CLOCK_TIME_NONE, max = 0;
+
+    /* warm up the page cache and the plugin registry */
+    if (run_once (argv[1], argv[2], configs[i]) == GST_CLOCK_TIME_NONE) {
+      g_printerr ("could not open %s with avdemux_%s %s\n", argv[1], argv[2],
+          configs[i]);
+      return 1;
+    }
+
+    for (j = 0; j < iterations; j++) {
+      elapsed = run_once (argv[1], argv[2], configs[i]);
+      if (elapsed == GST_CLOCK_TIME_NONE) {
+        g_printerr ("run %u failed\n", j);
+        return 1;
+      }
+      total += elapsed;
+      min = MIN (min, elapsed);
+      max = MAX (max, elapsed);
+    }
+
+    g_print ("%-72s avg %" GST_TIME_FORMAT " min %" GST_TIME_FORMAT
+        " max %" GST_TIME_FORMAT "\n", *configs[i] ? configs[i] : "(defaults)",
+        GST_TIME_ARGS (total / iterations), GST_TIME_ARGS (min),
+        GST_TIME_ARGS (max));
+  }
+
+  return 0;
+}
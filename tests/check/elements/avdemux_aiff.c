@@ -0,0 +1,445 @@
+/* GStreamer unit tests for avdemux_aiff
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gst/check/gstcheck.h>
+
+#include <gst/gst.h>
+
+/* mono 16 bit samples at 8 kHz, libavformat reads them in packets of 4096
+ * bytes */
+#define N_SAMPLES 8192
+#define DATA_SIZE (N_SAMPLES * 2)
+#define HEADER_SIZE 54
+#define FILE_SIZE (HEADER_SIZE + DATA_SIZE)
+#define PACKET_SIZE 4096
+#define CHUNK_SIZE 1000
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS ("audio/x-aiff"));
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static GstPad *mysrcpad, *mysinkpad;
+static GList *events;
+
+static gboolean
+have_avdemux_aiff (void)
+{
+  if (!gst_registry_check_feature_version (gst_registry_get (),
+          "avdemux_aiff", 1, 0, 0)) {
+    g_printerr ("Skipping test: avdemux_aiff not found\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* an AIFF file with a ramp, the header is written in the order libavformat
+ * can read without seeking */
+static guint8 *
+create_aiff (void)
+{
+  guint8 *data, *p;
+  guint i;
+
+  data = p = g_malloc (FILE_SIZE);
+
+  memcpy (p, "FORM", 4);
+  GST_WRITE_UINT32_BE (p + 4, FILE_SIZE - 8);
+  memcpy (p + 8, "AIFF", 4);
+  p += 12;
+
+  memcpy (p, "COMM", 4);
+  GST_WRITE_UINT32_BE (p + 4, 18);
+  GST_WRITE_UINT16_BE (p + 8, 1);
+  GST_WRITE_UINT32_BE (p + 10, N_SAMPLES);
+  GST_WRITE_UINT16_BE (p + 14, 16);
+  /* 8000 as 80 bit extended float */
+  GST_WRITE_UINT16_BE (p + 16, 16383 + 12);
+  GST_WRITE_UINT64_BE (p + 18, G_GUINT64_CONSTANT (8000) << (63 - 12));
+  p += 26;
+
+  memcpy (p, "SSND", 4);
+  GST_WRITE_UINT32_BE (p + 4, DATA_SIZE + 8);
+  GST_WRITE_UINT32_BE (p + 8, 0);
+  GST_WRITE_UINT32_BE (p + 12, 0);
+  p += 16;
+
+  for (i = 0; i < N_SAMPLES; i++, p += 2)
+    GST_WRITE_UINT16_BE (p, i * 8);
+
+  return data;
+}
+
+static gboolean
+sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  g_mutex_lock (&check_mutex);
+  events = g_list_append (events, event);
+  g_cond_signal (&check_cond);
+  g_mutex_unlock (&check_mutex);
+
+  return TRUE;
+}
+
+static void
+pad_added_cb (GstElement * demux, GstPad * pad, gpointer user_data)
+{
+  fail_unless (mysinkpad == NULL);
+
+  mysinkpad = gst_pad_new_from_static_template (&sinktemplate, "sink");
+  gst_pad_set_chain_function (mysinkpad, gst_check_chain_func);
+  gst_pad_set_event_function (mysinkpad, sink_event);
+  gst_pad_set_active (mysinkpad, TRUE);
+  fail_unless_equals_int (gst_pad_link (pad, mysinkpad), GST_PAD_LINK_OK);
+}
+
+static GstElement *
+setup_push_demux (void)
+{
+  GstElement *demux;
+
+  demux = gst_check_setup_element ("avdemux_aiff");
+  g_signal_connect (demux, "pad-added", G_CALLBACK (pad_added_cb), NULL);
+
+  /* upstream can't be pulled from */
+  mysrcpad = gst_check_setup_src_pad (demux, &srctemplate);
+  gst_pad_set_active (mysrcpad, TRUE);
+  fail_unless (gst_element_set_state (demux, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+  gst_check_setup_events (mysrcpad, demux, NULL, GST_FORMAT_BYTES);
+
+  return demux;
+}
+
+static void
+cleanup_push_demux (GstElement * demux)
+{
+  fail_unless_equals_int (gst_element_set_state (demux, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_check_teardown_src_pad (demux);
+  if (mysinkpad) {
+    gst_pad_set_active (mysinkpad, FALSE);
+    gst_object_unref (mysinkpad);
+    mysinkpad = NULL;
+  }
+  gst_check_teardown_element (demux);
+
+  gst_check_drop_buffers ();
+  g_list_free_full (events, (GDestroyNotify) gst_event_unref);
+  events = NULL;
+}
+
+static void
+push_data (const guint8 * data, gsize offset, gsize end)
+{
+  GstBuffer *buf;
+  gsize size;
+
+  for (; offset < end; offset += size) {
+    size = MIN (CHUNK_SIZE, end - offset);
+    buf = gst_buffer_new_allocate (NULL, size, NULL);
+    gst_buffer_fill (buf, 0, data + offset, size);
+    GST_BUFFER_OFFSET (buf) = offset;
+    fail_unless_equals_int (gst_pad_push (mysrcpad, buf), GST_FLOW_OK);
+  }
+}
+
+static GstEvent *
+marker_event (const gchar * name)
+{
+  return gst_event_new_custom (GST_EVENT_CUSTOM_DOWNSTREAM,
+      gst_structure_new_empty (name));
+}
+
+/* position of the first event of @type, named @name if not NULL, or -1.
+ * Call with the check mutex. */
+static gint
+find_event (GstEventType type, const gchar * name)
+{
+  GList *l;
+  gint i;
+
+  for (l = events, i = 0; l; l = l->next, i++) {
+    GstEvent *event = l->data;
+
+    if (GST_EVENT_TYPE (event) == type && (name == NULL ||
+            gst_event_has_name (event, name)))
+      return i;
+  }
+
+  return -1;
+}
+
+/* the chain function hands data over to the demuxer task through a ring of
+ * buffers, which has to survive a flush while the task waits for data and
+ * keep events in order with the data around them */
+GST_START_TEST (test_push_flush)
+{
+  GstElement *demux;
+  GstSegment segment;
+  guint8 *data;
+  gsize flush_offset = HEADER_SIZE + 2 * PACKET_SIZE + 1000;
+  gint before, flush_start, flush_stop, after, eos;
+  gsize size = 0;
+  GList *l;
+
+  if (!have_avdemux_aiff ())
+    return;
+
+  data = create_aiff ();
+  demux = setup_push_demux ();
+
+  /* the first two packets come out, the task then waits for the rest of the
+   * third one */
+  push_data (data, 0, flush_offset);
+  g_mutex_lock (&check_mutex);
+  while (g_list_length (buffers) < 2)
+    g_cond_wait (&check_cond, &check_mutex);
+  g_mutex_unlock (&check_mutex);
+
+  /* waits for the queued data to be taken */
+  fail_unless (gst_pad_push_event (mysrcpad, marker_event ("before-flush")));
+
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_flush_start ()));
+  fail_unless (gst_pad_push_event (mysrcpad,
+          gst_event_new_flush_stop (TRUE)));
+  gst_check_drop_buffers ();
+
+  /* picks up again with the data after the flush */
+  gst_segment_init (&segment, GST_FORMAT_BYTES);
+  segment.start = flush_offset;
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_segment (&segment)));
+  push_data (data, flush_offset, FILE_SIZE);
+  fail_unless (gst_pad_push_event (mysrcpad, marker_event ("after-flush")));
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()));
+
+  g_mutex_lock (&check_mutex);
+  while (find_event (GST_EVENT_EOS, NULL) < 0)
+    g_cond_wait (&check_cond, &check_mutex);
+
+  /* nothing was queued when flushing, the rest comes out */
+  for (l = buffers; l; l = l->next)
+    size += gst_buffer_get_size (l->data);
+  fail_unless_equals_int (size, DATA_SIZE - 2 * PACKET_SIZE);
+
+  before = find_event (GST_EVENT_CUSTOM_DOWNSTREAM, "before-flush");
+  flush_start = find_event (GST_EVENT_FLUSH_START, NULL);
+  flush_stop = find_event (GST_EVENT_FLUSH_STOP, NULL);
+  after = find_event (GST_EVENT_CUSTOM_DOWNSTREAM, "after-flush");
+  eos = find_event (GST_EVENT_EOS, NULL);
+  fail_unless (before >= 0);
+  fail_unless (before < flush_start);
+  fail_unless (flush_start < flush_stop);
+  fail_unless (flush_stop < after);
+  fail_unless (after < eos);
+  fail_unless_equals_int (eos, g_list_length (events) - 1);
+  g_mutex_unlock (&check_mutex);
+
+  cleanup_push_demux (demux);
+  g_free (data);
+}
+
+GST_END_TEST;
+
+/* EOS drains the data still queued and ends the stream */
+GST_START_TEST (test_push_eos)
+{
+  GstElement *demux;
+  GList *l;
+  guint8 *data;
+  gsize size = 0;
+
+  if (!have_avdemux_aiff ())
+    return;
+
+  data = create_aiff ();
+  demux = setup_push_demux ();
+
+  push_data (data, 0, FILE_SIZE);
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()));
+
+  g_mutex_lock (&check_mutex);
+  while (find_event (GST_EVENT_EOS, NULL) < 0)
+    g_cond_wait (&check_cond, &check_mutex);
+  for (l = buffers; l; l = l->next)
+    size += gst_buffer_get_size (l->data);
+  g_mutex_unlock (&check_mutex);
+
+  fail_unless_equals_int (size, DATA_SIZE);
+  fail_unless (gst_buffer_memcmp (buffers->data, 0, data + HEADER_SIZE,
+          PACKET_SIZE) == 0);
+
+  cleanup_push_demux (demux);
+  g_free (data);
+}
+
+GST_END_TEST;
+
+/* writes the generated file to a temporary file, returns its name */
+static gchar *
+write_aiff_file (void)
+{
+  gchar *filename;
+  guint8 *data;
+  gint fd;
+
+  fd = g_file_open_tmp ("avdemux-aiff-XXXXXX", &filename, NULL);
+  fail_unless (fd >= 0);
+  g_close (fd, NULL);
+
+  data = create_aiff ();
+  fail_unless (g_file_set_contents (filename, (const gchar *) data, FILE_SIZE,
+          NULL));
+  g_free (data);
+
+  return filename;
+}
+
+/* plays @location through avdemux_aiff set up with @props until EOS, or
+ * only prerolls it, and returns the demuxer's index */
+static GBytes *
+demux_index (const gchar * location, const gchar * props, gboolean play)
+{
+  GstElement *pipeline, *demux;
+  GstStateChangeReturn state_ret;
+  GstMessage *msg;
+  GstBus *bus;
+  GBytes *index = NULL;
+  gchar *desc;
+
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! avdemux_aiff "
+      "name=demux %s ! fakesink sync=false", location, props);
+  pipeline = gst_parse_launch (desc, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (desc);
+
+  if (play) {
+    fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) !=
+        GST_STATE_CHANGE_FAILURE);
+    bus = gst_element_get_bus (pipeline);
+    msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+        GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    fail_unless_equals_int (GST_MESSAGE_TYPE (msg), GST_MESSAGE_EOS);
+    gst_message_unref (msg);
+    gst_object_unref (bus);
+  } else {
+    state_ret = gst_element_set_state (pipeline, GST_STATE_PAUSED);
+    fail_unless (state_ret != GST_STATE_CHANGE_FAILURE);
+    state_ret = gst_element_get_state (pipeline, NULL, NULL, -1);
+    fail_unless_equals_int (state_ret, GST_STATE_CHANGE_SUCCESS);
+  }
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  g_object_get (demux, "index", &index, NULL);
+  gst_object_unref (demux);
+
+  /* saves the index file */
+  fail_unless_equals_int (gst_element_set_state (pipeline, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+
+  return index;
+}
+
+/* AIFF has no index, so one is collected while playing through in pull mode
+ * with an index file set, and loaded from it the next time */
+GST_START_TEST (test_index_collect)
+{
+  GBytes *index, *saved;
+  gchar *location, *index_file, *props, *contents;
+  const guint8 *data;
+  gsize length;
+  guint i;
+  gint fd;
+
+  if (!have_avdemux_aiff ())
+    return;
+
+  location = write_aiff_file ();
+  fd = g_file_open_tmp ("avdemux-index-XXXXXX", &index_file, NULL);
+  fail_unless (fd >= 0);
+  g_close (fd, NULL);
+  g_unlink (index_file);
+
+  /* nothing is collected without a place to keep it */
+  index = demux_index (location, "", TRUE);
+  fail_unless (index == NULL);
+
+  props = g_strdup_printf ("index-file=\"%s\"", index_file);
+  index = demux_index (location, props, TRUE);
+  fail_unless (index != NULL);
+
+  fail_unless (g_file_get_contents (index_file, &contents, &length, NULL));
+  saved = g_bytes_new_take (contents, length);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+
+  /* one stream in samples, with a keyframe for each packet */
+  data = g_bytes_get_data (index, &length);
+  fail_unless (length >= 32);
+  fail_unless (memcmp (data, "GAVI", 4) == 0);
+  fail_unless_equals_int64 (GST_READ_UINT64_LE (data + 8), FILE_SIZE);
+  fail_unless_equals_int (GST_READ_UINT32_LE (data + 16), 1);
+  fail_unless_equals_int (GST_READ_UINT32_LE (data + 20), 1);
+  fail_unless_equals_int (GST_READ_UINT32_LE (data + 24), 8000);
+  fail_unless_equals_int (GST_READ_UINT32_LE (data + 28),
+      DATA_SIZE / PACKET_SIZE);
+  fail_unless_equals_int (length, 32 + 16 * DATA_SIZE / PACKET_SIZE);
+  for (i = 0; i < DATA_SIZE / PACKET_SIZE; i++) {
+    fail_unless_equals_int64 (GST_READ_UINT64_LE (data + 32 + 16 * i),
+        i * PACKET_SIZE / 2);
+    fail_unless_equals_int64 (GST_READ_UINT64_LE (data + 40 + 16 * i),
+        HEADER_SIZE + i * PACKET_SIZE);
+  }
+
+  /* prerolling finds nothing new */
+  saved = demux_index (location, props, FALSE);
+  fail_unless (saved != NULL);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+
+  g_bytes_unref (index);
+  g_free (props);
+  g_unlink (index_file);
+  g_free (index_file);
+  g_unlink (location);
+  g_free (location);
+}
+
+GST_END_TEST;
+
+static Suite *
+avdemux_aiff_suite (void)
+{
+  Suite *s = suite_create ("avdemux_aiff");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_push_flush);
+  tcase_add_test (tc_chain, test_push_eos);
+  tcase_add_test (tc_chain, test_index_collect);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avdemux_aiff)
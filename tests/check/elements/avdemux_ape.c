@@ -18,6 +18,9 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <string.h>
+
+#include <glib/gstdio.h>
 #include <gst/check/gstcheck.h>
 
 #include <gst/gst.h>
@@ -191,6 +194,355 @@ GST_START_TEST (test_tag_caching)
 
 GST_END_TEST;
 
+static GstPadProbeReturn
+buffer_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstBuffer **p_buf = user_data;
+
+  if (*p_buf == NULL)
+    *p_buf = gst_buffer_ref (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* returns the first buffer coming out of the demuxer described by @demux */
+static GstBuffer *
+demux_first_buffer (const gchar * demux)
+{
+  GstStateChangeReturn state_ret;
+  GstElement *pipeline, *sink;
+  GstBuffer *buf = NULL;
+  GstPad *pad;
+  gchar *path, *desc;
+
+  path = g_build_filename (GST_TEST_FILES_PATH, "586957.ape", NULL);
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! %s ! "
+      "fakesink name=sink", path, demux);
+  pipeline = gst_parse_launch (desc, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (desc);
+  g_free (path);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, buffer_probe, &buf,
+      NULL);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+
+  state_ret = gst_element_set_state (pipeline, GST_STATE_PAUSED);
+  fail_unless (state_ret != GST_STATE_CHANGE_FAILURE);
+  if (state_ret == GST_STATE_CHANGE_ASYNC) {
+    state_ret = gst_element_get_state (pipeline, NULL, NULL, -1);
+    fail_unless_equals_int (state_ret, GST_STATE_CHANGE_SUCCESS);
+  }
+
+  fail_unless_equals_int (gst_element_set_state (pipeline, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+
+  fail_unless (buf != NULL);
+  return buf;
+}
+
+static gboolean
+have_avdemux_ape (void)
+{
+  if (!gst_registry_check_feature_version (gst_registry_get (),
+          "avdemux_ape", 1, 0, 0)) {
+    g_printerr ("Skipping test: avdemux_ape not found\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* packets are handed over without copying them */
+GST_START_TEST (test_zero_copy)
+{
+  GstBuffer *buf;
+  GstMemory *mem;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  buf = demux_first_buffer ("avdemux_ape");
+  fail_unless_equals_int (gst_buffer_n_memory (buf), 1);
+  mem = gst_buffer_peek_memory (buf, 0);
+  fail_unless (GST_MEMORY_IS_READONLY (mem));
+  fail_unless (GST_MEMORY_IS_ZERO_PADDED (mem));
+  gst_buffer_unref (buf);
+}
+
+GST_END_TEST;
+
+/* reading through a small AVIO buffer gives the same packets with and
+ * without read-ahead, prefetching and caching */
+GST_START_TEST (test_read_ahead)
+{
+  GstBuffer *ref, *buf;
+  GstMapInfo map;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  ref = demux_first_buffer ("avdemux_ape mmap=false avio-buffer-size=512 "
+      "max-read-ahead=0 cache-size=0");
+  buf = demux_first_buffer ("avdemux_ape mmap=false avio-buffer-size=512 "
+      "max-read-ahead=65536 prefetch=true");
+
+  fail_unless_equals_int (gst_buffer_get_size (buf),
+      gst_buffer_get_size (ref));
+  fail_unless (gst_buffer_map (ref, &map, GST_MAP_READ));
+  fail_unless (gst_buffer_memcmp (buf, 0, map.data, map.size) == 0);
+  gst_buffer_unref (buf);
+
+  /* with a cache small enough to evict while reading the headers */
+  buf = demux_first_buffer ("avdemux_ape mmap=false avio-buffer-size=512 "
+      "max-read-ahead=4096 cache-size=8192");
+  fail_unless (gst_buffer_memcmp (buf, 0, map.data, map.size) == 0);
+  gst_buffer_unref (buf);
+
+  gst_buffer_unmap (ref, &map);
+  gst_buffer_unref (ref);
+}
+
+GST_END_TEST;
+
+static void
+wait_for_preroll (GstElement * pipeline)
+{
+  GstStateChangeReturn state_ret;
+
+  state_ret = gst_element_get_state (pipeline, NULL, NULL, -1);
+  fail_unless_equals_int (state_ret, GST_STATE_CHANGE_SUCCESS);
+}
+
+/* returns the first buffer coming out of the demuxer described by @demux
+ * after seeking to each of @n_seeks fractions of the duration */
+static GstBuffer **
+demux_seek_buffers (const gchar * demux, const gdouble * seeks,
+    guint n_seeks)
+{
+  GstElement *pipeline, *sink;
+  GstBuffer *buf = NULL, **bufs;
+  gint64 duration;
+  GstPad *pad;
+  gchar *path, *desc;
+  guint i;
+
+  path = g_build_filename (GST_TEST_FILES_PATH, "586957.ape", NULL);
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! %s ! "
+      "fakesink name=sink", path, demux);
+  pipeline = gst_parse_launch (desc, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (desc);
+  g_free (path);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, buffer_probe, &buf,
+      NULL);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PAUSED) !=
+      GST_STATE_CHANGE_FAILURE);
+  wait_for_preroll (pipeline);
+  fail_unless (gst_element_query_duration (pipeline, GST_FORMAT_TIME,
+          &duration));
+
+  bufs = g_new0 (GstBuffer *, n_seeks);
+  for (i = 0; i < n_seeks; i++) {
+    /* the streaming thread waits in the sink until the flush */
+    gst_buffer_replace (&buf, NULL);
+    fail_unless (gst_element_seek_simple (pipeline, GST_FORMAT_TIME,
+            GST_SEEK_FLAG_FLUSH, (gint64) (duration * seeks[i])));
+    wait_for_preroll (pipeline);
+    fail_unless (buf != NULL);
+    bufs[i] = buf;
+    buf = NULL;
+  }
+
+  fail_unless_equals_int (gst_element_set_state (pipeline, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+
+  return bufs;
+}
+
+/* seeking cancels prefetching of the range after the last read, jumping
+ * around gives the same packets as without prefetching */
+GST_START_TEST (test_prefetch_seek)
+{
+  static const gdouble seeks[] = { 0.5, 0.25, 0.75, 0.0, 0.9, 0.1 };
+  GstBuffer **ref, **bufs;
+  GstMapInfo map;
+  guint i;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  ref = demux_seek_buffers ("avdemux_ape mmap=false avio-buffer-size=512 "
+      "max-read-ahead=0 cache-size=0", seeks, G_N_ELEMENTS (seeks));
+  bufs = demux_seek_buffers ("avdemux_ape mmap=false avio-buffer-size=512 "
+      "max-read-ahead=65536 cache-size=0 prefetch=true", seeks,
+      G_N_ELEMENTS (seeks));
+
+  for (i = 0; i < G_N_ELEMENTS (seeks); i++) {
+    fail_unless_equals_uint64 (GST_BUFFER_PTS (bufs[i]),
+        GST_BUFFER_PTS (ref[i]));
+    fail_unless_equals_int (gst_buffer_get_size (bufs[i]),
+        gst_buffer_get_size (ref[i]));
+    fail_unless (gst_buffer_map (ref[i], &map, GST_MAP_READ));
+    fail_unless (gst_buffer_memcmp (bufs[i], 0, map.data, map.size) == 0);
+    gst_buffer_unmap (ref[i], &map);
+    gst_buffer_unref (bufs[i]);
+    gst_buffer_unref (ref[i]);
+  }
+  g_free (bufs);
+  g_free (ref);
+}
+
+GST_END_TEST;
+
+/* reading the mapped file gives the same packets as pulling it */
+GST_START_TEST (test_mmap)
+{
+  GstBuffer *ref, *buf;
+  GstMapInfo map;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  ref = demux_first_buffer ("avdemux_ape mmap=false");
+  buf = demux_first_buffer ("avdemux_ape mmap=true");
+
+  fail_unless_equals_int (gst_buffer_get_size (buf),
+      gst_buffer_get_size (ref));
+  fail_unless (gst_buffer_map (ref, &map, GST_MAP_READ));
+  fail_unless (gst_buffer_memcmp (buf, 0, map.data, map.size) == 0);
+  gst_buffer_unmap (ref, &map);
+
+  gst_buffer_unref (buf);
+  gst_buffer_unref (ref);
+}
+
+GST_END_TEST;
+
+/* ape headers describe the stream completely, so opening without probing
+ * gives the same packets, as does probing less */
+GST_START_TEST (test_fast_open)
+{
+  GstBuffer *ref, *buf;
+  GstMapInfo map;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  ref = demux_first_buffer ("avdemux_ape");
+  fail_unless (gst_buffer_map (ref, &map, GST_MAP_READ));
+
+  buf = demux_first_buffer ("avdemux_ape fast-open=true");
+  fail_unless_equals_int (gst_buffer_get_size (buf), map.size);
+  fail_unless (gst_buffer_memcmp (buf, 0, map.data, map.size) == 0);
+  gst_buffer_unref (buf);
+
+  buf = demux_first_buffer ("avdemux_ape probesize=2048 "
+      "analyzeduration=10000000 fpsprobesize=1");
+  fail_unless_equals_int (gst_buffer_get_size (buf), map.size);
+  fail_unless (gst_buffer_memcmp (buf, 0, map.data, map.size) == 0);
+  gst_buffer_unref (buf);
+
+  gst_buffer_unmap (ref, &map);
+  gst_buffer_unref (ref);
+}
+
+GST_END_TEST;
+
+/* prerolls the ape test file with @index_file and returns the demuxer's
+ * index */
+static GBytes *
+demux_index (const gchar * index_file)
+{
+  GstElement *pipeline, *demux;
+  GstStateChangeReturn state_ret;
+  GBytes *index = NULL;
+  gchar *path, *desc;
+
+  path = g_build_filename (GST_TEST_FILES_PATH, "586957.ape", NULL);
+  desc = g_strdup_printf ("filesrc location=\"%s\" ! avdemux_ape name=demux "
+      "index-file=\"%s\" ! fakesink", path, index_file);
+  pipeline = gst_parse_launch (desc, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (desc);
+  g_free (path);
+
+  state_ret = gst_element_set_state (pipeline, GST_STATE_PAUSED);
+  fail_unless (state_ret != GST_STATE_CHANGE_FAILURE);
+  if (state_ret == GST_STATE_CHANGE_ASYNC) {
+    state_ret = gst_element_get_state (pipeline, NULL, NULL, -1);
+    fail_unless_equals_int (state_ret, GST_STATE_CHANGE_SUCCESS);
+  }
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  g_object_get (demux, "index", &index, NULL);
+  gst_object_unref (demux);
+
+  fail_unless_equals_int (gst_element_set_state (pipeline, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+
+  fail_unless (index != NULL);
+  return index;
+}
+
+/* the index is saved to the index file when closing and read back from it
+ * when opening again */
+GST_START_TEST (test_index_file)
+{
+  GBytes *index, *saved;
+  gchar *index_file, *contents;
+  gsize length;
+  gint fd;
+
+  if (!have_avdemux_ape ())
+    return;
+
+  fd = g_file_open_tmp ("avdemux-index-XXXXXX", &index_file, NULL);
+  fail_unless (fd >= 0);
+  g_close (fd, NULL);
+  g_unlink (index_file);
+
+  index = demux_index (index_file);
+  fail_unless (g_bytes_get_size (index) >= 20);
+  fail_unless (memcmp (g_bytes_get_data (index, NULL), "GAVI", 4) == 0);
+
+  fail_unless (g_file_get_contents (index_file, &contents, &length, NULL));
+  saved = g_bytes_new_take (contents, length);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+
+  saved = demux_index (index_file);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+
+  /* garbage is ignored and replaced */
+  fail_unless (g_file_set_contents (index_file, "garbage", -1, NULL));
+  saved = demux_index (index_file);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+  fail_unless (g_file_get_contents (index_file, &contents, &length, NULL));
+  saved = g_bytes_new_take (contents, length);
+  fail_unless (g_bytes_equal (index, saved));
+  g_bytes_unref (saved);
+
+  g_bytes_unref (index);
+  g_unlink (index_file);
+  g_free (index_file);
+}
+
+GST_END_TEST;
+
 static Suite *
 avdemux_ape_suite (void)
 {
@@ -199,6 +551,12 @@ avdemux_ape_suite (void)
 
   suite_add_tcase (s, tc_chain);
   tcase_add_test (tc_chain, test_tag_caching);
+  tcase_add_test (tc_chain, test_zero_copy);
+  tcase_add_test (tc_chain, test_read_ahead);
+  tcase_add_test (tc_chain, test_prefetch_seek);
+  tcase_add_test (tc_chain, test_mmap);
+  tcase_add_test (tc_chain, test_fast_open);
+  tcase_add_test (tc_chain, test_index_file);
 
   return s;
 }
@@ -0,0 +1,277 @@
+/* GStreamer unit tests for avdemux_yuv4mpegpipe
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <string.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/video/video.h>
+
+#include <gst/gst.h>
+
+/* I420 with a width that isn't a multiple of 4, so the rows libavformat
+ * leaves unpadded differ from the default layout of the caps */
+#define WIDTH 10
+#define HEIGHT 4
+#define N_FRAMES 2
+#define Y4M_HEADER "YUV4MPEG2 W10 H4 F25:1 Ip A1:1 C420jpeg\n"
+#define FRAME_HEADER "FRAME\n"
+#define FRAME_SIZE (WIDTH * HEIGHT + 2 * (WIDTH / 2) * (HEIGHT / 2))
+#define FILE_SIZE (sizeof (Y4M_HEADER) - 1 + \
+    N_FRAMES * (sizeof (FRAME_HEADER) - 1 + FRAME_SIZE))
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC, GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("application/x-yuv4mpeg, y4mversion=(int)2"));
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static GstPad *mysrcpad, *mysinkpad;
+static gboolean have_eos;
+/* whether the sink advertises GstVideoMeta in the allocation query */
+static gboolean sink_video_meta;
+
+static gboolean
+have_avdemux_y4m (void)
+{
+  if (!gst_registry_check_feature_version (gst_registry_get (),
+          "avdemux_yuv4mpegpipe", 1, 0, 0)) {
+    g_printerr ("Skipping test: avdemux_yuv4mpegpipe not found\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* value of the sample at @x,@y of @plane in frame @n */
+static guint8
+sample_value (guint n, guint plane, guint x, guint y)
+{
+  return (n * 64 + plane * 32 + y * 8 + x) & 0xff;
+}
+
+/* a stream of planar frames stored without padding */
+static guint8 *
+create_y4m (void)
+{
+  guint8 *data, *p;
+  guint n, c, x, y;
+
+  data = p = g_malloc (FILE_SIZE);
+
+  memcpy (p, Y4M_HEADER, sizeof (Y4M_HEADER) - 1);
+  p += sizeof (Y4M_HEADER) - 1;
+
+  for (n = 0; n < N_FRAMES; n++) {
+    memcpy (p, FRAME_HEADER, sizeof (FRAME_HEADER) - 1);
+    p += sizeof (FRAME_HEADER) - 1;
+    for (c = 0; c < 3; c++) {
+      guint w = c ? WIDTH / 2 : WIDTH;
+      guint h = c ? HEIGHT / 2 : HEIGHT;
+
+      for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+          *p++ = sample_value (n, c, x, y);
+    }
+  }
+
+  return data;
+}
+
+static gboolean
+sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  if (GST_EVENT_TYPE (event) == GST_EVENT_EOS) {
+    g_mutex_lock (&check_mutex);
+    have_eos = TRUE;
+    g_cond_signal (&check_cond);
+    g_mutex_unlock (&check_mutex);
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static gboolean
+sink_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  if (GST_QUERY_TYPE (query) == GST_QUERY_ALLOCATION) {
+    if (sink_video_meta)
+      gst_query_add_allocation_meta (query, GST_VIDEO_META_API_TYPE, NULL);
+    return TRUE;
+  }
+
+  return gst_pad_query_default (pad, parent, query);
+}
+
+static void
+pad_added_cb (GstElement * demux, GstPad * pad, gpointer user_data)
+{
+  fail_unless (mysinkpad == NULL);
+
+  mysinkpad = gst_pad_new_from_static_template (&sinktemplate, "sink");
+  gst_pad_set_chain_function (mysinkpad, gst_check_chain_func);
+  gst_pad_set_event_function (mysinkpad, sink_event);
+  gst_pad_set_query_function (mysinkpad, sink_query);
+  gst_pad_set_active (mysinkpad, TRUE);
+  fail_unless_equals_int (gst_pad_link (pad, mysinkpad), GST_PAD_LINK_OK);
+}
+
+/* pushes the whole stream through the demuxer and waits for EOS, returns
+ * the caps of the video */
+static GstCaps *
+demux_y4m (void)
+{
+  GstElement *demux;
+  GstBuffer *buf;
+  GstCaps *caps;
+  guint8 *data;
+
+  demux = gst_check_setup_element ("avdemux_yuv4mpegpipe");
+  g_signal_connect (demux, "pad-added", G_CALLBACK (pad_added_cb), NULL);
+
+  mysrcpad = gst_check_setup_src_pad (demux, &srctemplate);
+  gst_pad_set_active (mysrcpad, TRUE);
+  fail_unless (gst_element_set_state (demux, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+  gst_check_setup_events (mysrcpad, demux, NULL, GST_FORMAT_BYTES);
+
+  data = create_y4m ();
+  buf = gst_buffer_new_wrapped (data, FILE_SIZE);
+  fail_unless_equals_int (gst_pad_push (mysrcpad, buf), GST_FLOW_OK);
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()));
+
+  g_mutex_lock (&check_mutex);
+  while (!have_eos)
+    g_cond_wait (&check_cond, &check_mutex);
+  g_mutex_unlock (&check_mutex);
+
+  fail_unless (mysinkpad != NULL);
+  caps = gst_pad_get_current_caps (mysinkpad);
+  fail_unless (caps != NULL);
+
+  fail_unless_equals_int (gst_element_set_state (demux, GST_STATE_NULL),
+      GST_STATE_CHANGE_SUCCESS);
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_check_teardown_src_pad (demux);
+  gst_pad_set_active (mysinkpad, FALSE);
+  gst_object_unref (mysinkpad);
+  mysinkpad = NULL;
+  gst_check_teardown_element (demux);
+  have_eos = FALSE;
+
+  return caps;
+}
+
+/* checks every sample of the frames, in whatever layout they came in */
+static void
+check_frames (GstCaps * caps)
+{
+  GstVideoInfo info;
+  GstVideoFrame frame;
+  GList *l;
+  guint n, c, x, y;
+
+  fail_unless (gst_video_info_from_caps (&info, caps));
+  fail_unless_equals_int (GST_VIDEO_INFO_FORMAT (&info),
+      GST_VIDEO_FORMAT_I420);
+  fail_unless_equals_int (GST_VIDEO_INFO_WIDTH (&info), WIDTH);
+  fail_unless_equals_int (GST_VIDEO_INFO_HEIGHT (&info), HEIGHT);
+  fail_unless_equals_int (g_list_length (buffers), N_FRAMES);
+
+  for (l = buffers, n = 0; l; l = l->next, n++) {
+    fail_unless (gst_video_frame_map (&frame, &info, l->data, GST_MAP_READ));
+    for (c = 0; c < 3; c++) {
+      guint8 *p = GST_VIDEO_FRAME_COMP_DATA (&frame, c);
+      gint stride = GST_VIDEO_FRAME_COMP_STRIDE (&frame, c);
+
+      for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT (&frame, c); y++)
+        for (x = 0; x < GST_VIDEO_FRAME_COMP_WIDTH (&frame, c); x++)
+          fail_unless_equals_int (p[y * stride + x],
+              sample_value (n, c, x, y));
+    }
+    gst_video_frame_unmap (&frame);
+  }
+}
+
+/* downstream takes the packets as they are, described by a GstVideoMeta */
+GST_START_TEST (test_rawvideo_meta)
+{
+  GstVideoMeta *meta;
+  GstCaps *caps;
+
+  if (!have_avdemux_y4m ())
+    return;
+
+  sink_video_meta = TRUE;
+  caps = demux_y4m ();
+  check_frames (caps);
+
+  fail_unless_equals_int (gst_buffer_get_size (buffers->data), FRAME_SIZE);
+  meta = gst_buffer_get_video_meta (buffers->data);
+  fail_unless (meta != NULL);
+  fail_unless_equals_int (meta->stride[0], WIDTH);
+  fail_unless_equals_int (meta->stride[1], WIDTH / 2);
+  fail_unless_equals_int (meta->stride[2], WIDTH / 2);
+  fail_unless_equals_int (meta->offset[1], WIDTH * HEIGHT);
+  fail_unless_equals_int (meta->offset[2],
+      WIDTH * HEIGHT + (WIDTH / 2) * (HEIGHT / 2));
+
+  gst_caps_unref (caps);
+  gst_check_drop_buffers ();
+}
+
+GST_END_TEST;
+
+/* downstream doesn't handle GstVideoMeta, so the packets are repacked into
+ * the default layout of the caps */
+GST_START_TEST (test_rawvideo_repack)
+{
+  GstVideoInfo info;
+  GstCaps *caps;
+
+  if (!have_avdemux_y4m ())
+    return;
+
+  sink_video_meta = FALSE;
+  caps = demux_y4m ();
+  check_frames (caps);
+
+  fail_unless (gst_video_info_from_caps (&info, caps));
+  fail_if (GST_VIDEO_INFO_SIZE (&info) == FRAME_SIZE);
+  fail_unless_equals_int (gst_buffer_get_size (buffers->data),
+      GST_VIDEO_INFO_SIZE (&info));
+  fail_unless (gst_buffer_get_video_meta (buffers->data) == NULL);
+
+  gst_caps_unref (caps);
+  gst_check_drop_buffers ();
+}
+
+GST_END_TEST;
+
+static Suite *
+avdemux_y4m_suite (void)
+{
+  Suite *s = suite_create ("avdemux_y4m");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_rawvideo_meta);
+  tcase_add_test (tc_chain, test_rawvideo_repack);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avdemux_y4m)
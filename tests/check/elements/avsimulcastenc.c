@@ -0,0 +1,310 @@
+/* GStreamer unit tests for the libav simulcast encoders
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+
+#include <gst/gst.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define FPS 30
+#define FRAME_SIZE (WIDTH * HEIGHT * 3 / 2)
+#define VIDEO_CAPS_STR "video/x-raw, format=(string)I420, " \
+    "width=(int)320, height=(int)240, framerate=(fraction)30/1"
+
+#define N_LAYERS 2
+
+typedef struct
+{
+  GstElement *element;
+  GstHarness *h[N_LAYERS];
+} SimulcastTest;
+
+static gboolean
+setup_simulcast (SimulcastTest * test, const gchar * props)
+{
+  GstElementFactory *factory;
+  gchar *desc;
+  guint i;
+
+  factory = gst_element_factory_find ("avsimulcastenc_mpeg4");
+  if (!factory) {
+    g_printerr ("Skipping test: avsimulcastenc_mpeg4 not found\n");
+    return FALSE;
+  }
+  gst_object_unref (factory);
+
+  desc = g_strdup_printf ("avsimulcastenc_mpeg4 layers=320x240,160x120 %s",
+      props);
+  test->element = gst_parse_launch (desc, NULL);
+  g_free (desc);
+  fail_unless (test->element != NULL);
+
+  /* one harness per layer, the first one feeds the input */
+  for (i = 0; i < N_LAYERS; i++) {
+    gchar *name = g_strdup_printf ("src_%u", i);
+
+    test->h[i] = gst_harness_new_with_element (test->element,
+        i == 0 ? "sink" : NULL, name);
+    g_free (name);
+  }
+  gst_harness_set_src_caps_str (test->h[0], VIDEO_CAPS_STR);
+
+  return TRUE;
+}
+
+static void
+teardown_simulcast (SimulcastTest * test)
+{
+  guint i;
+
+  for (i = 0; i < N_LAYERS; i++)
+    gst_harness_teardown (test->h[i]);
+  gst_object_unref (test->element);
+}
+
+static GstBuffer *
+create_frame (guint n)
+{
+  GstBuffer *buf;
+
+  buf = gst_buffer_new_allocate (NULL, FRAME_SIZE, NULL);
+  gst_buffer_memset (buf, 0, 0x80, FRAME_SIZE);
+  /* leave room for decoding timestamps before the first frame */
+  GST_BUFFER_PTS (buf) = GST_SECOND + gst_util_uint64_scale (n, GST_SECOND,
+      FPS);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (1, GST_SECOND, FPS);
+
+  return buf;
+}
+
+static GstEvent *
+force_key_unit_event (void)
+{
+  return gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM,
+      gst_structure_new ("GstForceKeyUnit",
+          "running-time", G_TYPE_UINT64, GST_CLOCK_TIME_NONE,
+          "all-headers", G_TYPE_BOOLEAN, FALSE, NULL));
+}
+
+/* bit n set if the output frame with the timestamp of input frame n is a
+ * keyframe */
+static guint64
+pull_keyframe_mask (GstHarness * h)
+{
+  GstBuffer *buf;
+  guint64 mask = 0;
+  guint n;
+
+  while ((buf = gst_harness_try_pull (h))) {
+    n = gst_util_uint64_scale_round (GST_BUFFER_PTS (buf) - GST_SECOND, FPS,
+        GST_SECOND);
+    if (!GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT) && n < 64)
+      mask |= G_GUINT64_CONSTANT (1) << n;
+    gst_buffer_unref (buf);
+  }
+
+  return mask;
+}
+
+#define KEYFRAME(n) (G_GUINT64_CONSTANT (1) << (n))
+
+GST_START_TEST (test_layer_caps)
+{
+  static const gint sizes[N_LAYERS][2] = { {320, 240}, {160, 120} };
+  SimulcastTest test;
+  GstStructure *s;
+  GstBuffer *buf;
+  GstCaps *caps;
+  gint width, height, bitrate;
+  guint i;
+
+  if (!setup_simulcast (&test, "bitrate=400000"))
+    return;
+
+  fail_unless_equals_int (gst_harness_push (test.h[0], create_frame (0)),
+      GST_FLOW_OK);
+
+  for (i = 0; i < N_LAYERS; i++) {
+    buf = gst_harness_pull (test.h[i]);
+    fail_unless (buf != NULL);
+    fail_unless_equals_uint64 (GST_BUFFER_PTS (buf), GST_SECOND);
+    gst_buffer_unref (buf);
+
+    caps = gst_pad_get_current_caps (test.h[i]->sinkpad);
+    fail_unless (caps != NULL);
+    s = gst_caps_get_structure (caps, 0);
+    fail_unless (gst_structure_has_name (s, "video/mpeg"));
+    fail_unless (gst_structure_get_int (s, "width", &width));
+    fail_unless (gst_structure_get_int (s, "height", &height));
+    fail_unless_equals_int (width, sizes[i][0]);
+    fail_unless_equals_int (height, sizes[i][1]);
+    gst_caps_unref (caps);
+  }
+
+  /* the codec options are shared with avenc */
+  g_object_get (test.element, "bitrate", &bitrate, NULL);
+  fail_unless_equals_int (bitrate, 400000);
+
+  teardown_simulcast (&test);
+}
+
+GST_END_TEST;
+
+static void
+check_keyframe_sync (gboolean sync)
+{
+  SimulcastTest test;
+  guint i;
+
+  if (!setup_simulcast (&test, sync ? "gop-size=300" :
+          "gop-size=300 sync-keyframes=false"))
+    return;
+
+  for (i = 0; i < 10; i++) {
+    /* asked for on the small layer only */
+    if (i == 5)
+      fail_unless (gst_harness_push_upstream_event (test.h[1],
+              force_key_unit_event ()));
+    fail_unless_equals_int (gst_harness_push (test.h[0], create_frame (i)),
+        GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (test.h[0], gst_event_new_eos ()));
+
+  fail_unless_equals_uint64 (pull_keyframe_mask (test.h[0]),
+      sync ? KEYFRAME (0) | KEYFRAME (5) : KEYFRAME (0));
+  fail_unless_equals_uint64 (pull_keyframe_mask (test.h[1]),
+      KEYFRAME (0) | KEYFRAME (5));
+
+  teardown_simulcast (&test);
+}
+
+GST_START_TEST (test_keyframe_sync)
+{
+  check_keyframe_sync (TRUE);
+  check_keyframe_sync (FALSE);
+}
+
+GST_END_TEST;
+
+/* B-frames are held back by the codecs and have to come out on EOS, with
+ * decoding timestamps */
+GST_START_TEST (test_eos_drain)
+{
+  SimulcastTest test;
+  GstClockTime last_dts;
+  GstBuffer *buf;
+  GstEvent *event;
+  guint i, n_buffers, n_frames = 10;
+  gboolean got_eos;
+
+  if (!setup_simulcast (&test, "max-bframes=2"))
+    return;
+
+  for (i = 0; i < n_frames; i++)
+    fail_unless_equals_int (gst_harness_push (test.h[0], create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (test.h[0], gst_event_new_eos ()));
+
+  for (i = 0; i < N_LAYERS; i++) {
+    n_buffers = 0;
+    last_dts = 0;
+    while ((buf = gst_harness_try_pull (test.h[i]))) {
+      fail_unless (GST_BUFFER_PTS_IS_VALID (buf));
+      fail_unless (GST_BUFFER_DTS_IS_VALID (buf));
+      fail_unless (GST_BUFFER_DTS (buf) <= GST_BUFFER_PTS (buf));
+      fail_unless (GST_BUFFER_DTS (buf) >= last_dts);
+      last_dts = GST_BUFFER_DTS (buf);
+      n_buffers++;
+      gst_buffer_unref (buf);
+    }
+    fail_unless_equals_int (n_buffers, n_frames);
+
+    got_eos = FALSE;
+    while ((event = gst_harness_try_pull_event (test.h[i]))) {
+      if (GST_EVENT_TYPE (event) == GST_EVENT_EOS)
+        got_eos = TRUE;
+      gst_event_unref (event);
+    }
+    fail_unless (got_eos);
+  }
+
+  teardown_simulcast (&test);
+}
+
+GST_END_TEST;
+
+/* Every layer is a stream of its own */
+GST_START_TEST (test_stream_ids)
+{
+  SimulcastTest test;
+  GstEvent *event;
+  const gchar *upstream_id, *stream_id;
+  gchar *ids[N_LAYERS];
+  guint i;
+
+  if (!setup_simulcast (&test, ""))
+    return;
+
+  fail_unless_equals_int (gst_harness_push (test.h[0], create_frame (0)),
+      GST_FLOW_OK);
+
+  event = gst_pad_get_sticky_event (test.h[0]->srcpad,
+      GST_EVENT_STREAM_START, 0);
+  fail_unless (event != NULL);
+  gst_event_parse_stream_start (event, &upstream_id);
+
+  for (i = 0; i < N_LAYERS; i++) {
+    GstEvent *start = gst_pad_get_sticky_event (test.h[i]->sinkpad,
+        GST_EVENT_STREAM_START, 0);
+
+    fail_unless (start != NULL);
+    gst_event_parse_stream_start (start, &stream_id);
+    fail_unless (g_str_has_prefix (stream_id, upstream_id));
+    ids[i] = g_strdup (stream_id);
+    gst_event_unref (start);
+  }
+  gst_event_unref (event);
+
+  fail_if (g_strcmp0 (ids[0], ids[1]) == 0);
+  for (i = 0; i < N_LAYERS; i++)
+    g_free (ids[i]);
+
+  teardown_simulcast (&test);
+}
+
+GST_END_TEST;
+
+static Suite *
+avsimulcastenc_suite (void)
+{
+  Suite *s = suite_create ("avsimulcastenc");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_layer_caps);
+  tcase_add_test (tc_chain, test_keyframe_sync);
+  tcase_add_test (tc_chain, test_eos_drain);
+  tcase_add_test (tc_chain, test_stream_ids);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avsimulcastenc)
@@ -0,0 +1,230 @@
+/* GStreamer unit tests for the libav video decoders
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+
+#include <gst/gst.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define FPS 30
+#define FRAME_SIZE (WIDTH * HEIGHT * 3 / 2)
+#define VIDEO_CAPS_STR "video/x-raw, format=(string)I420, " \
+    "width=(int)320, height=(int)240, framerate=(fraction)30/1"
+
+static gboolean
+have_element (const gchar * name)
+{
+  GstElementFactory *factory;
+
+  factory = gst_element_factory_find (name);
+  if (!factory) {
+    g_printerr ("Skipping test: %s not found\n", name);
+    return FALSE;
+  }
+
+  gst_object_unref (factory);
+  return TRUE;
+}
+
+/* Encodes one second of intra-only MPEG-4 and returns the packets, with their
+ * caps in @caps */
+static GList *
+create_packets (GstCaps ** caps)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GList *packets = NULL;
+  guint i;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=1");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < FPS; i++) {
+    buf = gst_buffer_new_allocate (NULL, FRAME_SIZE, NULL);
+    gst_buffer_memset (buf, 0, 0x80, FRAME_SIZE);
+    GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, FPS);
+    GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (1, GST_SECOND, FPS);
+    fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  while ((buf = gst_harness_try_pull (h)))
+    packets = g_list_append (packets, buf);
+  fail_unless_equals_int (g_list_length (packets), FPS);
+
+  *caps = gst_pad_get_current_caps (h->sinkpad);
+  fail_unless (*caps != NULL);
+  gst_harness_teardown (h);
+
+  return packets;
+}
+
+static GstHarness *
+setup_async_decoder (GList ** packets)
+{
+  GstHarness *h;
+  GstCaps *caps;
+
+  if (!have_element ("avenc_mpeg4") || !have_element ("avdec_mpeg4"))
+    return NULL;
+
+  *packets = create_packets (&caps);
+
+  h = gst_harness_new_parse ("avdec_mpeg4 async-decode=true "
+      "async-queue-size=2");
+  gst_harness_set_src_caps (h, caps);
+
+  return h;
+}
+
+static void
+push_packets (GstHarness * h, GList * packets)
+{
+  GList *l;
+
+  for (l = packets; l; l = l->next)
+    fail_unless_equals_int (gst_harness_push (h,
+            gst_buffer_ref (l->data)), GST_FLOW_OK);
+}
+
+static guint
+pull_all (GstHarness * h)
+{
+  GstBuffer *buf;
+  guint n_buffers = 0;
+
+  while ((buf = gst_harness_try_pull (h))) {
+    n_buffers++;
+    gst_buffer_unref (buf);
+  }
+
+  return n_buffers;
+}
+
+GST_START_TEST (test_async_decode_eos)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  GList *packets;
+  guint depth, max_depth;
+  guint64 full_waits;
+
+  if (!(h = setup_async_decoder (&packets)))
+    return;
+
+  push_packets (h, packets);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* EOS waits for the decoding thread, nothing gets lost */
+  fail_unless_equals_int (pull_all (h), FPS);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_has_name (stats, "avdec-stats"));
+  fail_unless (gst_structure_get_uint (stats, "queue-depth", &depth));
+  fail_unless (gst_structure_get_uint (stats, "queue-max-depth", &max_depth));
+  fail_unless (gst_structure_get_uint64 (stats, "queue-full-waits",
+          &full_waits));
+  gst_structure_free (stats);
+
+  fail_unless_equals_int (depth, 0);
+  fail_unless (max_depth >= 1 && max_depth <= 2);
+  fail_unless (full_waits <= FPS);
+
+  g_list_free_full (packets, (GDestroyNotify) gst_buffer_unref);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_async_decode_drain)
+{
+  GstHarness *h;
+  GList *packets;
+
+  if (!(h = setup_async_decoder (&packets)))
+    return;
+
+  push_packets (h, packets);
+
+  /* a gap drains the decoder, which must wait for the queued packets */
+  fail_unless (gst_harness_push_event (h,
+          gst_event_new_gap (GST_SECOND, GST_CLOCK_TIME_NONE)));
+  fail_unless_equals_int (pull_all (h), FPS);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  fail_unless_equals_int (pull_all (h), 0);
+
+  g_list_free_full (packets, (GDestroyNotify) gst_buffer_unref);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_async_decode_flush)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  GstSegment segment;
+  GList *packets;
+  guint depth;
+
+  if (!(h = setup_async_decoder (&packets)))
+    return;
+
+  push_packets (h, packets);
+
+  /* the flush discards whatever is still queued */
+  fail_unless (gst_harness_push_event (h, gst_event_new_flush_start ()));
+  fail_unless (gst_harness_push_event (h, gst_event_new_flush_stop (TRUE)));
+  pull_all (h);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint (stats, "queue-depth", &depth));
+  gst_structure_free (stats);
+  fail_unless_equals_int (depth, 0);
+
+  /* and decoding resumes with the next packets */
+  gst_segment_init (&segment, GST_FORMAT_TIME);
+  fail_unless (gst_harness_push_event (h, gst_event_new_segment (&segment)));
+  push_packets (h, packets);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  fail_unless_equals_int (pull_all (h), FPS);
+
+  g_list_free_full (packets, (GDestroyNotify) gst_buffer_unref);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+static Suite *
+avviddec_suite (void)
+{
+  Suite *s = suite_create ("avviddec");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_async_decode_eos);
+  tcase_add_test (tc_chain, test_async_decode_drain);
+  tcase_add_test (tc_chain, test_async_decode_flush);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avviddec)
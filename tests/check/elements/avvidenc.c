@@ -0,0 +1,1093 @@
+/* GStreamer unit tests for the libav video encoders
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/video/video.h>
+
+#include <gst/gst.h>
+
+#include "gstavroi.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define FPS 30
+#define FRAME_SIZE (WIDTH * HEIGHT * 3 / 2)
+#define VIDEO_CAPS_STR "video/x-raw, format=(string)I420, " \
+    "width=(int)320, height=(int)240, framerate=(fraction)30/1"
+
+static gboolean
+have_encoder (const gchar * name)
+{
+  GstElementFactory *factory;
+
+  factory = gst_element_factory_find (name);
+  if (!factory) {
+    g_printerr ("Skipping test: %s not found\n", name);
+    return FALSE;
+  }
+
+  gst_object_unref (factory);
+  return TRUE;
+}
+
+static GstBuffer *
+create_frame (guint n)
+{
+  GstBuffer *buf;
+
+  buf = gst_buffer_new_allocate (NULL, FRAME_SIZE, NULL);
+  gst_buffer_memset (buf, 0, 0x80, FRAME_SIZE);
+  GST_BUFFER_PTS (buf) = gst_util_uint64_scale (n, GST_SECOND, FPS);
+  GST_BUFFER_DURATION (buf) = gst_util_uint64_scale (1, GST_SECOND, FPS);
+
+  return buf;
+}
+
+static GstEvent *
+force_key_unit_event (void)
+{
+  return gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM,
+      gst_structure_new ("GstForceKeyUnit",
+          "running-time", G_TYPE_UINT64, GST_CLOCK_TIME_NONE,
+          "all-headers", G_TYPE_BOOLEAN, FALSE, NULL));
+}
+
+static guint
+pull_keyframes (GstHarness * h)
+{
+  GstBuffer *buf;
+  guint keyframes = 0;
+
+  while ((buf = gst_harness_try_pull (h))) {
+    if (!GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT))
+      keyframes++;
+    gst_buffer_unref (buf);
+  }
+
+  return keyframes;
+}
+
+/* bit n set if the output frame with the timestamp of input frame n is a
+ * keyframe */
+static guint64
+pull_keyframe_mask (GstHarness * h)
+{
+  GstBuffer *buf;
+  guint64 mask = 0;
+  guint n;
+
+  while ((buf = gst_harness_try_pull (h))) {
+    n = gst_util_uint64_scale_round (GST_BUFFER_PTS (buf), FPS, GST_SECOND);
+    if (!GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT) && n < 64)
+      mask |= G_GUINT64_CONSTANT (1) << n;
+    gst_buffer_unref (buf);
+  }
+
+  return mask;
+}
+
+#define KEYFRAME(n) (G_GUINT64_CONSTANT (1) << (n))
+
+GST_START_TEST (test_force_key_unit_coalescing)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  guint64 requests, merged, deferred;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=300 "
+      "min-force-key-unit-interval=500000000");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  /* a request for every frame of one second */
+  for (i = 0; i < FPS; i++) {
+    fail_unless (gst_harness_push_upstream_event (h, force_key_unit_event ()));
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* the first frame, and one 500ms later */
+  fail_unless_equals_int (pull_keyframes (h), 2);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (stats != NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "keyframe-requests",
+          &requests));
+  fail_unless (gst_structure_get_uint64 (stats, "keyframe-requests-merged",
+          &merged));
+  fail_unless (gst_structure_get_uint64 (stats, "keyframe-requests-deferred",
+          &deferred));
+  gst_structure_free (stats);
+
+  fail_unless_equals_uint64 (requests, FPS);
+  fail_unless_equals_uint64 (deferred, 2);
+  fail_unless_equals_uint64 (merged, FPS - 3);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_async_encode)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  GstBuffer *buf;
+  guint64 dropped;
+  guint i, n_buffers = 0;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 async-encode=true "
+      "async-queue-size=2");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < FPS; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* the default policy waits for the encoding thread, nothing gets lost */
+  while ((buf = gst_harness_try_pull (h))) {
+    n_buffers++;
+    gst_buffer_unref (buf);
+  }
+  fail_unless_equals_int (n_buffers, FPS);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "frames-dropped", &dropped));
+  gst_structure_free (stats);
+  fail_unless_equals_uint64 (dropped, 0);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* Downstream allocator stalling the encoder while it writes a packet, the
+ * encoders with AV_CODEC_CAP_DR1 allocate from within
+ * avcodec_receive_packet() */
+typedef GstAllocator SlowAllocator;
+typedef GstAllocatorClass SlowAllocatorClass;
+
+static GType slow_allocator_get_type (void);
+G_DEFINE_TYPE (SlowAllocator, slow_allocator, GST_TYPE_ALLOCATOR);
+
+static gboolean slow_waiting, slow_released;
+
+static GstMemory *
+slow_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  g_mutex_lock (&check_mutex);
+  slow_waiting = TRUE;
+  g_cond_broadcast (&check_cond);
+  while (!slow_released)
+    g_cond_wait (&check_cond, &check_mutex);
+  g_mutex_unlock (&check_mutex);
+
+  return gst_allocator_alloc (NULL, size, params);
+}
+
+static void
+slow_allocator_class_init (SlowAllocatorClass * klass)
+{
+  klass->alloc = slow_allocator_alloc;
+}
+
+static void
+slow_allocator_init (SlowAllocator * allocator)
+{
+}
+
+GST_START_TEST (test_async_encode_unblocked)
+{
+  GstAllocator *allocator;
+  GstHarness *h;
+  GstBuffer *buf;
+  gint64 deadline;
+  guint i, n_buffers = 0;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  slow_waiting = slow_released = FALSE;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 async-encode=true "
+      "async-queue-size=4");
+  /* the harness takes the reference */
+  allocator = g_object_new (slow_allocator_get_type (), NULL);
+  gst_harness_set_propose_allocator (h, allocator, NULL);
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  fail_unless_equals_int (gst_harness_push (h, create_frame (0)), GST_FLOW_OK);
+
+  deadline = g_get_monotonic_time () + 5 * G_TIME_SPAN_SECOND;
+  g_mutex_lock (&check_mutex);
+  while (!slow_waiting)
+    if (!g_cond_wait_until (&check_cond, &check_mutex, deadline))
+      break;
+  g_mutex_unlock (&check_mutex);
+
+  if (slow_waiting) {
+    /* the encoding thread is stuck in the codec, upstream isn't */
+    for (i = 1; i < 4; i++)
+      fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+          GST_FLOW_OK);
+  } else {
+    g_printerr ("Skipping test: avenc_mpeg4 doesn't allocate downstream\n");
+  }
+
+  g_mutex_lock (&check_mutex);
+  slow_released = TRUE;
+  g_cond_broadcast (&check_cond);
+  g_mutex_unlock (&check_mutex);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  while ((buf = gst_harness_try_pull (h))) {
+    n_buffers++;
+    gst_buffer_unref (buf);
+  }
+  fail_unless_equals_int (n_buffers, slow_waiting ? 4 : 1);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* Frames lasting a nanosecond always take longer to encode than that, so the
+ * encoder climbs its whole overload ladder */
+GST_START_TEST (test_overload_ladder)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  GstMessage *msg;
+  GstBuffer *buf;
+  GstBus *bus;
+  guint64 dropped;
+  guint i, level, expected = 1;
+  gboolean dropping;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=20 "
+      "overload-adaptation=true");
+  bus = gst_bus_new ();
+  gst_element_set_bus (h->element, bus);
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 3 * FPS; i++) {
+    buf = create_frame (i);
+    GST_BUFFER_DURATION (buf) = 1;
+    fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  }
+
+  /* one step at a time, reopening the codec with cheaper options on the way
+   * and dropping frames at the top */
+  while ((msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ELEMENT))) {
+    const GstStructure *s = gst_message_get_structure (msg);
+
+    if (gst_structure_has_name (s, "GstLibAVEncOverload")) {
+      fail_unless (gst_structure_get_uint (s, "level", &level));
+      fail_unless (gst_structure_get_boolean (s, "dropping", &dropping));
+      fail_unless_equals_int (level, expected);
+      fail_unless_equals_int (dropping, expected == 4);
+      expected++;
+    }
+    gst_message_unref (msg);
+  }
+  fail_unless_equals_int (expected, 5);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  while ((buf = gst_harness_try_pull (h)))
+    gst_buffer_unref (buf);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint (stats, "overload-level", &level));
+  fail_unless (gst_structure_get_uint64 (stats, "frames-dropped", &dropped));
+  gst_structure_free (stats);
+  fail_unless_equals_int (level, 4);
+  fail_unless (dropped > 0);
+
+  gst_element_set_bus (h->element, NULL);
+  gst_object_unref (bus);
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_skip_static)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  guint64 skipped;
+  gdouble ratio;
+  guint i, n_buffers = 0;
+  GstBuffer *buf;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=300 skip-static=true "
+      "max-skip-interval=500000000");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  /* one second of identical frames */
+  for (i = 0; i < FPS; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* the first frame, and one after the maximum skip interval */
+  while ((buf = gst_harness_try_pull (h))) {
+    n_buffers++;
+    gst_buffer_unref (buf);
+  }
+  fail_unless_equals_int (n_buffers, 2);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "frames-static-skipped",
+          &skipped));
+  fail_unless (gst_structure_get_double (stats, "static-skip-ratio", &ratio));
+  gst_structure_free (stats);
+
+  fail_unless_equals_uint64 (skipped, FPS - 2);
+  fail_unless (ratio > 0.9);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* The static frame detection must not hold on to upstream buffers */
+GST_START_TEST (test_skip_static_unpinned)
+{
+  GstHarness *h;
+  GstBuffer *in, *buf;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 skip-static=true");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  in = create_frame (0);
+  fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in)),
+      GST_FLOW_OK);
+  buf = gst_harness_pull (h);
+  gst_buffer_unref (buf);
+  ASSERT_BUFFER_REFCOUNT (in, "in", 1);
+  gst_buffer_unref (in);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_inactive)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  gboolean active;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=300 "
+      "min-force-key-unit-interval=10000000000");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  fail_unless_equals_int (gst_harness_push (h, create_frame (0)), GST_FLOW_OK);
+  fail_unless_equals_int (pull_keyframes (h), 1);
+
+  /* nothing comes out while inactive */
+  g_object_set (h->element, "active", FALSE, NULL);
+  for (i = 1; i < 10; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  while ((buf = gst_harness_try_pull (h))) {
+    /* only what was left in the encoder before deactivating */
+    fail_unless (GST_BUFFER_PTS (buf) < gst_util_uint64_scale (1, GST_SECOND,
+            FPS));
+    gst_buffer_unref (buf);
+  }
+
+  /* a keyframe request resumes with a keyframe, bypassing the minimum
+   * interval */
+  fail_unless (gst_harness_push_upstream_event (h, force_key_unit_event ()));
+  fail_unless_equals_int (gst_harness_push (h, create_frame (10)),
+      GST_FLOW_OK);
+  g_object_get (h->element, "active", &active, NULL);
+  fail_unless (active);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+  fail_unless_equals_int (pull_keyframes (h), 1);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_parallel_chunks)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  guint64 chunks;
+  guint i;
+  GstBuffer *buf;
+  GstClockTime last_pts = GST_CLOCK_TIME_NONE;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=10 parallel-chunks=2");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 35; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* in order, one buffer per frame, each chunk starting with a keyframe */
+  for (i = 0; i < 35; i++) {
+    buf = gst_harness_pull (h);
+    fail_unless (buf != NULL);
+    if (GST_CLOCK_TIME_IS_VALID (last_pts))
+      fail_unless (GST_BUFFER_PTS (buf) > last_pts);
+    last_pts = GST_BUFFER_PTS (buf);
+    if (i % 10 == 0)
+      fail_if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT));
+    gst_buffer_unref (buf);
+  }
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "chunks-encoded", &chunks));
+  fail_unless (gst_structure_has_field (stats, "chunk-scaling"));
+  gst_structure_free (stats);
+
+  fail_unless_equals_uint64 (chunks, 4);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_two_pass)
+{
+  GstHarness *h;
+  guint i;
+  GstBuffer *buf;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 pass=two-pass gop-size=300 "
+      "two-pass-lookahead=10");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  /* nothing comes out before the lookahead window is full */
+  for (i = 0; i < 9; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless_equals_int (gst_harness_buffers_received (h), 0);
+
+  for (; i < 25; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless_equals_int (gst_harness_buffers_received (h), 20);
+
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  /* every window starts with a keyframe */
+  for (i = 0; i < 25; i++) {
+    buf = gst_harness_pull (h);
+    fail_unless (buf != NULL);
+    if (i % 10 == 0)
+      fail_if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT));
+    gst_buffer_unref (buf);
+  }
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_latency)
+{
+  GstHarness *h;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  /* the harness is a live source, so no frame threads are used */
+  h = gst_harness_new_parse ("avenc_mpeg4 max-bframes=2 max-threads=4");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  fail_unless_equals_int (gst_harness_push (h, create_frame (0)),
+      GST_FLOW_OK);
+
+  fail_unless_equals_uint64 (gst_harness_query_latency (h),
+      gst_util_uint64_scale_ceil (2 * GST_SECOND, 1, FPS));
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_standby_switch)
+{
+  GstHarness *h;
+  GstStructure *stats;
+  GstCaps *caps;
+  GstBuffer *buf;
+  guint64 switches;
+  gint width;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  fail_unless_equals_int (gst_harness_push (h, create_frame (0)),
+      GST_FLOW_OK);
+
+  /* announce the next resolution, prepared with the next frame */
+  fail_unless (gst_harness_push_upstream_event (h,
+          gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM,
+              gst_structure_new ("GstLibAVEncPrepare",
+                  "width", G_TYPE_INT, 160, "height", G_TYPE_INT, 120,
+                  NULL))));
+  fail_unless_equals_int (gst_harness_push (h, create_frame (1)),
+      GST_FLOW_OK);
+
+  gst_harness_set_src_caps_str (h, "video/x-raw, format=(string)I420, "
+      "width=(int)160, height=(int)120, framerate=(fraction)30/1");
+  for (i = 2; i < 4; i++) {
+    buf = gst_buffer_new_allocate (NULL, 160 * 120 * 3 / 2, NULL);
+    gst_buffer_memset (buf, 0, 0x80, 160 * 120 * 3 / 2);
+    GST_BUFFER_PTS (buf) = gst_util_uint64_scale (i, GST_SECOND, FPS);
+    fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+  }
+
+  /* the frames of both resolutions came out */
+  fail_unless_equals_int (gst_harness_buffers_received (h), 4);
+
+  caps = gst_pad_get_current_caps (h->sinkpad);
+  fail_unless (gst_structure_get_int (gst_caps_get_structure (caps, 0),
+          "width", &width));
+  fail_unless_equals_int (width, 160);
+  gst_caps_unref (caps);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "standby-switches",
+          &switches));
+  gst_structure_free (stats);
+  fail_unless_equals_uint64 (switches, 1);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_input_pool)
+{
+  GstHarness *h;
+  GstStructure *stats, *config;
+  GstBufferPool *pool = NULL;
+  GstQuery *query;
+  GstCaps *caps;
+  GstBuffer *buf;
+  guint64 pooled, unaligned;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  caps = gst_caps_from_string (VIDEO_CAPS_STR);
+  query = gst_query_new_allocation (caps, TRUE);
+  fail_unless (gst_pad_peer_query (h->srcpad, query));
+  fail_unless (gst_query_get_n_allocation_pools (query) > 0);
+  gst_query_parse_nth_allocation_pool (query, 0, &pool, NULL, NULL, NULL);
+  fail_unless (pool != NULL);
+  gst_query_unref (query);
+  gst_caps_unref (caps);
+
+  config = gst_buffer_pool_get_config (pool);
+  fail_unless (gst_buffer_pool_config_has_option (config,
+          GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT));
+  gst_structure_free (config);
+
+  fail_unless (gst_buffer_pool_set_active (pool, TRUE));
+  fail_unless_equals_int (gst_buffer_pool_acquire_buffer (pool, &buf, NULL),
+      GST_FLOW_OK);
+  GST_BUFFER_PTS (buf) = 0;
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "input-frames-pooled",
+          &pooled));
+  fail_unless (gst_structure_get_uint64 (stats, "input-frames-unaligned",
+          &unaligned));
+  gst_structure_free (stats);
+  fail_unless_equals_uint64 (pooled, 1);
+  fail_unless_equals_uint64 (unaligned, 0);
+
+  gst_harness_teardown (h);
+  gst_buffer_pool_set_active (pool, FALSE);
+  gst_object_unref (pool);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_crop)
+{
+  GstHarness *h;
+  GstCaps *caps;
+  GstBuffer *buf;
+  GstVideoCropMeta *crop;
+  gint width, height;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  buf = create_frame (0);
+  gst_buffer_add_video_meta (buf, GST_VIDEO_FRAME_FLAG_NONE,
+      GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  crop = gst_buffer_add_video_crop_meta (buf);
+  crop->x = 32;
+  crop->y = 16;
+  crop->width = 160;
+  crop->height = 128;
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+
+  /* the encoder was reopened at the size of the crop */
+  buf = gst_harness_pull (h);
+  fail_unless (buf != NULL);
+  gst_buffer_unref (buf);
+
+  caps = gst_pad_get_current_caps (h->sinkpad);
+  fail_unless (gst_structure_get_int (gst_caps_get_structure (caps, 0),
+          "width", &width));
+  fail_unless (gst_structure_get_int (gst_caps_get_structure (caps, 0),
+          "height", &height));
+  gst_caps_unref (caps);
+  fail_unless_equals_int (width, 160);
+  fail_unless_equals_int (height, 128);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_crop_odd)
+{
+  GstHarness *h;
+  GstCaps *caps;
+  GstBuffer *buf;
+  GstVideoCropMeta *crop;
+  gint width;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  /* the odd origin is rounded down to the chroma subsampling, which is what
+   * makes this crop fit in the frame */
+  buf = create_frame (0);
+  gst_buffer_add_video_meta (buf, GST_VIDEO_FRAME_FLAG_NONE,
+      GST_VIDEO_FORMAT_I420, WIDTH, HEIGHT);
+  crop = gst_buffer_add_video_crop_meta (buf);
+  crop->x = WIDTH - 159;
+  crop->y = 17;
+  crop->width = 160;
+  crop->height = 128;
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+
+  buf = gst_harness_pull (h);
+  fail_unless (buf != NULL);
+  gst_buffer_unref (buf);
+
+  caps = gst_pad_get_current_caps (h->sinkpad);
+  fail_unless (gst_structure_get_int (gst_caps_get_structure (caps, 0),
+          "width", &width));
+  gst_caps_unref (caps);
+  fail_unless_equals_int (width, 160);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_droppable)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GType meta_api;
+  guint i, droppable = 0;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 max-bframes=2 gop-size=30");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 12; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  meta_api = g_type_from_name ("GstFFMpegEncMetaAPI");
+  fail_unless (meta_api != 0);
+
+  /* B-frames aren't referenced in MPEG-4 part 2 */
+  while ((buf = gst_harness_try_pull (h))) {
+    fail_unless (gst_buffer_get_meta (buf, meta_api) != NULL);
+    if (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DROPPABLE)) {
+      fail_unless (GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT));
+      droppable++;
+    }
+    gst_buffer_unref (buf);
+  }
+  fail_unless (droppable > 0);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_quality_stats)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GstStructure *stats;
+  guint64 bitrate;
+  gdouble qp, keyframe_ratio;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=10");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 20; i++)
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+
+  while ((buf = gst_harness_try_pull (h)))
+    gst_buffer_unref (buf);
+
+  g_object_get (h->element, "stats", &stats, NULL);
+  fail_unless (gst_structure_get_uint64 (stats, "bitrate", &bitrate));
+  fail_unless (gst_structure_get_double (stats, "average-qp", &qp));
+  fail_unless (gst_structure_get_double (stats, "keyframe-ratio",
+          &keyframe_ratio));
+  fail_unless (gst_structure_has_field (stats, "encode-time"));
+  gst_structure_free (stats);
+
+  fail_unless (bitrate > 0);
+  fail_unless (qp > 0.0);
+  fail_unless (keyframe_ratio > 0.05 && keyframe_ratio < 0.15);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_roi)
+{
+  GstHarness *h;
+  GstBuffer *buf;
+  GstStructure *offsets;
+  gdouble offset;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 roi-quality-offset=-0.2 "
+      "roi-type-offsets=\"offsets,face=(double)-0.5\"");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  g_object_get (h->element, "roi-type-offsets", &offsets, NULL);
+  fail_unless (offsets != NULL);
+  fail_unless (gst_structure_get_double (offsets, "face", &offset));
+  fail_unless_equals_float (offset, -0.5);
+  gst_structure_free (offsets);
+
+  /* regions reaching out of the picture are clipped */
+  buf = create_frame (0);
+  gst_buffer_add_video_region_of_interest_meta (buf, "face", 64, 32, 96, 96);
+  gst_buffer_add_video_region_of_interest_meta (buf, "car", 280, 200, 80, 80);
+  fail_unless_equals_int (gst_harness_push (h, buf), GST_FLOW_OK);
+
+  buf = gst_harness_pull (h);
+  fail_unless (buf != NULL);
+  gst_buffer_unref (buf);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+/* A new gop size and bitrate need the codec reopened, which waits for the
+ * next keyframe instead of inserting one */
+GST_START_TEST (test_reconfigure_property)
+{
+  GstHarness *h;
+  gint bitrate;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=10 bitrate=300000");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 30; i++) {
+    if (i == 3)
+      g_object_set (h->element, "gop-size", 5, "bitrate", 600000, NULL);
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  fail_unless_equals_uint64 (pull_keyframe_mask (h),
+      KEYFRAME (0) | KEYFRAME (10) | KEYFRAME (15) | KEYFRAME (20) |
+      KEYFRAME (25));
+
+  g_object_get (h->element, "bitrate", &bitrate, NULL);
+  fail_unless_equals_int (bitrate, 600000);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_reconfigure_event)
+{
+  GstHarness *h;
+  GstEvent *event;
+  gint bitrate, gop_size;
+  guint i;
+
+  if (!have_encoder ("avenc_mpeg4"))
+    return;
+
+  h = gst_harness_new_parse ("avenc_mpeg4 gop-size=10 bitrate=300000");
+  gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+  for (i = 0; i < 30; i++) {
+    if (i == 3) {
+      event = gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM,
+          gst_structure_new ("GstLibAVEncReconfigure",
+              "gop-size", G_TYPE_INT, 5, "bitrate", G_TYPE_INT, 600000,
+              "no-such-property", G_TYPE_INT, 1, NULL));
+      fail_unless (gst_harness_push_upstream_event (h, event));
+    }
+    fail_unless_equals_int (gst_harness_push (h, create_frame (i)),
+        GST_FLOW_OK);
+  }
+  fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+
+  fail_unless_equals_uint64 (pull_keyframe_mask (h),
+      KEYFRAME (0) | KEYFRAME (10) | KEYFRAME (15) | KEYFRAME (20) |
+      KEYFRAME (25));
+
+  g_object_get (h->element, "bitrate", &bitrate, "gop-size", &gop_size, NULL);
+  fail_unless_equals_int (bitrate, 600000);
+  fail_unless_equals_int (gop_size, 5);
+
+  gst_harness_teardown (h);
+}
+
+GST_END_TEST;
+
+#define fail_unless_roi(r, l, t, ri, b, q) G_STMT_START { \
+  fail_unless_equals_int ((r)->left, l); \
+  fail_unless_equals_int ((r)->top, t); \
+  fail_unless_equals_int ((r)->right, ri); \
+  fail_unless_equals_int ((r)->bottom, b); \
+  fail_unless_equals_float ((r)->qoffset, q); \
+} G_STMT_END
+
+GST_START_TEST (test_roi_regions)
+{
+  GstVideoRegionOfInterestMeta *meta;
+  GstStructure *type_offsets;
+  GstFFMpegRoi *regions;
+  GstBuffer *buf;
+  guint n;
+
+  type_offsets = gst_structure_new ("offsets", "face", G_TYPE_DOUBLE, -0.5,
+      NULL);
+
+  buf = gst_buffer_new ();
+  /* type offset */
+  gst_buffer_add_video_region_of_interest_meta (buf, "face", 64, 32, 96, 96);
+  /* default offset, clipped to the bottom right of the encoded region */
+  gst_buffer_add_video_region_of_interest_meta (buf, "car", 280, 200, 80, 80);
+  /* left of the encoded region */
+  gst_buffer_add_video_region_of_interest_meta (buf, "sign", 0, 0, 16, 8);
+  /* the meta's own offset wins over the one for its type */
+  meta = gst_buffer_add_video_region_of_interest_meta (buf, "face", 100, 100,
+      10, 10);
+  gst_video_region_of_interest_meta_add_param (meta,
+      gst_structure_new ("roi/avenc", "quality-offset", G_TYPE_DOUBLE, 0.3,
+          NULL));
+
+  /* encoding the 256x200 region at 32,16 */
+  n = gst_ffmpeg_roi_from_buffer (buf, 32, 16, 256, 200, -0.2, type_offsets,
+      &regions);
+  fail_unless_equals_int (n, 3);
+  fail_unless_roi (&regions[0], 32, 16, 128, 112, -0.5);
+  fail_unless_roi (&regions[1], 248, 184, 256, 200, -0.2);
+  fail_unless_roi (&regions[2], 68, 84, 78, 94, 0.3);
+  g_free (regions);
+
+  /* without type offsets, everything but the meta's own offset is default */
+  n = gst_ffmpeg_roi_from_buffer (buf, 0, 0, 320, 240, 0.1, NULL, &regions);
+  fail_unless_equals_int (n, 4);
+  fail_unless_roi (&regions[0], 64, 32, 160, 128, 0.1);
+  fail_unless_roi (&regions[1], 280, 200, 320, 240, 0.1);
+  fail_unless_roi (&regions[2], 0, 0, 16, 8, 0.1);
+  fail_unless_roi (&regions[3], 100, 100, 110, 110, 0.3);
+  g_free (regions);
+
+  /* nothing inside the encoded region */
+  n = gst_ffmpeg_roi_from_buffer (buf, 0, 0, 8, 4, 0.1, NULL, &regions);
+  fail_unless_equals_int (n, 1);
+  fail_unless_roi (&regions[0], 0, 0, 8, 4, 0.1);
+  g_free (regions);
+  n = gst_ffmpeg_roi_from_buffer (buf, 200, 0, 60, 20, 0.1, NULL, &regions);
+  fail_unless_equals_int (n, 0);
+  fail_unless (regions == NULL);
+
+  gst_buffer_unref (buf);
+  gst_structure_free (type_offsets);
+}
+
+GST_END_TEST;
+
+/* Encoders writing straight into downstream buffers (AV_CODEC_CAP_DR1) size
+ * their pool buffers after the packets, not after the raw frames */
+GST_START_TEST (test_packet_pool)
+{
+  static const gchar *encoders[] = { "avenc_mpeg4", "avenc_huffyuv",
+    "avenc_ffv1"
+  };
+  GstHarness *h;
+  GstBuffer *buf;
+  GList *buffers = NULL, *l;
+  gsize size, maxsize;
+  guint i, j, n;
+
+  for (i = 0; i < G_N_ELEMENTS (encoders); i++) {
+    if (!have_encoder (encoders[i]))
+      continue;
+
+    h = gst_harness_new_parse (encoders[i]);
+    gst_harness_set_src_caps_str (h, VIDEO_CAPS_STR);
+
+    /* hold on to the output like a queue downstream would */
+    for (j = 0; j < FPS; j++) {
+      fail_unless_equals_int (gst_harness_push (h, create_frame (j)),
+          GST_FLOW_OK);
+      while ((buf = gst_harness_try_pull (h)))
+        buffers = g_list_prepend (buffers, buf);
+    }
+    fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+    while ((buf = gst_harness_try_pull (h)))
+      buffers = g_list_prepend (buffers, buf);
+
+    fail_unless (buffers != NULL);
+    for (l = buffers; l; l = l->next) {
+      buf = l->data;
+      size = gst_buffer_get_size (buf);
+      maxsize = 0;
+      for (n = 0; n < gst_buffer_n_memory (buf); n++) {
+        gsize mem_maxsize;
+
+        gst_memory_get_sizes (gst_buffer_peek_memory (buf, n), NULL,
+            &mem_maxsize);
+        maxsize += mem_maxsize;
+      }
+      GST_DEBUG ("%s: packet of %" G_GSIZE_FORMAT " bytes in %" G_GSIZE_FORMAT
+          " bytes of memory", encoders[i], size, maxsize);
+      fail_unless (maxsize <= MAX (size, FRAME_SIZE / 8) + 4096,
+          "%s: packet of %" G_GSIZE_FORMAT " bytes pins %" G_GSIZE_FORMAT
+          " bytes", encoders[i], size, maxsize);
+    }
+
+    g_list_free_full (buffers, (GDestroyNotify) gst_buffer_unref);
+    buffers = NULL;
+    gst_harness_teardown (h);
+  }
+}
+
+GST_END_TEST;
+
+static Suite *
+avvidenc_suite (void)
+{
+  Suite *s = suite_create ("avvidenc");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_force_key_unit_coalescing);
+  tcase_add_test (tc_chain, test_async_encode);
+  tcase_add_test (tc_chain, test_async_encode_unblocked);
+  tcase_add_test (tc_chain, test_overload_ladder);
+  tcase_add_test (tc_chain, test_skip_static);
+  tcase_add_test (tc_chain, test_skip_static_unpinned);
+  tcase_add_test (tc_chain, test_inactive);
+  tcase_add_test (tc_chain, test_parallel_chunks);
+  tcase_add_test (tc_chain, test_two_pass);
+  tcase_add_test (tc_chain, test_latency);
+  tcase_add_test (tc_chain, test_standby_switch);
+  tcase_add_test (tc_chain, test_input_pool);
+  tcase_add_test (tc_chain, test_crop);
+  tcase_add_test (tc_chain, test_crop_odd);
+  tcase_add_test (tc_chain, test_droppable);
+  tcase_add_test (tc_chain, test_quality_stats);
+  tcase_add_test (tc_chain, test_roi);
+  tcase_add_test (tc_chain, test_roi_regions);
+  tcase_add_test (tc_chain, test_packet_pool);
+  tcase_add_test (tc_chain, test_reconfigure_property);
+  tcase_add_test (tc_chain, test_reconfigure_event);
+
+  return s;
+}
+
+GST_CHECK_MAIN (avvidenc)